@@ -6,6 +6,7 @@
 #include <gio/gio.h>
 #include <glib.h>
 
+#include <stdint.h>
 #include <sys/param.h>
 
 #ifndef MAXPATHLEN
@@ -62,14 +63,19 @@ typedef struct
         bool visualizerBrailleMode;                     // Display the visualizer using braille characteres
         int titleDelay;                                 // Delay when drawing title in track view
         int cacheLibrary;                               // Cache the library or not
+        bool watchLibrary;                              // Patch the library as files are added or removed while running
+        bool indexMetadata;                             // Read the tags of every file in the library in the background
         bool quitAfterStopping;                         // Exit kew when the music stops or not
         bool hideGlimmeringText;                        // Glimmering text on the bottom row
         time_t lastTimeAppRan;                          // When did this app run last, used for updating the cached library if it has been modified since that time
         int visualizerBarWidth;                         // 0=Thin bars, 1=Bars twice the width or 2=Auto (Depends on window size, default)
         int replayGainCheckFirst;                       // Prioritize track or album replay gain setting
+        bool replayGainLimiter;                         // Soft limit peaks instead of clipping when replay gain is positive
         bool saveRepeatShuffleSettings;                 // Save repeat and shuffle settings between sessions. Default on.
         int repeatState;                                // 0=disabled,1=repeat track ,2=repeat list
         bool shuffleEnabled;
+        bool shuffleAlbums;                             // Shuffle whole albums, keeping the track order within each
+        uint64_t shuffleSeed;                           // Seed of the shuffle, 0=different every run
         bool trackTitleAsWindowTitle;                   // Set the window title to the title of the currently playing track
 } UISettings;
 
@@ -216,9 +222,14 @@ typedef struct
         char progressBarCurrentOddChar[12];
         char visualizerBarWidth[2];
         char replayGainCheckFirst[2];
+        char replayGainLimiter[2];
+        char watchLibrary[2];
+        char indexMetadata[2];
         char saveRepeatShuffleSettings[2];
         char repeatState[2];
         char shuffleEnabled[2];
+        char shuffleAlbums[2];
+        char shuffleSeed[21];
         char trackTitleAsWindowTitle[2];
         char hardShowWebSearch[6];
         char toggleAlbumsTracks[6];
@@ -0,0 +1,541 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "covercache.h"
+#include "file.h"
+#include "imgfunc.h"
+#include "utils.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#pragma GCC diagnostic ignored "-Wstrict-overflow"
+#include <stb_image.h>
+#include <stb_image_resize2.h>
+#pragma GCC diagnostic pop
+
+/*
+
+covercache.c
+
+ On-disk cache of decoded, downscaled cover bitmaps and their accent color.
+ Entries are keyed by a hash of the image bytes, or of the path, size and
+ mtime for cover images found next to the music, and by the thumbnail size.
+ Pixels are stored filtered and deflated. The cache is kept under
+ COVER_CACHE_MAX_SIZE by deleting the entries that were used longest ago.
+
+*/
+
+#ifndef MAXPATHLEN
+#define MAXPATHLEN 4096
+#endif
+
+#define COVER_CACHE_MAGIC "KWCV"
+#define COVER_CACHE_VERSION 2
+#define COVER_CACHE_SUFFIX ".thumb"
+
+typedef struct
+{
+        char magic[4];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t channels;    // 3 when the cover is opaque and alpha isn't stored
+        uint32_t encodedSize; // Bytes of deflated pixels that follow
+        unsigned char red;
+        unsigned char green;
+        unsigned char blue;
+        unsigned char hasColor;
+} CoverCacheHeader;
+
+typedef struct
+{
+        char *name;
+        time_t lastUsed;
+        off_t size;
+} CoverCacheFile;
+
+static pthread_once_t coverCacheOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t coverCacheSizeMutex = PTHREAD_MUTEX_INITIALIZER;
+static char coverCacheDir[MAXPATHLEN];
+static bool coverCacheAvailable = false;
+static int64_t coverCacheSize = -1; // Bytes on disk as far as we know, -1 until the directory is scanned
+
+static void initCoverCacheDir(void)
+{
+        char *cachePath = getCachePath();
+        if (cachePath == NULL)
+                return;
+
+        int written = snprintf(coverCacheDir, sizeof(coverCacheDir), "%s/%s", cachePath, COVER_CACHE_DIR);
+
+        if (written > 0 && written < (int)sizeof(coverCacheDir) &&
+            createDirectory(cachePath) >= 0 && createDirectory(coverCacheDir) >= 0)
+        {
+                coverCacheAvailable = true;
+        }
+
+        free(cachePath);
+}
+
+// FNV-1a, only used to name cache entries
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size)
+{
+        const unsigned char *p = data;
+
+        for (size_t i = 0; i < size; i++)
+        {
+                hash ^= p[i];
+                hash *= 0x100000001b3ULL;
+        }
+
+        return hash;
+}
+
+static const uint64_t hashSeed = 0xcbf29ce484222325ULL;
+
+static bool getCacheEntryPath(char *path, size_t pathSize, uint64_t key, int thumbnailSize)
+{
+        pthread_once(&coverCacheOnce, initCoverCacheDir);
+
+        if (!coverCacheAvailable)
+                return false;
+
+        int written = snprintf(path, pathSize, "%s/%016llx-%d" COVER_CACHE_SUFFIX, coverCacheDir, (unsigned long long)key, thumbnailSize);
+
+        return written > 0 && (size_t)written < pathSize;
+}
+
+static unsigned char paethPredictor(int left, int up, int upLeft)
+{
+        int p = left + up - upLeft;
+        int pLeft = abs(p - left);
+        int pUp = abs(p - up);
+        int pUpLeft = abs(p - upLeft);
+
+        if (pLeft <= pUp && pLeft <= pUpLeft)
+                return left;
+
+        return pUp <= pUpLeft ? up : upLeft;
+}
+
+// PNG's Paeth filter on tightly packed rows. Encoding runs backwards so every prediction still sees the original bytes.
+static void filterRows(unsigned char *data, int width, int height, int channels, bool decode)
+{
+        size_t stride = (size_t)width * channels;
+        size_t size = stride * height;
+
+        for (size_t n = 0; n < size; n++)
+        {
+                size_t i = decode ? n : size - 1 - n;
+                size_t x = i % stride;
+                int left = x >= (size_t)channels ? data[i - channels] : 0;
+                int up = i >= stride ? data[i - stride] : 0;
+                int upLeft = (x >= (size_t)channels && i >= stride) ? data[i - stride - channels] : 0;
+                unsigned char predicted = paethPredictor(left, up, upLeft);
+
+                data[i] = decode ? (unsigned char)(data[i] + predicted) : (unsigned char)(data[i] - predicted);
+        }
+}
+
+// Drops alpha when the cover is opaque, filters and deflates the rest
+static unsigned char *encodeCover(const unsigned char *pixels, int width, int height, uint32_t *channels, uLongf *encodedSize)
+{
+        size_t count = (size_t)width * height;
+
+        *channels = 3;
+
+        for (size_t i = 0; i < count; i++)
+        {
+                if (pixels[i * 4 + 3] != 255)
+                {
+                        *channels = 4;
+                        break;
+                }
+        }
+
+        unsigned char *packed = malloc(count * *channels);
+        if (packed == NULL)
+                return NULL;
+
+        for (size_t i = 0; i < count; i++)
+                memcpy(packed + i * *channels, pixels + i * 4, *channels);
+
+        filterRows(packed, width, height, *channels, false);
+
+        *encodedSize = compressBound(count * *channels);
+        unsigned char *encoded = malloc(*encodedSize);
+
+        if (encoded == NULL || compress2(encoded, encodedSize, packed, count * *channels, Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+                free(encoded);
+                encoded = NULL;
+        }
+
+        free(packed);
+
+        return encoded;
+}
+
+static unsigned char *decodeCover(const unsigned char *encoded, size_t encodedSize, int width, int height, uint32_t channels)
+{
+        size_t count = (size_t)width * height;
+        uLongf packedSize = count * channels;
+        unsigned char *pixels = malloc(count * 4);
+
+        if (pixels == NULL)
+                return NULL;
+
+        // Unpacked into the back of the RGBA buffer and spread out front to back, so no second buffer is needed
+        unsigned char *packed = pixels + count * (4 - channels);
+
+        if (uncompress(packed, &packedSize, encoded, encodedSize) != Z_OK || packedSize != count * channels)
+        {
+                free(pixels);
+                return NULL;
+        }
+
+        filterRows(packed, width, height, channels, true);
+
+        for (size_t i = 0; i < count; i++)
+        {
+                unsigned char alpha = channels == 4 ? packed[i * 4 + 3] : 255;
+
+                memmove(pixels + i * 4, packed + i * channels, 3);
+                pixels[i * 4 + 3] = alpha;
+        }
+
+        return pixels;
+}
+
+static int compareByLastUsed(const void *a, const void *b)
+{
+        const CoverCacheFile *fileA = a;
+        const CoverCacheFile *fileB = b;
+
+        return (fileA->lastUsed > fileB->lastUsed) - (fileA->lastUsed < fileB->lastUsed);
+}
+
+// Adds up the entries on disk, and when they are over the cap deletes the least recently used down to three quarters of it
+static int64_t trimCoverCache(int64_t maxSize)
+{
+        DIR *dir = opendir(coverCacheDir);
+        if (dir == NULL)
+                return -1;
+
+        CoverCacheFile *files = NULL;
+        size_t count = 0;
+        size_t capacity = 0;
+        int64_t total = 0;
+        struct dirent *entry;
+
+        while ((entry = readdir(dir)) != NULL)
+        {
+                size_t nameLength = strnlen(entry->d_name, sizeof(entry->d_name));
+                size_t suffixLength = strlen(COVER_CACHE_SUFFIX);
+
+                if (nameLength <= suffixLength || strcmp(entry->d_name + nameLength - suffixLength, COVER_CACHE_SUFFIX) != 0)
+                        continue;
+
+                struct stat st;
+
+                if (fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+                        continue;
+
+                if (count == capacity)
+                {
+                        size_t newCapacity = capacity == 0 ? 64 : capacity * 2;
+                        CoverCacheFile *newFiles = realloc(files, newCapacity * sizeof(CoverCacheFile));
+
+                        if (newFiles == NULL)
+                                break;
+
+                        files = newFiles;
+                        capacity = newCapacity;
+                }
+
+                files[count].name = strdup(entry->d_name);
+                if (files[count].name == NULL)
+                        break;
+
+                files[count].lastUsed = st.st_mtime;
+                files[count].size = st.st_size;
+                total += st.st_size;
+                count++;
+        }
+
+        if (total > maxSize)
+        {
+                qsort(files, count, sizeof(CoverCacheFile), compareByLastUsed);
+
+                for (size_t i = 0; i < count && total > maxSize / 4 * 3; i++)
+                {
+                        if (unlinkat(dirfd(dir), files[i].name, 0) == 0)
+                                total -= files[i].size;
+                }
+        }
+
+        for (size_t i = 0; i < count; i++)
+                free(files[i].name);
+
+        free(files);
+        closedir(dir);
+
+        return total;
+}
+
+static void addToCoverCacheSize(int64_t size)
+{
+        pthread_mutex_lock(&coverCacheSizeMutex);
+
+        // Only scanned again when it looks full, other instances' entries are counted then
+        if (coverCacheSize >= 0)
+                coverCacheSize += size;
+
+        if (coverCacheSize < 0 || coverCacheSize > COVER_CACHE_MAX_SIZE)
+                coverCacheSize = trimCoverCache(COVER_CACHE_MAX_SIZE);
+
+        pthread_mutex_unlock(&coverCacheSizeMutex);
+}
+
+static unsigned char *readCacheEntry(uint64_t key, int thumbnailSize, int *width, int *height,
+                                     unsigned char *red, unsigned char *green, unsigned char *blue)
+{
+        char path[MAXPATHLEN];
+
+        if (!getCacheEntryPath(path, sizeof(path), key, thumbnailSize))
+                return NULL;
+
+        FILE *file = fopen(path, "rb");
+        if (file == NULL)
+                return NULL;
+
+        CoverCacheHeader header;
+
+        if (fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, COVER_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != COVER_CACHE_VERSION ||
+            header.width == 0 || header.width > (uint32_t)thumbnailSize ||
+            header.height == 0 || header.height > (uint32_t)thumbnailSize ||
+            (header.channels != 3 && header.channels != 4) ||
+            header.encodedSize == 0 || header.encodedSize > compressBound(header.width * header.height * header.channels))
+        {
+                fclose(file);
+                return NULL;
+        }
+
+        unsigned char *encoded = malloc(header.encodedSize);
+
+        if (encoded == NULL || fread(encoded, 1, header.encodedSize, file) != header.encodedSize)
+        {
+                free(encoded);
+                fclose(file);
+                return NULL;
+        }
+
+        fclose(file);
+
+        unsigned char *pixels = decodeCover(encoded, header.encodedSize, header.width, header.height, header.channels);
+
+        free(encoded);
+
+        if (pixels == NULL)
+                return NULL;
+
+        // The mtime says when an entry was last used, eviction goes by it
+        utimensat(AT_FDCWD, path, NULL, 0);
+
+        *width = header.width;
+        *height = header.height;
+
+        if (header.hasColor)
+        {
+                *red = header.red;
+                *green = header.green;
+                *blue = header.blue;
+        }
+
+        return pixels;
+}
+
+static void writeCacheEntry(uint64_t key, int thumbnailSize, const unsigned char *pixels, int width, int height,
+                            bool hasColor, unsigned char red, unsigned char green, unsigned char blue)
+{
+        char path[MAXPATHLEN];
+        char tmpPath[MAXPATHLEN];
+
+        if (!getCacheEntryPath(path, sizeof(path), key, thumbnailSize))
+                return;
+
+        // Written under a private name and renamed, so a reader never sees half an entry
+        int written = snprintf(tmpPath, sizeof(tmpPath), "%s.%ld.tmp", path, (long)getpid());
+        if (written < 0 || (size_t)written >= sizeof(tmpPath))
+                return;
+
+        CoverCacheHeader header;
+        uLongf encodedSize = 0;
+        memset(&header, 0, sizeof(header));
+
+        unsigned char *encoded = encodeCover(pixels, width, height, &header.channels, &encodedSize);
+        if (encoded == NULL)
+                return;
+
+        FILE *file = fopen(tmpPath, "wb");
+        if (file == NULL)
+        {
+                free(encoded);
+                return;
+        }
+
+        memcpy(header.magic, COVER_CACHE_MAGIC, sizeof(header.magic));
+        header.version = COVER_CACHE_VERSION;
+        header.width = width;
+        header.height = height;
+        header.encodedSize = encodedSize;
+        header.red = red;
+        header.green = green;
+        header.blue = blue;
+        header.hasColor = hasColor;
+
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(encoded, 1, encodedSize, file) == encodedSize;
+
+        free(encoded);
+
+        if (fclose(file) != 0)
+                ok = false;
+
+        if (!ok || rename(tmpPath, path) != 0)
+        {
+                deleteFile(tmpPath);
+                return;
+        }
+
+        addToCoverCacheSize((int64_t)(sizeof(header) + encodedSize));
+}
+
+// Takes ownership of pixels and returns a bitmap no larger than thumbnailSize on either side
+static unsigned char *downscaleCover(unsigned char *pixels, int *width, int *height, int thumbnailSize)
+{
+        if (*width <= thumbnailSize && *height <= thumbnailSize)
+                return pixels;
+
+        float scale = (float)thumbnailSize / (float)(*width > *height ? *width : *height);
+        int newWidth = (int)(*width * scale + 0.5f);
+        int newHeight = (int)(*height * scale + 0.5f);
+
+        if (newWidth < 1)
+                newWidth = 1;
+        if (newHeight < 1)
+                newHeight = 1;
+
+        unsigned char *thumbnail = malloc((size_t)newWidth * newHeight * 4);
+        if (thumbnail == NULL)
+                return pixels;
+
+        if (stbir_resize_uint8_srgb(pixels, *width, *height, 0,
+                                    thumbnail, newWidth, newHeight, 0, STBIR_RGBA) == NULL)
+        {
+                free(thumbnail);
+                return pixels;
+        }
+
+        stbi_image_free(pixels);
+
+        *width = newWidth;
+        *height = newHeight;
+
+        return thumbnail;
+}
+
+static unsigned char *storeCover(uint64_t key, int thumbnailSize, unsigned char *pixels, int *width, int *height,
+                                 unsigned char *red, unsigned char *green, unsigned char *blue)
+{
+        if (pixels == NULL)
+                return NULL;
+
+        // The accent color is picked from the full size image like before
+        unsigned char r = *red, g = *green, b = *blue;
+        bool hasColor = getCoverColor(pixels, *width, *height, &r, &g, &b) == 0;
+
+        if (hasColor)
+        {
+                *red = r;
+                *green = g;
+                *blue = b;
+        }
+
+        pixels = downscaleCover(pixels, width, height, thumbnailSize);
+
+        writeCacheEntry(key, thumbnailSize, pixels, *width, *height, hasColor, r, g, b);
+
+        return pixels;
+}
+
+unsigned char *loadCoverFromMemory(const unsigned char *data, size_t size, int *width, int *height,
+                                   unsigned char *red, unsigned char *green, unsigned char *blue, guint64 *coverId)
+{
+        *coverId = 0;
+
+        if (data == NULL || size == 0)
+                return NULL;
+
+        int thumbnailSize = getCoverThumbnailSize();
+        uint64_t key = hashBytes(hashSeed, data, size);
+
+        unsigned char *pixels = readCacheEntry(key, thumbnailSize, width, height, red, green, blue);
+
+        if (pixels == NULL)
+        {
+                pixels = getBitmapFromMemory(data, size, width, height);
+                pixels = storeCover(key, thumbnailSize, pixels, width, height, red, green, blue);
+        }
+
+        if (pixels != NULL)
+                *coverId = key;
+
+        return pixels;
+}
+
+unsigned char *loadCoverFromFile(const char *path, int *width, int *height,
+                                 unsigned char *red, unsigned char *green, unsigned char *blue, guint64 *coverId)
+{
+        *coverId = 0;
+
+        if (path == NULL || path[0] == '\0')
+                return NULL;
+
+        struct stat st;
+
+        if (stat(path, &st) != 0)
+                return NULL;
+
+        int thumbnailSize = getCoverThumbnailSize();
+        int64_t fileSize = st.st_size;
+        int64_t mtime = st.st_mtime;
+
+        uint64_t key = hashBytes(hashSeed, path, strnlen(path, MAXPATHLEN));
+        key = hashBytes(key, &fileSize, sizeof(fileSize));
+        key = hashBytes(key, &mtime, sizeof(mtime));
+
+        unsigned char *pixels = readCacheEntry(key, thumbnailSize, width, height, red, green, blue);
+
+        if (pixels == NULL)
+        {
+                pixels = getBitmap(path, width, height);
+                pixels = storeCover(key, thumbnailSize, pixels, width, height, red, green, blue);
+        }
+
+        if (pixels != NULL)
+                *coverId = key;
+
+        return pixels;
+}
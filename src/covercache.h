@@ -0,0 +1,21 @@
+#ifndef COVERCACHE_H
+#define COVERCACHE_H
+
+#include <glib.h>
+#include <stddef.h>
+
+#ifndef COVER_CACHE_DIR
+#define COVER_CACHE_DIR "covers"
+#endif
+
+#ifndef COVER_CACHE_MAX_SIZE
+#define COVER_CACHE_MAX_SIZE (64 * 1024 * 1024) // Least recently used covers are deleted beyond this many bytes
+#endif
+
+unsigned char *loadCoverFromMemory(const unsigned char *data, size_t size, int *width, int *height,
+                                   unsigned char *red, unsigned char *green, unsigned char *blue, guint64 *coverId);
+
+unsigned char *loadCoverFromFile(const char *path, int *width, int *height,
+                                 unsigned char *red, unsigned char *green, unsigned char *blue, guint64 *coverId);
+
+#endif
@@ -2,14 +2,21 @@
 #include <dirent.h>
 #include <glib.h>
 #include <regex.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "file.h"
 #include "utils.h"
 #include "directorytree.h"
+#include "searchindex.h"
 
 /*
 
@@ -19,23 +26,345 @@ directorytree.c
 
 */
 
-static int lastUsedId = 0;
-
 typedef void (*TimeoutCallback)(void);
 
-FileSystemEntry *createEntry(const char *name, int isDirectory, FileSystemEntry *parent)
+/*
+ The library cache is a binary index:
+
+  LibraryIndexHeader
+  LibraryIndexNode[nodeCount]   in preorder, the root is node 0, then the pruned directories
+  string pool                   NUL terminated names, each distinct name once
+
+ A node's parent always comes before it and its children and siblings after
+ it, which is what makes the links cheap to validate. Pruned directories hold
+ no music, they are only linked to their parent. The file is mapped read-only
+ and names are used straight from the mapping.
+*/
+
+#define LIBRARY_INDEX_MAGIC "KEWLIBX"
+#define LIBRARY_INDEX_VERSION 2
+
+typedef struct
+{
+        char magic[8];
+        uint32_t version;
+        uint32_t headerSize;
+        uint32_t nodeSize;
+        uint32_t nodeCount;
+        uint64_t stringPoolSize;
+        uint64_t checksum; // Over the node array and the string pool
+} LibraryIndexHeader;
+
+typedef struct
+{
+        int32_t id;
+        int32_t parent; // Node indices, -1 for none
+        int32_t firstChild;
+        int32_t nextSibling;
+        uint32_t nameOffset;
+        uint32_t nameLength;
+        uint32_t isDirectory;
+        uint32_t pruned;
+        int64_t mtime;
+} LibraryIndexNode;
+
+/*
+ A library tree lives in an arena: entries are carved out of slabs and names
+ out of a string pool where every distinct name is stored once. Full paths are
+ not stored, they are put together from the parent chain when needed. Freeing
+ a tree releases a handful of blocks no matter how many entries it has.
+*/
+
+#define ARENA_SLAB_ENTRIES 4096
+#define ARENA_STRING_CHUNK 65536
+
+typedef struct EntrySlab
+{
+        struct EntrySlab *next;
+        size_t used;
+        size_t count;
+        FileSystemEntry entries[];
+} EntrySlab;
+
+typedef struct StringChunk
+{
+        struct StringChunk *next;
+        size_t used;
+        size_t size;
+        char data[];
+} StringChunk;
+
+typedef struct
+{
+        uint64_t hash; // Of the full path
+        FileSystemEntry *entry;
+} PathSlot;
+
+typedef struct
+{
+        FileSystemEntry root; // Must stay first, a tree is handed out as &arena->root
+        char *rootPath;       // What the root stands for, its name is always "root"
+        EntrySlab *slabs;
+        StringChunk *strings;
+        GHashTable *names; // Interned names, only kept while the tree is built
+        FileSystemEntry *pruned; // Directories without music, linked through next and left out of the tree
+        int lastId;
+        void *map;         // Library index the names point into, if it was loaded from one
+        size_t mapSize;
+        PathSlot *paths;   // Full path lookup for the live tree, rebuilt whenever the tree is finished
+        size_t pathMask;
+        SearchIndex *search; // Made when the tree is first searched, dropped when it changes
+} LibraryArena;
+
+static LibraryArena *getArena(const FileSystemEntry *entry)
+{
+        while (entry->parent != NULL)
+                entry = entry->parent;
+
+        return (LibraryArena *)entry;
+}
+
+static LibraryArena *createArena(const char *rootPath)
+{
+        LibraryArena *arena = calloc(1, sizeof(LibraryArena));
+        if (arena == NULL)
+        {
+                fprintf(stderr, "createArena: calloc\n");
+                return NULL;
+        }
+
+        arena->rootPath = strdup(rootPath);
+        if (arena->rootPath == NULL)
+        {
+                fprintf(stderr, "createArena: strdup\n");
+                free(arena);
+                return NULL;
+        }
+
+        arena->root.name = (char *)"root";
+        arena->root.isDirectory = 1;
+        arena->root.parentId = -1;
+
+        return arena;
+}
+
+static void freeArena(LibraryArena *arena)
+{
+        while (arena->slabs != NULL)
+        {
+                EntrySlab *slab = arena->slabs;
+                arena->slabs = slab->next;
+                free(slab);
+        }
+
+        while (arena->strings != NULL)
+        {
+                StringChunk *chunk = arena->strings;
+                arena->strings = chunk->next;
+                free(chunk);
+        }
+
+        if (arena->names != NULL)
+                g_hash_table_destroy(arena->names);
+
+        if (arena->map != NULL)
+                munmap(arena->map, arena->mapSize);
+
+        freeSearchIndex(arena->search);
+        free(arena->paths);
+        free(arena->rootPath);
+        free(arena);
+}
+
+static EntrySlab *addEntrySlab(LibraryArena *arena, size_t count)
+{
+        EntrySlab *slab = calloc(1, sizeof(EntrySlab) + count * sizeof(FileSystemEntry));
+        if (slab == NULL)
+        {
+                fprintf(stderr, "addEntrySlab: calloc\n");
+                return NULL;
+        }
+
+        slab->count = count;
+        slab->next = arena->slabs;
+        arena->slabs = slab;
+
+        return slab;
+}
+
+static FileSystemEntry *allocEntry(LibraryArena *arena)
+{
+        EntrySlab *slab = arena->slabs;
+
+        if (slab == NULL || slab->used == slab->count)
+        {
+                slab = addEntrySlab(arena, ARENA_SLAB_ENTRIES);
+                if (slab == NULL)
+                        return NULL;
+        }
+
+        return &slab->entries[slab->used++];
+}
+
+static const char *internName(LibraryArena *arena, const char *name)
+{
+        if (arena->names == NULL)
+                arena->names = g_hash_table_new(g_str_hash, g_str_equal);
+
+        const char *interned = g_hash_table_lookup(arena->names, name);
+        if (interned != NULL)
+                return interned;
+
+        size_t size = strlen(name) + 1;
+        StringChunk *chunk = arena->strings;
+
+        if (chunk == NULL || chunk->size - chunk->used < size)
+        {
+                size_t chunkSize = size > ARENA_STRING_CHUNK ? size : ARENA_STRING_CHUNK;
+
+                chunk = malloc(sizeof(StringChunk) + chunkSize);
+                if (chunk == NULL)
+                {
+                        fprintf(stderr, "internName: malloc\n");
+                        return NULL;
+                }
+
+                chunk->used = 0;
+                chunk->size = chunkSize;
+                chunk->next = arena->strings;
+                arena->strings = chunk;
+        }
+
+        char *copy = chunk->data + chunk->used;
+        memcpy(copy, name, size);
+        chunk->used += size;
+
+        g_hash_table_insert(arena->names, copy, copy);
+
+        return copy;
+}
+
+static FileSystemEntry *nextInPreorder(FileSystemEntry *node, FileSystemEntry *root)
+{
+        if (node->children != NULL)
+                return node->children;
+
+        while (node != root && node->next == NULL)
+                node = node->parent;
+
+        return node == root ? NULL : node->next;
+}
+
+// The root and everything linked below it
+static size_t countTreeEntries(FileSystemEntry *root)
+{
+        size_t count = 0;
+
+        for (FileSystemEntry *node = root; node != NULL; node = nextInPreorder(node, root))
+                count++;
+
+        return count;
+}
+
+// FNV-1a, fed one piece of the path at a time so a parent's hash can be extended
+static uint64_t hashPathPart(uint64_t hash, const char *part)
+{
+        for (const unsigned char *p = (const unsigned char *)part; *p != '\0'; p++)
+        {
+                hash ^= *p;
+                hash *= 0x100000001b3ULL;
+        }
+
+        return hash;
+}
+
+static const uint64_t pathHashSeed = 0xcbf29ce484222325ULL;
+
+static void addPathSlot(LibraryArena *arena, uint64_t hash, FileSystemEntry *entry)
+{
+        size_t i = hash & arena->pathMask;
+
+        while (arena->paths[i].entry != NULL)
+                i = (i + 1) & arena->pathMask;
+
+        arena->paths[i].hash = hash;
+        arena->paths[i].entry = entry;
+}
+
+static void addPathSlots(LibraryArena *arena, FileSystemEntry *first, uint64_t parentHash)
+{
+        for (FileSystemEntry *entry = first; entry != NULL; entry = entry->next)
+        {
+                uint64_t hash = hashPathPart(hashPathPart(parentHash, "/"), entry->name);
+
+                addPathSlot(arena, hash, entry);
+
+                if (entry->isDirectory)
+                        addPathSlots(arena, entry->children, hash);
+        }
+}
+
+static void dropPathIndex(LibraryArena *arena)
+{
+        free(arena->paths);
+        arena->paths = NULL;
+        arena->pathMask = 0;
+}
+
+static void buildPathIndex(LibraryArena *arena)
+{
+        dropPathIndex(arena);
+
+        // Only the live tree, entries dropped by a refresh still sit in the slabs
+        size_t count = countTreeEntries(&arena->root);
+
+        // At most half full so probes stay short
+        size_t size = 16;
+
+        while (size < count * 2)
+                size *= 2;
+
+        arena->paths = calloc(size, sizeof(PathSlot));
+        if (arena->paths == NULL)
+        {
+                // Lookups fall back to walking down the tree
+                fprintf(stderr, "buildPathIndex: calloc\n");
+                return;
+        }
+
+        arena->pathMask = size - 1;
+
+        uint64_t rootHash = hashPathPart(pathHashSeed, arena->rootPath);
+
+        addPathSlot(arena, rootHash, &arena->root);
+        addPathSlots(arena, arena->root.children, rootHash);
+}
+
+static void finishArena(LibraryArena *arena)
+{
+        // The lookup table is only needed while names are still being added
+        if (arena->names != NULL)
+        {
+                g_hash_table_destroy(arena->names);
+                arena->names = NULL;
+        }
+
+        buildPathIndex(arena);
+}
+
+FileSystemEntry *createEntry(LibraryArena *arena, const char *name, int isDirectory, FileSystemEntry *parent)
 {
-        if (lastUsedId == INT_MAX)
+        if (arena->lastId == INT_MAX)
                 return NULL;
 
-        FileSystemEntry *newEntry = malloc(sizeof(FileSystemEntry));
+        FileSystemEntry *newEntry = allocEntry(arena);
         if (newEntry != NULL)
         {
-                newEntry->name = strdup(name);
+                newEntry->name = (char *)internName(arena, name);
                 if (newEntry->name == NULL)
                 {
                         fprintf(stderr, "createEntry: name is null\n");
-                        free(newEntry);
+                        arena->slabs->used--;
                         return NULL;
                 }
 
@@ -44,7 +373,8 @@ FileSystemEntry *createEntry(const char *name, int isDirectory, FileSystemEntry
                 newEntry->parent = parent;
                 newEntry->children = NULL;
                 newEntry->next = NULL;
-                newEntry->id = ++lastUsedId;
+                newEntry->mtime = 0;
+                newEntry->id = ++arena->lastId;
                 if (parent != NULL)
                 {
                         newEntry->parentId = parent->id;
@@ -57,6 +387,68 @@ FileSystemEntry *createEntry(const char *name, int isDirectory, FileSystemEntry
         return newEntry;
 }
 
+char *getEntryPath(const FileSystemEntry *entry, char *path, size_t size)
+{
+        if (size == 0)
+                return path;
+
+        path[0] = '\0';
+
+        if (entry == NULL)
+                return path;
+
+        const LibraryArena *arena = getArena(entry);
+        size_t rootLength = strlen(arena->rootPath);
+        size_t length = rootLength;
+
+        for (const FileSystemEntry *e = entry; e->parent != NULL; e = e->parent)
+                length += 1 + strlen(e->name);
+
+        if (length >= size)
+                return path;
+
+        // Filled in from the end, the same walk up again
+        path[length] = '\0';
+
+        for (const FileSystemEntry *e = entry; e->parent != NULL; e = e->parent)
+        {
+                size_t nameLength = strlen(e->name);
+
+                length -= nameLength;
+                memcpy(path + length, e->name, nameLength);
+                path[--length] = '/';
+        }
+
+        memcpy(path, arena->rootPath, rootLength);
+
+        return path;
+}
+
+bool entryHasPath(const FileSystemEntry *entry, const char *path)
+{
+        if (entry == NULL || path == NULL)
+                return false;
+
+        size_t end = strlen(path);
+        const FileSystemEntry *e = entry;
+
+        // Compares from the end without building the path
+        for (; e->parent != NULL; e = e->parent)
+        {
+                size_t nameLength = strlen(e->name);
+
+                if (end < nameLength + 1 || path[end - nameLength - 1] != '/' ||
+                    memcmp(path + end - nameLength, e->name, nameLength) != 0)
+                        return false;
+
+                end -= nameLength + 1;
+        }
+
+        const char *rootPath = ((const LibraryArena *)e)->rootPath;
+
+        return strlen(rootPath) == end && memcmp(path, rootPath, end) == 0;
+}
+
 void addChild(FileSystemEntry *parent, FileSystemEntry *child)
 {
         if (parent != NULL)
@@ -104,89 +496,12 @@ int isValidEntryName(const char *name)
         return 1;
 }
 
-void setFullPath(FileSystemEntry *entry, const char *parentPath, const char *entryName)
-{
-        if (entry == NULL || parentPath == NULL || entryName == NULL)
-                return;
-
-        if (!isValidEntryName(entryName))
-        {
-                // Limit printed length to avoid huge strings
-                char buf[257]; // 256 chars + null
-                snprintf(buf, sizeof(buf), "%s", entryName);
-                fprintf(stderr, "Invalid entryName (possible path traversal): '%s'\n", buf);
-                return;
-        }
-
-        size_t parentLen = strnlen(parentPath, MAXPATHLEN);
-        size_t nameLen = strnlen(entryName, MAXPATHLEN);
-
-        // +1 for '/', +1 for null terminator
-        size_t needed = parentLen + 1 + nameLen + 1;
-
-        if (needed > MAXPATHLEN)
-        {
-                fprintf(stderr, "Path too long, rejecting.\n");
-                return;
-        }
-
-        entry->fullPath = malloc(needed);
-        if (entry->fullPath == NULL)
-                return;
-
-        snprintf(entry->fullPath, needed, "%s/%s", parentPath, entryName);
-}
-
 void freeTree(FileSystemEntry *root)
 {
         if (root == NULL)
                 return;
 
-        // Stack of pointers
-        size_t cap = 128, top = 0;
-        FileSystemEntry **stack = malloc(cap * sizeof(*stack));
-        if (!stack)
-                return;
-
-        stack[top++] = root;
-
-        while (top > 0)
-        {
-                FileSystemEntry *node = stack[top - 1]; /* peek */
-
-                // If node has a child, push sibling then child so child is processed first */
-                if (node->children)
-                {
-                        // Ensure capacity
-                        if (top + 2 > cap)
-                        {
-                                size_t nc = cap * 2;
-                                FileSystemEntry **tmp = realloc(stack, nc * sizeof(*stack));
-                                if (!tmp)
-                                        break; // Allocation failure: abort early
-                                stack = tmp;
-                                cap = nc;
-                        }
-                        if (node->next)
-                        {
-                                stack[top++] = node->next;
-                        }
-                        stack[top++] = node->children;
-
-                        // Disconnect to avoid re-traversal down this pointer path
-                        node->children = NULL;
-                        node->next = NULL;
-                        continue;
-                }
-
-                // No children left, pop and free this node
-                top--; // Pop
-                free(node->name);
-                free(node->fullPath);
-                free(node);
-        }
-
-        free(stack);
+        freeArena(getArena(root));
 }
 
 int naturalCompare(const char *a, const char *b)
@@ -246,26 +561,24 @@ int naturalCompare(const char *a, const char *b)
         return 1;
 }
 
-int compareLibEntries(const struct dirent **a, const struct dirent **b)
+// Library order of two names that are already uppercased, names starting with '_' go last
+static int compareUpperNames(const char *nameA, const char *nameB)
 {
-        // All strings need to be uppercased or already uppercased characters will come before all lower-case ones
-        char *nameA = stringToUpper((*a)->d_name);
-        char *nameB = stringToUpper((*b)->d_name);
-
         if (nameA[0] == '_' && nameB[0] != '_')
-        {
-                free(nameA);
-                free(nameB);
                 return 1;
-        }
         else if (nameA[0] != '_' && nameB[0] == '_')
-        {
-                free(nameA);
-                free(nameB);
                 return -1;
-        }
 
-        int result = naturalCompare(nameA, nameB);
+        return naturalCompare(nameA, nameB);
+}
+
+int compareLibEntries(const struct dirent **a, const struct dirent **b)
+{
+        // All strings need to be uppercased or already uppercased characters will come before all lower-case ones
+        char *nameA = stringToUpper((*a)->d_name);
+        char *nameB = stringToUpper((*b)->d_name);
+
+        int result = compareUpperNames(nameA, nameB);
 
         free(nameA);
         free(nameB);
@@ -288,23 +601,11 @@ int compareEntryNatural(const void *a, const void *b)
         char *nameA = stringToUpper(entryA->name);
         char *nameB = stringToUpper(entryB->name);
 
-        if (nameA[0] == '_' && nameB[0] != '_')
-        {
-                free(nameA);
-                free(nameB);
-                return 1;
-        }
-        else if (nameA[0] != '_' && nameB[0] == '_')
-        {
-                free(nameA);
-                free(nameB);
-                return -1;
-        }
-
-        int result = naturalCompare(nameA, nameB);
+        int result = compareUpperNames(nameA, nameB);
 
         free(nameA);
         free(nameB);
+
         return result;
 }
 
@@ -315,7 +616,7 @@ int compareEntryNaturalReversed(const void *a, const void *b)
 
 #define MAX_RECURSION_DEPTH 1024
 
-int removeEmptyDirectories(FileSystemEntry *node, int depth)
+int removeEmptyDirectories(LibraryArena *arena, FileSystemEntry *node, int depth)
 {
         if (node == NULL || depth > MAX_RECURSION_DEPTH)
                 return 0;
@@ -328,7 +629,7 @@ int removeEmptyDirectories(FileSystemEntry *node, int depth)
         {
                 if (currentChild->isDirectory)
                 {
-                        numEntries += removeEmptyDirectories(currentChild, depth + 1);
+                        numEntries += removeEmptyDirectories(arena, currentChild, depth + 1);
 
                         if (currentChild->children == NULL)
                         {
@@ -341,12 +642,12 @@ int removeEmptyDirectories(FileSystemEntry *node, int depth)
                                         prevChild->next = currentChild->next;
                                 }
 
-                                FileSystemEntry *toFree = currentChild;
+                                // Kept aside with its parent link intact, so music added to it later is noticed
+                                FileSystemEntry *pruned = currentChild;
                                 currentChild = currentChild->next;
 
-                                free(toFree->name);
-                                free(toFree->fullPath);
-                                free(toFree);
+                                pruned->next = arena->pruned;
+                                arena->pruned = pruned;
                                 numEntries++;
                                 continue;
                         }
@@ -358,431 +659,1723 @@ int removeEmptyDirectories(FileSystemEntry *node, int depth)
         return numEntries;
 }
 
-int readDirectory(const char *path, FileSystemEntry *parent)
+/*
+ The music folder is scanned by several threads. Each has its own deque of
+ directories, takes work from the back of it and steals from the front of
+ the others when it runs dry. A directory is listed, filtered and sorted into
+ a ScanDirectory, and the tree is built from those afterwards on the calling
+ thread in the same order a plain recursive scan would use.
+*/
+
+#define SCAN_MAX_THREADS 16
+
+typedef struct ScanDirectory ScanDirectory;
+
+typedef struct
+{
+        const char *name; // Into the directory's names buffer
+        char *sortKey;    // Uppercased name, only while sorting
+        int isDirectory;
+        ScanDirectory *directory; // Listing of a subdirectory, NULL for files
+} ScanItem;
+
+struct ScanDirectory
+{
+        char *path;
+        ScanItem *items;
+        char *names;
+        int count;
+        int64_t mtime; // Taken before listing, so a change made meanwhile shows up next time
+};
+
+typedef struct
+{
+        pthread_mutex_t mutex;
+        ScanDirectory **directories;
+        size_t head;
+        size_t tail;
+        size_t capacity;
+} ScanDeque;
+
+typedef struct
+{
+        ScanDeque *deques;
+        int numDeques;
+        atomic_int pending; // Directories queued or being read
+        atomic_int queued;  // Directories sitting in a deque
+        pthread_mutex_t idleMutex;
+        pthread_cond_t idleCond;
+} LibraryScan;
+
+typedef struct
 {
-        struct dirent **entries;
-        int dirEntries = scandir(path, &entries, NULL, compareLibEntriesReversed);
+        LibraryScan *scan;
+        int index;
+} ScanWorker;
 
-        if (dirEntries < 0)
+static ScanDirectory *createScanDirectory(const char *path)
+{
+        ScanDirectory *dir = calloc(1, sizeof(ScanDirectory));
+        if (dir == NULL)
         {
-                return 0;
+                fprintf(stderr, "createScanDirectory: calloc\n");
+                return NULL;
         }
 
-        regex_t regex;
-        regcomp(&regex, AUDIO_EXTENSIONS, REG_EXTENDED);
+        dir->path = strdup(path);
+        if (dir->path == NULL)
+        {
+                fprintf(stderr, "createScanDirectory: strdup\n");
+                free(dir);
+                return NULL;
+        }
 
-        int numEntries = 0;
+        return dir;
+}
 
-        for (int i = 0; i < dirEntries; ++i)
-        {
-                struct dirent *entry = entries[i];
+static void freeScanDirectory(ScanDirectory *dir)
+{
+        if (dir == NULL)
+                return;
 
-                if (entry == NULL)
+        for (int i = 0; i < dir->count; i++)
+                freeScanDirectory(dir->items[i].directory);
+
+        free(dir->items);
+        free(dir->names);
+        free(dir->path);
+        free(dir);
+}
+
+static bool pushScanDirectory(ScanDeque *deque, ScanDirectory *dir)
+{
+        pthread_mutex_lock(&deque->mutex);
+
+        if (deque->tail == deque->capacity)
+        {
+                if (deque->head > 0)
                 {
-                        continue;
+                        memmove(deque->directories, deque->directories + deque->head,
+                                (deque->tail - deque->head) * sizeof(ScanDirectory *));
+                        deque->tail -= deque->head;
+                        deque->head = 0;
                 }
-
-                if (entry->d_name[0] != '.' && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                else
                 {
-                        char childPath[MAXPATHLEN];
-                        snprintf(childPath, sizeof(childPath), "%s/%s", path, entry->d_name);
+                        size_t capacity = deque->capacity > 0 ? deque->capacity * 2 : 64;
+                        ScanDirectory **directories = realloc(deque->directories, capacity * sizeof(ScanDirectory *));
 
-                        struct stat fileStats;
-                        if (stat(childPath, &fileStats) == -1)
+                        if (directories == NULL)
                         {
-                                continue;
+                                pthread_mutex_unlock(&deque->mutex);
+                                fprintf(stderr, "pushScanDirectory: realloc\n");
+                                return false;
                         }
 
-                        int isDir = true;
+                        deque->directories = directories;
+                        deque->capacity = capacity;
+                }
+        }
 
-                        if (S_ISREG(fileStats.st_mode))
-                        {
-                                isDir = false;
-                        }
+        deque->directories[deque->tail++] = dir;
+
+        pthread_mutex_unlock(&deque->mutex);
+
+        return true;
+}
+
+// The owner works from the back, so it goes depth first through what it found itself
+static ScanDirectory *popScanDirectory(ScanDeque *deque)
+{
+        ScanDirectory *dir = NULL;
+
+        pthread_mutex_lock(&deque->mutex);
+
+        if (deque->tail > deque->head)
+                dir = deque->directories[--deque->tail];
+
+        if (deque->tail == deque->head)
+                deque->head = deque->tail = 0;
+
+        pthread_mutex_unlock(&deque->mutex);
+
+        return dir;
+}
+
+// Thieves take from the front, where the directories closest to the top are
+static ScanDirectory *stealScanDirectory(ScanDeque *deque)
+{
+        ScanDirectory *dir = NULL;
+
+        pthread_mutex_lock(&deque->mutex);
+
+        if (deque->tail > deque->head)
+                dir = deque->directories[deque->head++];
+
+        pthread_mutex_unlock(&deque->mutex);
+
+        return dir;
+}
+
+static void queueScanDirectory(LibraryScan *scan, int index, ScanDirectory *dir)
+{
+        atomic_fetch_add(&scan->pending, 1);
+
+        if (!pushScanDirectory(&scan->deques[index], dir))
+        {
+                // Stays in the listing of its parent, just without contents
+                atomic_fetch_sub(&scan->pending, 1);
+                return;
+        }
+
+        atomic_fetch_add(&scan->queued, 1);
+
+        pthread_mutex_lock(&scan->idleMutex);
+        pthread_cond_signal(&scan->idleCond);
+        pthread_mutex_unlock(&scan->idleMutex);
+}
+
+static int compareScanItemsReversed(const void *a, const void *b)
+{
+        const ScanItem *itemA = a;
+        const ScanItem *itemB = b;
+
+        int result = compareUpperNames(itemA->sortKey, itemB->sortKey);
+
+        // Names that only differ in case still need a fixed order
+        if (result == 0)
+                result = strcmp(itemA->name, itemB->name);
+
+        return -result;
+}
+
+static int64_t getModificationTimeNs(const struct stat *st)
+{
+#ifdef __APPLE__
+        return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+        return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+// Lists one directory, d_type saves the stat for most entries
+static bool listScanDirectory(const regex_t *regex, ScanDirectory *dir)
+{
+        int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+                return false;
+
+        struct stat dirStats;
+        DIR *stream = fstat(fd, &dirStats) == 0 ? fdopendir(fd) : NULL;
+        if (stream == NULL)
+        {
+                close(fd);
+                return false;
+        }
+
+        dir->mtime = getModificationTimeNs(&dirStats);
+
+        size_t pathLength = strlen(dir->path);
+        size_t itemsCapacity = 0;
+        size_t namesSize = 0;
+        size_t namesCapacity = 0;
+        size_t *nameOffsets = NULL;
+        struct dirent *entry;
+
+        while ((entry = readdir(stream)) != NULL)
+        {
+                // Also skips "." and ".."
+                if (entry->d_name[0] == '.')
+                        continue;
+
+                if (!isValidEntryName(entry->d_name))
+                {
+                        // Limit printed length to avoid huge strings
+                        char buf[257]; // 256 chars + null
+                        snprintf(buf, sizeof(buf), "%s", entry->d_name);
+                        fprintf(stderr, "Invalid entryName (possible path traversal): '%s'\n", buf);
+                        continue;
+                }
+
+                size_t nameLength = strlen(entry->d_name);
 
+                if (pathLength + 1 + nameLength >= MAXPATHLEN)
+                {
+                        fprintf(stderr, "Path too long, rejecting.\n");
+                        continue;
+                }
+
+                int isDir;
+
+                switch (entry->d_type)
+                {
+                case DT_REG:
+                        isDir = 0;
+                        break;
+                case DT_DIR:
+                        isDir = 1;
+                        break;
+                case DT_LNK:
+                case DT_UNKNOWN:
+                {
+                        // Symlinks are followed, and some filesystems don't fill in d_type at all
+                        struct stat fileStats;
+
+                        if (fstatat(fd, entry->d_name, &fileStats, 0) == -1)
+                                continue;
+
+                        if (S_ISREG(fileStats.st_mode))
+                                isDir = 0;
+                        else if (S_ISDIR(fileStats.st_mode))
+                                isDir = 1;
+                        else
+                                continue;
+                        break;
+                }
+                default:
+                        continue;
+                }
+
+                if (!isDir)
+                {
                         char exto[100];
                         extractExtension(entry->d_name, sizeof(exto) - 1, exto);
 
-                        int isAudio = match_regex(&regex, exto);
+                        if (match_regex(regex, exto) != 0)
+                                continue;
+                }
+
+                if ((size_t)dir->count == itemsCapacity)
+                {
+                        size_t capacity = itemsCapacity > 0 ? itemsCapacity * 2 : 16;
+                        ScanItem *items = realloc(dir->items, capacity * sizeof(ScanItem));
+                        size_t *offsets = realloc(nameOffsets, capacity * sizeof(size_t));
+
+                        if (items != NULL)
+                                dir->items = items;
+                        if (offsets != NULL)
+                                nameOffsets = offsets;
+
+                        if (items == NULL || offsets == NULL)
+                        {
+                                fprintf(stderr, "readScanDirectory: realloc\n");
+                                break;
+                        }
+
+                        itemsCapacity = capacity;
+                }
+
+                if (namesSize + nameLength + 1 > namesCapacity)
+                {
+                        size_t capacity = namesCapacity > 0 ? namesCapacity * 2 : 1024;
+
+                        while (capacity < namesSize + nameLength + 1)
+                                capacity *= 2;
+
+                        char *names = realloc(dir->names, capacity);
+
+                        if (names == NULL)
+                        {
+                                fprintf(stderr, "readScanDirectory: realloc\n");
+                                break;
+                        }
+
+                        dir->names = names;
+                        namesCapacity = capacity;
+                }
+
+                memcpy(dir->names + namesSize, entry->d_name, nameLength + 1);
+
+                ScanItem *item = &dir->items[dir->count];
+                item->name = NULL;
+                item->sortKey = NULL;
+                item->isDirectory = isDir;
+                item->directory = NULL;
+                nameOffsets[dir->count++] = namesSize;
+
+                namesSize += nameLength + 1;
+        }
+
+        closedir(stream);
+
+        // The names buffer doesn't move anymore
+        for (int i = 0; i < dir->count; i++)
+        {
+                dir->items[i].name = dir->names + nameOffsets[i];
+                dir->items[i].sortKey = stringToUpper(dir->items[i].name);
+        }
+
+        free(nameOffsets);
+
+        bool hasKeys = true;
+
+        for (int i = 0; i < dir->count; i++)
+                hasKeys = hasKeys && dir->items[i].sortKey != NULL;
+
+        // Same order scandir with compareLibEntriesReversed used to give
+        if (hasKeys && dir->count > 1)
+                qsort(dir->items, dir->count, sizeof(ScanItem), compareScanItemsReversed);
+
+        for (int i = 0; i < dir->count; i++)
+        {
+                free(dir->items[i].sortKey);
+                dir->items[i].sortKey = NULL;
+        }
+
+        return true;
+}
+
+// Lists a directory and hands its subdirectories to the scan
+static void readScanDirectory(LibraryScan *scan, int index, const regex_t *regex, ScanDirectory *dir)
+{
+        listScanDirectory(regex, dir);
+
+        for (int i = 0; i < dir->count; i++)
+        {
+                ScanItem *item = &dir->items[i];
+
+                if (!item->isDirectory)
+                        continue;
+
+                char childPath[MAXPATHLEN];
+                snprintf(childPath, sizeof(childPath), "%s/%s", dir->path, item->name);
+
+                item->directory = createScanDirectory(childPath);
+
+                if (item->directory != NULL)
+                        queueScanDirectory(scan, index, item->directory);
+        }
+}
+
+static void *libraryScanWorker(void *arg)
+{
+        ScanWorker *worker = arg;
+        LibraryScan *scan = worker->scan;
+
+        // Compiled once per thread, so the threads don't share regexec's lock
+        regex_t regex;
+        if (regcomp(&regex, AUDIO_EXTENSIONS, REG_EXTENDED) != 0)
+                return NULL;
+
+        while (true)
+        {
+                ScanDirectory *dir = popScanDirectory(&scan->deques[worker->index]);
+
+                for (int i = 1; dir == NULL && i < scan->numDeques; i++)
+                        dir = stealScanDirectory(&scan->deques[(worker->index + i) % scan->numDeques]);
+
+                if (dir != NULL)
+                {
+                        atomic_fetch_sub(&scan->queued, 1);
+
+                        readScanDirectory(scan, worker->index, &regex, dir);
+
+                        if (atomic_fetch_sub(&scan->pending, 1) == 1)
+                        {
+                                // That was the last one, wake everyone up to leave
+                                pthread_mutex_lock(&scan->idleMutex);
+                                pthread_cond_broadcast(&scan->idleCond);
+                                pthread_mutex_unlock(&scan->idleMutex);
+                        }
+                        continue;
+                }
+
+                pthread_mutex_lock(&scan->idleMutex);
+
+                while (atomic_load(&scan->pending) > 0 && atomic_load(&scan->queued) == 0)
+                        pthread_cond_wait(&scan->idleCond, &scan->idleMutex);
+
+                bool done = atomic_load(&scan->pending) == 0;
+
+                pthread_mutex_unlock(&scan->idleMutex);
+
+                if (done)
+                        break;
+        }
+
+        regfree(&regex);
+
+        return NULL;
+}
+
+static int getScanThreadCount(void)
+{
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+        // Scanning mostly waits on the filesystem, so more threads than cores still help
+        long threads = cores > 0 ? cores * 2 : 2;
+
+        if (threads > SCAN_MAX_THREADS)
+                threads = SCAN_MAX_THREADS;
+
+        return (int)threads;
+}
+
+static ScanDirectory *scanLibrary(const char *startPath)
+{
+        ScanDirectory *root = createScanDirectory(startPath);
+        if (root == NULL)
+                return NULL;
+
+        int numThreads = getScanThreadCount();
+        LibraryScan scan;
+        ScanWorker workers[SCAN_MAX_THREADS];
+        pthread_t threads[SCAN_MAX_THREADS];
+        int numStarted = 0;
+
+        scan.deques = calloc(numThreads, sizeof(ScanDeque));
+        if (scan.deques == NULL)
+        {
+                fprintf(stderr, "scanLibrary: calloc\n");
+                freeScanDirectory(root);
+                return NULL;
+        }
+
+        scan.numDeques = numThreads;
+        atomic_init(&scan.pending, 0);
+        atomic_init(&scan.queued, 0);
+        pthread_mutex_init(&scan.idleMutex, NULL);
+        pthread_cond_init(&scan.idleCond, NULL);
+
+        for (int i = 0; i < numThreads; i++)
+        {
+                pthread_mutex_init(&scan.deques[i].mutex, NULL);
+                workers[i].scan = &scan;
+                workers[i].index = i;
+        }
+
+        queueScanDirectory(&scan, 0, root);
+
+        // The calling thread is worker 0, if some threads fail to start the rest steal their share
+        for (int i = 1; i < numThreads; i++)
+        {
+                if (pthread_create(&threads[numStarted], NULL, libraryScanWorker, &workers[i]) == 0)
+                        numStarted++;
+        }
+
+        libraryScanWorker(&workers[0]);
+
+        for (int i = 0; i < numStarted; i++)
+                pthread_join(threads[i], NULL);
+
+        for (int i = 0; i < numThreads; i++)
+        {
+                pthread_mutex_destroy(&scan.deques[i].mutex);
+                free(scan.deques[i].directories);
+        }
+
+        pthread_cond_destroy(&scan.idleCond);
+        pthread_mutex_destroy(&scan.idleMutex);
+        free(scan.deques);
+
+        return root;
+}
+
+// Creates the entries in the order the old recursive scan did, so ids come out the same
+static int buildTreeFromScan(LibraryArena *arena, const ScanDirectory *dir, FileSystemEntry *parent)
+{
+        int numEntries = 0;
+
+        for (int i = 0; i < dir->count; i++)
+        {
+                const ScanItem *item = &dir->items[i];
+                FileSystemEntry *child = createEntry(arena, item->name, item->isDirectory, parent);
+
+                if (child == NULL)
+                        continue;
+
+                addChild(parent, child);
+
+                if (item->isDirectory)
+                {
+                        numEntries++;
+
+                        if (item->directory != NULL)
+                        {
+                                child->mtime = item->directory->mtime;
+                                numEntries += buildTreeFromScan(arena, item->directory, child);
+                        }
+                }
+        }
+
+        return numEntries;
+}
+
+static uint64_t libraryIndexChecksum(uint64_t hash, const void *data, size_t size)
+{
+        const unsigned char *p = data;
+        size_t i = 0;
+
+        // FNV-1a over 64-bit words, it only has to catch truncated or damaged files
+        for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+        {
+                uint64_t word;
+                memcpy(&word, p + i, sizeof(word));
+                hash ^= word;
+                hash *= 0x100000001b3ULL;
+        }
+
+        for (; i < size; i++)
+        {
+                hash ^= p[i];
+                hash *= 0x100000001b3ULL;
+        }
+
+        return hash;
+}
+
+static void countTree(FileSystemEntry *root, uint32_t *nodeCount, uint64_t *stringPoolSize)
+{
+        FileSystemEntry *node = root;
+
+        *nodeCount = 0;
+        *stringPoolSize = 0;
+
+        // Preorder walk without recursion or a stack, the parent links lead back up
+        while (node != NULL)
+        {
+                (*nodeCount)++;
+                *stringPoolSize += strlen(node->name) + 1;
+
+                if (node->children != NULL)
+                {
+                        node = node->children;
+                        continue;
+                }
+
+                while (node != NULL && node != root && node->next == NULL)
+                        node = node->parent;
+
+                node = (node == NULL || node == root) ? NULL : node->next;
+        }
+}
+
+static int getEntryDepth(const FileSystemEntry *entry)
+{
+        int depth = 0;
+
+        for (; entry->parent != NULL; entry = entry->parent)
+                depth++;
+
+        return depth;
+}
+
+static int comparePrunedByDepth(const void *a, const void *b)
+{
+        int depthA = getEntryDepth(*(const FileSystemEntry **)a);
+        int depthB = getEntryDepth(*(const FileSystemEntry **)b);
+
+        return depthA - depthB;
+}
+
+static uint32_t addIndexName(GHashTable *offsets, char *pool, uint32_t *poolPos, char *name)
+{
+        gpointer offset = g_hash_table_lookup(offsets, name);
+
+        if (offset == NULL)
+        {
+                size_t nameLength = strlen(name);
+
+                offset = GUINT_TO_POINTER(*poolPos + 1);
+                memcpy(pool + *poolPos, name, nameLength + 1);
+                *poolPos += (uint32_t)nameLength + 1;
+                g_hash_table_insert(offsets, name, offset);
+        }
+
+        return GPOINTER_TO_UINT(offset) - 1;
+}
+
+static int writeLibraryIndex(FileSystemEntry *root, const char *filename)
+{
+        LibraryArena *arena = getArena(root);
+        uint32_t nodeCount;
+        uint64_t stringPoolSize;
+        size_t prunedCount = 0;
+
+        countTree(root, &nodeCount, &stringPoolSize);
+
+        for (FileSystemEntry *pruned = arena->pruned; pruned != NULL; pruned = pruned->next)
+        {
+                prunedCount++;
+                stringPoolSize += strlen(pruned->name) + 1;
+        }
+
+        if (nodeCount == 0 || nodeCount + (uint64_t)prunedCount > INT32_MAX || stringPoolSize > UINT32_MAX)
+                return -1;
+
+        uint32_t capacity = nodeCount + (uint32_t)prunedCount;
+        LibraryIndexNode *nodes = malloc(capacity * sizeof(LibraryIndexNode));
+        char *pool = malloc(stringPoolSize > 0 ? stringPoolSize : 1);
+        int32_t *lastChild = malloc(nodeCount * sizeof(int32_t));
+        FileSystemEntry **pruned = malloc((prunedCount > 0 ? prunedCount : 1) * sizeof(FileSystemEntry *));
+
+        if (nodes == NULL || pool == NULL || lastChild == NULL || pruned == NULL)
+        {
+                fprintf(stderr, "writeLibraryIndex: malloc\n");
+                free(nodes);
+                free(pool);
+                free(lastChild);
+                free(pruned);
+                return -1;
+        }
+
+        // Names that repeat across the tree are written to the pool once
+        GHashTable *offsets = g_hash_table_new(g_str_hash, g_str_equal);
+        GHashTable *directoryIndices = g_hash_table_new(g_direct_hash, g_direct_equal);
+        FileSystemEntry *node = root;
+        int32_t index = 0;
+        int32_t parentIndex = -1;
+        uint32_t poolPos = 0;
+
+        while (node != NULL)
+        {
+                nodes[index].id = node->id;
+                nodes[index].parent = parentIndex;
+                nodes[index].firstChild = -1;
+                nodes[index].nextSibling = -1;
+                nodes[index].nameOffset = addIndexName(offsets, pool, &poolPos, node->name);
+                nodes[index].nameLength = (uint32_t)strlen(node->name);
+                nodes[index].isDirectory = node->isDirectory ? 1 : 0;
+                nodes[index].pruned = 0;
+                nodes[index].mtime = node->mtime;
+                lastChild[index] = -1;
+
+                if (node->isDirectory)
+                        g_hash_table_insert(directoryIndices, node, GINT_TO_POINTER(index + 1));
+
+                if (parentIndex >= 0)
+                {
+                        if (lastChild[parentIndex] < 0)
+                                nodes[parentIndex].firstChild = index;
+                        else
+                                nodes[lastChild[parentIndex]].nextSibling = index;
+
+                        lastChild[parentIndex] = index;
+                }
+
+                if (node->children != NULL)
+                {
+                        parentIndex = index++;
+                        node = node->children;
+                        continue;
+                }
+
+                index++;
+
+                while (node != NULL && node != root && node->next == NULL)
+                {
+                        node = node->parent;
+                        parentIndex = nodes[parentIndex].parent;
+                }
+
+                node = (node == NULL || node == root) ? NULL : node->next;
+        }
+
+        free(lastChild);
+
+        // Pruned directories go last, shallowest first so a pruned parent is always written before its children
+        prunedCount = 0;
+
+        for (FileSystemEntry *entry = arena->pruned; entry != NULL; entry = entry->next)
+                pruned[prunedCount++] = entry;
+
+        qsort(pruned, prunedCount, sizeof(FileSystemEntry *), comparePrunedByDepth);
+
+        for (size_t i = 0; i < prunedCount; i++)
+        {
+                int parent = GPOINTER_TO_INT(g_hash_table_lookup(directoryIndices, pruned[i]->parent)) - 1;
+
+                if (parent < 0)
+                        continue;
+
+                nodes[index].id = pruned[i]->id;
+                nodes[index].parent = parent;
+                nodes[index].firstChild = -1;
+                nodes[index].nextSibling = -1;
+                nodes[index].nameOffset = addIndexName(offsets, pool, &poolPos, pruned[i]->name);
+                nodes[index].nameLength = (uint32_t)strlen(pruned[i]->name);
+                nodes[index].isDirectory = 1;
+                nodes[index].pruned = 1;
+                nodes[index].mtime = pruned[i]->mtime;
+
+                g_hash_table_insert(directoryIndices, pruned[i], GINT_TO_POINTER(index + 1));
+                index++;
+        }
+
+        free(pruned);
+        g_hash_table_destroy(directoryIndices);
+        g_hash_table_destroy(offsets);
+
+        nodeCount = (uint32_t)index;
+        stringPoolSize = poolPos;
+
+        LibraryIndexHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, LIBRARY_INDEX_MAGIC, sizeof(header.magic));
+        header.version = LIBRARY_INDEX_VERSION;
+        header.headerSize = sizeof(LibraryIndexHeader);
+        header.nodeSize = sizeof(LibraryIndexNode);
+        header.nodeCount = nodeCount;
+        header.stringPoolSize = stringPoolSize;
+        header.checksum = libraryIndexChecksum(0xcbf29ce484222325ULL, nodes, nodeCount * sizeof(LibraryIndexNode));
+        header.checksum = libraryIndexChecksum(header.checksum, pool, stringPoolSize);
+
+        // Written next to the old index and renamed over it, a mapping of the old file stays valid
+        char tmpFilename[MAXPATHLEN];
+        snprintf(tmpFilename, sizeof(tmpFilename), "%s.tmp", filename);
+
+        int result = -1;
+        FILE *file = fopen(tmpFilename, "wb");
+
+        if (file == NULL)
+        {
+                perror("Failed to open file");
+        }
+        else
+        {
+                bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                          fwrite(nodes, sizeof(LibraryIndexNode), nodeCount, file) == nodeCount &&
+                          fwrite(pool, 1, stringPoolSize, file) == stringPoolSize;
+
+                if (fclose(file) != 0)
+                        ok = false;
+
+                if (ok && rename(tmpFilename, filename) == 0)
+                        result = 0;
+                else
+                        remove(tmpFilename);
+        }
+
+        free(nodes);
+        free(pool);
+
+        return result;
+}
+
+void freeAndWriteTree(FileSystemEntry *root, const char *filename)
+{
+        if (root == NULL)
+                return;
+
+        if (writeLibraryIndex(root, filename) != 0)
+                fprintf(stderr, "Failed to write library index '%s'\n", filename);
+
+        freeTree(root);
+}
+
+FileSystemEntry *createDirectoryTree(const char *startPath, int *numEntries)
+{
+        LibraryArena *arena = createArena(startPath);
+
+        if (arena == NULL)
+        {
+                *numEntries = 0;
+                return NULL;
+        }
+
+        FileSystemEntry *root = &arena->root;
+        root->id = ++arena->lastId;
+
+        ScanDirectory *scanned = scanLibrary(startPath);
+
+        *numEntries = scanned != NULL ? buildTreeFromScan(arena, scanned, root) : 0;
+        *numEntries -= removeEmptyDirectories(arena, root, 0);
+
+        root->mtime = scanned != NULL ? scanned->mtime : 0;
+
+        freeScanDirectory(scanned);
+
+        finishArena(arena);
+
+        return root;
+}
+
+static const LibraryIndexHeader *validateLibraryIndex(const void *map, size_t mapSize)
+{
+        if (mapSize < sizeof(LibraryIndexHeader))
+                return NULL;
+
+        const LibraryIndexHeader *header = map;
+
+        if (memcmp(header->magic, LIBRARY_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != LIBRARY_INDEX_VERSION ||
+            header->headerSize != sizeof(LibraryIndexHeader) ||
+            header->nodeSize != sizeof(LibraryIndexNode) ||
+            header->nodeCount == 0 || header->nodeCount > INT32_MAX ||
+            header->stringPoolSize > UINT32_MAX)
+                return NULL;
+
+        uint64_t nodesSize = (uint64_t)header->nodeCount * sizeof(LibraryIndexNode);
+
+        if ((uint64_t)mapSize != sizeof(LibraryIndexHeader) + nodesSize + header->stringPoolSize)
+                return NULL;
+
+        const unsigned char *nodes = (const unsigned char *)map + sizeof(LibraryIndexHeader);
+        uint64_t checksum = libraryIndexChecksum(0xcbf29ce484222325ULL, nodes, nodesSize);
+        checksum = libraryIndexChecksum(checksum, nodes + nodesSize, header->stringPoolSize);
+
+        if (checksum != header->checksum)
+                return NULL;
+
+        return header;
+}
+
+// Index node i is the root for 0, entries[i - 1] otherwise and NULL for -1
+static FileSystemEntry *indexEntry(LibraryArena *arena, FileSystemEntry *entries, int32_t i)
+{
+        if (i < 0)
+                return NULL;
+
+        return i == 0 ? &arena->root : &entries[i - 1];
+}
+
+FileSystemEntry *reconstructTreeFromFile(const char *filename, const char *startMusicPath, int *numDirectoryEntries)
+{
+        if (numDirectoryEntries)
+                *numDirectoryEntries = 0;
+
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+                return NULL;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+                close(fd);
+                return NULL;
+        }
+
+        size_t mapSize = (size_t)st.st_size;
+        void *map = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (map == MAP_FAILED)
+                return NULL;
+
+        const LibraryIndexHeader *header = validateLibraryIndex(map, mapSize);
+        if (header == NULL)
+        {
+                // An old text cache or a damaged file, the caller rescans
+                munmap(map, mapSize);
+                return NULL;
+        }
+
+        int32_t nodeCount = (int32_t)header->nodeCount;
+        const LibraryIndexNode *indexNodes = (const LibraryIndexNode *)((const char *)map + sizeof(LibraryIndexHeader));
+        char *pool = (char *)map + sizeof(LibraryIndexHeader) + (size_t)nodeCount * sizeof(LibraryIndexNode);
+        size_t pathLength = strnlen(startMusicPath, MAXPATHLEN);
+        bool valid = true;
+
+        // Every node is checked before anything is linked up
+        for (int32_t i = 0; i < nodeCount && valid; i++)
+        {
+                const LibraryIndexNode *n = &indexNodes[i];
+
+                valid = (uint64_t)n->nameOffset + n->nameLength < header->stringPoolSize &&
+                        pool[n->nameOffset + n->nameLength] == '\0' &&
+                        (i == 0 ? n->parent == -1 : (n->parent >= 0 && n->parent < i && indexNodes[n->parent].isDirectory)) &&
+                        (n->firstChild == -1 || (n->firstChild > i && n->firstChild < nodeCount && indexNodes[n->firstChild].parent == i &&
+                                                 !indexNodes[n->firstChild].pruned)) &&
+                        (n->nextSibling == -1 || (n->nextSibling > i && n->nextSibling < nodeCount && indexNodes[n->nextSibling].parent == n->parent &&
+                                                  !indexNodes[n->nextSibling].pruned)) &&
+                        (n->pruned == 0 || (n->pruned == 1 && i > 0 && n->isDirectory && n->firstChild == -1 && n->nextSibling == -1));
+
+                if (valid && i > 0)
+                        valid = isValidEntryName(pool + n->nameOffset) && strlen(pool + n->nameOffset) == n->nameLength;
+        }
+
+        // Paths are no longer stored, but one that would not fit is still refused
+        for (int32_t i = 1; i < nodeCount && valid; i++)
+        {
+                if (indexNodes[i].firstChild != -1)
+                        continue;
+
+                size_t length = pathLength;
+
+                for (int32_t j = i; j > 0 && length < MAXPATHLEN; j = indexNodes[j].parent)
+                        length += 1 + indexNodes[j].nameLength;
+
+                valid = length < MAXPATHLEN;
+        }
+
+        LibraryArena *arena = valid ? createArena(startMusicPath) : NULL;
+
+        // The root is part of the arena itself, the rest share one slab
+        if (arena == NULL || (nodeCount > 1 && addEntrySlab(arena, (size_t)nodeCount - 1) == NULL))
+        {
+                if (arena != NULL)
+                        freeArena(arena);
+                munmap(map, mapSize);
+                return NULL;
+        }
+
+        FileSystemEntry *entries = NULL;
+
+        if (nodeCount > 1)
+        {
+                entries = arena->slabs->entries;
+                arena->slabs->used = (size_t)nodeCount - 1;
+        }
+
+        arena->map = map;
+        arena->mapSize = mapSize;
+
+        for (int32_t i = 0; i < nodeCount; i++)
+        {
+                const LibraryIndexNode *n = &indexNodes[i];
+                FileSystemEntry *node = indexEntry(arena, entries, i);
+
+                node->id = n->id;
+                node->name = i == 0 ? node->name : pool + n->nameOffset;
+                node->isDirectory = n->isDirectory ? 1 : 0;
+                node->isEnqueued = 0;
+                node->parent = indexEntry(arena, entries, n->parent);
+                node->parentId = node->parent != NULL ? node->parent->id : -1;
+                node->children = indexEntry(arena, entries, n->firstChild);
+                node->next = indexEntry(arena, entries, n->nextSibling);
+                node->mtime = n->mtime;
+
+                if (n->id > arena->lastId)
+                        arena->lastId = n->id;
+
+                if (n->pruned)
+                {
+                        node->next = arena->pruned;
+                        arena->pruned = node;
+                }
+                else if (i > 0 && node->isDirectory && numDirectoryEntries)
+                {
+                        (*numDirectoryEntries)++;
+                }
+        }
+
+        finishArena(arena);
+
+        return &arena->root;
+}
+
+static int countDirectories(FileSystemEntry *root)
+{
+        int count = 0;
+
+        for (FileSystemEntry *node = nextInPreorder(root, root); node != NULL; node = nextInPreorder(node, root))
+        {
+                if (node->isDirectory)
+                        count++;
+        }
+
+        return count;
+}
+
+char **getDirectoryPaths(FileSystemEntry *root, int *count)
+{
+        *count = 0;
+
+        if (root == NULL)
+                return NULL;
+
+        LibraryArena *arena = getArena(root);
+        int capacity = countDirectories(root) + 1;
+
+        for (FileSystemEntry *pruned = arena->pruned; pruned != NULL; pruned = pruned->next)
+                capacity++;
+
+        char **paths = malloc(capacity * sizeof(char *));
+        if (paths == NULL)
+        {
+                fprintf(stderr, "getDirectoryPaths: malloc\n");
+                return NULL;
+        }
+
+        char path[MAXPATHLEN];
+
+        // The live tree first, then the directories without music
+        for (FileSystemEntry *node = root; node != NULL && *count < capacity; node = nextInPreorder(node, root))
+        {
+                if (node->isDirectory && (paths[*count] = strdup(getEntryPath(node, path, sizeof(path)))) != NULL)
+                        (*count)++;
+        }
+
+        for (FileSystemEntry *pruned = arena->pruned; pruned != NULL && *count < capacity; pruned = pruned->next)
+        {
+                if ((paths[*count] = strdup(getEntryPath(pruned, path, sizeof(path)))) != NULL)
+                        (*count)++;
+        }
+
+        return paths;
+}
+
+char **getFilePaths(FileSystemEntry *root, int *count)
+{
+        *count = 0;
+
+        if (root == NULL)
+                return NULL;
+
+        int capacity = 0;
+
+        for (FileSystemEntry *node = root; node != NULL; node = nextInPreorder(node, root))
+        {
+                if (!node->isDirectory)
+                        capacity++;
+        }
+
+        char **paths = malloc((capacity + 1) * sizeof(char *));
+        if (paths == NULL)
+        {
+                fprintf(stderr, "getFilePaths: malloc\n");
+                return NULL;
+        }
 
-                        if (isAudio == 0 || isDir)
-                        {
+        char path[MAXPATHLEN];
 
-                                FileSystemEntry *child = createEntry(entry->d_name, isDir, parent);
+        for (FileSystemEntry *node = root; node != NULL && *count < capacity; node = nextInPreorder(node, root))
+        {
+                if (!node->isDirectory && (paths[*count] = strdup(getEntryPath(node, path, sizeof(path)))) != NULL)
+                        (*count)++;
+        }
 
-                                if (child == NULL)
-                                        continue;
+        return paths;
+}
 
-                                setFullPath(child, path, entry->d_name);
+FileSystemEntry **getFileEntries(FileSystemEntry *root, int *count)
+{
+        *count = 0;
 
-                                if (child->fullPath == NULL)
-                                        continue;
+        if (root == NULL)
+                return NULL;
 
-                                addChild(parent, child);
+        int capacity = 0;
 
-                                if (isDir)
-                                {
-                                        numEntries++;
-                                        numEntries += readDirectory(childPath, child);
-                                }
-                        }
-                }
+        for (FileSystemEntry *node = root; node != NULL; node = nextInPreorder(node, root))
+        {
+                if (!node->isDirectory)
+                        capacity++;
+        }
 
-                free(entry);
+        FileSystemEntry **entries = malloc((capacity + 1) * sizeof(FileSystemEntry *));
+        if (entries == NULL)
+        {
+                fprintf(stderr, "getFileEntries: malloc\n");
+                return NULL;
         }
 
-        free(entries);
-        regfree(&regex);
+        for (FileSystemEntry *node = root; node != NULL && *count < capacity; node = nextInPreorder(node, root))
+        {
+                if (!node->isDirectory)
+                        entries[(*count)++] = node;
+        }
 
-        return numEntries;
+        return entries;
 }
 
-void writeTreeToFile(FileSystemEntry *node, FILE *file, int parentId)
+/*
+ A refresh only rereads directories whose mtime moved since they were listed.
+ It comes in three steps so the slow part doesn't need the tree:
+ createLibraryChanges takes a snapshot of the directories to check,
+ readLibraryChanges stats and rereads them and scans new subdirectories, and
+ applyLibraryChanges patches the tree in place.
+*/
+
+typedef struct
 {
-        if (node == NULL)
-        {
-                return;
-        }
+        FileSystemEntry *entry;
+        char *path;
+        int64_t mtime;
+        bool force;             // Reread even if the mtime looks the same
+        ScanDirectory *listing; // Set when the directory changed
+} ChangedDirectory;
+
+struct LibraryChanges
+{
+        FileSystemEntry *root;
+        ChangedDirectory *dirs;
+        int count;
+        int capacity;
+        GHashTable *knownPaths; // Subdirectories already in the tree, they aren't scanned again as new
+};
+
+static FileSystemEntry *findDirectoryEntry(FileSystemEntry *root, const char *path)
+{
+        FileSystemEntry *entry = findCorrespondingEntry(root, path);
 
-        fprintf(file, "%d\t%s\t%d\t%d\n", node->id, node->name, node->isDirectory, parentId);
+        if (entry != NULL && entry->isDirectory)
+                return entry;
 
-        FileSystemEntry *child = node->children;
-        FileSystemEntry *tmp = NULL;
-        while (child)
+        for (FileSystemEntry *pruned = getArena(root)->pruned; pruned != NULL; pruned = pruned->next)
         {
-                tmp = child->next;
-                writeTreeToFile(child, file, node->id);
-                child = tmp;
+                if (entryHasPath(pruned, path))
+                        return pruned;
         }
 
-        free(node->name);
-        free(node->fullPath);
-        free(node);
+        return NULL;
 }
 
-void freeAndWriteTree(FileSystemEntry *root, const char *filename)
+static void addChangedDirectory(LibraryChanges *changes, GHashTable *checked, FileSystemEntry *entry, bool force)
 {
-        FILE *file = fopen(filename, "w");
-        if (!file)
-        {
-                perror("Failed to open file");
+        if (g_hash_table_lookup(checked, entry) != NULL)
                 return;
+
+        if (changes->count == changes->capacity)
+        {
+                int capacity = changes->capacity > 0 ? changes->capacity * 2 : 64;
+                ChangedDirectory *dirs = realloc(changes->dirs, capacity * sizeof(ChangedDirectory));
+
+                if (dirs == NULL)
+                {
+                        fprintf(stderr, "addChangedDirectory: realloc\n");
+                        return;
+                }
+
+                changes->dirs = dirs;
+                changes->capacity = capacity;
         }
 
-        writeTreeToFile(root, file, -1);
-        fclose(file);
-}
+        char path[MAXPATHLEN];
+        ChangedDirectory *dir = &changes->dirs[changes->count];
 
-FileSystemEntry *createDirectoryTree(const char *startPath, int *numEntries)
-{
-        FileSystemEntry *root = createEntry("root", 1, NULL);
+        dir->path = strdup(getEntryPath(entry, path, sizeof(path)));
+        if (dir->path == NULL)
+                return;
 
-        setFullPath(root, "", "");
+        dir->entry = entry;
+        dir->mtime = entry->mtime;
+        dir->force = force;
+        dir->listing = NULL;
 
-        *numEntries = readDirectory(startPath, root);
-        *numEntries -= removeEmptyDirectories(root, 0);
+        g_hash_table_insert(checked, entry, entry);
+        changes->count++;
+}
 
-        lastUsedId = 0;
+static void addKnownPath(LibraryChanges *changes, FileSystemEntry *entry)
+{
+        char path[MAXPATHLEN];
+        char *copy = strdup(getEntryPath(entry, path, sizeof(path)));
 
-        return root;
+        if (copy != NULL)
+                g_hash_table_insert(changes->knownPaths, copy, copy);
 }
 
-FileSystemEntry **resizeNodesArray(FileSystemEntry **nodes, int oldSize, int newSize)
+LibraryChanges *createLibraryChanges(FileSystemEntry *root, char **paths, int count)
 {
-        FileSystemEntry **newNodes = realloc(nodes, newSize * sizeof(FileSystemEntry *));
-        if (newNodes)
+        if (root == NULL)
+                return NULL;
+
+        LibraryChanges *changes = calloc(1, sizeof(LibraryChanges));
+        if (changes == NULL)
+        {
+                fprintf(stderr, "createLibraryChanges: calloc\n");
+                return NULL;
+        }
+
+        LibraryArena *arena = getArena(root);
+        GHashTable *checked = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+        changes->root = root;
+        changes->knownPaths = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+
+        if (paths == NULL)
         {
-                for (int i = oldSize; i < newSize; i++)
+                for (FileSystemEntry *node = root; node != NULL; node = nextInPreorder(node, root))
                 {
-                        newNodes[i] = NULL;
+                        if (node->isDirectory)
+                                addChangedDirectory(changes, checked, node, false);
                 }
-        }
-        return newNodes;
-}
 
-int countLinesAndMaxId(const char *filename, int *maxId_out)
-{
-        FILE *file = fopen(filename, "r");
-        if (!file)
-                return -1;
+                for (FileSystemEntry *pruned = arena->pruned; pruned != NULL; pruned = pruned->next)
+                        addChangedDirectory(changes, checked, pruned, false);
+        }
+        else
+        {
+                // Someone saw these change, so they are read even if the mtime didn't move
+                for (int i = 0; i < count; i++)
+                {
+                        FileSystemEntry *entry = findDirectoryEntry(root, paths[i]);
 
-        char line[1024];
-        int lines = 0, maxId = -1;
+                        if (entry != NULL)
+                                addChangedDirectory(changes, checked, entry, true);
+                }
+        }
 
-        while (fgets(line, sizeof(line), file))
+        for (int i = 0; i < changes->count; i++)
         {
-                int id;
-                if (sscanf(line, "%d", &id) == 1)
+                for (FileSystemEntry *child = changes->dirs[i].entry->children; child != NULL; child = child->next)
                 {
-                        if (id > maxId)
-                                maxId = id;
+                        if (child->isDirectory)
+                                addKnownPath(changes, child);
                 }
-                lines++;
         }
 
-        fclose(file);
+        for (FileSystemEntry *pruned = arena->pruned; pruned != NULL; pruned = pruned->next)
+        {
+                if (g_hash_table_lookup(checked, pruned->parent) != NULL)
+                        addKnownPath(changes, pruned);
+        }
 
-        if (maxId_out)
-                *maxId_out = maxId;
+        g_hash_table_destroy(checked);
 
-        return lines;
+        return changes;
 }
 
-FileSystemEntry *reconstructTreeFromFile(const char *filename, const char *startMusicPath, int *numDirectoryEntries)
+void readLibraryChanges(LibraryChanges *changes)
 {
-        int maxId = -1;
-        int nodeCount = countLinesAndMaxId(filename, &maxId);
-        if (nodeCount <= 0 || maxId < 0)
-                return NULL;
+        if (changes == NULL)
+                return;
 
-        FILE *file = fopen(filename, "r");
-        if (!file)
-                return NULL;
+        regex_t regex;
+        if (regcomp(&regex, AUDIO_EXTENSIONS, REG_EXTENDED) != 0)
+                return;
 
-        // Allocate memory for maxid + 1 nodes
-        FileSystemEntry **nodes = calloc((size_t)(maxId + 1), sizeof(FileSystemEntry *));
-        if (!nodes)
+        for (int i = 0; i < changes->count; i++)
         {
-                fclose(file);
-                return NULL;
-        }
-        char line[1024];
-        FileSystemEntry *root = NULL;
-        if (numDirectoryEntries)
-                *numDirectoryEntries = 0;
+                ChangedDirectory *dir = &changes->dirs[i];
+                struct stat st;
 
-        while (fgets(line, sizeof(line), file))
-        {
-                int id, parentId, isDir;
-                char name[256];
-                if (sscanf(line, "%d\t%255[^\t]\t%d\t%d", &id, name, &isDir, &parentId) != 4)
+                // A directory that is gone is dropped when its parent is read
+                if (stat(dir->path, &st) != 0 || !S_ISDIR(st.st_mode))
+                        continue;
+
+                if (!dir->force && getModificationTimeNs(&st) == dir->mtime)
                         continue;
-                FileSystemEntry *node = malloc(sizeof(FileSystemEntry));
-                node->id = id;
-                node->name = strdup(name);
-                if (node->name == NULL)
+
+                ScanDirectory *listing = createScanDirectory(dir->path);
+
+                if (listing == NULL)
+                        continue;
+
+                if (!listScanDirectory(&regex, listing))
                 {
-                        fprintf(stderr, "reconstructTreeFromFile:name is null\n");
-                        free(node);
+                        freeScanDirectory(listing);
                         continue;
                 }
-                node->isDirectory = isDir;
-                node->isEnqueued = 0;
-                node->parentId = parentId;
-                node->parent = NULL;
-                node->children = NULL;
-                node->next = NULL;
-                node->lastChild = NULL;
-                nodes[id] = node;
-
-                if (parentId >= 0 && parentId <= maxId && nodes[parentId])
-                {
-                        node->parent = nodes[parentId];
-                        FileSystemEntry *parent = nodes[parentId];
-                        if (!parent->children)
-                        {
-                                parent->children = parent->lastChild = node;
-                        }
-                        else
-                        {
-                                parent->lastChild->next = node;
-                                parent->lastChild = node;
-                        }
-                        // fullPath = parent/fullName
-                        size_t plen = strlen(parent->fullPath);
-                        size_t nlen = strlen(name);
-                        node->fullPath = malloc(plen + 1 + nlen + 1);
-                        memcpy(node->fullPath, parent->fullPath, plen);
-                        node->fullPath[plen] = '/';
-                        memcpy(node->fullPath + plen + 1, name, nlen);
-                        node->fullPath[plen + 1 + nlen] = 0;
-                        if (isDir && numDirectoryEntries)
-                                (*numDirectoryEntries)++;
+
+                for (int j = 0; j < listing->count; j++)
+                {
+                        ScanItem *item = &listing->items[j];
+                        char childPath[MAXPATHLEN];
+
+                        if (!item->isDirectory)
+                                continue;
+
+                        snprintf(childPath, sizeof(childPath), "%s/%s", listing->path, item->name);
+
+                        if (g_hash_table_lookup(changes->knownPaths, childPath) == NULL)
+                                item->directory = scanLibrary(childPath);
                 }
-                else
+
+                dir->listing = listing;
+        }
+
+        regfree(&regex);
+}
+
+// Rebuilds the children of a directory from a new listing, keeping the entries that are still there.
+// They end up in natural order unless a comparator is given.
+static void mergeDirectoryListing(LibraryArena *arena, FileSystemEntry *dir, const ScanDirectory *listing, int (*comparator)(const void *, const void *))
+{
+        GHashTable *existing = g_hash_table_new(g_str_hash, g_str_equal);
+
+        for (FileSystemEntry *child = dir->children; child != NULL; child = child->next)
+                g_hash_table_insert(existing, child->name, child);
+
+        FileSystemEntry *children = NULL;
+
+        // The listing is sorted in reverse and every child goes to the front, like in the scan
+        for (int i = 0; i < listing->count; i++)
+        {
+                const ScanItem *item = &listing->items[i];
+                FileSystemEntry *child = g_hash_table_lookup(existing, item->name);
+
+                if (child == NULL || child->isDirectory != item->isDirectory)
                 {
-                        node->parent = NULL;
-                        node->fullPath = strdup(startMusicPath);
-                        if (node->fullPath == NULL)
-                        {
-                                fprintf(stderr, "reconstructTreeFromFiley: fullPath is null\n");
-                                free(node);
+                        child = createEntry(arena, item->name, item->isDirectory, dir);
+
+                        if (child == NULL)
                                 continue;
+
+                        if (item->directory != NULL)
+                        {
+                                child->mtime = item->directory->mtime;
+                                buildTreeFromScan(arena, item->directory, child);
+
+                                if (comparator != NULL)
+                                        sortFileSystemTree(child, comparator);
                         }
-                        root = node;
                 }
+
+                child->next = children;
+                children = child;
         }
-        fclose(file);
 
-        free(nodes);
-        return root;
+        dir->children = children;
+        dir->mtime = listing->mtime;
+
+        if (comparator != NULL)
+                sortFileSystemEntryChildren(dir, comparator);
+
+        g_hash_table_destroy(existing);
 }
 
-#ifdef __GNUC__
-#ifndef __APPLE__
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
-#endif
-#endif
-// Calculates the Levenshtein distance.
-// The Levenshtein distance between two strings is the minimum number of single-character edits
-// (insertions, deletions, or substitutions) required to change one string into the other.
-int utf8_levenshteinDistance(const char *s1, const char *s2)
+static bool unlinkChild(FileSystemEntry *parent, FileSystemEntry *child)
+{
+        for (FileSystemEntry **link = &parent->children; *link != NULL; link = &(*link)->next)
+        {
+                if (*link == child)
+                {
+                        *link = child->next;
+                        child->next = NULL;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+static void insertChildInOrder(FileSystemEntry *parent, FileSystemEntry *child, int (*comparator)(const void *, const void *))
+{
+        FileSystemEntry **link = &parent->children;
+
+        while (*link != NULL && comparator(link, &child) <= 0)
+                link = &(*link)->next;
+
+        child->next = *link;
+        *link = child;
+}
+
+int applyLibraryChanges(FileSystemEntry *root, LibraryChanges *changes, int *numDirectoryEntries, int (*comparator)(const void *, const void *))
 {
-        // Get the length of s1 and s2 in terms of characters, not bytes
-        int len1 = g_utf8_strlen(s1, -1);
-        int len2 = g_utf8_strlen(s2, -1);
+        if (root == NULL || changes == NULL || changes->root != root)
+                return -1;
 
-        // Allocate a 2D matrix (only two rows at a time are needed)
-        int *prevRow = malloc((len2 + 1) * sizeof(int));
-        int *currRow = malloc((len2 + 1) * sizeof(int));
+        int numChanged = 0;
 
-        if (prevRow == NULL)
+        for (int i = 0; i < changes->count; i++)
         {
-                if (currRow != NULL)
-                        free(currRow);
-                perror("malloc");
+                if (changes->dirs[i].listing != NULL)
+                        numChanged++;
+        }
+
+        if (numChanged == 0)
                 return 0;
+
+        LibraryArena *arena = getArena(root);
+        size_t prunedCount = 0;
+
+        // Entries come and go below, it's rebuilt when the tree is finished again
+        dropPathIndex(arena);
+        freeSearchIndex(arena->search);
+        arena->search = NULL;
+
+        for (FileSystemEntry *pruned = arena->pruned; pruned != NULL; pruned = pruned->next)
+                prunedCount++;
+
+        FileSystemEntry **wasPruned = malloc((prunedCount > 0 ? prunedCount : 1) * sizeof(FileSystemEntry *));
+        if (wasPruned == NULL)
+        {
+                fprintf(stderr, "applyLibraryChanges: malloc\n");
+                return -1;
         }
 
-        if (currRow == NULL)
+        // Pruned directories are put back for now, they may have gotten music or be gone
+        prunedCount = 0;
+
+        while (arena->pruned != NULL)
         {
-                free(prevRow);
-                perror("malloc");
-                return 0;
+                FileSystemEntry *pruned = arena->pruned;
+                arena->pruned = pruned->next;
+
+                pruned->next = pruned->parent->children;
+                pruned->parent->children = pruned;
+                wasPruned[prunedCount++] = pruned;
         }
 
-        // Initialize the first row (for empty s1)
-        for (int j = 0; j <= len2; j++)
+        for (int i = 0; i < changes->count; i++)
         {
-                prevRow[j] = j;
+                if (changes->dirs[i].listing != NULL)
+                        mergeDirectoryListing(arena, changes->dirs[i].entry, changes->dirs[i].listing, comparator);
         }
 
-        // Iterate over the characters of both strings
-        const char *p1 = s1;
-        for (int i = 1; i <= len1; i++, p1 = g_utf8_next_char(p1))
+        removeEmptyDirectories(arena, root, 0);
+
+        // One that got music without its parent being reread still sits at the front, move it into place
+        for (size_t i = 0; i < prunedCount; i++)
         {
-                currRow[0] = i;
-                const char *p2 = s2;
-                for (int j = 1; j <= len2; j++, p2 = g_utf8_next_char(p2))
+                if (unlinkChild(wasPruned[i]->parent, wasPruned[i]))
                 {
-                        // Compare Unicode characters using g_utf8_get_char
-                        gunichar c1 = g_utf8_get_char(p1);
-                        gunichar c2 = g_utf8_get_char(p2);
+                        if (comparator != NULL)
+                                sortFileSystemTree(wasPruned[i], comparator);
 
-                        int cost = (c1 == c2) ? 0 : 1;
-
-                        // Fill the current row with the minimum of deletion, insertion, or substitution
-                        currRow[j] = MIN(prevRow[j] + 1,              // Deletion
-                                         MIN(currRow[j - 1] + 1,      // Insertion
-                                             prevRow[j - 1] + cost)); // Substitution
+                        insertChildInOrder(wasPruned[i]->parent, wasPruned[i], comparator != NULL ? comparator : compareEntryNatural);
                 }
+        }
 
-                // Swap rows (current becomes previous for the next iteration)
-                int *tmp = prevRow;
-                prevRow = currRow;
-                currRow = tmp;
+        // A directory that was reread has a new mtime, which can move it among its siblings
+        for (int i = 0; i < changes->count && comparator != NULL; i++)
+        {
+                FileSystemEntry *parent = changes->dirs[i].entry->parent;
+
+                if (changes->dirs[i].listing != NULL && parent != NULL)
+                        sortFileSystemEntryChildren(parent, comparator);
         }
 
-        // The last value in prevRow contains the Levenshtein distance
-        int distance = prevRow[len2];
+        free(wasPruned);
+        finishArena(arena);
 
-        // Free the allocated memory
-        free(prevRow);
-        free(currRow);
+        if (numDirectoryEntries != NULL)
+                *numDirectoryEntries = countDirectories(root);
 
-        return distance;
+        return numChanged;
 }
 
-#ifdef __GNUC__
-#ifndef __APPLE__
-#pragma GCC diagnostic pop
-#endif
-#endif
-
-char *stripFileExtension(const char *filename)
+void freeLibraryChanges(LibraryChanges *changes)
 {
-        const char *dot = strrchr(filename, '.'); // find last '.'
-        size_t length = (dot != NULL) ? (size_t)(dot - filename) : strlen(filename);
+        if (changes == NULL)
+                return;
 
-        char *result = malloc(length + 1);
-        if (!result)
+        for (int i = 0; i < changes->count; i++)
         {
-                perror("malloc");
-                return NULL;
+                free(changes->dirs[i].path);
+                freeScanDirectory(changes->dirs[i].listing);
         }
-        c_strcpy(result, filename, length);
-        result[length] = '\0';
 
-        return result;
+        g_hash_table_destroy(changes->knownPaths);
+        free(changes->dirs);
+        free(changes);
+}
+
+/*
+ A refresh never frees the entries it drops, something may still point at
+ them. They are only reclaimed by copying what is left into a fresh arena,
+ which is done once they take up most of the old one.
+*/
+
+static FileSystemEntry *copyEntry(LibraryArena *arena, const FileSystemEntry *entry, FileSystemEntry *parent)
+{
+        FileSystemEntry *copy = allocEntry(arena);
+        if (copy == NULL)
+                return NULL;
+
+        *copy = *entry;
+        copy->name = (char *)internName(arena, entry->name);
+        copy->parent = parent;
+        copy->children = NULL;
+        copy->next = NULL;
+
+        return copy->name != NULL ? copy : NULL;
 }
 
-// Traverses the tree and applies fuzzy search on each node
-void fuzzySearchRecursive(FileSystemEntry *node, const char *searchTerm, int threshold, void (*callback)(FileSystemEntry *, int))
+static bool copyChildren(LibraryArena *arena, const FileSystemEntry *from, FileSystemEntry *to, GHashTable *directories)
 {
-        if (node == NULL)
+        FileSystemEntry **link = &to->children;
+
+        for (const FileSystemEntry *child = from->children; child != NULL; child = child->next)
         {
-                return;
+                FileSystemEntry *copy = copyEntry(arena, child, to);
+                if (copy == NULL)
+                        return false;
+
+                *link = copy;
+                link = &copy->next;
+
+                if (child->isDirectory)
+                {
+                        g_hash_table_insert(directories, (gpointer)child, copy);
+
+                        if (!copyChildren(arena, child, copy, directories))
+                                return false;
+                }
         }
 
-        // Convert search term, name, and fullPath to lowercase
-        char *lowerSearchTerm = g_utf8_casefold(searchTerm, -1);
-        char *lowerName = g_utf8_casefold(node->name, -1);
+        return true;
+}
+
+// Pruned directories hang off a directory of the tree or off another pruned one
+static bool copyPruned(LibraryArena *arena, const LibraryArena *from, GHashTable *directories)
+{
+        FileSystemEntry **link = &arena->pruned;
+
+        for (const FileSystemEntry *pruned = from->pruned; pruned != NULL; pruned = pruned->next)
+        {
+                // Still the old parent, it's swapped for its copy below
+                FileSystemEntry *copy = copyEntry(arena, pruned, pruned->parent);
+                if (copy == NULL)
+                        return false;
 
-        char *strippedName = stripFileExtension(lowerName);
+                *link = copy;
+                link = &copy->next;
 
-        int nameDistance = utf8_levenshteinDistance(strippedName, lowerSearchTerm);
+                g_hash_table_insert(directories, (gpointer)pruned, copy);
+        }
 
-        // Partial matching with lowercase strings
-        if (strstr(strippedName, lowerSearchTerm) != NULL)
+        for (FileSystemEntry *copy = arena->pruned; copy != NULL; copy = copy->next)
         {
-                callback(node, 0);
+                copy->parent = g_hash_table_lookup(directories, copy->parent);
+
+                if (copy->parent == NULL)
+                        return false;
         }
-        else if (nameDistance <= threshold)
+
+        return true;
+}
+
+FileSystemEntry *compactLibraryTree(FileSystemEntry *root)
+{
+        if (root == NULL)
+                return NULL;
+
+        LibraryArena *from = getArena(root);
+        size_t allocated = 0;
+        size_t live = countTreeEntries(&from->root);
+
+        for (EntrySlab *slab = from->slabs; slab != NULL; slab = slab->next)
+                allocated += slab->used;
+
+        for (FileSystemEntry *pruned = from->pruned; pruned != NULL; pruned = pruned->next)
+                live++;
+
+        size_t dead = allocated + 1 > live ? allocated + 1 - live : 0;
+
+        if (dead < live || dead < ARENA_SLAB_ENTRIES)
+                return NULL;
+
+        LibraryArena *arena = createArena(from->rootPath);
+        if (arena == NULL)
+                return NULL;
+
+        GHashTable *directories = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+        arena->root.id = from->root.id;
+        arena->root.isEnqueued = from->root.isEnqueued;
+        arena->root.mtime = from->root.mtime;
+        arena->lastId = from->lastId;
+
+        g_hash_table_insert(directories, &from->root, &arena->root);
+
+        bool copied = copyChildren(arena, &from->root, &arena->root, directories) &&
+                      copyPruned(arena, from, directories);
+
+        g_hash_table_destroy(directories);
+
+        if (!copied)
         {
-                callback(node, nameDistance);
+                fprintf(stderr, "compactLibraryTree: copy failed\n");
+                freeArena(arena);
+                return NULL;
         }
 
-        // Free the allocated memory for lowercase strings
-        g_free(lowerSearchTerm);
-        g_free(lowerName);
-        free(strippedName);
+        finishArena(arena);
 
-        fuzzySearchRecursive(node->children, searchTerm, threshold, callback);
-        fuzzySearchRecursive(node->next, searchTerm, threshold, callback);
+        return &arena->root;
 }
 
-FileSystemEntry *findCorrespondingEntry(FileSystemEntry *tmp, const char *fullPath)
+void fuzzySearchLibrary(FileSystemEntry *root, const char *searchTerm, int threshold, void (*callback)(FileSystemEntry *, int), bool (*isCancelled)(void))
 {
-        if (tmp == NULL)
-                return NULL;
-        if (strcmp(tmp->fullPath, fullPath) == 0)
-                return tmp;
+        if (root == NULL)
+                return;
 
-        FileSystemEntry *found = findCorrespondingEntry(tmp->children, fullPath);
-        if (found != NULL)
-                return found;
+        LibraryArena *arena = getArena(root);
 
-        return findCorrespondingEntry(tmp->next, fullPath);
+        // Built on the first search after the tree was loaded or changed
+        if (arena->search == NULL)
+                arena->search = createSearchIndex(&arena->root);
+
+        searchIndex(arena->search, searchTerm, threshold, callback, isCancelled);
 }
 
-void copyIsEnqueued(FileSystemEntry *library, FileSystemEntry *tmp)
+void dropSearchIndex(FileSystemEntry *root)
 {
-        if (library == NULL)
+        if (root == NULL)
                 return;
 
-        if (library->isEnqueued)
+        LibraryArena *arena = getArena(root);
+
+        freeSearchIndex(arena->search);
+        arena->search = NULL;
+}
+
+FileSystemEntry *findCorrespondingEntry(FileSystemEntry *tmp, const char *fullPath)
+{
+        if (tmp == NULL || fullPath == NULL)
+                return NULL;
+
+        if (tmp->parent != NULL)
+        {
+                // Somewhere inside a tree, search this subtree and the siblings after it
+                if (entryHasPath(tmp, fullPath))
+                        return tmp;
+
+                FileSystemEntry *found = findCorrespondingEntry(tmp->children, fullPath);
+                if (found != NULL)
+                        return found;
+
+                return findCorrespondingEntry(tmp->next, fullPath);
+        }
+
+        const LibraryArena *arena = (const LibraryArena *)tmp;
+
+        if (arena->paths != NULL)
         {
-                FileSystemEntry *tmpEntry = findCorrespondingEntry(tmp, library->fullPath);
-                if (tmpEntry != NULL)
+                uint64_t hash = hashPathPart(pathHashSeed, fullPath);
+
+                for (size_t i = hash & arena->pathMask; arena->paths[i].entry != NULL; i = (i + 1) & arena->pathMask)
                 {
-                        tmpEntry->isEnqueued = library->isEnqueued;
+                        if (arena->paths[i].hash == hash && entryHasPath(arena->paths[i].entry, fullPath))
+                                return arena->paths[i].entry;
                 }
+
+                return NULL;
+        }
+
+        // Without the index the path leads straight down, one name at a time
+        const char *rootPath = arena->rootPath;
+        size_t rootLength = strlen(rootPath);
+
+        if (strncmp(fullPath, rootPath, rootLength) != 0)
+                return NULL;
+
+        const char *segment = fullPath + rootLength;
+        FileSystemEntry *entry = tmp;
+
+        while (*segment != '\0')
+        {
+                if (*segment != '/')
+                        return NULL;
+
+                segment++;
+
+                const char *end = strchr(segment, '/');
+                size_t length = end != NULL ? (size_t)(end - segment) : strlen(segment);
+                FileSystemEntry *child = entry->children;
+
+                while (child != NULL && (strncmp(child->name, segment, length) != 0 || child->name[length] != '\0'))
+                        child = child->next;
+
+                if (child == NULL)
+                        return NULL;
+
+                entry = child;
+                segment += length;
         }
 
-        copyIsEnqueued(library->children, tmp);
+        return entry;
+}
+
+void copyIsEnqueued(FileSystemEntry *library, FileSystemEntry *tmp)
+{
+        for (; library != NULL; library = library->next)
+        {
+                if (library->isEnqueued)
+                {
+                        char path[MAXPATHLEN];
+                        FileSystemEntry *tmpEntry = findCorrespondingEntry(tmp, getEntryPath(library, path, sizeof(path)));
+                        if (tmpEntry != NULL)
+                        {
+                                tmpEntry->isEnqueued = library->isEnqueued;
+                        }
+                }
 
-        copyIsEnqueued(library->next, tmp);
+                copyIsEnqueued(library->children, tmp);
+        }
 }
 
 int compareFoldersByAgeFilesAlphabetically(const void *a, const void *b)
@@ -790,15 +2383,10 @@ int compareFoldersByAgeFilesAlphabetically(const void *a, const void *b)
         const FileSystemEntry *entryA = *(const FileSystemEntry **)a;
         const FileSystemEntry *entryB = *(const FileSystemEntry **)b;
 
-        // Both are directories → sort by mtime descending
+        // Both are directories → sort by the mtime they were listed with, newest first
         if (entryA->isDirectory && entryB->isDirectory)
         {
-                struct stat statA, statB;
-
-                if (stat(entryA->fullPath, &statA) != 0 || stat(entryB->fullPath, &statB) != 0)
-                        return 0;
-
-                return (int)(statB.st_mtime - statA.st_mtime); // newer first
+                return (entryB->mtime > entryA->mtime) - (entryB->mtime < entryA->mtime);
         }
 
         // Both are files → sort alphabetically
@@ -2,6 +2,8 @@
 #define DIRECTORYTREE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 
 #ifndef PATH_MAX
@@ -12,15 +14,14 @@
 typedef struct FileSystemEntry
 {
         int id;
-        char *name;
-        char *fullPath;
+        char *name; // Interned and shared with other entries, never modify or free it
         int isDirectory; // 1 for directory, 0 for file
         int isEnqueued;
         int parentId;
         struct FileSystemEntry *parent;
         struct FileSystemEntry *children;
         struct FileSystemEntry *next; // For siblings (next node in the same directory)
-        struct FileSystemEntry *lastChild; // TEMP: only for construction
+        int64_t mtime; // Directories only, modification time in nanoseconds when it was last listed
 } FileSystemEntry;
 #endif
 
@@ -31,16 +32,55 @@ typedef void (*SlowloadingCallback)(void);
 
 FileSystemEntry *createDirectoryTree(const char *startPath, int *numEntries);
 
+// Frees the whole tree the entry belongs to in one go
 void freeTree(FileSystemEntry *root);
 
+// Puts the full path of an entry together in path, empty if it doesn't fit
+char *getEntryPath(const FileSystemEntry *entry, char *path, size_t size);
+
+bool entryHasPath(const FileSystemEntry *entry, const char *path);
+
 void freeAndWriteTree(FileSystemEntry *root, const char *filename);
 
 FileSystemEntry *reconstructTreeFromFile(const char *filename, const char *startMusicPath, int *numDirectoryEntries);
 
-void fuzzySearchRecursive(FileSystemEntry *node, const char *searchTerm, int threshold, void (*callback)(FileSystemEntry *, int));
+typedef struct LibraryChanges LibraryChanges;
+
+// Snapshot of the directories to check, all of them if paths is NULL. Needs the tree locked.
+LibraryChanges *createLibraryChanges(FileSystemEntry *root, char **paths, int count);
+
+// Rereads the directories that changed and scans new subdirectories, doesn't touch the tree
+void readLibraryChanges(LibraryChanges *changes);
+
+// Patches the tree, returns how many directories changed or -1. Needs the tree locked.
+// Only what changed is sorted with comparator, NULL keeps the natural order.
+int applyLibraryChanges(FileSystemEntry *root, LibraryChanges *changes, int *numDirectoryEntries, int (*comparator)(const void *, const void *));
+
+void freeLibraryChanges(LibraryChanges *changes);
+
+// A copy of the tree in a fresh arena once entries dropped by refreshes take up most of it, NULL if that isn't worth it yet.
+// The old tree is left alone, free it when nothing points into it anymore. Needs the tree locked.
+FileSystemEntry *compactLibraryTree(FileSystemEntry *root);
+
+// Every directory in the tree, also those without music
+char **getDirectoryPaths(FileSystemEntry *root, int *count);
+
+// Every music file in the tree
+char **getFilePaths(FileSystemEntry *root, int *count);
+
+// Every music file in the tree, in tree order. The entries live as long as the tree.
+FileSystemEntry **getFileEntries(FileSystemEntry *root, int *count);
+
+// Names containing the term or within threshold edits of it, in tree order. isCancelled may be NULL.
+void fuzzySearchLibrary(FileSystemEntry *root, const char *searchTerm, int threshold, void (*callback)(FileSystemEntry *, int), bool (*isCancelled)(void));
+
+// The search index follows the tree order it was built in, drop it after sorting. Needs the tree write locked.
+void dropSearchIndex(FileSystemEntry *root);
 
 void copyIsEnqueued(FileSystemEntry *library, FileSystemEntry *tmp);
 
+void sortFileSystemEntryChildren(FileSystemEntry *parent, int (*comparator)(const void *, const void *));
+
 void sortFileSystemTree(FileSystemEntry *root, int (*comparator)(const void *, const void *));
 
 int compareFoldersByAgeFilesAlphabetically(const void *a, const void *b);
@@ -0,0 +1,739 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gain.h"
+
+/*
+
+gain.c
+
+ Gain kernels used for ReplayGain.
+
+ applyGain multiplies and clamps a block of interleaved samples in place, using
+ AVX2 (picked at runtime), SSE2 or NEON where available and a scalar loop for
+ the rest. The soft limiter looks a few milliseconds ahead so that a positive
+ gain is turned down smoothly before a peak instead of clipping it. It is only
+ on the signal path while it has something to do: with nothing held and unity
+ or negative gain the frames just get applyGain. Engaging holds the first
+ frames back in the delay line, counted by held, rather than putting silence in
+ front of them. Once it is idle again at gain <= 1 the held frames go out ahead
+ of the chunk and it steps aside, and drainSoftLimiter flushes them when a song
+ ends.
+
+*/
+
+#define LIMITER_THRESHOLD 0.98f
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GAIN_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define S32_MAX_AS_FLOAT 2147483520.0f // Largest float below 2^31
+
+float replayGainToLinear(double gainDb)
+{
+        return (float)pow(10.0, gainDb / 20.0);
+}
+
+static inline float clampFloat(float x, float lo, float hi)
+{
+        return (x < lo) ? lo : ((x > hi) ? hi : x);
+}
+
+#ifdef GAIN_HAVE_AVX2
+static int hasAvx2(void)
+{
+        static int supported = -1;
+
+        if (supported < 0)
+        {
+                __builtin_cpu_init();
+                supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+        }
+
+        return supported;
+}
+
+__attribute__((target("avx2"))) static ma_uint64 gainF32Avx2(float *samples, ma_uint64 count, float gain)
+{
+        const __m256 g = _mm256_set1_ps(gain);
+        const __m256 lo = _mm256_set1_ps(-1.0f);
+        const __m256 hi = _mm256_set1_ps(1.0f);
+        ma_uint64 i = 0;
+
+        for (; i + 8 <= count; i += 8)
+        {
+                __m256 v = _mm256_mul_ps(_mm256_loadu_ps(samples + i), g);
+                _mm256_storeu_ps(samples + i, _mm256_min_ps(_mm256_max_ps(v, lo), hi));
+        }
+
+        return i;
+}
+
+__attribute__((target("avx2"))) static ma_uint64 gainS16Avx2(ma_int16 *samples, ma_uint64 count, float gain)
+{
+        const __m256 g = _mm256_set1_ps(gain);
+        const __m256 lo = _mm256_set1_ps(-32768.0f);
+        const __m256 hi = _mm256_set1_ps(32767.0f);
+        ma_uint64 i = 0;
+
+        for (; i + 16 <= count; i += 16)
+        {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(samples + i));
+                __m256 first = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)));
+                __m256 second = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1)));
+
+                first = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(first, g), lo), hi);
+                second = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(second, g), lo), hi);
+
+                // packs works per 128-bit lane, the permute puts the halves back in order
+                __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(first), _mm256_cvtps_epi32(second));
+                _mm256_storeu_si256((__m256i *)(samples + i), _mm256_permute4x64_epi64(packed, 0xD8));
+        }
+
+        return i;
+}
+
+__attribute__((target("avx2"))) static ma_uint64 gainS32Avx2(ma_int32 *samples, ma_uint64 count, float gain)
+{
+        const __m256 g = _mm256_set1_ps(gain);
+        const __m256 lo = _mm256_set1_ps(-2147483648.0f);
+        const __m256 hi = _mm256_set1_ps(S32_MAX_AS_FLOAT);
+        ma_uint64 i = 0;
+
+        for (; i + 8 <= count; i += 8)
+        {
+                __m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(samples + i)));
+                v = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(v, g), lo), hi);
+                _mm256_storeu_si256((__m256i *)(samples + i), _mm256_cvtps_epi32(v));
+        }
+
+        return i;
+}
+#endif
+
+#if defined(__SSE2__)
+static ma_uint64 gainF32Vector(float *samples, ma_uint64 count, float gain)
+{
+        const __m128 g = _mm_set1_ps(gain);
+        const __m128 lo = _mm_set1_ps(-1.0f);
+        const __m128 hi = _mm_set1_ps(1.0f);
+        ma_uint64 i = 0;
+
+        for (; i + 4 <= count; i += 4)
+        {
+                __m128 v = _mm_mul_ps(_mm_loadu_ps(samples + i), g);
+                _mm_storeu_ps(samples + i, _mm_min_ps(_mm_max_ps(v, lo), hi));
+        }
+
+        return i;
+}
+
+static ma_uint64 gainS16Vector(ma_int16 *samples, ma_uint64 count, float gain)
+{
+        const __m128 g = _mm_set1_ps(gain);
+        const __m128 lo = _mm_set1_ps(-32768.0f);
+        const __m128 hi = _mm_set1_ps(32767.0f);
+        ma_uint64 i = 0;
+
+        for (; i + 8 <= count; i += 8)
+        {
+                __m128i v = _mm_loadu_si128((const __m128i *)(samples + i));
+
+                // Sign extend to 32 bits by unpacking into the high half and shifting back down
+                __m128 first = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+                __m128 second = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+
+                first = _mm_min_ps(_mm_max_ps(_mm_mul_ps(first, g), lo), hi);
+                second = _mm_min_ps(_mm_max_ps(_mm_mul_ps(second, g), lo), hi);
+
+                _mm_storeu_si128((__m128i *)(samples + i), _mm_packs_epi32(_mm_cvtps_epi32(first), _mm_cvtps_epi32(second)));
+        }
+
+        return i;
+}
+
+static ma_uint64 gainS32Vector(ma_int32 *samples, ma_uint64 count, float gain)
+{
+        const __m128 g = _mm_set1_ps(gain);
+        const __m128 lo = _mm_set1_ps(-2147483648.0f);
+        const __m128 hi = _mm_set1_ps(S32_MAX_AS_FLOAT);
+        ma_uint64 i = 0;
+
+        for (; i + 4 <= count; i += 4)
+        {
+                __m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(samples + i)));
+                v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(v, g), lo), hi);
+                _mm_storeu_si128((__m128i *)(samples + i), _mm_cvtps_epi32(v));
+        }
+
+        return i;
+}
+#elif defined(__ARM_NEON)
+
+#if defined(__aarch64__)
+#define NEON_ROUND_TO_INT(v) vcvtnq_s32_f32(v)
+#else
+#define NEON_ROUND_TO_INT(v) vcvtq_s32_f32(v)
+#endif
+
+static ma_uint64 gainF32Vector(float *samples, ma_uint64 count, float gain)
+{
+        const float32x4_t lo = vdupq_n_f32(-1.0f);
+        const float32x4_t hi = vdupq_n_f32(1.0f);
+        ma_uint64 i = 0;
+
+        for (; i + 4 <= count; i += 4)
+        {
+                float32x4_t v = vmulq_n_f32(vld1q_f32(samples + i), gain);
+                vst1q_f32(samples + i, vminq_f32(vmaxq_f32(v, lo), hi));
+        }
+
+        return i;
+}
+
+static ma_uint64 gainS16Vector(ma_int16 *samples, ma_uint64 count, float gain)
+{
+        const float32x4_t lo = vdupq_n_f32(-32768.0f);
+        const float32x4_t hi = vdupq_n_f32(32767.0f);
+        ma_uint64 i = 0;
+
+        for (; i + 8 <= count; i += 8)
+        {
+                int16x8_t v = vld1q_s16(samples + i);
+                float32x4_t first = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+                float32x4_t second = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+
+                first = vminq_f32(vmaxq_f32(vmulq_n_f32(first, gain), lo), hi);
+                second = vminq_f32(vmaxq_f32(vmulq_n_f32(second, gain), lo), hi);
+
+                vst1q_s16(samples + i, vcombine_s16(vqmovn_s32(NEON_ROUND_TO_INT(first)), vqmovn_s32(NEON_ROUND_TO_INT(second))));
+        }
+
+        return i;
+}
+
+static ma_uint64 gainS32Vector(ma_int32 *samples, ma_uint64 count, float gain)
+{
+        const float32x4_t lo = vdupq_n_f32(-2147483648.0f);
+        const float32x4_t hi = vdupq_n_f32(S32_MAX_AS_FLOAT);
+        ma_uint64 i = 0;
+
+        for (; i + 4 <= count; i += 4)
+        {
+                float32x4_t v = vcvtq_f32_s32(vld1q_s32(samples + i));
+                v = vminq_f32(vmaxq_f32(vmulq_n_f32(v, gain), lo), hi);
+                vst1q_s32(samples + i, NEON_ROUND_TO_INT(v));
+        }
+
+        return i;
+}
+#else
+static ma_uint64 gainF32Vector(float *samples, ma_uint64 count, float gain)
+{
+        (void)samples;
+        (void)count;
+        (void)gain;
+        return 0;
+}
+
+static ma_uint64 gainS16Vector(ma_int16 *samples, ma_uint64 count, float gain)
+{
+        (void)samples;
+        (void)count;
+        (void)gain;
+        return 0;
+}
+
+static ma_uint64 gainS32Vector(ma_int32 *samples, ma_uint64 count, float gain)
+{
+        (void)samples;
+        (void)count;
+        (void)gain;
+        return 0;
+}
+#endif
+
+static void gainF32(float *samples, ma_uint64 count, float gain)
+{
+        ma_uint64 i = 0;
+
+#ifdef GAIN_HAVE_AVX2
+        if (hasAvx2())
+                i = gainF32Avx2(samples, count, gain);
+#endif
+        i += gainF32Vector(samples + i, count - i, gain);
+
+        for (; i < count; i++)
+                samples[i] = clampFloat(samples[i] * gain, -1.0f, 1.0f);
+}
+
+static void gainS16(ma_int16 *samples, ma_uint64 count, float gain)
+{
+        ma_uint64 i = 0;
+
+#ifdef GAIN_HAVE_AVX2
+        if (hasAvx2())
+                i = gainS16Avx2(samples, count, gain);
+#endif
+        i += gainS16Vector(samples + i, count - i, gain);
+
+        for (; i < count; i++)
+                samples[i] = (ma_int16)lrintf(clampFloat(samples[i] * gain, -32768.0f, 32767.0f));
+}
+
+static void gainS32(ma_int32 *samples, ma_uint64 count, float gain)
+{
+        ma_uint64 i = 0;
+
+#ifdef GAIN_HAVE_AVX2
+        if (hasAvx2())
+                i = gainS32Avx2(samples, count, gain);
+#endif
+        i += gainS32Vector(samples + i, count - i, gain);
+
+        for (; i < count; i++)
+                samples[i] = (ma_int32)lrintf(clampFloat(samples[i] * gain, -2147483648.0f, S32_MAX_AS_FLOAT));
+}
+
+static inline ma_int32 readS24(const ma_uint8 *p)
+{
+        return (ma_int32)(((ma_uint32)p[0] << 8) | ((ma_uint32)p[1] << 16) | ((ma_uint32)p[2] << 24)) >> 8;
+}
+
+static inline void writeS24(ma_uint8 *p, ma_int32 value)
+{
+        p[0] = (ma_uint8)(value & 0xFF);
+        p[1] = (ma_uint8)((value >> 8) & 0xFF);
+        p[2] = (ma_uint8)((value >> 16) & 0xFF);
+}
+
+static void gainS24(ma_uint8 *samples, ma_uint64 count, float gain)
+{
+        for (ma_uint64 i = 0; i < count; i++)
+        {
+                float value = clampFloat(readS24(samples + i * 3) * gain, -8388608.0f, 8388607.0f);
+                writeS24(samples + i * 3, (ma_int32)lrintf(value));
+        }
+}
+
+static void gainU8(ma_uint8 *samples, ma_uint64 count, float gain)
+{
+        for (ma_uint64 i = 0; i < count; i++)
+        {
+                float value = clampFloat(((int)samples[i] - 128) * gain, -128.0f, 127.0f);
+                samples[i] = (ma_uint8)(lrintf(value) + 128);
+        }
+}
+
+void applyGain(void *pSamples, ma_format format, ma_uint64 sampleCount, float gain)
+{
+        if (pSamples == NULL || sampleCount == 0 || gain == 1.0f)
+                return;
+
+        switch (format)
+        {
+        case ma_format_f32:
+                gainF32((float *)pSamples, sampleCount, gain);
+                break;
+        case ma_format_s16:
+                gainS16((ma_int16 *)pSamples, sampleCount, gain);
+                break;
+        case ma_format_s24:
+                gainS24((ma_uint8 *)pSamples, sampleCount, gain);
+                break;
+        case ma_format_s32:
+                gainS32((ma_int32 *)pSamples, sampleCount, gain);
+                break;
+        case ma_format_u8:
+                gainU8((ma_uint8 *)pSamples, sampleCount, gain);
+                break;
+        default:
+                break;
+        }
+}
+
+static void samplesToFloat(const void *pSamples, ma_format format, ma_uint64 count, float *out)
+{
+        switch (format)
+        {
+        case ma_format_s16:
+                for (ma_uint64 i = 0; i < count; i++)
+                        out[i] = ((const ma_int16 *)pSamples)[i] / 32768.0f;
+                break;
+        case ma_format_s24:
+                for (ma_uint64 i = 0; i < count; i++)
+                        out[i] = readS24((const ma_uint8 *)pSamples + i * 3) / 8388608.0f;
+                break;
+        case ma_format_s32:
+                for (ma_uint64 i = 0; i < count; i++)
+                        out[i] = (float)(((const ma_int32 *)pSamples)[i] / 2147483648.0);
+                break;
+        case ma_format_u8:
+                for (ma_uint64 i = 0; i < count; i++)
+                        out[i] = ((int)((const ma_uint8 *)pSamples)[i] - 128) / 128.0f;
+                break;
+        default:
+                memcpy(out, pSamples, count * sizeof(float));
+                break;
+        }
+}
+
+static void floatToSamples(const float *in, ma_format format, ma_uint64 count, void *pSamples)
+{
+        switch (format)
+        {
+        case ma_format_s16:
+                for (ma_uint64 i = 0; i < count; i++)
+                        ((ma_int16 *)pSamples)[i] = (ma_int16)lrintf(clampFloat(in[i] * 32768.0f, -32768.0f, 32767.0f));
+                break;
+        case ma_format_s24:
+                for (ma_uint64 i = 0; i < count; i++)
+                        writeS24((ma_uint8 *)pSamples + i * 3, (ma_int32)lrintf(clampFloat(in[i] * 8388608.0f, -8388608.0f, 8388607.0f)));
+                break;
+        case ma_format_s32:
+                for (ma_uint64 i = 0; i < count; i++)
+                {
+                        double value = in[i] * 2147483648.0;
+                        value = (value < -2147483648.0) ? -2147483648.0 : ((value > 2147483647.0) ? 2147483647.0 : value);
+                        ((ma_int32 *)pSamples)[i] = (ma_int32)lrint(value);
+                }
+                break;
+        case ma_format_u8:
+                for (ma_uint64 i = 0; i < count; i++)
+                        ((ma_uint8 *)pSamples)[i] = (ma_uint8)(lrintf(clampFloat(in[i] * 128.0f, -128.0f, 127.0f)) + 128);
+                break;
+        default:
+                memcpy(pSamples, in, count * sizeof(float));
+                break;
+        }
+}
+
+int initSoftLimiter(SoftLimiter *limiter, ma_uint32 channels, ma_uint32 sampleRate)
+{
+        if (limiter == NULL || channels == 0 || sampleRate == 0)
+                return -1;
+
+        freeSoftLimiter(limiter);
+
+        ma_uint32 lookAhead = sampleRate * LIMITER_LOOKAHEAD_MILLISECONDS / 1000;
+
+        if (lookAhead < 2)
+                lookAhead = 2;
+
+        limiter->channels = channels;
+        limiter->lookAhead = lookAhead;
+        limiter->threshold = LIMITER_THRESHOLD;
+        limiter->releaseCoef = 1.0f - expf(-1000.0f / (LIMITER_RELEASE_MILLISECONDS * (float)sampleRate));
+        limiter->delayLine = malloc(sizeof(float) * (lookAhead - 1) * channels);
+        limiter->minHistory = malloc(sizeof(float) * lookAhead);
+        limiter->dequeIndex = malloc(sizeof(ma_uint64) * lookAhead);
+        limiter->dequeValue = malloc(sizeof(float) * lookAhead);
+        limiter->block = malloc(sizeof(float) * LIMITER_BLOCK_FRAMES * channels);
+
+        if (limiter->delayLine == NULL || limiter->minHistory == NULL || limiter->dequeIndex == NULL ||
+            limiter->dequeValue == NULL || limiter->block == NULL)
+        {
+                fprintf(stderr, "initSoftLimiter: malloc\n");
+                freeSoftLimiter(limiter);
+                return -1;
+        }
+
+        resetSoftLimiter(limiter);
+
+        return 0;
+}
+
+void resetSoftLimiter(SoftLimiter *limiter)
+{
+        if (limiter == NULL || limiter->delayLine == NULL)
+                return;
+
+        memset(limiter->delayLine, 0, sizeof(float) * (limiter->lookAhead - 1) * limiter->channels);
+
+        for (ma_uint32 i = 0; i < limiter->lookAhead; i++)
+                limiter->minHistory[i] = 1.0f;
+
+        limiter->minSum = limiter->lookAhead;
+        limiter->historyPos = 0;
+        limiter->delayPos = 0;
+        limiter->dequeHead = 0;
+        limiter->dequeCount = 0;
+        limiter->frameIndex = 0;
+        limiter->envelope = 1.0f;
+        limiter->held = 0;
+}
+
+void freeSoftLimiter(SoftLimiter *limiter)
+{
+        if (limiter == NULL)
+                return;
+
+        free(limiter->delayLine);
+        free(limiter->minHistory);
+        free(limiter->dequeIndex);
+        free(limiter->dequeValue);
+        free(limiter->block);
+
+        memset(limiter, 0, sizeof(SoftLimiter));
+}
+
+// Nothing in the look-ahead window is being turned down
+static bool isLimiterIdle(const SoftLimiter *limiter)
+{
+        return limiter->envelope == 1.0f && limiter->minSum >= limiter->lookAhead;
+}
+
+// Only delays the frames, for gain that can't push a peak past the threshold while the limiter is idle
+static void delayBlock(SoftLimiter *limiter, float *samples, ma_uint32 frameCount)
+{
+        const ma_uint32 channels = limiter->channels;
+        const ma_uint32 delayFrames = limiter->lookAhead - 1;
+        ma_uint32 f = 0;
+
+        while (f < frameCount)
+        {
+                ma_uint32 frames = delayFrames - limiter->delayPos;
+
+                if (frameCount - f < frames)
+                        frames = frameCount - f;
+
+                float *delayed = limiter->delayLine + (size_t)limiter->delayPos * channels;
+                float *frame = samples + (size_t)f * channels;
+
+                for (size_t i = 0; i < (size_t)frames * channels; i++)
+                {
+                        float out = delayed[i];
+                        delayed[i] = frame[i];
+                        frame[i] = out;
+                }
+
+                limiter->delayPos = (limiter->delayPos + frames) % delayFrames;
+                limiter->frameIndex += frames;
+                f += frames;
+        }
+}
+
+// The gain for each frame is the minimum gain needed by any frame in the look-ahead window,
+// averaged over the same window. Delaying the signal by lookAhead - 1 frames means the ramp
+// down is complete by the time a peak reaches the output. Peaks are only looked for when
+// the gain is positive, otherwise the envelope just releases back to unity.
+static void limitBlock(SoftLimiter *limiter, float *samples, ma_uint32 frameCount, float gain)
+{
+        const bool detectPeaks = gain > 1.0f;
+        const ma_uint32 channels = limiter->channels;
+        const ma_uint32 lookAhead = limiter->lookAhead;
+        const ma_uint32 delayFrames = lookAhead - 1;
+
+        for (ma_uint32 f = 0; f < frameCount; f++)
+        {
+                float *frame = samples + (size_t)f * channels;
+                float peak = 0.0f;
+
+                for (ma_uint32 c = 0; c < channels; c++)
+                {
+                        frame[c] *= gain;
+
+                        float magnitude = fabsf(frame[c]);
+
+                        if (magnitude > peak)
+                                peak = magnitude;
+                }
+
+                float required = (detectPeaks && peak > limiter->threshold) ? limiter->threshold / peak : 1.0f;
+
+                while (limiter->dequeCount > 0 &&
+                       limiter->dequeIndex[limiter->dequeHead] + lookAhead <= limiter->frameIndex)
+                {
+                        limiter->dequeHead = (limiter->dequeHead + 1) % lookAhead;
+                        limiter->dequeCount--;
+                }
+
+                while (limiter->dequeCount > 0)
+                {
+                        ma_uint32 back = (limiter->dequeHead + limiter->dequeCount - 1) % lookAhead;
+
+                        if (limiter->dequeValue[back] < required)
+                                break;
+
+                        limiter->dequeCount--;
+                }
+
+                ma_uint32 tail = (limiter->dequeHead + limiter->dequeCount) % lookAhead;
+                limiter->dequeIndex[tail] = limiter->frameIndex;
+                limiter->dequeValue[tail] = required;
+                limiter->dequeCount++;
+
+                float windowMin = limiter->dequeValue[limiter->dequeHead];
+
+                limiter->minSum += windowMin - limiter->minHistory[limiter->historyPos];
+                limiter->minHistory[limiter->historyPos] = windowMin;
+                limiter->historyPos = (limiter->historyPos + 1) % lookAhead;
+
+                if (limiter->historyPos == 0)
+                {
+                        // Recompute now and then so rounding errors don't accumulate
+                        double sum = 0.0;
+
+                        for (ma_uint32 i = 0; i < lookAhead; i++)
+                                sum += limiter->minHistory[i];
+
+                        limiter->minSum = sum;
+                }
+
+                float smoothed = (float)(limiter->minSum / lookAhead);
+
+                if (smoothed < limiter->envelope)
+                        limiter->envelope = smoothed;
+                else
+                        limiter->envelope += (smoothed - limiter->envelope) * limiter->releaseCoef;
+
+                // Float rounding stalls the release just short of unity, the last 0.01 dB is snapped
+                if (smoothed >= 1.0f && limiter->envelope > 0.999f)
+                        limiter->envelope = 1.0f;
+
+                float *delayed = limiter->delayLine + (size_t)limiter->delayPos * channels;
+
+                for (ma_uint32 c = 0; c < channels; c++)
+                {
+                        float out = delayed[c] * limiter->envelope;
+                        delayed[c] = frame[c];
+                        frame[c] = clampFloat(out, -1.0f, 1.0f);
+                }
+
+                limiter->delayPos = (limiter->delayPos + 1) % delayFrames;
+                limiter->frameIndex++;
+        }
+}
+
+// Frames that only push silence left by a reset out of the delay line, they are dropped from the output
+static ma_uint32 countSilentFrames(SoftLimiter *limiter, ma_uint32 frameCount)
+{
+        ma_uint32 silent = (limiter->lookAhead - 1) - limiter->held;
+
+        if (silent > frameCount)
+                silent = frameCount;
+
+        limiter->held += silent;
+
+        return silent;
+}
+
+ma_uint64 drainSoftLimiter(SoftLimiter *limiter, void *pFrames, ma_format format, ma_uint64 capacity)
+{
+        if (limiter == NULL || limiter->block == NULL || pFrames == NULL || limiter->held == 0 || capacity < limiter->held)
+                return 0;
+
+        const ma_uint32 channels = limiter->channels;
+        const ma_uint32 delayFrames = limiter->lookAhead - 1;
+        ma_uint32 bytesPerFrame = ma_get_bytes_per_frame(format, channels);
+        ma_uint8 *frames = (ma_uint8 *)pFrames;
+        ma_uint32 held = limiter->held;
+        ma_uint32 pushed = 0;
+        ma_uint32 framesOut = 0;
+
+        // Silence pushed in behind the held frames brings them out, the envelope goes on releasing over them
+        while (pushed < delayFrames)
+        {
+                ma_uint32 framesToProcess = LIMITER_BLOCK_FRAMES;
+
+                if (delayFrames - pushed < framesToProcess)
+                        framesToProcess = delayFrames - pushed;
+
+                memset(limiter->block, 0, sizeof(float) * framesToProcess * channels);
+                limitBlock(limiter, limiter->block, framesToProcess, 1.0f);
+
+                ma_uint32 silent = countSilentFrames(limiter, framesToProcess);
+
+                floatToSamples(limiter->block + (size_t)silent * channels, format, (ma_uint64)(framesToProcess - silent) * channels,
+                               frames + (size_t)framesOut * bytesPerFrame);
+
+                framesOut += framesToProcess - silent;
+                pushed += framesToProcess;
+        }
+
+        resetSoftLimiter(limiter);
+
+        return held;
+}
+
+ma_uint64 applyGainWithLimiter(SoftLimiter *limiter, void *pFrames, ma_format format, ma_uint64 frameCount, ma_uint64 capacity, float gain)
+{
+        if (limiter == NULL || limiter->block == NULL || pFrames == NULL)
+                return frameCount;
+
+        ma_uint32 bytesPerFrame = ma_get_bytes_per_frame(format, limiter->channels);
+        ma_uint8 *frames = (ma_uint8 *)pFrames;
+
+        // Nothing held back and nothing to limit, the frames don't need to go through at all
+        if (gain <= 1.0f && limiter->held == 0)
+        {
+                applyGain(pFrames, format, frameCount * limiter->channels, gain);
+                return frameCount;
+        }
+
+        // Idle again, the held frames go out in front of these and the limiter steps aside
+        if (gain <= 1.0f && isLimiterIdle(limiter) && frameCount + limiter->held <= capacity)
+        {
+                ma_uint32 held = limiter->held;
+
+                memmove(frames + (size_t)held * bytesPerFrame, frames, frameCount * bytesPerFrame);
+                applyGain(frames + (size_t)held * bytesPerFrame, format, frameCount * limiter->channels, gain);
+
+                return drainSoftLimiter(limiter, frames, format, held) + frameCount;
+        }
+
+        ma_uint64 framesDone = 0;
+        ma_uint64 framesOut = 0;
+
+        while (framesDone < frameCount)
+        {
+                ma_uint32 framesToProcess = LIMITER_BLOCK_FRAMES;
+
+                if (frameCount - framesDone < framesToProcess)
+                        framesToProcess = (ma_uint32)(frameCount - framesDone);
+
+                void *pBlock = frames + framesDone * bytesPerFrame;
+                ma_uint64 sampleCount = (ma_uint64)framesToProcess * limiter->channels;
+
+                float *samples = (format == ma_format_f32) ? (float *)pBlock : limiter->block;
+
+                if (format != ma_format_f32)
+                        samplesToFloat(pBlock, format, sampleCount, samples);
+
+                if (gain <= 1.0f && isLimiterIdle(limiter))
+                {
+                        applyGain(samples, ma_format_f32, sampleCount, gain);
+                        delayBlock(limiter, samples, framesToProcess);
+                }
+                else
+                {
+                        limitBlock(limiter, samples, framesToProcess, gain);
+                }
+
+                // Engaging from a reset holds the first frames back instead of putting silence in front of them
+                ma_uint32 silent = countSilentFrames(limiter, framesToProcess);
+                ma_uint8 *out = frames + framesOut * bytesPerFrame;
+
+                if (format != ma_format_f32)
+                        floatToSamples(samples + (size_t)silent * limiter->channels, format, sampleCount - (ma_uint64)silent * limiter->channels, out);
+                else if (silent > 0 || framesOut != framesDone)
+                        memmove(out, samples + (size_t)silent * limiter->channels, (size_t)(framesToProcess - silent) * bytesPerFrame);
+
+                framesOut += framesToProcess - silent;
+                framesDone += framesToProcess;
+        }
+
+        return framesOut;
+}
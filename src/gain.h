@@ -0,0 +1,56 @@
+#ifndef GAIN_H
+#define GAIN_H
+
+#include <miniaudio.h>
+
+#ifndef LIMITER_LOOKAHEAD_MILLISECONDS
+#define LIMITER_LOOKAHEAD_MILLISECONDS 5
+#endif
+
+#ifndef LIMITER_RELEASE_MILLISECONDS
+#define LIMITER_RELEASE_MILLISECONDS 60
+#endif
+
+#ifndef LIMITER_BLOCK_FRAMES
+#define LIMITER_BLOCK_FRAMES 512
+#endif
+
+typedef struct
+{
+        ma_uint32 channels;
+        ma_uint32 lookAhead;    // Window length in frames, the signal is delayed by lookAhead - 1 frames
+        float threshold;        // Peak level the output never exceeds
+        float releaseCoef;
+        float envelope;         // Gain currently applied
+        float *delayLine;       // (lookAhead - 1) * channels samples
+        ma_uint32 delayPos;
+        float *minHistory;      // Sliding window minimums, averaged into a smooth gain curve
+        double minSum;
+        ma_uint32 historyPos;
+        ma_uint64 *dequeIndex;  // Monotonic deque for the sliding window minimum of required gain
+        float *dequeValue;
+        ma_uint32 dequeHead;
+        ma_uint32 dequeCount;
+        ma_uint64 frameIndex;
+        float *block;           // Scratch buffer for LIMITER_BLOCK_FRAMES frames
+        ma_uint32 held;         // Frames of signal in the delay line, the rest is silence from a reset
+} SoftLimiter;
+
+float replayGainToLinear(double gainDb);
+
+void applyGain(void *pSamples, ma_format format, ma_uint64 sampleCount, float gain);
+
+int initSoftLimiter(SoftLimiter *limiter, ma_uint32 channels, ma_uint32 sampleRate);
+
+void resetSoftLimiter(SoftLimiter *limiter);
+
+void freeSoftLimiter(SoftLimiter *limiter);
+
+// Returns how many frames it left in pFrames, which has room for capacity. The limiter holds the last frames back
+// to look ahead. They come out once it is idle at unity or negative gain and can step aside, or when drained.
+ma_uint64 applyGainWithLimiter(SoftLimiter *limiter, void *pFrames, ma_format format, ma_uint64 frameCount, ma_uint64 capacity, float gain);
+
+// Writes out the frames held back and resets the limiter. Returns how many, 0 if they don't fit in capacity.
+ma_uint64 drainSoftLimiter(SoftLimiter *limiter, void *pFrames, ma_format format, ma_uint64 capacity);
+
+#endif
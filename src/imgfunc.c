@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -372,36 +373,66 @@ tty_init(void)
 #endif
 }
 
+typedef struct
+{
+        bool detected;
+        ChafaTermInfo *termInfo;
+        ChafaCanvasMode mode;
+        ChafaPixelMode pixelMode;
+        ChafaSymbolMap *symbolMap;
+#ifdef CHAFA_VERSION_1_16
+        ChafaPassthrough passthrough;
+#endif
+} TerminalCaps;
+
+static TerminalCaps terminalCaps;
+
+// The terminal doesn't change during a session, so it is only examined the first time a cover is drawn
+static TerminalCaps *getTerminalCaps(void)
+{
+        if (terminalCaps.detected)
+                return &terminalCaps;
+
+#ifdef CHAFA_VERSION_1_16
+        detect_terminal(&terminalCaps.termInfo, &terminalCaps.mode, &terminalCaps.pixelMode,
+                        &terminalCaps.passthrough, &terminalCaps.symbolMap);
+
+        if (terminalCaps.passthrough == CHAFA_PASSTHROUGH_TMUX)
+                apply_passthrough_workarounds_tmux();
+#else
+        detect_terminal(&terminalCaps.termInfo, &terminalCaps.mode, &terminalCaps.pixelMode);
+
+        /* Specify the symbols we want */
+
+        terminalCaps.symbolMap = chafa_symbol_map_new();
+        chafa_symbol_map_add_by_tags(terminalCaps.symbolMap, CHAFA_SYMBOL_TAG_BLOCK);
+#endif
+
+        terminalCaps.detected = true;
+
+        return &terminalCaps;
+}
+
 static GString *
 convert_image(const void *pixels, gint pix_width, gint pix_height,
               gint pix_rowstride, ChafaPixelType pixel_type,
               gint width_cells, gint height_cells,
               gint cell_width, gint cell_height)
 {
-        ChafaTermInfo *term_info;
-        ChafaCanvasMode mode;
-        ChafaPixelMode pixel_mode;
-        ChafaSymbolMap *symbol_map;
+        TerminalCaps *caps = getTerminalCaps();
         ChafaCanvasConfig *config;
         ChafaCanvas *canvas;
         GString *printable;
 
 #ifdef CHAFA_VERSION_1_16
 
-        ChafaPassthrough passthrough;
         ChafaFrame *frame;
         ChafaImage *image;
         ChafaPlacement *placement;
 
-        detect_terminal(&term_info, &mode, &pixel_mode,
-                        &passthrough, &symbol_map);
-
-        if (passthrough == CHAFA_PASSTHROUGH_TMUX)
-                apply_passthrough_workarounds_tmux();
-
         config = chafa_canvas_config_new();
-        chafa_canvas_config_set_canvas_mode(config, mode);
-        chafa_canvas_config_set_pixel_mode(config, pixel_mode);
+        chafa_canvas_config_set_canvas_mode(config, caps->mode);
+        chafa_canvas_config_set_pixel_mode(config, caps->pixelMode);
         chafa_canvas_config_set_geometry(config, width_cells, height_cells);
 
         if (cell_width > 0 && cell_height > 0)
@@ -411,8 +442,8 @@ convert_image(const void *pixels, gint pix_width, gint pix_height,
                 chafa_canvas_config_set_cell_geometry(config, cell_width, cell_height);
         }
 
-        chafa_canvas_config_set_passthrough(config, passthrough);
-        chafa_canvas_config_set_symbol_map(config, symbol_map);
+        chafa_canvas_config_set_passthrough(config, caps->passthrough);
+        chafa_canvas_config_set_symbol_map(config, caps->symbolMap);
 
         canvas = chafa_canvas_new(config);
         frame = chafa_frame_new_borrow((gpointer)pixels, pixel_type,
@@ -435,29 +466,18 @@ convert_image(const void *pixels, gint pix_width, gint pix_height,
         chafa_frame_unref(frame);
         chafa_canvas_unref(canvas);
         chafa_canvas_config_unref(config);
-        chafa_symbol_map_unref(symbol_map);
-        chafa_term_info_unref(term_info);
         canvas = NULL;
         config = NULL;
-        symbol_map = NULL;
-        term_info = NULL;
 
         return printable;
 #else
-        detect_terminal(&term_info, &mode, &pixel_mode);
-
-        /* Specify the symbols we want */
-
-        symbol_map = chafa_symbol_map_new();
-        chafa_symbol_map_add_by_tags(symbol_map, CHAFA_SYMBOL_TAG_BLOCK);
-
         /* Set up a configuration with the symbols and the canvas size in characters */
 
         config = chafa_canvas_config_new();
-        chafa_canvas_config_set_canvas_mode(config, mode);
-        chafa_canvas_config_set_pixel_mode(config, pixel_mode);
+        chafa_canvas_config_set_canvas_mode(config, caps->mode);
+        chafa_canvas_config_set_pixel_mode(config, caps->pixelMode);
         chafa_canvas_config_set_geometry(config, width_cells, height_cells);
-        chafa_canvas_config_set_symbol_map(config, symbol_map);
+        chafa_canvas_config_set_symbol_map(config, caps->symbolMap);
 
         if (cell_width > 0 && cell_height > 0)
         {
@@ -480,23 +500,132 @@ convert_image(const void *pixels, gint pix_width, gint pix_height,
                                      pix_rowstride);
 
         /* Build printable string */
-        printable = chafa_canvas_print(canvas, term_info);
+        printable = chafa_canvas_print(canvas, caps->termInfo);
 
         /* Clean up and return */
 
         chafa_canvas_unref(canvas);
         chafa_canvas_config_unref(config);
-        chafa_symbol_map_unref(symbol_map);
-        chafa_term_info_unref(term_info);
         canvas = NULL;
         config = NULL;
-        symbol_map = NULL;
-        term_info = NULL;
 
         return printable;
 #endif
 }
 
+typedef struct
+{
+        guint64 coverId;
+        gint widthCells;
+        gint heightCells;
+        gint cellWidth;
+        gint cellHeight;
+        ChafaCanvasMode mode;
+        ChafaPixelMode pixelMode;
+        int row; // Placement, or -1 and the indentation in col when centered
+        int col;
+        GString *output; // Escape sequences ready to be written to the terminal
+        guint64 lastUsed;
+} RenderedCover;
+
+static RenderedCover renderedCovers[RENDERED_COVER_CACHE_SIZE];
+static guint64 renderedCoverClock = 0;
+
+// Returns the complete output for a cover, rendering it with chafa only if this exact placement hasn't been drawn recently.
+// The string stays owned by the cache.
+static const GString *getRenderedCover(guint64 coverId, unsigned char *pixels, int pix_width, int pix_height,
+                                       int width_cells, int height_cells, int cell_width, int cell_height,
+                                       int row, int col)
+{
+        TerminalCaps *caps = getTerminalCaps();
+        RenderedCover *slot = &renderedCovers[0];
+
+        renderedCoverClock++;
+
+        for (int i = 0; i < RENDERED_COVER_CACHE_SIZE; i++)
+        {
+                RenderedCover *entry = &renderedCovers[i];
+
+                if (entry->output != NULL && coverId != 0 &&
+                    entry->coverId == coverId &&
+                    entry->widthCells == width_cells && entry->heightCells == height_cells &&
+                    entry->cellWidth == cell_width && entry->cellHeight == cell_height &&
+                    entry->mode == caps->mode && entry->pixelMode == caps->pixelMode &&
+                    entry->row == row && entry->col == col)
+                {
+                        entry->lastUsed = renderedCoverClock;
+                        return entry->output;
+                }
+
+                if (entry->output == NULL || entry->lastUsed < slot->lastUsed)
+                        slot = entry;
+        }
+
+        // Convert image to a printable string using Chafa
+        GString *printable = convert_image(
+            pixels,
+            pix_width,
+            pix_height,
+            pix_width * 4,                  // Row stride
+            CHAFA_PIXEL_RGBA8_UNASSOCIATED, // Correct pixel format
+            width_cells,
+            height_cells,
+            cell_width,
+            cell_height);
+
+        // Split the printable string into lines and position each one
+        gchar **lines = g_strsplit(printable->str, "\n", -1);
+        GString *output = g_string_sized_new(printable->len + 16 * height_cells);
+
+        for (int i = 0; lines[i] != NULL; i++)
+        {
+                if (row < 0)
+                        g_string_append_printf(output, "\n\033[%dC%s", col, lines[i]);
+                else
+                        g_string_append_printf(output, "\033[%d;%dH%s", row + i, col, lines[i]);
+        }
+
+        g_strfreev(lines);
+        g_string_free(printable, TRUE);
+
+        if (slot->output != NULL)
+                g_string_free(slot->output, TRUE);
+
+        slot->coverId = coverId;
+        slot->widthCells = width_cells;
+        slot->heightCells = height_cells;
+        slot->cellWidth = cell_width;
+        slot->cellHeight = cell_height;
+        slot->mode = caps->mode;
+        slot->pixelMode = caps->pixelMode;
+        slot->row = row;
+        slot->col = col;
+        slot->output = output;
+        slot->lastUsed = renderedCoverClock;
+
+        return output;
+}
+
+void freeRenderedCovers(void)
+{
+        for (int i = 0; i < RENDERED_COVER_CACHE_SIZE; i++)
+        {
+                if (renderedCovers[i].output != NULL)
+                        g_string_free(renderedCovers[i].output, TRUE);
+
+                renderedCovers[i].output = NULL;
+        }
+
+        if (terminalCaps.detected)
+        {
+                chafa_symbol_map_unref(terminalCaps.symbolMap);
+                chafa_term_info_unref(terminalCaps.termInfo);
+                terminalCaps.symbolMap = NULL;
+                terminalCaps.termInfo = NULL;
+                terminalCaps.detected = false;
+        }
+}
+
 // The function to load and return image data
 unsigned char *getBitmap(const char *image_path, int *width, int *height)
 {
@@ -515,6 +644,23 @@ unsigned char *getBitmap(const char *image_path, int *width, int *height)
         return image;
 }
 
+unsigned char *getBitmapFromMemory(const unsigned char *data, size_t size, int *width, int *height)
+{
+        if (data == NULL || size == 0 || size > INT_MAX)
+                return NULL;
+
+        int channels;
+
+        unsigned char *image = stbi_load_from_memory(data, (int)size, width, height, &channels, 4); // Force 4 channels (RGBA)
+        if (!image)
+        {
+                fprintf(stderr, "Failed to decode embedded image: %s\n", stbi_failure_reason());
+                return NULL;
+        }
+
+        return image;
+}
+
 float calcAspectRatio(void)
 {
         TermSize term_size;
@@ -539,6 +685,29 @@ float calcAspectRatio(void)
         return (float)cell_height / (float)cell_width;
 }
 
+// Covers are cached pre-scaled in a few fixed sizes, the smallest that fills the terminal's height in pixels
+int getCoverThumbnailSize(void)
+{
+        TermSize term_size;
+        int needed = COVER_THUMBNAIL_DEFAULT_SIZE;
+        int size = COVER_THUMBNAIL_MIN_SIZE;
+
+        tty_init();
+        get_tty_size(&term_size);
+
+        if (term_size.height_pixels > 0)
+                needed = term_size.height_pixels;
+
+        // Doubling keeps it to a handful of sizes, so resizing the window doesn't cache every cover again
+        while (size < needed && size < COVER_THUMBNAIL_MAX_SIZE)
+                size *= 2;
+
+        if (size > COVER_THUMBNAIL_MAX_SIZE)
+                size = COVER_THUMBNAIL_MAX_SIZE;
+
+        return size;
+}
+
 float getAspectRatio()
 {
         TermSize term_size;
@@ -565,7 +734,7 @@ float getAspectRatio()
         return (float)cell_height / (float)cell_width;
 }
 
-void printSquareBitmap(int row, int col, unsigned char *pixels, int width, int height, int baseHeight)
+void printSquareBitmap(int row, int col, unsigned char *pixels, int width, int height, int baseHeight, guint64 coverId)
 {
         if (pixels == NULL)
         {
@@ -576,7 +745,6 @@ void printSquareBitmap(int row, int col, unsigned char *pixels, int width, int h
         // Use the provided width and height
         int pix_width = width;
         int pix_height = height;
-        int n_channels = 4; // Assuming RGBA format
 
         // Validate the image dimensions
         if (pix_width == 0 || pix_height == 0)
@@ -586,7 +754,6 @@ void printSquareBitmap(int row, int col, unsigned char *pixels, int width, int h
         }
 
         TermSize term_size;
-        GString *printable;
         gint cell_width = -1, cell_height = -1;
 
         tty_init();
@@ -628,39 +795,15 @@ void printSquareBitmap(int row, int col, unsigned char *pixels, int width, int h
                 return;
         }
 
-        // Convert image to a printable string using Chafa
-        printable = convert_image(
-            pixels,
-            pix_width,
-            pix_height,
-            pix_width * n_channels,         // Row stride
-            CHAFA_PIXEL_RGBA8_UNASSOCIATED, // Correct pixel format
-            correctedWidth,
-            baseHeight,
-            cell_width,
-            cell_height);
-
-        // Ensure the string is null-terminated
-        g_string_append_c(printable, '\0');
-
-        // Split the printable string into lines
-        const gchar *delimiters = "\n";
-        gchar **lines = g_strsplit(printable->str, delimiters, -1);
+        const GString *output = getRenderedCover(coverId, pixels, pix_width, pix_height,
+                                                 correctedWidth, baseHeight, cell_width, cell_height,
+                                                 row, col);
 
-        // Print each line with indentation
-        for (int i = 0; lines[i] != NULL; i++)
-        {
-                printf("\033[%d;%dH", row + i, col);
-                printf("%s", lines[i]);
-                fflush(stdout);
-        }
-
-        // Free allocated memory
-        g_strfreev(lines);
-        g_string_free(printable, TRUE);
+        fwrite(output->str, 1, output->len, stdout);
+        fflush(stdout);
 }
 
-void printSquareBitmapCentered(unsigned char *pixels, int width, int height, int baseHeight)
+void printSquareBitmapCentered(unsigned char *pixels, int width, int height, int baseHeight, guint64 coverId)
 {
         if (pixels == NULL)
         {
@@ -671,7 +814,6 @@ void printSquareBitmapCentered(unsigned char *pixels, int width, int height, int
         // Use the provided width and height
         int pix_width = width;
         int pix_height = height;
-        int n_channels = 4; // Assuming RGBA format
 
         // Validate the image dimensions
         if (pix_width == 0 || pix_height == 0)
@@ -681,7 +823,6 @@ void printSquareBitmapCentered(unsigned char *pixels, int width, int height, int
         }
 
         TermSize term_size;
-        GString *printable;
         gint cell_width = -1, cell_height = -1;
 
         tty_init();
@@ -726,34 +867,11 @@ void printSquareBitmapCentered(unsigned char *pixels, int width, int height, int
         // Calculate indentation to center the image
         int indentation = ((term_size.width_cells - correctedWidth) / 2);
 
-        // Convert image to a printable string using Chafa
-        printable = convert_image(
-            pixels,
-            pix_width,
-            pix_height,
-            pix_width * n_channels,         // Row stride
-            CHAFA_PIXEL_RGBA8_UNASSOCIATED, // Correct pixel format
-            correctedWidth,
-            baseHeight,
-            cell_width,
-            cell_height);
-
-        // Ensure the string is null-terminated
-        g_string_append_c(printable, '\0');
-
-        // Split the printable string into lines
-        const gchar *delimiters = "\n";
-        gchar **lines = g_strsplit(printable->str, delimiters, -1);
+        const GString *output = getRenderedCover(coverId, pixels, pix_width, pix_height,
+                                                 correctedWidth, baseHeight, cell_width, cell_height,
+                                                 -1, indentation);
 
-        // Print each line with indentation
-        for (int i = 0; lines[i] != NULL; i++)
-        {
-                printf("\n\033[%dC%s", indentation, lines[i]);
-        }
-
-        // Free allocated memory
-        g_strfreev(lines);
-        g_string_free(printable, TRUE);
+        fwrite(output->str, 1, output->len, stdout);
 }
 
 unsigned char luminanceFromRGB(unsigned char r, unsigned char g, unsigned char b)
@@ -805,6 +923,30 @@ int getCoverColor(unsigned char *pixels, int width, int height, unsigned char *r
         return found ? 0 : -1;
 }
 
+// The cover is kept decoded as RGBA, the ascii renderer works on packed RGB
+static unsigned char *rgbaToRgb(const unsigned char *pixels, int width, int height)
+{
+        if (pixels == NULL || width <= 0 || height <= 0)
+                return NULL;
+
+        size_t count = (size_t)width * height;
+        unsigned char *rgb = malloc(count * 3);
+        if (rgb == NULL)
+        {
+                fprintf(stderr, "rgbaToRgb: malloc\n");
+                return NULL;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+                rgb[i * 3] = pixels[i * 4];
+                rgb[i * 3 + 1] = pixels[i * 4 + 1];
+                rgb[i * 3 + 2] = pixels[i * 4 + 2];
+        }
+
+        return rgb;
+}
+
 unsigned char calcAsciiChar(PixelData *p)
 {
         unsigned char ch = luminanceFromRGB(p->r, p->g, p->b);
@@ -813,7 +955,7 @@ unsigned char calcAsciiChar(PixelData *p)
         return scale[brightness_levels - rescaled];
 }
 
-int convertToAsciiCentered(const char *filepath, unsigned int height)
+int convertToAsciiCentered(const unsigned char *pixels, int bitmapWidth, int bitmapHeight, unsigned int height)
 {
         /*
         Modified, originally by Danny Burrows:
@@ -868,8 +1010,8 @@ int convertToAsciiCentered(const char *filepath, unsigned int height)
         // Calculate indentation to center the image
         int indent = ((term_size.width_cells - correctedWidth) / 2);
 
-        int rwidth, rheight, rchannels;
-        unsigned char *read_data = stbi_load(filepath, &rwidth, &rheight, &rchannels, 3);
+        int rwidth = bitmapWidth, rheight = bitmapHeight;
+        unsigned char *read_data = rgbaToRgb(pixels, rwidth, rheight);
 
         if (read_data == NULL)
         {
@@ -915,7 +1057,7 @@ int convertToAsciiCentered(const char *filepath, unsigned int height)
         return 0;
 }
 
-int convertToAscii(int indentation, const char *filepath, unsigned int height)
+int convertToAscii(int indentation, const unsigned char *pixels, int bitmapWidth, int bitmapHeight, unsigned int height)
 {
         /*
         Modified, originally by Danny Burrows:
@@ -967,8 +1109,8 @@ int convertToAscii(int indentation, const char *filepath, unsigned int height)
         float aspect_ratio_correction = (float)cell_height / (float)cell_width;
         unsigned int correctedWidth = (int)(height * aspect_ratio_correction) - 1;
 
-        int rwidth, rheight, rchannels;
-        unsigned char *read_data = stbi_load(filepath, &rwidth, &rheight, &rchannels, 3);
+        int rwidth = bitmapWidth, rheight = bitmapHeight;
+        unsigned char *read_data = rgbaToRgb(pixels, rwidth, rheight);
 
         if (read_data == NULL)
         {
@@ -1014,21 +1156,21 @@ int convertToAscii(int indentation, const char *filepath, unsigned int height)
         return 0;
 }
 
-int printInAscii(int indentation, const char *pathToImgFile, int height)
+int printInAscii(int indentation, const unsigned char *pixels, int width, int height, int baseHeight)
 {
         printf("\r");
 
-        int ret = convertToAscii(indentation, pathToImgFile, (unsigned)height);
+        int ret = convertToAscii(indentation, pixels, width, height, (unsigned)baseHeight);
         if (ret == -1)
                 printf("\033[0m");
         return 0;
 }
 
-int printInAsciiCentered(const char *pathToImgFile, int height)
+int printInAsciiCentered(const unsigned char *pixels, int width, int height, int baseHeight)
 {
         printf("\r");
 
-        int ret = convertToAsciiCentered(pathToImgFile, (unsigned)height);
+        int ret = convertToAsciiCentered(pixels, width, height, (unsigned)baseHeight);
         if (ret == -1)
                 printf("\033[0m");
         return 0;
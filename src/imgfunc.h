@@ -13,22 +13,44 @@ typedef struct
 } PixelData;
 #endif
 
-int printInAsciiCentered(const char *pathToImgFile, int height);
+#ifndef COVER_THUMBNAIL_DEFAULT_SIZE
+#define COVER_THUMBNAIL_DEFAULT_SIZE 512
+#endif
+
+#ifndef COVER_THUMBNAIL_MIN_SIZE
+#define COVER_THUMBNAIL_MIN_SIZE 256
+#endif
 
-int printInAscii(int indentation, const char *pathToImgFile, int height);
+#ifndef COVER_THUMBNAIL_MAX_SIZE
+#define COVER_THUMBNAIL_MAX_SIZE 1024
+#endif
+
+#ifndef RENDERED_COVER_CACHE_SIZE
+#define RENDERED_COVER_CACHE_SIZE 8
+#endif
+
+int printInAsciiCentered(const unsigned char *pixels, int width, int height, int baseHeight);
+
+int printInAscii(int indentation, const unsigned char *pixels, int width, int height, int baseHeight);
 
 float calcAspectRatio(void);
 
 unsigned char *getBitmap(const char *image_path, int *width, int *height);
 
-void printSquareBitmapCentered(unsigned char *pixels, int width, int height, int baseHeight);
+unsigned char *getBitmapFromMemory(const unsigned char *data, size_t size, int *width, int *height);
+
+void printSquareBitmapCentered(unsigned char *pixels, int width, int height, int baseHeight, guint64 coverId);
 
-void printSquareBitmap(int row, int col, unsigned char *pixels, int width, int height, int baseHeight);
+void printSquareBitmap(int row, int col, unsigned char *pixels, int width, int height, int baseHeight, guint64 coverId);
+
+void freeRenderedCovers(void);
 
 int getCoverColor(unsigned char *pixels, int width, int height, unsigned char *r, unsigned char *g, unsigned char *b);
 
 float getAspectRatio();
 
+int getCoverThumbnailSize(void);
+
 #ifdef CHAFA_VERSION_1_16
 gboolean retire_passthrough_workarounds_tmux(void);
 #endif
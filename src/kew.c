@@ -58,6 +58,8 @@ OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE. */
 #include "events.h"
 #include "file.h"
 #include "imgfunc.h"
+#include "librarymetadata.h"
+#include "librarywatcher.h"
 #include "mpris.h"
 #include "notifications.h"
 #include "player_ui.h"
@@ -95,6 +97,7 @@ int fuzzySearchThreshold = 4;
 int maxDigitsPressedCount = 9;
 int isNewSearchTerm = false;
 bool wasEndOfList = false;
+bool playingFromStart = false; // Started over from a song, waiting on play() to switch to it
 
 void updateLastInputTime(void)
 {
@@ -324,14 +327,14 @@ struct Event processInput()
                 {
                         removeFromSearchText();
                         resetSearchResult();
-                        fuzzySearch(getLibrary(), fuzzySearchThreshold);
+                        fuzzySearch(fuzzySearchThreshold);
                         event.type = EVENT_SEARCH;
                 }
                 else if (((strnlen(event.key, sizeof(event.key)) == 1 && event.key[0] != '\033' && event.key[0] != '\n' && event.key[0] != '\t' && event.key[0] != '\r') || strcmp(event.key, " ") == 0 || (unsigned char)event.key[0] >= 0xC0) && strcmp(event.key, "Z") != 0 && strcmp(event.key, "X") != 0 && strcmp(event.key, "C") != 0 && strcmp(event.key, "V") != 0 && strcmp(event.key, "B") != 0 && strcmp(event.key, "N") != 0)
                 {
                         addToSearchText(event.key);
                         resetSearchResult();
-                        fuzzySearch(getLibrary(), fuzzySearchThreshold);
+                        fuzzySearch(fuzzySearchThreshold);
                         event.type = EVENT_SEARCH;
                 }
         }
@@ -503,12 +506,19 @@ void notifyMPRISSwitch(SongData *currentSongData)
 
         gint64 length = getLengthInMicroSec(currentSongData->duration);
 
+#ifdef USE_DBUS
+        // Embedded covers only get written out when mpris:artUrl needs a file
+        const char *coverArtPath = getCoverArtPath(currentSongData, &appState);
+#else
+        const char *coverArtPath = currentSongData->coverArtPath;
+#endif
+
         // Update mpris
         emitMetadataChanged(
             currentSongData->metadata->title,
             currentSongData->metadata->artist,
             currentSongData->metadata->album,
-            currentSongData->coverArtPath,
+            coverArtPath,
             currentSongData->trackId != NULL ? currentSongData->trackId : "", currentSong,
             length);
 }
@@ -518,7 +528,7 @@ void notifySongSwitch(SongData *currentSongData, UISettings *ui)
         if (currentSongData != NULL && currentSongData->hasErrors == 0 && currentSongData->metadata && strnlen(currentSongData->metadata->title, 10) > 0)
         {
 #ifdef USE_DBUS
-                displaySongNotification(currentSongData->metadata->artist, currentSongData->metadata->title, currentSongData->coverArtPath, ui);
+                displaySongNotification(currentSongData->metadata->artist, currentSongData->metadata->title, getCoverArtPath(currentSongData, &appState), ui);
 #else
                 (void)ui;
 #endif
@@ -562,6 +572,13 @@ void refreshPlayer(UIState *uis)
                 return;
         }
 
+        // The library is being patched or replaced, draw it next time around
+        if (pthread_rwlock_tryrdlock(&libraryLock) != 0)
+        {
+                pthread_mutex_unlock(&switchMutex);
+                return;
+        }
+
         if (uis->doNotifyMPRISPlaying)
         {
                 uis->doNotifyMPRISPlaying = false;
@@ -581,6 +598,7 @@ void refreshPlayer(UIState *uis)
                 printPlayer(getCurrentSongData(), elapsedSeconds, &settings, &appState);
         }
 
+        pthread_rwlock_unlock(&libraryLock);
         pthread_mutex_unlock(&switchMutex);
 }
 
@@ -671,12 +689,15 @@ FileSystemEntry *enqueue(AppState *state, FileSystemEntry *entry)
                 }
         }
 
+        // The library watcher can't patch the tree while it's walked
+        pthread_rwlock_rdlock(&libraryLock);
         pthread_mutex_lock(&(playlist.mutex));
 
         firstEnqueuedEntry = enqueueSongs(entry, &(state->uiState));
         resetListAfterDequeuingPlayingSong(state);
 
         pthread_mutex_unlock(&(playlist.mutex));
+        pthread_rwlock_unlock(&libraryLock);
 
         return firstEnqueuedEntry;
 }
@@ -703,6 +724,25 @@ void playPostProcessing()
         audioData.endOfListReached = false;
 }
 
+// The rest of starting over from a song, once play() has switched to it
+static void finishPlayFromStart(void)
+{
+        playPostProcessing();
+
+        skipOutOfOrder = false;
+        usingSongDataA = true;
+}
+
+static void playFromStart(Node *song)
+{
+        play(song);
+
+        if (isSkipPending())
+                playingFromStart = true;
+        else
+                finishPlayFromStart();
+}
+
 void handleGoToSong(AppState *state)
 {
         bool canGoNext = (currentSong != NULL && currentSong->next != NULL);
@@ -715,12 +755,15 @@ void handleGoToSong(AppState *state)
                         return;
 
                 // Enqueue playlist
-                if (pathEndsWith(entry->fullPath, "m3u") || pathEndsWith(entry->fullPath, "m3u8"))
+                if (pathEndsWith(entry->name, "m3u") || pathEndsWith(entry->name, "m3u8"))
                 {
                         FileSystemEntry *firstEnqueuedEntry = NULL;
                         Node *prevTail = playlist.tail;
+                        char path[MAXPATHLEN];
+
+                        pthread_rwlock_rdlock(&libraryLock);
 
-                        readM3UFile(entry->fullPath, &playlist, library);
+                        readM3UFile(getEntryPath(entry, path, sizeof(path)), &playlist, library);
 
                         if (prevTail != NULL && prevTail->next != NULL)
                         {
@@ -735,6 +778,8 @@ void handleGoToSong(AppState *state)
 
                         markListAsEnqueued(library, &playlist);
 
+                        pthread_rwlock_unlock(&libraryLock);
+
                         deepCopyPlayListOntoList(&playlist, unshuffledPlaylist);
                 }
                 else
@@ -742,6 +787,7 @@ void handleGoToSong(AppState *state)
         }
         else if (state->currentView == SEARCH_VIEW)
         {
+                pthread_rwlock_rdlock(&libraryLock);
                 pthread_mutex_lock(&(playlist.mutex));
 
                 FileSystemEntry *entry = getCurrentSearchEntry();
@@ -753,6 +799,7 @@ void handleGoToSong(AppState *state)
                 resetListAfterDequeuingPlayingSong(state);
 
                 pthread_mutex_unlock(&(playlist.mutex));
+                pthread_rwlock_unlock(&libraryLock);
         }
         else if (state->currentView == PLAYLIST_VIEW)
         {
@@ -783,12 +830,7 @@ void handleGoToSong(AppState *state)
 
                                 Node *found = NULL;
                                 findNodeInList(&playlist, state->uiState.chosenNodeId, &found);
-                                play(found);
-
-                                playPostProcessing();
-
-                                skipOutOfOrder = false;
-                                usingSongDataA = true;
+                                playFromStart(found);
                         }
                 }
                 else
@@ -841,7 +883,13 @@ void enqueueAndPlay(AppState *state)
 
         if (firstEnqueuedEntry && !wasEmpty)
         {
-                Node *song = findPathInPlaylist(firstEnqueuedEntry->fullPath, &playlist);
+                char path[MAXPATHLEN];
+
+                pthread_rwlock_rdlock(&libraryLock);
+                getEntryPath(firstEnqueuedEntry, path, sizeof(path));
+                pthread_rwlock_unlock(&libraryLock);
+
+                Node *song = findPathInPlaylist(path, &playlist);
 
                 loadedNextSong = true;
 
@@ -858,12 +906,7 @@ void enqueueAndPlay(AppState *state)
 
                 playbackPlay(&totalPauseSeconds, &pauseSeconds);
 
-                play(song);
-
-                playPostProcessing();
-
-                skipOutOfOrder = false;
-                usingSongDataA = true;
+                playFromStart(song);
         }
 }
 
@@ -1248,6 +1291,10 @@ void updatePlayerStatus(AppState *state)
 {
         updatePlayer(&(state->uiState));
 
+        // The slot is being loaded for a skip, onSongLoaded takes it from there
+        if (isSkipPending())
+                return;
+
         if (playlist.head != NULL)
         {
                 if ((skipFromStopped || !loadedNextSong || nextSongNeedsRebuilding) && !audioData.endOfListReached)
@@ -1300,6 +1347,25 @@ gboolean mainloop_callback(gpointer data)
         return TRUE;
 }
 
+// Runs on the main loop when the loader thread is done with a song
+static gboolean onSongLoaded(gpointer user_data)
+{
+        (void)user_data;
+
+        finishPendingSkip();
+
+        if (playingFromStart && !isSkipPending())
+        {
+                playingFromStart = false;
+                finishPlayFromStart();
+        }
+
+        if (playlist.head != NULL && !audioData.endOfListReached)
+                updatePlayerStatus(&appState);
+
+        return G_SOURCE_REMOVE;
+}
+
 static gboolean quitOnSignal(gpointer user_data)
 {
         GMainLoop *loop = (GMainLoop *)user_data;
@@ -1370,6 +1436,12 @@ void initFirstPlay(Node *song, AppState *state)
 
 void cleanupOnExit()
 {
+        stopDecodeThread();
+        stopSongLoader();
+        stopLibraryWatcher();
+        stopMetadataIndexer();
+        cancelPlaylistStream();
+
         pthread_mutex_lock(&dataSourceMutex);
 
         resetAllDecoders();
@@ -1380,6 +1452,7 @@ void cleanupOnExit()
                 shutdownAndroid();
 #else
                 cleanupPlaybackDevice();
+                freePcmRing();
 #endif
                 cleanupAudioContext();
         }
@@ -1409,7 +1482,9 @@ void cleanupOnExit()
 #ifdef CHAFA_VERSION_1_16
         retire_passthrough_workarounds_tmux();
 #endif
+        freeRenderedCovers();
 
+        stopSearchThread();
         freeSearchResults();
         cleanupMpris();
         restoreTerminalMode();
@@ -1546,10 +1621,14 @@ void init(AppState *state)
         userData.songdataBDeleted = true;
         unsigned int seed = (unsigned int)time(NULL);
         srand(seed);
+        seedShuffleRandom(state->uiSettings.shuffleSeed);
+        setAlbumShuffle(state->uiSettings.shuffleAlbums);
         pthread_mutex_init(&dataSourceMutex, NULL);
         pthread_mutex_init(&switchMutex, NULL);
         pthread_mutex_init(&(loadingdata.mutex), NULL);
         pthread_mutex_init(&(playlist.mutex), NULL);
+        setSongLoadedCallback(onSongLoaded);
+        startSongLoader();
         createLibrary(&settings, state);
         setlocale(LC_ALL, "");
         setlocale(LC_CTYPE, "");
@@ -1573,7 +1652,10 @@ void initDefaultState(AppState *state)
         init(state);
 
         loadLastUsedPlaylist();
+
+        pthread_rwlock_rdlock(&libraryLock);
         markListAsEnqueued(library, &playlist);
+        pthread_rwlock_unlock(&libraryLock);
 
         resetListAfterDequeuingPlayingSong(state);
 
@@ -1597,34 +1679,43 @@ void playFavoritesPlaylist(AppState *state)
         init(state);
         deepCopyPlayListOntoList(favoritesPlaylist, &playlist);
         shufflePlaylist(&playlist);
+
+        pthread_rwlock_rdlock(&libraryLock);
         markListAsEnqueued(library, &playlist);
+        pthread_rwlock_unlock(&libraryLock);
         run(state, true);
 }
 
 void playAll(AppState *state)
 {
         init(state);
-        FileSystemEntry *library = getLibrary();
-        createPlayListFromFileSystemEntry(library, &playlist, MAX_FILES);
+        streamSongsToPlaylist(getFileEntries, true, false);
         if (playlist.count == 0)
         {
                 exit(0);
         }
-        shufflePlaylist(&playlist);
-        markListAsEnqueued(library, &playlist);
         run(state, true);
 }
 
 void playAllAlbums(AppState *state)
 {
         init(state);
-        FileSystemEntry *library = getLibrary();
-        addShuffledAlbumsToPlayList(library, &playlist, MAX_FILES);
+        streamSongsToPlaylist(getShuffledAlbumSongs, false, false);
+        if (playlist.count == 0)
+        {
+                exit(0);
+        }
+        run(state, true);
+}
+
+void playRadio(AppState *state)
+{
+        init(state);
+        streamSongsToPlaylist(getFileEntries, true, true);
         if (playlist.count == 0)
         {
                 exit(0);
         }
-        markListAsEnqueued(library, &playlist);
         run(state, true);
 }
 
@@ -1978,6 +2069,8 @@ void initState(AppState *state)
         state->uiSettings.visualizerBarWidth = 2;
         state->uiSettings.titleDelay = 9;
         state->uiSettings.cacheLibrary = -1;
+        state->uiSettings.watchLibrary = false;
+        state->uiSettings.indexMetadata = false;
         state->uiSettings.useConfigColors = false;
         state->uiSettings.mouseEnabled = true;
         state->uiSettings.mouseLeftClickAction = 0;
@@ -1988,6 +2081,7 @@ void initState(AppState *state)
         state->uiSettings.mouseAltScrollUpAction = 7;
         state->uiSettings.mouseAltScrollDownAction = 8;
         state->uiSettings.replayGainCheckFirst = 0;
+        state->uiSettings.replayGainLimiter = true;
         state->uiSettings.saveRepeatShuffleSettings = 1;
         state->uiSettings.repeatState = 0;
         state->uiSettings.shuffleEnabled = 0;
@@ -2010,6 +2104,7 @@ void initSettings(AppState *appState, AppSettings *settings)
 {
         getConfig(settings, &(appState->uiSettings));
         userData.replayGainCheckFirst = appState->uiSettings.replayGainCheckFirst;
+        userData.replayGainLimiter = appState->uiSettings.replayGainLimiter;
         mapSettingsToKeys(settings, &(appState->uiSettings), keyMappings);
         enableMouse(&(appState->uiSettings));
         setTrackTitleAsWindowTitle(&(appState->uiSettings));
@@ -2043,6 +2138,8 @@ int main(int argc, char *argv[])
                 exit(0);
         }
 
+        initVisuals();
+
         enterAlternateScreenBuffer();
         atexit(cleanupOnExit);
 
@@ -2066,6 +2163,10 @@ int main(int argc, char *argv[])
         {
                 playAllAlbums(&appState);
         }
+        else if (argc == 2 && strcmp(argv[1], "radio") == 0)
+        {
+                playRadio(&appState);
+        }
         else if (argc == 2 && strcmp(argv[1], ".") == 0 && favoritesPlaylist->count != 0)
         {
                 playFavoritesPlaylist(&appState);
@@ -2073,13 +2174,20 @@ int main(int argc, char *argv[])
         else if (argc >= 2)
         {
                 init(&appState);
-                makePlaylist(argc, argv, exactSearch, settings.path);
+
+                pthread_rwlock_rdlock(&libraryLock);
+                makePlaylist(argc, argv, exactSearch, settings.path, library);
+                pthread_rwlock_unlock(&libraryLock);
+
                 if (playlist.count == 0)
                 {
                         noPlaylist = true;
                         exit(0);
                 }
+
+                pthread_rwlock_rdlock(&libraryLock);
                 markListAsEnqueued(library, &playlist);
+                pthread_rwlock_unlock(&libraryLock);
                 run(&appState, true);
         }
 
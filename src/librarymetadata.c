@@ -0,0 +1,688 @@
+#include <glib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "file.h"
+#include "librarymetadata.h"
+#include "utils.h"
+
+/*
+
+librarymetadata.c
+
+ Tags and durations of every file in the library, kept in the cache directory
+ so they can be shown without opening the audio files. A background scan
+ stats each file and only reads the tags of those whose mtime or size changed
+ since the last time, a few files at a time on separate threads.
+
+*/
+
+#ifndef MAXPATHLEN
+#define MAXPATHLEN 4096
+#endif
+
+#define METADATA_MAGIC "KWMD"
+#define METADATA_VERSION 3 // 3 fills in the album artist
+#define METADATA_FIELDS 5
+#define METADATA_CANCEL_CHECK_MASK 255
+
+typedef struct
+{
+        int64_t mtime;
+        int64_t size;
+        double duration;
+        double replaygainTrack;
+        double replaygainAlbum;
+        uint32_t scan; // The last scan that found the file
+        bool exact;    // The duration was counted from the decoded stream, not estimated from headers
+        unsigned char lengths[METADATA_FIELDS];
+        char text[]; // Title, artist, album artist, album and date, each terminated
+} MetadataRecord;
+
+typedef struct
+{
+        char magic[4];
+        uint32_t version;
+        uint32_t count;
+} MetadataFileHeader;
+
+// Followed by the path and the fields, without terminators
+typedef struct
+{
+        int64_t mtime;
+        int64_t size;
+        double duration;
+        double replaygainTrack;
+        double replaygainAlbum;
+        uint16_t pathLength;
+        unsigned char exact;
+        unsigned char lengths[METADATA_FIELDS];
+} MetadataFileRecord;
+
+typedef struct
+{
+        int64_t mtime;
+        int64_t size;
+} FileStamp;
+
+typedef struct
+{
+        char **paths;
+        FileStamp *stamps;
+        int count;
+        int numTodo; // Files to read, moved to the front of paths
+        uint32_t scan;
+        atomic_int next;
+        atomic_bool stop;
+        pthread_t thread;
+} MetadataIndexer;
+
+static GHashTable *records = NULL; // Path -> MetadataRecord
+static bool recordsChanged = false;
+static pthread_mutex_t recordsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t recordsOnce = PTHREAD_ONCE_INIT;
+
+static MetadataIndexer *indexer = NULL;
+static pthread_mutex_t indexerMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t lastScan = 0;
+
+static char *getMetadataFilePath(void)
+{
+        char *cachePath = getCachePath();
+        if (cachePath == NULL)
+                return NULL;
+
+        char *path = malloc(MAXPATHLEN);
+
+        if (path != NULL)
+        {
+                int written = snprintf(path, MAXPATHLEN, "%s/%s", cachePath, LIBRARY_METADATA_FILE);
+
+                if (written < 0 || written >= MAXPATHLEN || createDirectory(cachePath) < 0)
+                {
+                        free(path);
+                        path = NULL;
+                }
+        }
+
+        free(cachePath);
+
+        return path;
+}
+
+static int64_t getModificationTimeNs(const struct stat *st)
+{
+#ifdef __APPLE__
+        return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+        return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+static const char *getField(const MetadataRecord *record, int field)
+{
+        const char *text = record->text;
+
+        for (int i = 0; i < field; i++)
+                text += record->lengths[i] + 1;
+
+        return text;
+}
+
+static MetadataRecord *allocRecord(const unsigned char *lengths)
+{
+        size_t textSize = 0;
+
+        for (int i = 0; i < METADATA_FIELDS; i++)
+                textSize += lengths[i] + 1;
+
+        MetadataRecord *record = malloc(sizeof(MetadataRecord) + textSize);
+        if (record == NULL)
+        {
+                fprintf(stderr, "allocRecord: malloc\n");
+                return NULL;
+        }
+
+        memcpy(record->lengths, lengths, METADATA_FIELDS);
+        record->scan = 0;
+        record->exact = false;
+
+        return record;
+}
+
+static MetadataRecord *createRecord(const TagSettings *tags, double duration, FileStamp stamp)
+{
+        const char *fields[METADATA_FIELDS] = {tags->title, tags->artist, tags->album_artist, tags->album, tags->date};
+        unsigned char lengths[METADATA_FIELDS];
+
+        for (int i = 0; i < METADATA_FIELDS; i++)
+                lengths[i] = (unsigned char)strnlen(fields[i], METADATA_MAX_LENGTH - 1);
+
+        MetadataRecord *record = allocRecord(lengths);
+        if (record == NULL)
+                return NULL;
+
+        char *text = record->text;
+
+        for (int i = 0; i < METADATA_FIELDS; i++)
+        {
+                memcpy(text, fields[i], lengths[i]);
+                text[lengths[i]] = '\0';
+                text += lengths[i] + 1;
+        }
+
+        record->mtime = stamp.mtime;
+        record->size = stamp.size;
+        record->duration = duration;
+        record->replaygainTrack = tags->replaygainTrack;
+        record->replaygainAlbum = tags->replaygainAlbum;
+
+        return record;
+}
+
+static GHashTable *createRecordTable(void)
+{
+        return g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+}
+
+static GHashTable *readMetadataFile(void)
+{
+        GHashTable *table = createRecordTable();
+        char *filename = getMetadataFilePath();
+
+        FILE *file = filename != NULL ? fopen(filename, "rb") : NULL;
+
+        free(filename);
+
+        if (file == NULL)
+                return table;
+
+        MetadataFileHeader header;
+
+        if (fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, METADATA_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != METADATA_VERSION)
+        {
+                fclose(file);
+                return table;
+        }
+
+        char path[MAXPATHLEN];
+
+        for (uint32_t i = 0; i < header.count; i++)
+        {
+                MetadataFileRecord stored;
+
+                if (fread(&stored, sizeof(stored), 1, file) != 1 ||
+                    stored.pathLength == 0 || stored.pathLength >= sizeof(path) ||
+                    fread(path, 1, stored.pathLength, file) != stored.pathLength)
+                        break;
+
+                path[stored.pathLength] = '\0';
+
+                MetadataRecord *record = allocRecord(stored.lengths);
+                if (record == NULL)
+                        break;
+
+                bool ok = true;
+                char *text = record->text;
+
+                for (int f = 0; f < METADATA_FIELDS && ok; f++)
+                {
+                        ok = fread(text, 1, stored.lengths[f], file) == stored.lengths[f];
+                        text[stored.lengths[f]] = '\0';
+                        text += stored.lengths[f] + 1;
+                }
+
+                char *key = ok ? strdup(path) : NULL;
+
+                if (key == NULL)
+                {
+                        free(record);
+                        break;
+                }
+
+                record->mtime = stored.mtime;
+                record->size = stored.size;
+                record->duration = stored.duration;
+                record->replaygainTrack = stored.replaygainTrack;
+                record->replaygainAlbum = stored.replaygainAlbum;
+                record->exact = stored.exact != 0;
+
+                g_hash_table_replace(table, key, record);
+        }
+
+        fclose(file);
+
+        return table;
+}
+
+// Needs recordsMutex
+static void writeMetadataFile(void)
+{
+        char *filename = getMetadataFilePath();
+        if (filename == NULL)
+                return;
+
+        char tmpFilename[MAXPATHLEN];
+        int written = snprintf(tmpFilename, sizeof(tmpFilename), "%s.%ld.tmp", filename, (long)getpid());
+
+        FILE *file = written > 0 && written < (int)sizeof(tmpFilename) ? fopen(tmpFilename, "wb") : NULL;
+
+        if (file == NULL)
+        {
+                free(filename);
+                return;
+        }
+
+        MetadataFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, METADATA_MAGIC, sizeof(header.magic));
+        header.version = METADATA_VERSION;
+        header.count = g_hash_table_size(records);
+
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+        GHashTableIter iter;
+        gpointer key, value;
+
+        g_hash_table_iter_init(&iter, records);
+
+        while (ok && g_hash_table_iter_next(&iter, &key, &value))
+        {
+                const char *path = key;
+                const MetadataRecord *record = value;
+
+                MetadataFileRecord stored;
+                memset(&stored, 0, sizeof(stored));
+                stored.mtime = record->mtime;
+                stored.size = record->size;
+                stored.duration = record->duration;
+                stored.replaygainTrack = record->replaygainTrack;
+                stored.replaygainAlbum = record->replaygainAlbum;
+                stored.pathLength = (uint16_t)strnlen(path, MAXPATHLEN - 1);
+                stored.exact = record->exact;
+                memcpy(stored.lengths, record->lengths, METADATA_FIELDS);
+
+                ok = fwrite(&stored, sizeof(stored), 1, file) == 1 &&
+                     fwrite(path, 1, stored.pathLength, file) == stored.pathLength;
+
+                for (int f = 0; f < METADATA_FIELDS && ok; f++)
+                        ok = fwrite(getField(record, f), 1, record->lengths[f], file) == record->lengths[f];
+        }
+
+        if (fclose(file) != 0)
+                ok = false;
+
+        // Renamed over the old store so it's never left half written
+        if (ok && rename(tmpFilename, filename) == 0)
+                recordsChanged = false;
+        else
+                deleteFile(tmpFilename);
+
+        free(filename);
+}
+
+static void loadRecords(void)
+{
+        GHashTable *table = readMetadataFile();
+
+        pthread_mutex_lock(&recordsMutex);
+        records = table;
+        pthread_mutex_unlock(&recordsMutex);
+}
+
+static bool getFileStamp(const char *path, FileStamp *stamp)
+{
+        struct stat st;
+
+        if (stat(path, &st) != 0)
+                return false;
+
+        stamp->mtime = getModificationTimeNs(&st);
+        stamp->size = (int64_t)st.st_size;
+
+        return true;
+}
+
+static gboolean isNotInScan(gpointer key, gpointer value, gpointer scan)
+{
+        (void)key;
+
+        return ((MetadataRecord *)value)->scan != GPOINTER_TO_UINT(scan);
+}
+
+// Marks the files whose stamp didn't change and moves the rest to the front of the list
+static void findChangedFiles(MetadataIndexer *ix)
+{
+        ix->numTodo = 0;
+
+        for (int i = 0; i < ix->count; i++)
+        {
+                if ((i & METADATA_CANCEL_CHECK_MASK) == 0 && atomic_load(&ix->stop))
+                        return;
+
+                char *path = ix->paths[i];
+                FileStamp stamp;
+
+                ix->paths[i] = NULL;
+
+                if (path == NULL || !getFileStamp(path, &stamp))
+                {
+                        free(path);
+                        continue;
+                }
+
+                pthread_mutex_lock(&recordsMutex);
+
+                MetadataRecord *record = g_hash_table_lookup(records, path);
+                bool unchanged = record != NULL && record->mtime == stamp.mtime && record->size == stamp.size;
+
+                if (unchanged)
+                        record->scan = ix->scan;
+
+                pthread_mutex_unlock(&recordsMutex);
+
+                if (unchanged)
+                {
+                        free(path);
+                        continue;
+                }
+
+                ix->paths[ix->numTodo] = path;
+                ix->stamps[ix->numTodo] = stamp;
+                ix->numTodo++;
+        }
+}
+
+static void *metadataWorker(void *arg)
+{
+        MetadataIndexer *ix = arg;
+        TagSettings tags;
+        int i;
+
+        while (!atomic_load(&ix->stop) && (i = atomic_fetch_add(&ix->next, 1)) < ix->numTodo)
+        {
+                double duration = 0.0;
+
+                // Files it can't read are kept too, with what it got, so they aren't retried every time
+                readTags(ix->paths[i], TAG_READ_DURATION, &tags, &duration, NULL, NULL);
+
+                MetadataRecord *record = createRecord(&tags, duration, ix->stamps[i]);
+                if (record == NULL)
+                        continue;
+
+                record->scan = ix->scan;
+
+                pthread_mutex_lock(&recordsMutex);
+
+                g_hash_table_replace(records, ix->paths[i], record);
+                ix->paths[i] = NULL;
+                recordsChanged = true;
+
+                pthread_mutex_unlock(&recordsMutex);
+        }
+
+        return NULL;
+}
+
+static void *metadataIndexerThread(void *arg)
+{
+        MetadataIndexer *ix = arg;
+
+        pthread_once(&recordsOnce, loadRecords);
+
+        findChangedFiles(ix);
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int numThreads = cpus > 1 ? (int)cpus : 1;
+
+        if (numThreads > LIBRARY_METADATA_MAX_THREADS)
+                numThreads = LIBRARY_METADATA_MAX_THREADS;
+        if (numThreads > ix->numTodo)
+                numThreads = ix->numTodo;
+
+        pthread_t workers[LIBRARY_METADATA_MAX_THREADS];
+        int numWorkers = 0;
+
+        // This thread is one of the workers
+        for (int i = 1; i < numThreads; i++)
+        {
+                if (pthread_create(&workers[numWorkers], NULL, metadataWorker, ix) == 0)
+                        numWorkers++;
+        }
+
+        metadataWorker(ix);
+
+        for (int i = 0; i < numWorkers; i++)
+                pthread_join(workers[i], NULL);
+
+        pthread_mutex_lock(&recordsMutex);
+
+        // Only a finished scan knows which files are gone
+        if (!atomic_load(&ix->stop) &&
+            g_hash_table_foreach_remove(records, isNotInScan, GUINT_TO_POINTER(ix->scan)) > 0)
+                recordsChanged = true;
+
+        if (recordsChanged)
+                writeMetadataFile();
+
+        pthread_mutex_unlock(&recordsMutex);
+
+        return NULL;
+}
+
+static void freeMetadataIndexer(MetadataIndexer *ix)
+{
+        for (int i = 0; i < ix->count; i++)
+                free(ix->paths[i]);
+
+        free(ix->paths);
+        free(ix->stamps);
+        free(ix);
+}
+
+// Needs indexerMutex
+static void stopIndexer(void)
+{
+        if (indexer == NULL)
+                return;
+
+        atomic_store(&indexer->stop, true);
+        pthread_join(indexer->thread, NULL);
+
+        freeMetadataIndexer(indexer);
+        indexer = NULL;
+}
+
+void startMetadataIndexer(char **paths, int count)
+{
+        if (paths == NULL)
+                return;
+
+        pthread_mutex_lock(&indexerMutex);
+
+        stopIndexer();
+
+        MetadataIndexer *ix = calloc(1, sizeof(MetadataIndexer));
+        FileStamp *stamps = malloc((count > 0 ? count : 1) * sizeof(FileStamp));
+
+        if (ix == NULL || stamps == NULL)
+        {
+                fprintf(stderr, "startMetadataIndexer: malloc\n");
+
+                for (int i = 0; i < count; i++)
+                        free(paths[i]);
+
+                free(paths);
+                free(stamps);
+                free(ix);
+
+                pthread_mutex_unlock(&indexerMutex);
+                return;
+        }
+
+        ix->paths = paths;
+        ix->stamps = stamps;
+        ix->count = count;
+        ix->scan = ++lastScan;
+        atomic_init(&ix->next, 0);
+        atomic_init(&ix->stop, false);
+
+        if (pthread_create(&ix->thread, NULL, metadataIndexerThread, ix) != 0)
+        {
+                perror("startMetadataIndexer: pthread_create");
+                freeMetadataIndexer(ix);
+        }
+        else
+        {
+                indexer = ix;
+        }
+
+        pthread_mutex_unlock(&indexerMutex);
+}
+
+void stopMetadataIndexer(void)
+{
+        pthread_mutex_lock(&indexerMutex);
+
+        stopIndexer();
+
+        pthread_mutex_unlock(&indexerMutex);
+
+        // Durations counted while playing, when no scan ran to save them
+        pthread_mutex_lock(&recordsMutex);
+
+        if (records != NULL && recordsChanged)
+                writeMetadataFile();
+
+        pthread_mutex_unlock(&recordsMutex);
+}
+
+double getIndexedDuration(const char *path)
+{
+        double duration = 0.0;
+
+        if (path == NULL)
+                return duration;
+
+        pthread_mutex_lock(&recordsMutex);
+
+        if (records != NULL)
+        {
+                MetadataRecord *record = g_hash_table_lookup(records, path);
+
+                if (record != NULL)
+                        duration = record->duration;
+        }
+
+        pthread_mutex_unlock(&recordsMutex);
+
+        return duration;
+}
+
+bool getIndexedMetadata(const char *path, TagSettings *tags, double *duration)
+{
+        FileStamp stamp;
+
+        if (path == NULL || !getFileStamp(path, &stamp))
+                return false;
+
+        pthread_once(&recordsOnce, loadRecords);
+
+        pthread_mutex_lock(&recordsMutex);
+
+        MetadataRecord *record = records != NULL ? g_hash_table_lookup(records, path) : NULL;
+
+        // Files that couldn't be read are kept without a duration
+        if (record != NULL && (record->mtime != stamp.mtime || record->size != stamp.size || record->duration <= 0.0))
+                record = NULL;
+
+        if (record != NULL)
+        {
+                char *fields[METADATA_FIELDS] = {tags->title, tags->artist, tags->album_artist, tags->album, tags->date};
+
+                memset(tags, 0, sizeof(TagSettings));
+
+                for (int i = 0; i < METADATA_FIELDS; i++)
+                        memcpy(fields[i], getField(record, i), record->lengths[i]);
+
+                tags->replaygainTrack = record->replaygainTrack;
+                tags->replaygainAlbum = record->replaygainAlbum;
+                *duration = record->duration;
+        }
+
+        pthread_mutex_unlock(&recordsMutex);
+
+        return record != NULL;
+}
+
+double getExactDuration(const char *path)
+{
+        FileStamp stamp;
+        double duration = 0.0;
+
+        if (path == NULL || !getFileStamp(path, &stamp))
+                return duration;
+
+        pthread_once(&recordsOnce, loadRecords);
+
+        pthread_mutex_lock(&recordsMutex);
+
+        MetadataRecord *record = records != NULL ? g_hash_table_lookup(records, path) : NULL;
+
+        if (record != NULL && record->exact && record->mtime == stamp.mtime && record->size == stamp.size)
+                duration = record->duration;
+
+        pthread_mutex_unlock(&recordsMutex);
+
+        return duration;
+}
+
+void setExactDuration(const char *path, const TagSettings *tags, double duration)
+{
+        FileStamp stamp;
+
+        if (path == NULL || tags == NULL || duration <= 0.0 || !getFileStamp(path, &stamp))
+                return;
+
+        pthread_once(&recordsOnce, loadRecords);
+
+        MetadataRecord *record = createRecord(tags, duration, stamp);
+        char *key = strdup(path);
+
+        if (record == NULL || key == NULL)
+        {
+                free(record);
+                free(key);
+                return;
+        }
+
+        record->exact = true;
+
+        pthread_mutex_lock(&recordsMutex);
+
+        if (records != NULL)
+        {
+                // A scan running now still counts the file as seen
+                MetadataRecord *old = g_hash_table_lookup(records, path);
+
+                if (old != NULL)
+                        record->scan = old->scan;
+
+                g_hash_table_replace(records, key, record);
+                recordsChanged = true;
+                key = NULL;
+                record = NULL;
+        }
+
+        pthread_mutex_unlock(&recordsMutex);
+
+        free(record);
+        free(key);
+}
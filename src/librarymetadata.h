@@ -0,0 +1,34 @@
+#ifndef LIBRARYMETADATA_H
+#define LIBRARYMETADATA_H
+
+#include <stdbool.h>
+#include "tagLibWrapper.h"
+
+#ifndef LIBRARY_METADATA_FILE
+#define LIBRARY_METADATA_FILE "metadata"
+#endif
+
+#ifndef LIBRARY_METADATA_MAX_THREADS
+#define LIBRARY_METADATA_MAX_THREADS 4
+#endif
+
+// Reads the tags of the files that are new or changed since last time on a few background threads,
+// stopping a scan already running. Takes ownership of paths and the strings in it.
+void startMetadataIndexer(char **paths, int count);
+
+// Stops the scan and saves what was read or counted so far
+void stopMetadataIndexer(void);
+
+// Duration in seconds as of the last scan, 0.0 if the file isn't indexed
+double getIndexedDuration(const char *path);
+
+// Tags, replay gain and duration as of the last scan, false if the file isn't indexed or changed since
+bool getIndexedMetadata(const char *path, TagSettings *tags, double *duration);
+
+// Duration counted from the decoded stream, 0.0 if it hasn't been or the file changed since
+double getExactDuration(const char *path);
+
+// Remembers a counted duration, the tags are kept with it in case the file isn't indexed yet
+void setExactDuration(const char *path, const TagSettings *tags, double duration);
+
+#endif
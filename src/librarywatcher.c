@@ -0,0 +1,348 @@
+#include <errno.h>
+#include <glib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "librarywatcher.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/*
+
+librarywatcher.c
+
+ Watches every directory of the library with inotify and reports which ones
+ changed once things have been quiet for a moment, so the tree can be patched
+ instead of rescanned. Only available on Linux, elsewhere starting it does nothing.
+
+*/
+
+#ifndef MAXPATHLEN
+#define MAXPATHLEN 4096
+#endif
+
+#ifdef __linux__
+
+#define LIBRARY_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct
+{
+        int inotifyFd;
+        int stopPipe[2];
+        pthread_t thread;
+        GHashTable *watches; // Watch descriptor -> directory path
+        GHashTable *dirty;   // Directories changed since the last report
+        bool everything;     // Events were lost, the whole library needs checking
+        bool outOfWatches;
+        LibraryChangeCallback onChange;
+} LibraryWatcher;
+
+static LibraryWatcher *watcher = NULL;
+static pthread_mutex_t watcherMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void addWatch(LibraryWatcher *w, const char *path)
+{
+        if (w->outOfWatches)
+                return;
+
+        int wd = inotify_add_watch(w->inotifyFd, path, LIBRARY_WATCH_MASK | IN_ONLYDIR);
+
+        if (wd < 0)
+        {
+                // The user limit is reached, the rest of the library is only refreshed on startup or 'u'
+                if (errno == ENOSPC)
+                {
+                        fprintf(stderr, "Library watcher: out of inotify watches, see fs.inotify.max_user_watches\n");
+                        w->outOfWatches = true;
+                }
+                return;
+        }
+
+        // Watching the same directory twice gives back the same descriptor
+        g_hash_table_replace(w->watches, GINT_TO_POINTER(wd), strdup(path));
+}
+
+// Watches a directory that just appeared together with everything already inside it
+static void addWatchTree(LibraryWatcher *w, const char *path, int depth)
+{
+        if (depth > 64)
+                return;
+
+        addWatch(w, path);
+
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+                return;
+
+        struct dirent *entry;
+        char childPath[MAXPATHLEN];
+
+        while ((entry = readdir(dir)) != NULL)
+        {
+                if (entry->d_name[0] == '.')
+                        continue;
+
+                if (entry->d_type != DT_DIR && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+                        continue;
+
+                int written = snprintf(childPath, sizeof(childPath), "%s/%s", path, entry->d_name);
+                if (written < 0 || written >= (int)sizeof(childPath))
+                        continue;
+
+                addWatchTree(w, childPath, depth + 1);
+        }
+
+        closedir(dir);
+}
+
+static void markDirty(LibraryWatcher *w, const char *path)
+{
+        if (!g_hash_table_contains(w->dirty, path))
+                g_hash_table_add(w->dirty, strdup(path));
+}
+
+static void handleEvent(LibraryWatcher *w, const struct inotify_event *event)
+{
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+                w->everything = true;
+                return;
+        }
+
+        if (event->mask & IN_IGNORED)
+        {
+                g_hash_table_remove(w->watches, GINT_TO_POINTER(event->wd));
+                return;
+        }
+
+        const char *path = g_hash_table_lookup(w->watches, GINT_TO_POINTER(event->wd));
+        if (path == NULL)
+                return;
+
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+        {
+                // The parent reports it too, and a moved directory gets watched again at its new place
+                inotify_rm_watch(w->inotifyFd, event->wd);
+                return;
+        }
+
+        if (event->len == 0 || event->name[0] == '.')
+                return;
+
+        if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+        {
+                char childPath[MAXPATHLEN];
+                int written = snprintf(childPath, sizeof(childPath), "%s/%s", path, event->name);
+
+                if (written > 0 && written < (int)sizeof(childPath))
+                        addWatchTree(w, childPath, 0);
+        }
+
+        // Rereading the parent picks up the new directory with all its contents
+        markDirty(w, path);
+}
+
+static void reportChanges(LibraryWatcher *w)
+{
+        if (w->everything)
+        {
+                w->everything = false;
+                g_hash_table_remove_all(w->dirty);
+                w->onChange(NULL, 0);
+                return;
+        }
+
+        guint count = 0;
+        char **paths = (char **)g_hash_table_get_keys_as_array(w->dirty, &count);
+
+        if (paths != NULL && count > 0)
+                w->onChange(paths, (int)count);
+
+        g_free(paths);
+        g_hash_table_remove_all(w->dirty);
+}
+
+static long long getMonotonicMs(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *libraryWatcherThread(void *arg)
+{
+        LibraryWatcher *w = arg;
+        char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+        long long lastEvent = 0;
+        bool pending = false;
+
+        for (;;)
+        {
+                struct pollfd fds[2] = {
+                    {.fd = w->inotifyFd, .events = POLLIN},
+                    {.fd = w->stopPipe[0], .events = POLLIN}};
+
+                int timeout = -1;
+
+                if (pending)
+                {
+                        long long waited = getMonotonicMs() - lastEvent;
+                        timeout = waited >= LIBRARY_WATCH_DELAY_MS ? 0 : (int)(LIBRARY_WATCH_DELAY_MS - waited);
+                }
+
+                int ready = poll(fds, 2, timeout);
+
+                if (ready < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        break;
+                }
+
+                if (fds[1].revents != 0)
+                        break;
+
+                if (ready == 0)
+                {
+                        // Quiet long enough, a copy in progress is usually done by now
+                        reportChanges(w);
+                        pending = false;
+                        continue;
+                }
+
+                ssize_t length;
+
+                while ((length = read(w->inotifyFd, buffer, sizeof(buffer))) > 0)
+                {
+                        for (char *p = buffer; p < buffer + length;)
+                        {
+                                const struct inotify_event *event = (const struct inotify_event *)p;
+                                handleEvent(w, event);
+                                p += sizeof(struct inotify_event) + event->len;
+                        }
+                }
+
+                if (g_hash_table_size(w->dirty) > 0 || w->everything)
+                {
+                        pending = true;
+                        lastEvent = getMonotonicMs();
+                }
+        }
+
+        return NULL;
+}
+
+static void freeLibraryWatcher(LibraryWatcher *w)
+{
+        if (w->watches != NULL)
+                g_hash_table_destroy(w->watches);
+        if (w->dirty != NULL)
+                g_hash_table_destroy(w->dirty);
+        if (w->inotifyFd >= 0)
+                close(w->inotifyFd);
+        if (w->stopPipe[0] >= 0)
+                close(w->stopPipe[0]);
+        if (w->stopPipe[1] >= 0)
+                close(w->stopPipe[1]);
+
+        free(w);
+}
+
+static LibraryWatcher *createLibraryWatcher(char **directories, int count, LibraryChangeCallback onChange)
+{
+        LibraryWatcher *w = calloc(1, sizeof(LibraryWatcher));
+        if (w == NULL)
+        {
+                fprintf(stderr, "startLibraryWatcher: calloc\n");
+                return NULL;
+        }
+
+        w->stopPipe[0] = w->stopPipe[1] = -1;
+        w->onChange = onChange;
+        w->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        w->watches = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+        w->dirty = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+
+        if (w->inotifyFd < 0 || pipe(w->stopPipe) != 0)
+        {
+                perror("startLibraryWatcher");
+                freeLibraryWatcher(w);
+                return NULL;
+        }
+
+        for (int i = 0; i < count; i++)
+                addWatch(w, directories[i]);
+
+        if (pthread_create(&w->thread, NULL, libraryWatcherThread, w) != 0)
+        {
+                perror("startLibraryWatcher: pthread_create");
+                freeLibraryWatcher(w);
+                return NULL;
+        }
+
+        return w;
+}
+
+bool startLibraryWatcher(char **directories, int count, LibraryChangeCallback onChange)
+{
+        if (directories == NULL || onChange == NULL)
+                return false;
+
+        pthread_mutex_lock(&watcherMutex);
+
+        if (watcher == NULL)
+                watcher = createLibraryWatcher(directories, count, onChange);
+
+        bool started = watcher != NULL;
+
+        pthread_mutex_unlock(&watcherMutex);
+
+        return started;
+}
+
+// Must not be called while holding a lock the change callback takes
+void stopLibraryWatcher(void)
+{
+        pthread_mutex_lock(&watcherMutex);
+
+        if (watcher != NULL)
+        {
+                char stop = 1;
+
+                if (write(watcher->stopPipe[1], &stop, 1) != 1)
+                        perror("stopLibraryWatcher");
+
+                pthread_join(watcher->thread, NULL);
+
+                freeLibraryWatcher(watcher);
+                watcher = NULL;
+        }
+
+        pthread_mutex_unlock(&watcherMutex);
+}
+
+#else
+
+bool startLibraryWatcher(char **directories, int count, LibraryChangeCallback onChange)
+{
+        (void)directories;
+        (void)count;
+        (void)onChange;
+
+        return false;
+}
+
+void stopLibraryWatcher(void)
+{
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef LIBRARYWATCHER_H
+#define LIBRARYWATCHER_H
+
+#include <stdbool.h>
+
+#ifndef LIBRARY_WATCH_DELAY_MS
+#define LIBRARY_WATCH_DELAY_MS 500
+#endif
+
+// Called from the watcher thread with the directories that changed, or with NULL when everything needs checking
+typedef void (*LibraryChangeCallback)(char **paths, int count);
+
+bool startLibraryWatcher(char **directories, int count, LibraryChangeCallback onChange);
+
+void stopLibraryWatcher(void);
+
+#endif
@@ -1,6 +1,7 @@
 #include <glib.h>
 #include "common.h"
 #include "playerops.h"
+#include "songloader.h"
 #include "sound.h"
 #include "soundcommon.h"
 #include "mpris.h"
@@ -559,7 +560,7 @@ static gboolean get_metadata(GDBusConnection *connection, const gchar *sender,
                 }
                 artistList[1] = NULL;
 
-                gchar *coverArtUrl = g_strdup_printf("file://%s", currentSongData->coverArtPath);
+                gchar *coverArtUrl = g_strdup_printf("file://%s", getCoverArtPath(currentSongData, &appState));
 
                 g_variant_builder_add(&metadata_builder, "{sv}", "xesam:artist", g_variant_new_strv(artistList, -1));
                 g_variant_builder_add(&metadata_builder, "{sv}", "xesam:album", g_variant_new_string(currentSongData->metadata->album));
@@ -79,6 +79,7 @@ FileSystemEntry *currentEntry = NULL;
 FileSystemEntry *lastEntry = NULL;
 FileSystemEntry *chosenDir = NULL;
 FileSystemEntry *library = NULL;
+pthread_rwlock_t libraryLock = PTHREAD_RWLOCK_INITIALIZER;
 
 static const int LOGO_WIDTH = 22;
 
@@ -133,8 +134,9 @@ void printHelp()
                " \033[1;4mUsage:\033[0m   kew path \"path to music library\"\n"
                "          (Saves the music library path. Use this the first time. Ie: kew path \"/home/joe/Music/\")\n"
                "          kew (no argument, opens library)\n"
-               "          kew all (loads all your songs up to 10 000)\n"
-               "          kew albums (plays all albums up to 2000 randomly one after the other)"
+               "          kew all (loads all your songs)\n"
+               "          kew albums (plays all albums randomly one after the other)\n"
+               "          kew radio (plays random songs from your library without end)\n"
                "          kew <song name,directory or playlist words>\n"
                "          kew --help, -? or -h\n"
                "          kew --version or -v\n"
@@ -307,11 +309,11 @@ void printCoverCentered(SongData *songdata, UISettings *ui)
         {
                 if (!ui->coverAnsi)
                 {
-                        printSquareBitmapCentered(songdata->cover, songdata->coverWidth, songdata->coverHeight, preferredHeight);
+                        printSquareBitmapCentered(songdata->cover, songdata->coverWidth, songdata->coverHeight, preferredHeight, songdata->coverId);
                 }
                 else
                 {
-                        printInAsciiCentered(songdata->coverArtPath, preferredHeight);
+                        printInAsciiCentered(songdata->cover, songdata->coverWidth, songdata->coverHeight, preferredHeight);
                 }
         }
         else
@@ -337,11 +339,11 @@ void printCover(int height, SongData *songdata, UISettings *ui)
         {
                 if (!ui->coverAnsi)
                 {
-                        printSquareBitmap(row, col, songdata->cover, songdata->coverWidth, songdata->coverHeight, imgHeight);
+                        printSquareBitmap(row, col, songdata->cover, songdata->coverWidth, songdata->coverHeight, imgHeight, songdata->coverId);
                 }
                 else
                 {
-                        printInAscii(col, songdata->coverArtPath, imgHeight);
+                        printInAscii(col, songdata->cover, songdata->coverWidth, songdata->coverHeight, imgHeight);
                 }
         }
 }
@@ -1330,7 +1332,7 @@ int displayTree(FileSystemEntry *root, int depth, int maxListSize, int maxNameWi
         UISettings *ui = &(state->uiSettings);
         UIState *uis = &(state->uiState);
 
-        if (currentSong != NULL && (strcmp(currentSong->song.filePath, root->fullPath) == 0))
+        if (currentSong != NULL && entryHasPath(root, currentSong->song.filePath))
         {
                 foundCurrent = 1;
         }
@@ -1366,7 +1368,7 @@ int displayTree(FileSystemEntry *root, int depth, int maxListSize, int maxNameWi
         if (!(root->isDirectory ||
               (!root->isDirectory && depth == 1) ||
               (root->isDirectory && depth == 0) ||
-              (chosenDir != NULL && uis->allowChooseSongs && root->parent != NULL && (strcmp(root->parent->fullPath, chosenDir->fullPath) == 0 || strcmp(root->fullPath, chosenDir->fullPath) == 0))))
+              (chosenDir != NULL && uis->allowChooseSongs && root->parent != NULL && (root->parent == chosenDir || root == chosenDir))))
         {
                 return foundChosen;
         }
@@ -1431,7 +1433,7 @@ int displayTree(FileSystemEntry *root, int depth, int maxListSize, int maxNameWi
                                 currentEntry = root;
 
                                 if (uis->allowChooseSongs == true && (chosenDir == NULL ||
-                                                                      (currentEntry != NULL && currentEntry->parent != NULL && chosenDir != NULL && !isContainedWithin(currentEntry, chosenDir) && strcmp(root->fullPath, chosenDir->fullPath) != 0)))
+                                                                      (currentEntry != NULL && currentEntry->parent != NULL && chosenDir != NULL && !isContainedWithin(currentEntry, chosenDir) && root != chosenDir)))
                                 {
                                         uis->collapseView = true;
                                         refresh = true;
@@ -1488,7 +1490,6 @@ int displayTree(FileSystemEntry *root, int depth, int maxListSize, int maxNameWi
                         else
                         {
                                 filename[0] = '\0';
-                                pathEndsWith(root->fullPath, "m3u");
                                 isSameNameAsLastTime = (previousChosenLibRow == chosenLibRow);
 
                                 if (foundChosen)
@@ -1517,7 +1518,7 @@ int displayTree(FileSystemEntry *root, int depth, int maxListSize, int maxNameWi
                                         printf("\e[4m\e[1m");
                                 }
 
-                                if (pathEndsWith(root->fullPath, "m3u") || pathEndsWith(root->fullPath, "m3u8"))
+                                if (pathEndsWith(root->name, "m3u") || pathEndsWith(root->name, "m3u8"))
                                 {
                                         printf("\e[3m"); // Print playlists in italics to distinguish them
                                 }
@@ -38,10 +38,14 @@ typedef struct
         unsigned char blue;
         TagSettings *metadata;
         unsigned char *cover;
+        unsigned char *coverData; // Embedded picture bytes, NULL when the cover comes from an image file
+        size_t coverDataSize;
+        guint64 coverId;          // Same for every song sharing a cover image, 0 when there is none
         int avgBitRate;
         int coverWidth;
         int coverHeight;
         double duration;
+        float replayGain; // Linear, 1.0 when there is none or it is turned off
         bool hasErrors;
 } SongData;
 #endif
@@ -64,6 +68,9 @@ extern bool draggingProgressBar;
 
 extern FileSystemEntry *library;
 
+// Read locked to walk the library, write locked to patch or replace it. Never taken by the audio path.
+extern pthread_rwlock_t libraryLock;
+
 int printPlayer(SongData *songdata, double elapsedSeconds, AppSettings *settings, AppState *appState);
 
 void flipNextPage(void);
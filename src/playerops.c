@@ -7,6 +7,8 @@
 #include <unistd.h>
 #include "playerops.h"
 #include "file.h"
+#include "librarymetadata.h"
+#include "librarywatcher.h"
 #include "player_ui.h"
 #include "songloader.h"
 #include "search_ui.h"
@@ -29,6 +31,24 @@ playerops.c
 #define ASK_IF_USE_CACHE_LIMIT_SECONDS 4
 #endif
 
+#ifndef PREFETCH_COUNT
+#define PREFETCH_COUNT 2
+#endif
+
+#define PENDING_COUNTS (PREFETCH_COUNT + 1)
+
+#ifndef PLAYLIST_STREAM_BATCH
+#define PLAYLIST_STREAM_BATCH 500
+#endif
+
+#ifndef ENDLESS_SONGS_AHEAD
+#define ENDLESS_SONGS_AHEAD 50
+#endif
+
+#ifndef ENDLESS_SONGS_BEHIND
+#define ENDLESS_SONGS_BEHIND 100
+#endif
+
 struct timespec current_time;
 struct timespec start_time;
 struct timespec pause_time;
@@ -61,9 +81,70 @@ GMainContext *global_main_context = NULL;
 
 typedef struct
 {
-        char *path;
-        UISettings *ui;
-} UpdateLibraryThreadArgs;
+        char filePath[MAXPATHLEN];
+        SongData *songdata;
+} PrefetchedSong;
+
+typedef struct
+{
+        char filePath[MAXPATHLEN];
+        TagSettings tags;
+} PendingCount;
+
+typedef struct
+{
+        FileSystemEntry **songs;
+        int count;
+        int next;                 // songs[0..next) are taken, in random order the rest are drawn from
+        bool shuffle;
+        bool endless;             // Starts over instead of ending and only keeps a few songs ahead
+        unsigned long generation; // The library the entries belong to
+        unsigned long revision;   // The last change to that library the entries were checked against
+        LibrarySongCollector collect;
+        guint source;
+} PlaylistStream;
+
+typedef enum
+{
+        NO_SKIP,
+        SKIP_TO_SONG,
+        SKIP_TO_PREV,
+        SKIP_TO_NUMBER
+} SkipKind;
+
+// A skip whose song the loader is still reading, finished on the main loop by finishPendingSkip
+typedef struct
+{
+        SkipKind kind;
+        int songNumber;
+        AppState *state;
+} PendingSkip;
+
+static pthread_t loaderThread;
+static pthread_mutex_t loaderMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loaderCond = PTHREAD_COND_INITIALIZER; // New request for the loader
+static pthread_cond_t loadedCond = PTHREAD_COND_INITIALIZER; // The loader finished a request
+static bool loaderRunning = false;
+static bool loadRequested = false;
+static char requestedPath[MAXPATHLEN];
+static unsigned long requestedLoads = 0;
+static unsigned long completedLoads = 0;
+static bool prefetchRequested = false;
+static char prefetchPaths[PREFETCH_COUNT][MAXPATHLEN];
+static int numPrefetchPaths = 0;
+static PrefetchedSong prefetched[PREFETCH_COUNT]; // Only touched by the loader thread
+static PendingCount pendingCounts[PENDING_COUNTS]; // Songs whose length the loader thread still has to count
+static int numPendingCounts = 0;
+static GSourceFunc songLoadedCallback = NULL;
+static unsigned long skipLoad = 0; // The request a pending skip waits on
+static bool skipLoadDone = false;
+static bool skipLoadHasErrors = false;
+static PendingSkip pendingSkip = {NO_SKIP, 0, NULL}; // Only touched by the main thread
+
+static unsigned long libraryGeneration = 0; // Bumped when the whole library tree is replaced
+static unsigned long libraryRevision = 0;   // Bumped whenever the library tree changes, patched or replaced
+static PlaylistStream playlistStream = {NULL, 0, 0, false, false, 0, 0, NULL, 0};
+static bool libraryFromCache = false;
 
 void reshufflePlaylist(void)
 {
@@ -184,6 +265,48 @@ void playbackPause(struct timespec *pause_time)
         pausePlayback();
 }
 
+// Hands the loader a song, replacing a request it hasn't started yet. forSkip keeps the result for finishPendingSkip.
+static void requestLoad(Node *song, bool forSkip)
+{
+        pthread_mutex_lock(&loaderMutex);
+
+        c_strcpy(requestedPath, song->song.filePath, sizeof(requestedPath));
+        requestedLoads++;
+        loadRequested = true;
+
+        skipLoad = forSkip ? requestedLoads : 0;
+        skipLoadDone = false;
+
+        numPrefetchPaths = 0;
+
+        for (Node *next = song->next; next != NULL && numPrefetchPaths < PREFETCH_COUNT; next = next->next)
+        {
+                c_strcpy(prefetchPaths[numPrefetchPaths], next->song.filePath, sizeof(prefetchPaths[numPrefetchPaths]));
+                numPrefetchPaths++;
+        }
+
+        prefetchRequested = (numPrefetchPaths > 0);
+
+        pthread_cond_signal(&loaderCond);
+
+        pthread_mutex_unlock(&loaderMutex);
+}
+
+// Loads currentSong without waiting for it, the skip is finished once the loader is done
+static void loadSongForSkip(SkipKind kind, int songNumber, AppState *state)
+{
+        pendingSkip.kind = kind;
+        pendingSkip.songNumber = songNumber;
+        pendingSkip.state = state;
+
+        requestLoad(currentSong, true);
+}
+
+bool isSkipPending(void)
+{
+        return pendingSkip.kind != NO_SKIP;
+}
+
 void play(Node *song)
 {
         if (song != NULL)
@@ -212,36 +335,14 @@ void play(Node *song)
         loadingdata.loadA = !usingSongDataA;
 
         loadingdata.loadingFirstDecoder = true;
-        loadSong(currentSong, &loadingdata);
-
-        int maxNumTries = 50;
-        int numtries = 0;
-
-        while (!loadedNextSong && numtries < maxNumTries)
-        {
-                c_sleep(100);
-                numtries++;
-        }
-
-        if (songHasErrors)
-        {
-                songHasErrors = false;
-                forceSkip = true;
-                if (currentSong->next != NULL)
-                {
-                        skipToSong(currentSong->next->id, true);
-                        return;
-                }
-        }
-
-        resetClock();
-        skip();
+        loadSongForSkip(SKIP_TO_SONG, 0, NULL);
 }
 
 void skipToSong(int id, bool startPlaying)
 {
+        // A skip still loading is replaced, not waited for
         if (songLoading || !loadedNextSong || skipping || clearingErrors)
-                if (!forceSkip)
+                if (!forceSkip && !isSkipPending())
                         return;
 
         Node *found = NULL;
@@ -383,22 +484,10 @@ void toggleShuffle(UISettings *ui)
         }
         else
         {
-                char *path = NULL;
-                if (currentSong != NULL)
-                {
-                        path = strdup(currentSong->song.filePath);
-                }
-
                 pthread_mutex_lock(&(playlist.mutex));
 
-                deletePlaylist(&playlist); // Doesn't destroy the mutex
-                deepCopyPlayListOntoList(unshuffledPlaylist, &playlist);
-
-                if (path != NULL)
-                {
-                        currentSong = findPathInPlaylist(path, &playlist);
-                        free(path);
-                }
+                // The same nodes back in the order of the playlist view, currentSong stays valid
+                orderPlaylistLike(&playlist, unshuffledPlaylist);
 
                 pthread_mutex_unlock(&(playlist.mutex));
 
@@ -658,97 +747,38 @@ void seekBack(UIState *uis)
 
 Node *findSelectedEntryById(PlayList *playlist, int id)
 {
-        Node *node = playlist->head;
+        Node *node = NULL;
 
-        if (node == NULL || id < 0)
+        if (id < 0)
                 return NULL;
 
-        bool found = false;
-
-        for (int i = 0; i < playlist->count; i++)
-        {
-                if (node != NULL && node->id == id)
-                {
-                        found = true;
-                        break;
-                }
-                else if (node == NULL)
-                {
-                        return NULL;
-                }
-                node = node->next;
-        }
-
-        if (found)
-        {
-                return node;
-        }
+        findNodeInList(playlist, id, &node);
 
-        return NULL;
+        return node;
 }
 
 Node *findSelectedEntry(PlayList *playlist, int row)
 {
-        Node *node = playlist->head;
-
-        if (node == NULL)
-                return NULL;
-
-        bool found = false;
-
-        for (int i = 0; i < playlist->count; i++)
-        {
-                if (i == row)
-                {
-                        found = true;
-                        break;
-                }
-                node = node->next;
-        }
-
-        if (found)
-        {
-                return node;
-        }
-
-        return NULL;
+        return findNodeAtRow(playlist, row);
 }
 
 bool markAsEnqueued(FileSystemEntry *root, char *path)
 {
-        if (root == NULL)
+        FileSystemEntry *entry = findCorrespondingEntry(root, path);
+
+        if (entry == NULL || entry->isDirectory)
                 return false;
 
-        if (!root->isDirectory)
+        // The song and every directory above it, up to root
+        for (; entry != NULL; entry = entry->parent)
         {
-                if (strcmp(root->fullPath, path) == 0)
-                {
-                        root->isEnqueued = true;
-                        return true;
-                }
-        }
-        else
-        {
-                FileSystemEntry *child = root->children;
-                bool found = false;
-                while (child != NULL)
-                {
-                        found = markAsEnqueued(child, path);
-                        child = child->next;
+                entry->isEnqueued = true;
 
-                        if (found)
-                                break;
-                }
-
-                if (found)
-                {
-                        root->isEnqueued = true;
-
-                        return true;
-                }
+                if (entry == root)
+                        break;
         }
 
-        return false;
+        return true;
 }
 
 void markListAsEnqueued(FileSystemEntry *root, PlayList *playlist)
@@ -773,52 +803,31 @@ void markListAsEnqueued(FileSystemEntry *root, PlayList *playlist)
 
 bool markAsDequeued(FileSystemEntry *root, char *path)
 {
-        int numChildrenEnqueued = 0;
+        FileSystemEntry *entry = findCorrespondingEntry(root, path);
 
-        if (root == NULL)
+        if (entry == NULL || entry->isDirectory)
                 return false;
 
-        if (!root->isDirectory)
-        {
-                if (strcmp(root->fullPath, path) == 0)
-                {
-                        root->isEnqueued = false;
-                        return true;
-                }
-        }
-        else
+        entry->isEnqueued = false;
+
+        // A directory stays enqueued as long as something in it is
+        while (entry != root && entry->parent != NULL)
         {
-                FileSystemEntry *child = root->children;
-                bool found = false;
-                while (child != NULL)
-                {
-                        found = markAsDequeued(child, path);
-                        child = child->next;
+                entry = entry->parent;
 
-                        if (found)
-                                break;
-                }
+                int numChildrenEnqueued = 0;
 
-                if (found)
+                for (FileSystemEntry *child = entry->children; child != NULL; child = child->next)
                 {
-                        child = root->children;
-
-                        while (child != NULL)
-                        {
-                                if (child->isEnqueued)
-                                        numChildrenEnqueued++;
-
-                                child = child->next;
-                        }
-
-                        if (numChildrenEnqueued == 0)
-                                root->isEnqueued = false;
-
-                        return true;
+                        if (child->isEnqueued)
+                                numChildrenEnqueued++;
                 }
+
+                if (numChildrenEnqueued == 0)
+                        entry->isEnqueued = false;
         }
 
-        return false;
+        return true;
 }
 
 Node *getNextSong(void)
@@ -839,18 +848,274 @@ void enqueueSong(FileSystemEntry *child)
 {
         int id = nodeIdCounter++;
 
-        Node *node = NULL;
-        createNode(&node, child->fullPath, id);
-        addToList(unshuffledPlaylist, node);
+        char path[MAXPATHLEN];
+        getEntryPath(child, path, sizeof(path));
 
         Node *node2 = NULL;
-        createNode(&node2, child->fullPath, id);
+        createNode(&node2, path, id);
         addToList(&playlist, node2);
 
+        // Before the first run the playlist view gets a copy of the whole playlist
+        if (unshuffledPlaylist != NULL)
+                addToList(unshuffledPlaylist, copyNode(node2));
+
         child->isEnqueued = 1;
         child->parent->isEnqueued = 1;
 }
 
+// Takes the songs a refresh removed from the library out of the stream. Their entries are still
+// there, unlinked from the tree, but the files are gone. Needs the library read locked.
+static void dropRemovedStreamSongs(void)
+{
+        int count = 0;
+        FileSystemEntry **songs = getFileEntries(library, &count);
+
+        if (songs == NULL)
+                return;
+
+        GHashTable *inLibrary = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+        for (int i = 0; i < count; i++)
+                g_hash_table_insert(inLibrary, songs[i], songs[i]);
+
+        int kept = 0;
+        int next = 0;
+
+        for (int i = 0; i < playlistStream.count; i++)
+        {
+                if (i == playlistStream.next)
+                        next = kept;
+
+                if (g_hash_table_lookup(inLibrary, playlistStream.songs[i]) != NULL)
+                        playlistStream.songs[kept++] = playlistStream.songs[i];
+        }
+
+        playlistStream.next = playlistStream.next == playlistStream.count ? kept : next;
+        playlistStream.count = kept;
+
+        g_hash_table_destroy(inLibrary);
+        free(songs);
+}
+
+// Enqueues up to max more songs of the stream, returns true if there are some left
+static bool appendStreamedSongs(int max)
+{
+        int added = 0;
+
+        pthread_rwlock_rdlock(&libraryLock);
+
+        bool replaced = playlistStream.generation != libraryGeneration;
+
+        // An endless stream collects its songs again after any change, so music added meanwhile gets played too
+        if (playlistStream.endless && (replaced || playlistStream.revision != libraryRevision))
+        {
+                free(playlistStream.songs);
+                playlistStream.songs = playlistStream.collect(library, &playlistStream.count);
+                playlistStream.next = 0;
+                playlistStream.generation = libraryGeneration;
+                playlistStream.revision = libraryRevision;
+
+                if (playlistStream.songs == NULL || playlistStream.count == 0)
+                {
+                        pthread_rwlock_unlock(&libraryLock);
+                        return false;
+                }
+        }
+        // The entries went away with the old tree
+        else if (replaced)
+        {
+                pthread_rwlock_unlock(&libraryLock);
+                return false;
+        }
+        // The tree was patched in place
+        else if (playlistStream.revision != libraryRevision)
+        {
+                dropRemovedStreamSongs();
+                playlistStream.revision = libraryRevision;
+
+                if (playlistStream.count == 0)
+                {
+                        pthread_rwlock_unlock(&libraryLock);
+                        return false;
+                }
+        }
+
+        pthread_mutex_lock(&(playlist.mutex));
+
+        while (added < max)
+        {
+                if (playlistStream.next == playlistStream.count)
+                {
+                        if (!playlistStream.endless)
+                                break;
+
+                        playlistStream.next = 0; // Another round through all the songs
+                }
+
+                // Draw the next song from the ones not taken yet, a Fisher-Yates shuffle one step at a time
+                if (playlistStream.shuffle)
+                {
+                        int pick = playlistStream.next + getRandomBelow(getShuffleRandomState(), playlistStream.count - playlistStream.next);
+                        FileSystemEntry *tmp = playlistStream.songs[pick];
+                        playlistStream.songs[pick] = playlistStream.songs[playlistStream.next];
+                        playlistStream.songs[playlistStream.next] = tmp;
+                }
+
+                FileSystemEntry *song = playlistStream.songs[playlistStream.next++];
+
+                // Enqueued by hand in the meantime, or in an earlier round which is fine
+                if (song->isEnqueued && !playlistStream.endless)
+                        continue;
+
+                enqueueSong(song);
+                added++;
+        }
+
+        pthread_mutex_unlock(&(playlist.mutex));
+        pthread_rwlock_unlock(&libraryLock);
+
+        return playlistStream.endless || playlistStream.next < playlistStream.count;
+}
+
+static gboolean playlistStreamCallback(gpointer data)
+{
+        (void)data;
+
+        if (appendStreamedSongs(PLAYLIST_STREAM_BATCH))
+                return G_SOURCE_CONTINUE;
+
+        playlistStream.source = 0;
+        cancelPlaylistStream();
+        refresh = true;
+
+        return G_SOURCE_REMOVE;
+}
+
+// Removes up to count songs from the start of the playlist and their copies in the view, stopping at any song still in use.
+// Needs the library read locked and the playlist locked.
+static int dropPlayedSongs(int count)
+{
+        int dropped = 0;
+
+        while (dropped < count && playlist.head != NULL)
+        {
+                Node *node = playlist.head;
+
+                if (node == currentSong || node == nextSong || node == tryNextSong || node == songToStartFrom || node == prevSong)
+                        break;
+
+                Node *viewNode = NULL;
+
+                if (unshuffledPlaylist != NULL && findNodeInList(unshuffledPlaylist, node->id, &viewNode) >= 0)
+                        deleteFromList(unshuffledPlaylist, viewNode);
+
+                // A small library comes round again within the history, the later copy keeps it enqueued
+                if (findLastPathInPlaylist(node->song.filePath, &playlist) == node)
+                        markAsDequeued(library, node->song.filePath);
+
+                deleteFromList(&playlist, node);
+                dropped++;
+        }
+
+        return dropped;
+}
+
+static gboolean endlessStreamCallback(gpointer data)
+{
+        (void)data;
+
+        pthread_rwlock_rdlock(&libraryLock);
+        pthread_mutex_lock(&(playlist.mutex));
+
+        Node *node = NULL;
+        int row = (currentSong != NULL) ? findNodeInList(&playlist, currentSong->id, &node) : -1;
+
+        // Only a short history of played songs is kept so the playlist doesn't grow for as long as the radio plays
+        if (row > ENDLESS_SONGS_BEHIND && dropPlayedSongs(row - ENDLESS_SONGS_BEHIND) > 0)
+        {
+                row = findNodeInList(&playlist, currentSong->id, &node);
+                refresh = true;
+        }
+
+        int songsAhead = playlist.count - row - 1;
+
+        pthread_mutex_unlock(&(playlist.mutex));
+        pthread_rwlock_unlock(&libraryLock);
+
+        if (songsAhead >= ENDLESS_SONGS_AHEAD / 2)
+                return G_SOURCE_CONTINUE;
+
+        if (appendStreamedSongs(ENDLESS_SONGS_AHEAD))
+        {
+                refresh = true;
+                return G_SOURCE_CONTINUE;
+        }
+
+        playlistStream.source = 0;
+        cancelPlaylistStream();
+
+        return G_SOURCE_REMOVE;
+}
+
+void streamSongsToPlaylist(LibrarySongCollector collect, bool shuffle, bool endless)
+{
+        cancelPlaylistStream();
+
+        int count = 0;
+
+        // Collected under the same lock the library is stamped with, so no change slips in between
+        pthread_rwlock_rdlock(&libraryLock);
+        FileSystemEntry **songs = collect(library, &count);
+        playlistStream.generation = libraryGeneration;
+        playlistStream.revision = libraryRevision;
+        pthread_rwlock_unlock(&libraryLock);
+
+        if (songs == NULL)
+                return;
+
+        if (count == 0)
+        {
+                free(songs);
+                return;
+        }
+
+        playlistStream.songs = songs;
+        playlistStream.count = count;
+        playlistStream.next = 0;
+        playlistStream.shuffle = shuffle;
+        playlistStream.endless = endless;
+        playlistStream.collect = collect;
+
+        // An endless stream tops up the playlist as it's played
+        if (endless)
+        {
+                appendStreamedSongs(ENDLESS_SONGS_AHEAD);
+                playlistStream.source = g_timeout_add_seconds(1, endlessStreamCallback, NULL);
+                return;
+        }
+
+        // The first batch right away so playing can start, the rest whenever the main loop is idle
+        if (appendStreamedSongs(PLAYLIST_STREAM_BATCH))
+                playlistStream.source = g_idle_add_full(G_PRIORITY_LOW, playlistStreamCallback, NULL, NULL);
+        else
+                cancelPlaylistStream();
+}
+
+void cancelPlaylistStream(void)
+{
+        if (playlistStream.source != 0)
+        {
+                g_source_remove(playlistStream.source);
+                playlistStream.source = 0;
+        }
+
+        free(playlistStream.songs);
+        playlistStream.songs = NULL;
+        playlistStream.count = 0;
+        playlistStream.next = 0;
+        playlistStream.endless = false;
+}
+
 void silentSwitchToNext(bool loadSong, AppState *state)
 {
         skipping = true;
@@ -1052,7 +1317,8 @@ void moveSongDown()
 
 void dequeueSong(FileSystemEntry *child)
 {
-        Node *node1 = findLastPathInPlaylist(child->fullPath, unshuffledPlaylist);
+        char path[MAXPATHLEN];
+        Node *node1 = findLastPathInPlaylist(getEntryPath(child, path, sizeof(path)), unshuffledPlaylist);
 
         if (node1 == NULL)
                 return;
@@ -1190,7 +1456,7 @@ bool isContainedWithin(FileSystemEntry *entry, FileSystemEntry *containingEntry)
 
         while (tmp != NULL)
         {
-                if (strcmp(tmp->fullPath, containingEntry->fullPath) == 0)
+                if (tmp == containingEntry)
                         return true;
 
                 tmp = tmp->parent;
@@ -1204,7 +1470,10 @@ void autostartIfStopped(FileSystemEntry *firstEnqueuedEntry)
         waitingForNext = true;
         audioData.endOfListReached = false;
         if (firstEnqueuedEntry != NULL)
-                songToStartFrom = findPathInPlaylist(firstEnqueuedEntry->fullPath, &playlist);
+        {
+                char path[MAXPATHLEN];
+                songToStartFrom = findPathInPlaylist(getEntryPath(firstEnqueuedEntry, path, sizeof(path)), &playlist);
+        }
         lastPlayedId = -1;
 }
 
@@ -1219,7 +1488,7 @@ FileSystemEntry *enqueueSongs(FileSystemEntry *entry, UIState *uis)
         {
                 if (entry->isDirectory)
                 {
-                        if (!hasSongChildren(entry) || entry->parent == NULL || (chosenDir != NULL && strcmp(entry->fullPath, chosenDir->fullPath) == 0))
+                        if (!hasSongChildren(entry) || entry->parent == NULL || entry == chosenDir)
                         {
                                 if (hasDequeuedChildren(entry))
                                 {
@@ -1237,6 +1506,9 @@ FileSystemEntry *enqueueSongs(FileSystemEntry *entry, UIState *uis)
                                 }
                                 else
                                 {
+                                        // Don't add back what is being dequeued
+                                        cancelPlaylistStream();
+
                                         dequeueChildren(entry);
 
                                         entry->isEnqueued = 0;
@@ -1255,7 +1527,7 @@ FileSystemEntry *enqueueSongs(FileSystemEntry *entry, UIState *uis)
 
                                 while (tmpc != NULL)
                                 {
-                                        if (strcmp(entry->fullPath, tmpc->fullPath) == 0 || isContainedWithin(entry, tmpc))
+                                        if (entry == tmpc || isContainedWithin(entry, tmpc))
                                                 break;
                                         tmpc = tmpc->next;
                                         uis->numSongsAboveSubDir++;
@@ -1341,6 +1613,7 @@ void handleRemove(void)
                         }
                 }
 
+                pthread_rwlock_rdlock(&libraryLock);
                 pthread_mutex_lock(&(playlist.mutex));
 
                 if (node != NULL && song != NULL && currentSong != NULL)
@@ -1380,6 +1653,7 @@ void handleRemove(void)
                 }
 
                 pthread_mutex_unlock(&(playlist.mutex));
+                pthread_rwlock_unlock(&libraryLock);
         }
         else
         {
@@ -1401,15 +1675,10 @@ Node *getSongByNumber(PlayList *playlist, int songNumber)
                 return song;
         }
 
-        int count = 1;
-
-        while (song->next != NULL && count != songNumber)
-        {
-                song = getListNext(song);
-                count++;
-        }
+        if (songNumber > playlist->count)
+                return playlist->tail;
 
-        return song;
+        return findNodeAtRow(playlist, songNumber - 1);
 }
 
 void addToFavoritesPlaylist(void)
@@ -1424,7 +1693,7 @@ void addToFavoritesPlaylist(void)
         if (findSelectedEntryById(favoritesPlaylist, id) != NULL) // Song is already in list
                 return;
 
-        createNode(&node, currentSong->song.filePath, id);
+        node = copyNode(currentSong);
         addToList(favoritesPlaylist, node);
 }
 
@@ -1474,16 +1743,88 @@ int assignLoadedData(void)
         return result;
 }
 
-void *songDataReaderThread(void *arg)
+// Takes ownership of a prefetched song, if there is one for this path
+static SongData *takePrefetchedSong(const char *filePath)
+{
+        for (int i = 0; i < PREFETCH_COUNT; i++)
+        {
+                if (prefetched[i].songdata != NULL && strcmp(prefetched[i].filePath, filePath) == 0)
+                {
+                        SongData *songdata = prefetched[i].songdata;
+                        prefetched[i].songdata = NULL;
+                        prefetched[i].filePath[0] = '\0';
+                        return songdata;
+                }
+        }
+
+        return NULL;
+}
+
+// The headers of an mp3 only estimate its length, so count it when there is nothing else to load
+static void queueDurationCount(const SongData *songdata)
+{
+        if (songdata == NULL || songdata->hasErrors || songdata->metadata == NULL ||
+            !pathEndsWith(songdata->filePath, ".mp3") || getKnownDuration(songdata->filePath) > 0.0)
+                return;
+
+        for (int i = 0; i < numPendingCounts; i++)
+        {
+                if (strcmp(pendingCounts[i].filePath, songdata->filePath) == 0)
+                        return;
+        }
+
+        // Drop the oldest, it has most likely been played already
+        if (numPendingCounts == PENDING_COUNTS)
+        {
+                memmove(&pendingCounts[0], &pendingCounts[1], (PENDING_COUNTS - 1) * sizeof(PendingCount));
+                numPendingCounts--;
+        }
+
+        PendingCount *count = &pendingCounts[numPendingCounts++];
+
+        c_strcpy(count->filePath, songdata->filePath, sizeof(count->filePath));
+        count->tags = *songdata->metadata;
+}
+
+static void countDuration(const PendingCount *count)
 {
-        LoadingThreadData *loadingdata = (LoadingThreadData *)arg;
+        double duration = calcExactDuration(count->filePath);
 
+        if (duration <= 0.0)
+                return;
+
+        setKnownDuration(count->filePath, duration);
+        setExactDuration(count->filePath, &count->tags, duration);
+}
+
+// Publishes the outcome of the latest load to the main thread
+static void publishLoadedSong(bool hasErrors)
+{
+        if (hasErrors)
+        {
+                songHasErrors = true;
+                clearingErrors = true;
+                nextSong = NULL;
+        }
+        else
+        {
+                songHasErrors = false;
+                clearingErrors = false;
+                nextSong = tryNextSong;
+                tryNextSong = NULL;
+        }
+
+        loadedNextSong = true;
+        skipping = false;
+        songLoading = false;
+}
+
+// Returns true if the song couldn't be loaded
+static bool readSongData(LoadingThreadData *loadingdata, const char *filePath)
+{
         // Acquire the mutex lock
         pthread_mutex_lock(&(loadingdata->mutex));
 
-        char filepath[MAXPATHLEN];
-        c_strcpy(filepath, loadingdata->filePath, sizeof(filepath));
-
         SongData *songdata = NULL;
 
         if (loadingdata->loadA)
@@ -1503,12 +1844,12 @@ void *songDataReaderThread(void *arg)
                 }
         }
 
-        if (existsFile(filepath) >= 0)
+        songdata = takePrefetchedSong(filePath);
+
+        if (songdata == NULL && existsFile(filePath) >= 0)
         {
-                songdata = loadSongData(filepath, &appState);
+                songdata = loadSongData((char *)filePath, &appState);
         }
-        else
-                songdata = NULL;
 
         if (loadingdata->loadA)
         {
@@ -1521,35 +1862,271 @@ void *songDataReaderThread(void *arg)
 
         int result = assignLoadedData();
 
-        if (result < 0)
+        if (result < 0 && songdata != NULL)
                 songdata->hasErrors = true;
 
+        queueDurationCount(songdata);
+
         // Release the mutex lock
         pthread_mutex_unlock(&(loadingdata->mutex));
 
-        if (songdata == NULL || songdata->hasErrors)
+        return songdata == NULL || songdata->hasErrors;
+}
+
+static bool isLoadRequested(void)
+{
+        pthread_mutex_lock(&loaderMutex);
+        bool requested = loadRequested || !loaderRunning;
+        pthread_mutex_unlock(&loaderMutex);
+
+        return requested;
+}
+
+// Loads metadata and cover for the upcoming songs, so loading them into a slot later is quick
+static void prefetchSongs(char paths[][MAXPATHLEN], int count)
+{
+        // Drop what is no longer coming up
+        for (int i = 0; i < PREFETCH_COUNT; i++)
         {
-                songHasErrors = true;
-                clearingErrors = true;
-                nextSong = NULL;
+                if (prefetched[i].songdata == NULL)
+                        continue;
+
+                bool wanted = false;
+
+                for (int j = 0; j < count; j++)
+                {
+                        if (strcmp(prefetched[i].filePath, paths[j]) == 0)
+                                wanted = true;
+                }
+
+                if (!wanted)
+                {
+                        unloadSongData(&(prefetched[i].songdata), &appState);
+                        prefetched[i].filePath[0] = '\0';
+                }
         }
-        else
+
+        for (int j = 0; j < count; j++)
         {
-                songHasErrors = false;
-                clearingErrors = false;
-                nextSong = tryNextSong;
-                tryNextSong = NULL;
+                // A real load always goes first, the rest of the prefetch is stale by then anyway
+                if (isLoadRequested())
+                        return;
+
+                int freeSlot = -1;
+                bool found = false;
+
+                for (int i = 0; i < PREFETCH_COUNT; i++)
+                {
+                        if (prefetched[i].songdata != NULL && strcmp(prefetched[i].filePath, paths[j]) == 0)
+                                found = true;
+                        else if (prefetched[i].songdata == NULL && freeSlot < 0)
+                                freeSlot = i;
+                }
+
+                if (found || freeSlot < 0 || existsFile(paths[j]) < 0)
+                        continue;
+
+                SongData *songdata = loadSongData(paths[j], &appState);
+
+                if (songdata == NULL)
+                        continue;
+
+                if (songdata->hasErrors)
+                {
+                        unloadSongData(&songdata, &appState);
+                        continue;
+                }
+
+                c_strcpy(prefetched[freeSlot].filePath, paths[j], sizeof(prefetched[freeSlot].filePath));
+                prefetched[freeSlot].songdata = songdata;
+
+                queueDurationCount(songdata);
         }
+}
 
-        loadedNextSong = true;
-        skipping = false;
-        songLoading = false;
+static void *songLoaderThread(void *arg)
+{
+        (void)arg;
+
+        char filePath[MAXPATHLEN];
+        char paths[PREFETCH_COUNT][MAXPATHLEN];
+
+        pthread_mutex_lock(&loaderMutex);
+
+        while (loaderRunning)
+        {
+                if (loadRequested)
+                {
+                        unsigned long request = requestedLoads;
+
+                        loadRequested = false;
+                        c_strcpy(filePath, requestedPath, sizeof(filePath));
+
+                        pthread_mutex_unlock(&loaderMutex);
+
+                        bool hasErrors = readSongData(&loadingdata, filePath);
+
+                        pthread_mutex_lock(&loaderMutex);
+
+                        completedLoads = request;
+
+                        // A request that was replaced while loading leaves the flags to the one that replaced it
+                        if (request == requestedLoads)
+                        {
+                                if (request == skipLoad)
+                                {
+                                        skipLoadDone = true;
+                                        skipLoadHasErrors = hasErrors;
+                                }
+                                else
+                                {
+                                        publishLoadedSong(hasErrors);
+                                }
+                        }
+
+                        pthread_cond_broadcast(&loadedCond);
+
+                        // Let the main loop pick the song up right away instead of on its next tick
+                        if (songLoadedCallback != NULL)
+                                g_idle_add(songLoadedCallback, NULL);
+
+                        continue;
+                }
+
+                if (prefetchRequested)
+                {
+                        int count = numPrefetchPaths;
+
+                        prefetchRequested = false;
+
+                        for (int i = 0; i < count; i++)
+                                c_strcpy(paths[i], prefetchPaths[i], sizeof(paths[i]));
+
+                        pthread_mutex_unlock(&loaderMutex);
+
+                        prefetchSongs(paths, count);
+
+                        pthread_mutex_lock(&loaderMutex);
+
+                        continue;
+                }
+
+                if (numPendingCounts > 0)
+                {
+                        PendingCount count = pendingCounts[0];
+
+                        numPendingCounts--;
+                        memmove(&pendingCounts[0], &pendingCounts[1], numPendingCounts * sizeof(PendingCount));
+
+                        pthread_mutex_unlock(&loaderMutex);
+
+                        countDuration(&count);
+
+                        pthread_mutex_lock(&loaderMutex);
+
+                        continue;
+                }
+
+                pthread_cond_wait(&loaderCond, &loaderMutex);
+        }
+
+        pthread_mutex_unlock(&loaderMutex);
 
         return NULL;
 }
 
+void startSongLoader(void)
+{
+        pthread_mutex_lock(&loaderMutex);
+
+        if (loaderRunning)
+        {
+                pthread_mutex_unlock(&loaderMutex);
+                return;
+        }
+
+        loaderRunning = true;
+
+        pthread_mutex_unlock(&loaderMutex);
+
+        if (pthread_create(&loaderThread, NULL, songLoaderThread, NULL) != 0)
+        {
+                perror("pthread_create");
+
+                pthread_mutex_lock(&loaderMutex);
+                loaderRunning = false;
+                pthread_mutex_unlock(&loaderMutex);
+        }
+}
+
+void stopSongLoader(void)
+{
+        pthread_mutex_lock(&loaderMutex);
+
+        if (!loaderRunning)
+        {
+                pthread_mutex_unlock(&loaderMutex);
+                return;
+        }
+
+        loaderRunning = false;
+        pthread_cond_broadcast(&loaderCond);
+        pthread_cond_broadcast(&loadedCond);
+
+        pthread_mutex_unlock(&loaderMutex);
+
+        pthread_join(loaderThread, NULL);
+
+        for (int i = 0; i < PREFETCH_COUNT; i++)
+        {
+                if (prefetched[i].songdata != NULL)
+                        unloadSongData(&(prefetched[i].songdata), &appState);
+        }
+}
+
+void setSongLoadedCallback(GSourceFunc callback)
+{
+        pthread_mutex_lock(&loaderMutex);
+        songLoadedCallback = callback;
+        pthread_mutex_unlock(&loaderMutex);
+}
+
+// Waits until every requested load is done. Returns false on timeout.
+bool waitForSongLoader(int timeoutMilliseconds)
+{
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeoutMilliseconds / 1000;
+        deadline.tv_nsec += (long)(timeoutMilliseconds % 1000) * 1000000L;
+
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&loaderMutex);
+
+        while (loaderRunning && completedLoads != requestedLoads)
+        {
+                if (pthread_cond_timedwait(&loadedCond, &loaderMutex, &deadline) != 0)
+                        break;
+        }
+
+        bool done = (completedLoads == requestedLoads);
+
+        pthread_mutex_unlock(&loaderMutex);
+
+        return done;
+}
+
 void loadSong(Node *song, LoadingThreadData *loadingdata)
 {
+        (void)loadingdata;
+
+        // Loading something else into the slot drops a skip still waiting on it
+        pendingSkip.kind = NO_SKIP;
+
         if (song == NULL)
         {
                 loadedNextSong = true;
@@ -1558,15 +2135,13 @@ void loadSong(Node *song, LoadingThreadData *loadingdata)
                 return;
         }
 
-        c_strcpy(loadingdata->filePath, song->song.filePath, sizeof(loadingdata->filePath));
-
-        pthread_t loadingThread;
-        pthread_create(&loadingThread, NULL, songDataReaderThread, (void *)loadingdata);
+        requestLoad(song, false);
 }
 
 void rebuildNextSong(Node *song)
 {
-        if (song == NULL)
+        // A pending skip loads into the same slot, what comes after it is loaded once it's done
+        if (song == NULL || isSkipPending())
                 return;
 
         loadingdata.loadA = !usingSongDataA;
@@ -1575,16 +2150,56 @@ void rebuildNextSong(Node *song)
         songLoading = true;
 
         loadSong(song, &loadingdata);
+}
+
+void finishPendingSkip(void)
+{
+        if (pendingSkip.kind == NO_SKIP)
+                return;
+
+        pthread_mutex_lock(&loaderMutex);
+
+        bool done = skipLoadDone && skipLoad == requestedLoads;
+        bool hasErrors = skipLoadHasErrors;
+
+        if (done)
+                skipLoadDone = false;
+
+        pthread_mutex_unlock(&loaderMutex);
 
-        int maxNumTries = 50;
-        int numtries = 0;
+        if (!done)
+                return;
+
+        PendingSkip skipped = pendingSkip;
+        pendingSkip.kind = NO_SKIP;
+
+        publishLoadedSong(hasErrors);
 
-        while (songLoading && !loadedNextSong && numtries < maxNumTries)
+        if (songHasErrors && currentSong != NULL)
         {
-                c_sleep(100);
-                numtries++;
+                songHasErrors = false;
+                forceSkip = true;
+
+                // Try the song after it, or before it when skipping back
+                if (skipped.kind == SKIP_TO_SONG && currentSong->next != NULL)
+                {
+                        skipToSong(currentSong->next->id, true);
+                        return;
+                }
+                else if (skipped.kind == SKIP_TO_PREV && currentSong->prev != NULL)
+                {
+                        skipToPrevSong(skipped.state);
+                        return;
+                }
+                else if (skipped.kind == SKIP_TO_NUMBER && skipped.songNumber < playlist.count)
+                {
+                        skipToNumberedSong(skipped.songNumber + 1);
+                        return;
+                }
         }
-        songLoading = false;
+
+        resetClock();
+        skip();
 }
 
 void stop(void)
@@ -1602,6 +2217,8 @@ int currentSort = 0;
 
 void sortLibrary(void)
 {
+        pthread_rwlock_wrlock(&libraryLock);
+
         if (currentSort == 0)
         {
                 sortFileSystemTree(library, compareFoldersByAgeFilesAlphabetically);
@@ -1613,9 +2230,101 @@ void sortLibrary(void)
                 currentSort = 0;
         }
 
+        // Searches report results in tree order, the next one builds the index again
+        dropSearchIndex(library);
+
+        pthread_rwlock_unlock(&libraryLock);
+
         refresh = true;
 }
 
+// Reads the tags of library files that are new or changed since the last scan
+static void indexMetadata(void)
+{
+        int count = 0;
+
+        pthread_rwlock_rdlock(&libraryLock);
+        char **paths = getFilePaths(library, &count);
+        pthread_rwlock_unlock(&libraryLock);
+
+        startMetadataIndexer(paths, count);
+}
+
+// Rereads the given directories, or all of them when paths is NULL, and patches the library in place
+void refreshLibrary(char **paths, int count)
+{
+        pthread_rwlock_rdlock(&libraryLock);
+
+        unsigned long generation = libraryGeneration;
+        LibraryChanges *changes = createLibraryChanges(library, paths, count);
+
+        pthread_rwlock_unlock(&libraryLock);
+
+        if (changes == NULL)
+                return;
+
+        // The slow part, done without holding up playback or drawing
+        readLibraryChanges(changes);
+
+        int changed = 0;
+
+        pthread_rwlock_wrlock(&libraryLock);
+
+        // Only the directories that changed get sorted again
+        if (generation == libraryGeneration)
+                changed = applyLibraryChanges(library, changes, &(appState.uiState.numDirectoryTreeEntries),
+                                              currentSort == 1 ? compareFoldersByAgeFilesAlphabetically : NULL);
+
+        // Dropped entries stay in the arena, once they are most of it the tree moves to a fresh one like after a rescan
+        FileSystemEntry *compacted = changed > 0 ? compactLibraryTree(library) : NULL;
+
+        if (compacted != NULL)
+        {
+                freeTree(library);
+                library = compacted;
+                libraryGeneration++;
+                resetChosenDir();
+                freeSearchResults();
+        }
+
+        if (changed > 0)
+                libraryRevision++;
+
+        pthread_rwlock_unlock(&libraryLock);
+
+        freeLibraryChanges(changes);
+
+        if (changed > 0)
+        {
+                refresh = true;
+
+                if (appState.uiSettings.indexMetadata)
+                        indexMetadata();
+        }
+}
+
+// (Re)starts watching every directory currently in the library
+static void watchLibrary(void)
+{
+        stopLibraryWatcher();
+
+        int count = 0;
+
+        pthread_rwlock_rdlock(&libraryLock);
+        char **paths = getDirectoryPaths(library, &count);
+        pthread_rwlock_unlock(&libraryLock);
+
+        if (paths == NULL)
+                return;
+
+        startLibraryWatcher(paths, count, refreshLibrary);
+
+        for (int i = 0; i < count; i++)
+                free(paths[i]);
+
+        free(paths);
+}
+
 void loadNextSong(void)
 {
         songLoading = true;
@@ -1655,14 +2364,7 @@ void setCurrentSongToNext(void)
 
 void finishLoading(void)
 {
-        int maxNumTries = 20;
-        int numtries = 0;
-
-        while (!loadedNextSong && numtries < maxNumTries)
-        {
-                c_sleep(100);
-                numtries++;
-        }
+        waitForSongLoader(2000);
 
         loadedNextSong = true;
 }
@@ -1776,13 +2478,16 @@ void skipToPrevSong(AppState *state)
                 return;
         }
 
+        bool replacing = isSkipPending();
+
         if (songLoading || skipping || clearingErrors)
-                if (!forceSkip)
+                if (!forceSkip && !replacing)
                         return;
 
         if (isStopped() || isPaused())
         {
-                silentSwitchToPrev(state);
+                if (!replacing)
+                        silentSwitchToPrev(state);
                 return;
         }
 
@@ -1806,32 +2511,13 @@ void skipToPrevSong(AppState *state)
 
         loadingdata.loadA = !usingSongDataA;
         loadingdata.loadingFirstDecoder = true;
-        loadSong(currentSong, &loadingdata);
-        int maxNumTries = 50;
-        int numtries = 0;
-
-        while (!loadedNextSong && numtries < maxNumTries)
-        {
-                c_sleep(100);
-                numtries++;
-        }
-
-        if (songHasErrors)
-        {
-                songHasErrors = false;
-                forceSkip = true;
-                skipToPrevSong(state);
-        }
-
-        resetClock();
-
-        skip();
+        loadSongForSkip(SKIP_TO_PREV, 0, state);
 }
 
 void skipToNumberedSong(int songNumber)
 {
         if (songLoading || !loadedNextSong || skipping || clearingErrors)
-                if (!forceSkip)
+                if (!forceSkip && !isSkipPending())
                         return;
 
         playbackPlay(&totalPauseSeconds, &pauseSeconds);
@@ -1846,26 +2532,16 @@ void skipToNumberedSong(int songNumber)
 
         loadingdata.loadA = !usingSongDataA;
         loadingdata.loadingFirstDecoder = true;
-        loadSong(currentSong, &loadingdata);
-        int maxNumTries = 50;
-        int numtries = 0;
 
-        while (!loadedNextSong && numtries < maxNumTries)
-        {
-                c_sleep(100);
-                numtries++;
-        }
-
-        if (songHasErrors)
+        if (currentSong == NULL)
         {
-                songHasErrors = false;
-                forceSkip = true;
-                if (songNumber < playlist.count)
-                        skipToNumberedSong(songNumber + 1);
+                loadSong(NULL, &loadingdata);
+                resetClock();
+                skip();
+                return;
         }
 
-        resetClock();
-        skip();
+        loadSongForSkip(SKIP_TO_NUMBER, songNumber, NULL);
 }
 
 void skipToLastSong(void)
@@ -1892,18 +2568,19 @@ void loadFirstSong(Node *song, UISettings *ui)
         loadingdata.loadingFirstDecoder = true;
         loadSong(song, &loadingdata);
 
-        int i = 0;
-        while (!loadedNextSong && i < 10000)
+        // Show progress every ten seconds, give up after a hundred
+        for (int i = 0; i < 10 && !waitForSongLoader(10000); i++)
         {
-                if (i != 0 && i % 1000 == 0 && ui->uiEnabled)
+                if (ui->uiEnabled)
+                {
                         printf(".");
-                c_sleep(10);
-                fflush(stdout);
-                i++;
+                        fflush(stdout);
+                }
         }
 }
 
-void unloadSongA(AppState *state)
+// Needs loadingdata.mutex, the loader thread fills the slots under it
+static void unloadSlotA(AppState *state)
 {
         if (userData.songdataADeleted == false)
         {
@@ -1913,7 +2590,8 @@ void unloadSongA(AppState *state)
         }
 }
 
-void unloadSongB(AppState *state)
+// Needs loadingdata.mutex
+static void unloadSlotB(AppState *state)
 {
         if (userData.songdataBDeleted == false)
         {
@@ -1923,6 +2601,20 @@ void unloadSongB(AppState *state)
         }
 }
 
+void unloadSongA(AppState *state)
+{
+        pthread_mutex_lock(&(loadingdata.mutex));
+        unloadSlotA(state);
+        pthread_mutex_unlock(&(loadingdata.mutex));
+}
+
+void unloadSongB(AppState *state)
+{
+        pthread_mutex_lock(&(loadingdata.mutex));
+        unloadSlotB(state);
+        pthread_mutex_unlock(&(loadingdata.mutex));
+}
+
 void unloadPreviousSong(AppState *state)
 {
         pthread_mutex_lock(&(loadingdata.mutex));
@@ -1931,7 +2623,7 @@ void unloadPreviousSong(AppState *state)
             (skipping || (userData.currentSongData == NULL || userData.songdataADeleted == false ||
                           (loadingdata.songdataA != NULL && userData.songdataADeleted == false && userData.currentSongData->hasErrors == 0 && userData.currentSongData->trackId != NULL && strcmp(loadingdata.songdataA->trackId, userData.currentSongData->trackId) != 0))))
         {
-                unloadSongA(state);
+                unloadSlotA(state);
 
                 if (!audioData.endOfListReached)
                         loadedNextSong = false;
@@ -1942,7 +2634,7 @@ void unloadPreviousSong(AppState *state)
                  (skipping || (userData.currentSongData == NULL || userData.songdataBDeleted == false ||
                                (loadingdata.songdataB != NULL && userData.songdataBDeleted == false && userData.currentSongData->hasErrors == 0 && userData.currentSongData->trackId != NULL && strcmp(loadingdata.songdataB->trackId, userData.currentSongData->trackId) != 0))))
         {
-                unloadSongB(state);
+                unloadSlotB(state);
 
                 if (!audioData.endOfListReached)
                         loadedNextSong = false;
@@ -1994,20 +2686,30 @@ void *updateLibraryThread(void *arg)
         if (!tmp)
         {
                 perror("createDirectoryTree");
-                pthread_mutex_unlock(&switchMutex);
                 return NULL;
         }
 
-        pthread_mutex_lock(&switchMutex);
+        pthread_rwlock_wrlock(&libraryLock);
 
         copyIsEnqueued(library, tmp);
 
         freeTree(library);
         library = tmp;
+        libraryGeneration++;
+        libraryRevision++;
         appState.uiState.numDirectoryTreeEntries = tmpDirectoryTreeEntries;
         resetChosenDir();
 
-        pthread_mutex_unlock(&switchMutex);
+        // A search during the rescan found entries of the old tree, they are gone now
+        freeSearchResults();
+
+        pthread_rwlock_unlock(&libraryLock);
+
+        if (appState.uiSettings.watchLibrary)
+                watchLibrary();
+
+        if (appState.uiSettings.indexMetadata)
+                indexMetadata();
 
         c_sleep(1000); // Don't refresh immediately or we risk the error message not clearing
         refresh = true;
@@ -2019,8 +2721,6 @@ void updateLibrary(char *path)
 {
         pthread_t threadId;
 
-        freeSearchResults();
-
         if (pthread_create(&threadId, NULL, updateLibraryThread, path) != 0)
         {
                 perror("Failed to create thread");
@@ -2070,12 +2770,14 @@ void askIfCacheLibrary(UISettings *ui)
 
 void createLibrary(AppSettings *settings, AppState *state)
 {
+        bool fromCache = false;
+
         if (state->uiSettings.cacheLibrary > 0)
         {
                 char *libFilepath = getLibraryFilePath();
                 library = reconstructTreeFromFile(libFilepath, settings->path, &(state->uiState.numDirectoryTreeEntries));
                 free(libFilepath);
-                updateLibraryIfChangedDetected();
+                fromCache = library != NULL && library->children != NULL;
         }
 
         if (library == NULL || library->children == NULL)
@@ -2106,111 +2808,42 @@ void createLibrary(AppSettings *settings, AppState *state)
 
                 setErrorMessage(message);
         }
-}
-
-time_t getModificationTime(struct stat *path_stat)
-{
 
-        if (path_stat->st_mtime != 0)
-        {
-                return path_stat->st_mtime;
-        }
-        else
-        {
-#ifdef __APPLE__
-                return path_stat->st_mtimespec.tv_sec; // macOS-specific member.
-#else
-                return path_stat->st_mtim.tv_sec; // Linux-specific member.
-#endif
-        }
+        if (fromCache || state->uiSettings.watchLibrary || state->uiSettings.indexMetadata)
+                updateLibraryIfChangedDetected(fromCache);
 }
 
-void *updateIfTopLevelFoldersMtimesChangedThread(void *arg)
+void *updateLibraryIfChangedThread(void *arg)
 {
-        UpdateLibraryThreadArgs *args = (UpdateLibraryThreadArgs *)arg; // Cast `arg` back to the structure pointer
-        char *path = args->path;
-        UISettings *ui = args->ui;
+        (void)arg;
 
-        struct stat path_stat;
+        // Only directories whose mtime moved since they were cached get reread
+        if (libraryFromCache)
+                refreshLibrary(NULL, 0);
 
-        if (stat(path, &path_stat) == -1)
-        {
-                perror("stat");
-                free(args);
-                pthread_exit(NULL);
-        }
+        if (appState.uiSettings.watchLibrary)
+                watchLibrary();
 
-        if (getModificationTime(&path_stat) > ui->lastTimeAppRan && ui->lastTimeAppRan > 0)
-        {
-                updateLibrary(path);
-                free(args);
-                pthread_exit(NULL);
-        }
-
-        DIR *dir = opendir(path);
-        if (!dir)
-        {
-                perror("opendir");
-                free(args);
-                pthread_exit(NULL);
-        }
-
-        struct dirent *entry;
-        while ((entry = readdir(dir)) != NULL)
-        {
-
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                {
-                        continue;
-                }
+        if (appState.uiSettings.indexMetadata)
+                indexMetadata();
 
-                char fullPath[1024];
-                snprintf(fullPath, sizeof(fullPath), "%s/%s", path, entry->d_name);
-
-                if (stat(fullPath, &path_stat) == -1)
-                {
-                        perror("stat");
-                        continue;
-                }
-
-                if (S_ISDIR(path_stat.st_mode))
-                {
-
-                        if (getModificationTime(&path_stat) > ui->lastTimeAppRan && ui->lastTimeAppRan > 0)
-                        {
-                                updateLibrary(path);
-                                break;
-                        }
-                }
-        }
-
-        closedir(dir);
-
-        free(args);
-
-        pthread_exit(NULL);
+        return NULL;
 }
 
-// This only checks the library mtime and toplevel subfolders mtimes
-void updateLibraryIfChangedDetected(void)
+// Brings a cached library up to date and starts watching it for changes
+void updateLibraryIfChangedDetected(bool fromCache)
 {
         pthread_t tid;
 
-        UpdateLibraryThreadArgs *args = malloc(sizeof(UpdateLibraryThreadArgs));
-        if (args == NULL)
-        {
-                perror("malloc");
-                return;
-        }
-
-        args->path = settings.path;
-        args->ui = &(appState.uiSettings);
+        libraryFromCache = fromCache;
 
-        if (pthread_create(&tid, NULL, updateIfTopLevelFoldersMtimesChangedThread, (void *)args) != 0)
+        if (pthread_create(&tid, NULL, updateLibraryIfChangedThread, NULL) != 0)
         {
                 perror("pthread_create");
-                free(args);
+                return;
         }
+
+        pthread_detach(tid);
 }
 
 // Go through the display playlist and the shuffle playlist to remove all songs except the current one.
@@ -2232,6 +2865,7 @@ void updatePlaylistToPlayingSong(void)
         }
 
         int nextInPlaylistID;
+        pthread_rwlock_rdlock(&libraryLock);
         pthread_mutex_lock(&(playlist.mutex));
         Node *songToBeRemoved;
         Node *nextInPlaylist = unshuffledPlaylist->head;
@@ -2268,6 +2902,7 @@ void updatePlaylistToPlayingSong(void)
 
         }
         pthread_mutex_unlock(&(playlist.mutex));
+        pthread_rwlock_unlock(&libraryLock);
 
         nextSongNeedsRebuilding = true;
         nextSong = NULL;
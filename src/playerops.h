@@ -57,6 +57,7 @@ Node *getNextSong(void);
 
 void handleRemove(void);
 
+// Needs the library read locked and the playlist locked
 FileSystemEntry *enqueueSongs(FileSystemEntry *entry, UIState *uis);
 
 void resetStartTime(void);
@@ -101,6 +102,20 @@ void skipToLastSong(void);
 
 void loadSong(Node *song, LoadingThreadData *loadingdata);
 
+void startSongLoader(void);
+
+void stopSongLoader(void);
+
+void setSongLoadedCallback(GSourceFunc callback);
+
+bool waitForSongLoader(int timeoutMilliseconds);
+
+// True while a skip waits on the loader, a new skip replaces it
+bool isSkipPending(void);
+
+// Switches to the song a skip loaded, or tries the next one if it couldn't be. Call from the main loop once the loader is done.
+void finishPendingSkip(void);
+
 int loadFirst(Node *song, AppState *state);
 
 void flushSeek(void);
@@ -143,7 +158,9 @@ void reshufflePlaylist(void);
 
 bool determineCurrentSongData(SongData **currentSongData);
 
-void updateLibraryIfChangedDetected(void);
+void updateLibraryIfChangedDetected(bool fromCache);
+
+void refreshLibrary(char **paths, int count);
 
 double getCurrentSongDuration(void);
 
@@ -161,8 +178,20 @@ void skipToBegginningOfSong(void);
 
 void sortLibrary(void);
 
+// Needs the library read locked, the library watcher may be patching it
 void markListAsEnqueued(FileSystemEntry *root, PlayList *playlist);
 
+// Picks the songs to stream out of the library, which is read locked while it runs
+typedef FileSystemEntry **(*LibrarySongCollector)(FileSystemEntry *root, int *count);
+
+// Enqueues the first songs now and the rest a batch at a time from the main loop. The songs come from collect.
+// With shuffle each song is drawn at random when it's enqueued. An endless stream starts over when
+// it runs out and only keeps a few songs ahead of the current one.
+void streamSongsToPlaylist(LibrarySongCollector collect, bool shuffle, bool endless);
+
+// Stops adding the rest of the songs
+void cancelPlaylistStream(void);
+
 bool isContainedWithin(FileSystemEntry *entry, FileSystemEntry *containingEntry);
 
 void addToFavoritesPlaylist(void);
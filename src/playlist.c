@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "file.h"
+#include "librarymetadata.h"
 #include "utils.h"
 #include "playlist.h"
 
@@ -30,7 +31,7 @@ const char lastUsedPlaylistName[] = "lastPlaylist.m3u";
 PlayList *unshuffledPlaylist = NULL;
 
 // The (sometimes shuffled) sequence of songs that will be played
-PlayList playlist = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+PlayList playlist = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, NULL};
 
 // The playlist from kew favorites .m3u
 PlayList *favoritesPlaylist = NULL;
@@ -42,6 +43,247 @@ int numDirs = 0;
 volatile int stopPlaylistDurationThread = 0;
 Node *currentSong = NULL;
 int nodeIdCounter = 0;
+static bool albumShuffle = false;
+
+typedef struct PlayListChunk
+{
+        int first; // Row of nodes[0]
+        int count;
+        Node *nodes[PLAYLIST_CHUNK_SIZE];
+} PlayListChunk;
+
+// Rows are kept in chunks so inserting or removing only shifts one chunk and renumbers the rest
+struct PlayListIndex
+{
+        GHashTable *ids; // Id -> Node
+        PlayListChunk **chunks;
+        int numChunks;
+        int capacity;
+};
+
+static void freeIndex(PlayList *list)
+{
+        PlayListIndex *index = list->index;
+
+        if (index == NULL)
+                return;
+
+        for (int i = 0; i < index->numChunks; i++)
+                free(index->chunks[i]);
+
+        free(index->chunks);
+        g_hash_table_destroy(index->ids);
+        free(index);
+
+        list->index = NULL;
+}
+
+static PlayListChunk *insertChunk(PlayListIndex *index, int pos)
+{
+        if (index->numChunks == index->capacity)
+        {
+                int capacity = (index->capacity == 0) ? 16 : index->capacity * 2;
+                PlayListChunk **chunks = realloc(index->chunks, capacity * sizeof(PlayListChunk *));
+
+                if (chunks == NULL)
+                        return NULL;
+
+                index->chunks = chunks;
+                index->capacity = capacity;
+        }
+
+        PlayListChunk *chunk = malloc(sizeof(PlayListChunk));
+
+        if (chunk == NULL)
+                return NULL;
+
+        chunk->first = 0;
+        chunk->count = 0;
+
+        memmove(&index->chunks[pos + 1], &index->chunks[pos], (index->numChunks - pos) * sizeof(PlayListChunk *));
+        index->chunks[pos] = chunk;
+        index->numChunks++;
+
+        return chunk;
+}
+
+// Updates the first rows of the chunks from pos on
+static void renumberChunks(PlayListIndex *index, int pos)
+{
+        if (pos <= 0 && index->numChunks > 0)
+                index->chunks[0]->first = 0;
+
+        for (int i = (pos > 0) ? pos : 1; i < index->numChunks; i++)
+                index->chunks[i]->first = index->chunks[i - 1]->first + index->chunks[i - 1]->count;
+}
+
+// Position in the chunk array of the chunk holding the row, the last chunk if the row is past the end
+static int findChunk(PlayListIndex *index, int row)
+{
+        int low = 0;
+        int high = index->numChunks - 1;
+
+        while (low < high)
+        {
+                int mid = low + (high - low + 1) / 2;
+
+                if (index->chunks[mid]->first <= row)
+                        low = mid;
+                else
+                        high = mid - 1;
+        }
+
+        return low;
+}
+
+static int findInChunk(const PlayListChunk *chunk, const Node *node)
+{
+        for (int i = 0; i < chunk->count; i++)
+        {
+                if (chunk->nodes[i] == node)
+                        return i;
+        }
+
+        return -1;
+}
+
+static void exitOnAllocationError(void)
+{
+        printf("Memory allocation error.\n");
+        exit(0);
+}
+
+static void indexInsert(PlayList *list, Node *node, int row)
+{
+        PlayListIndex *index = list->index;
+        int pos = (index->numChunks > 0) ? findChunk(index, row) : 0;
+
+        if (index->numChunks == 0 && insertChunk(index, 0) == NULL)
+                exitOnAllocationError();
+
+        PlayListChunk *chunk = index->chunks[pos];
+
+        if (chunk->count == PLAYLIST_CHUNK_SIZE)
+        {
+                // Split in two, moving the second half into a new chunk
+                PlayListChunk *next = insertChunk(index, pos + 1);
+
+                if (next == NULL)
+                        exitOnAllocationError();
+
+                int half = PLAYLIST_CHUNK_SIZE / 2;
+
+                next->count = chunk->count - half;
+                memcpy(next->nodes, &chunk->nodes[half], next->count * sizeof(Node *));
+                chunk->count = half;
+                next->first = chunk->first + half;
+
+                for (int i = 0; i < next->count; i++)
+                        next->nodes[i]->chunk = next;
+
+                if (row > next->first)
+                {
+                        pos++;
+                        chunk = next;
+                }
+        }
+
+        int offset = row - chunk->first;
+
+        memmove(&chunk->nodes[offset + 1], &chunk->nodes[offset], (chunk->count - offset) * sizeof(Node *));
+        chunk->nodes[offset] = node;
+        chunk->count++;
+        node->chunk = chunk;
+
+        renumberChunks(index, pos + 1);
+
+        g_hash_table_insert(index->ids, GINT_TO_POINTER(node->id), node);
+}
+
+static void indexRemove(PlayList *list, Node *node)
+{
+        PlayListIndex *index = list->index;
+        PlayListChunk *chunk = node->chunk;
+        int pos = findChunk(index, chunk->first);
+        int offset = findInChunk(chunk, node);
+
+        if (offset < 0)
+                return;
+
+        chunk->count--;
+        memmove(&chunk->nodes[offset], &chunk->nodes[offset + 1], (chunk->count - offset) * sizeof(Node *));
+
+        if (chunk->count == 0)
+        {
+                free(chunk);
+                index->numChunks--;
+                memmove(&index->chunks[pos], &index->chunks[pos + 1], (index->numChunks - pos) * sizeof(PlayListChunk *));
+                renumberChunks(index, pos);
+        }
+        else
+        {
+                renumberChunks(index, pos + 1);
+        }
+
+        if (g_hash_table_lookup(index->ids, GINT_TO_POINTER(node->id)) == node)
+                g_hash_table_remove(index->ids, GINT_TO_POINTER(node->id));
+}
+
+// The nodes are next to each other, a comes first
+static void indexSwap(PlayList *list, Node *a, Node *b)
+{
+        if (list->index == NULL)
+                return;
+
+        PlayListChunk *chunkA = a->chunk;
+        PlayListChunk *chunkB = b->chunk;
+        int offsetA = findInChunk(chunkA, a);
+        int offsetB = findInChunk(chunkB, b);
+
+        chunkA->nodes[offsetA] = b;
+        chunkB->nodes[offsetB] = a;
+        a->chunk = chunkB;
+        b->chunk = chunkA;
+}
+
+static PlayListIndex *getIndex(PlayList *list)
+{
+        if (list->index != NULL)
+                return list->index;
+
+        PlayListIndex *index = calloc(1, sizeof(PlayListIndex));
+
+        if (index == NULL)
+                exitOnAllocationError();
+
+        index->ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+        list->index = index;
+
+        PlayListChunk *chunk = NULL;
+        int row = 0;
+
+        for (Node *node = list->head; node != NULL; node = node->next, row++)
+        {
+                if (chunk == NULL || chunk->count == PLAYLIST_CHUNK_SIZE)
+                {
+                        chunk = insertChunk(index, index->numChunks);
+
+                        if (chunk == NULL)
+                                exitOnAllocationError();
+
+                        chunk->first = row;
+                }
+
+                chunk->nodes[chunk->count++] = node;
+                node->chunk = chunk;
+
+                // An id only appears once in a list, but keep the first like a walk would
+                if (!g_hash_table_contains(index->ids, GINT_TO_POINTER(node->id)))
+                        g_hash_table_insert(index->ids, GINT_TO_POINTER(node->id), node);
+        }
+
+        return index;
+}
 
 Node *getListNext(Node *node)
 {
@@ -55,9 +297,6 @@ Node *getListPrev(Node *node)
 
 void addToList(PlayList *list, Node *newNode)
 {
-        if (list->count >= MAX_FILES)
-                return;
-
         list->count++;
 
         if (list->head == NULL)
@@ -72,6 +311,9 @@ void addToList(PlayList *list, Node *newNode)
                 list->tail->next = newNode;
                 list->tail = newNode;
         }
+
+        if (list->index != NULL)
+                indexInsert(list, newNode, list->count - 1);
 }
 
 void moveUpList(PlayList *list, Node *node)
@@ -82,6 +324,8 @@ void moveUpList(PlayList *list, Node *node)
         Node *prevNode = node->prev;
         Node *nextNode = node->next;
 
+        indexSwap(list, prevNode, node);
+
         if (prevNode->prev)
                 prevNode->prev->next = node;
         else
@@ -108,6 +352,8 @@ void moveDownList(PlayList *list, Node *node)
         Node *prevNode = node->prev;
         Node *nextNextNode = nextNode->next;
 
+        indexSwap(list, node, nextNode);
+
         if (prevNode)
                 prevNode->next = nextNode;
         else
@@ -130,6 +376,9 @@ Node *deleteFromList(PlayList *list, Node *node)
         if (list->head == NULL || node == NULL)
                 return NULL;
 
+        if (list->index != NULL)
+                indexRemove(list, node);
+
         if (list->head == node)
         {
                 list->head = node->next;
@@ -148,7 +397,9 @@ Node *deleteFromList(PlayList *list, Node *node)
                 node->next->prev = node->prev;
 
         if (node->song.filePath != NULL)
-                free(node->song.filePath);
+                g_ref_string_release(node->song.filePath);
+        if (node->song.title != NULL)
+                g_ref_string_release(node->song.title);
 
         Node *nextNode = node->next;
 
@@ -166,18 +417,139 @@ void deletePlaylist(PlayList *list)
         while (current != NULL)
         {
                 Node *next = current->next;
-                free(current->song.filePath);
+                g_ref_string_release(current->song.filePath);
+                if (current->song.title != NULL)
+                        g_ref_string_release(current->song.title);
                 free(current);
                 current = next;
         }
 
+        freeIndex(list);
+
         // Reset the playlist
         list->head = NULL;
         list->tail = NULL;
         list->count = 0;
 }
 
-void shufflePlaylist(PlayList *playlist)
+void setAlbumShuffle(bool enabled)
+{
+        albumShuffle = enabled;
+}
+
+// Length of the directory part of a path
+static size_t getDirLength(const char *path)
+{
+        const char *slash = strrchr(path, '/');
+
+        return (slash != NULL) ? (size_t)(slash - path) : 0;
+}
+
+// Puts the albums in random order with the album of first, if given, at the front.
+// The songs of an album keep the order they had.
+static void shuffleAlbumNodes(Node **nodes, int count, Node *first)
+{
+        int *albumOf = malloc(count * sizeof(int));
+        int *albumStart = malloc((count + 1) * sizeof(int));
+        int *albumFill = malloc(count * sizeof(int));
+        Node **grouped = malloc(count * sizeof(Node *));
+
+        if (albumOf == NULL || albumStart == NULL || albumFill == NULL || grouped == NULL)
+        {
+                printf("Memory allocation error.\n");
+                exit(0);
+        }
+
+        // Songs in the same directory are an album
+        GHashTable *albums = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        char dir[MAXPATHLEN];
+        int numAlbums = 0;
+        int firstAlbum = -1;
+
+        for (int i = 0; i < count; i++)
+        {
+                const char *path = nodes[i]->song.filePath;
+                size_t len = getDirLength(path);
+                gpointer album = NULL;
+
+                if (len >= sizeof(dir))
+                        len = sizeof(dir) - 1;
+
+                memcpy(dir, path, len);
+                dir[len] = '\0';
+
+                if (g_hash_table_lookup_extended(albums, dir, NULL, &album))
+                {
+                        albumOf[i] = GPOINTER_TO_INT(album);
+                }
+                else
+                {
+                        albumOf[i] = numAlbums;
+                        g_hash_table_insert(albums, g_strdup(dir), GINT_TO_POINTER(numAlbums));
+                        numAlbums++;
+                }
+
+                if (nodes[i] == first)
+                        firstAlbum = albumOf[i];
+        }
+
+        g_hash_table_destroy(albums);
+
+        // Group the songs by album, keeping their order
+        memset(albumStart, 0, (numAlbums + 1) * sizeof(int));
+
+        for (int i = 0; i < count; i++)
+                albumStart[albumOf[i] + 1]++;
+
+        for (int a = 0; a < numAlbums; a++)
+        {
+                albumStart[a + 1] += albumStart[a];
+                albumFill[a] = albumStart[a];
+        }
+
+        for (int i = 0; i < count; i++)
+                grouped[albumFill[albumOf[i]]++] = nodes[i];
+
+        // Shuffle the album order, albumFill is free again
+        RandomState *random = getShuffleRandomState();
+        int *order = albumFill;
+
+        for (int a = 0; a < numAlbums; a++)
+                order[a] = a;
+
+        for (int a = numAlbums - 1; a >= 1; --a)
+        {
+                int k = getRandomBelow(random, a + 1);
+                int tmp = order[a];
+                order[a] = order[k];
+                order[k] = tmp;
+        }
+
+        for (int a = 0; a < numAlbums && firstAlbum >= 0; a++)
+        {
+                if (order[a] == firstAlbum)
+                {
+                        order[a] = order[0];
+                        order[0] = firstAlbum;
+                        break;
+                }
+        }
+
+        int k = 0;
+
+        for (int a = 0; a < numAlbums; a++)
+        {
+                for (int j = albumStart[order[a]]; j < albumStart[order[a] + 1]; j++)
+                        nodes[k++] = grouped[j];
+        }
+
+        free(grouped);
+        free(albumFill);
+        free(albumStart);
+        free(albumOf);
+}
+
+static void shuffleNodes(PlayList *playlist, Node *first)
 {
         if (playlist == NULL || playlist->count <= 1)
         {
@@ -200,14 +572,25 @@ void shufflePlaylist(PlayList *playlist)
                 current = current->next;
         }
 
-        // Shuffle the array using Fisher-Yates algorithm
-        for (int j = playlist->count - 1; j >= 1; --j)
+        if (albumShuffle)
         {
-                int k = rand() % (j + 1);
-                Node *tmp = nodes[j];
-                nodes[j] = nodes[k];
-                nodes[k] = tmp;
+                shuffleAlbumNodes(nodes, playlist->count, first);
         }
+        else
+        {
+                // Shuffle the array using Fisher-Yates algorithm
+                RandomState *random = getShuffleRandomState();
+
+                for (int j = playlist->count - 1; j >= 1; --j)
+                {
+                        int k = getRandomBelow(random, j + 1);
+                        Node *tmp = nodes[j];
+                        nodes[j] = nodes[k];
+                        nodes[k] = tmp;
+                }
+        }
+        freeIndex(playlist);
+
         playlist->head = nodes[0];
         playlist->tail = nodes[playlist->count - 1];
         for (int j = 0; j < playlist->count; ++j)
@@ -218,6 +601,11 @@ void shufflePlaylist(PlayList *playlist)
         free(nodes);
 }
 
+void shufflePlaylist(PlayList *playlist)
+{
+        shuffleNodes(playlist, NULL);
+}
+
 void insertAsFirst(Node *currentSong, PlayList *playlist)
 {
         if (currentSong == NULL || playlist == NULL)
@@ -236,6 +624,9 @@ void insertAsFirst(Node *currentSong, PlayList *playlist)
         {
                 if (currentSong != playlist->head)
                 {
+                        if (playlist->index != NULL)
+                                indexRemove(playlist, currentSong);
+
                         if (currentSong->next != NULL)
                         {
                                 currentSong->next->prev = currentSong->prev;
@@ -255,12 +646,22 @@ void insertAsFirst(Node *currentSong, PlayList *playlist)
                         currentSong->prev = NULL;
                         playlist->head->prev = currentSong;
                         playlist->head = currentSong;
+
+                        if (playlist->index != NULL)
+                                indexInsert(playlist, currentSong, 0);
                 }
         }
 }
 
 void shufflePlaylistStartingFromSong(PlayList *playlist, Node *song)
 {
+        // The rest of the album of the song plays first
+        if (albumShuffle)
+        {
+                shuffleNodes(playlist, song);
+                return;
+        }
+
         shufflePlaylist(playlist);
         if (song != NULL && playlist->count > 1)
         {
@@ -271,14 +672,15 @@ void shufflePlaylistStartingFromSong(PlayList *playlist, Node *song)
 void createNode(Node **node, const char *directoryPath, int id)
 {
         SongInfo song;
-        song.filePath = strdup(directoryPath);
-        song.duration = 0.0;
+        song.filePath = g_ref_string_new(directoryPath);
+        song.title = NULL;
+        song.duration = getIndexedDuration(directoryPath);
 
         *node = (Node *)malloc(sizeof(Node));
         if (*node == NULL)
         {
                 printf("Failed to allocate memory.");
-                free(song.filePath);
+                g_ref_string_release(song.filePath);
                 exit(0);
                 return;
         }
@@ -286,6 +688,7 @@ void createNode(Node **node, const char *directoryPath, int id)
         (*node)->song = song;
         (*node)->next = NULL;
         (*node)->prev = NULL;
+        (*node)->chunk = NULL;
         (*node)->id = id;
 }
 
@@ -326,7 +729,7 @@ void buildPlaylistRecursive(const char *directoryPath, const char *allowedExtens
                 return;
         }
 
-        for (int i = 0; i < numEntries && playlist->count < MAX_FILES; i++)
+        for (int i = 0; i < numEntries; i++)
         {
                 struct dirent *entry = entries[i];
 
@@ -376,6 +779,9 @@ int joinPlaylist(PlayList *dest, PlayList *src)
                 return 0;
         }
 
+        freeIndex(dest);
+        freeIndex(src);
+
         if (dest->count == 0)
         {
                 dest->head = src->head;
@@ -413,62 +819,242 @@ void makePlaylistName(const char *search, int maxSize)
         }
 }
 
-void readM3UFile(const char *filename, PlayList *playlist, FileSystemEntry *library)
+typedef struct
 {
-        GError *error = NULL;
-        gchar *contents;
-        gchar **lines;
+        char *path;
+        char *title; // From the #EXTINF line before it, can be NULL
+        double duration;
+        bool exists;
+} M3UEntry;
 
-        if (!g_file_get_contents(filename, &contents, NULL, &error))
+typedef struct
+{
+        M3UEntry *entries;
+        int *unchecked; // Entries that aren't in the library
+        int count;
+        int first;
+        int step;
+} ExistsCheck;
+
+static void *checkExists(void *arg)
+{
+        ExistsCheck *check = (ExistsCheck *)arg;
+
+        for (int i = check->first; i < check->count; i += check->step)
         {
-                g_clear_error(&error);
-                return;
+                M3UEntry *entry = &check->entries[check->unchecked[i]];
+                entry->exists = (existsFile(entry->path) >= 0);
         }
 
-        gchar *directory = g_path_get_dirname(filename);
+        return NULL;
+}
 
-        lines = g_strsplit(contents, "\n", -1);
+// Looks for the files the library doesn't know about, spread over a few threads when there are many
+static void checkUncheckedEntries(M3UEntry *entries, int *unchecked, int count)
+{
+        int numThreads = count / 64 + 1;
+
+        if (numThreads > M3U_CHECK_THREADS)
+                numThreads = M3U_CHECK_THREADS;
+
+        pthread_t threads[M3U_CHECK_THREADS];
+        ExistsCheck checks[M3U_CHECK_THREADS];
+        bool started[M3U_CHECK_THREADS] = {false};
 
-        for (gint i = 0; lines[i] != NULL; i++)
+        for (int t = 0; t < numThreads; t++)
         {
-                gchar *line = lines[i];
+                checks[t].entries = entries;
+                checks[t].unchecked = unchecked;
+                checks[t].count = count;
+                checks[t].first = t;
+                checks[t].step = numThreads;
+        }
 
-                line = g_strdelimit(line, "\r", '\0');
-                gchar *trimmed_line = g_strstrip(line);
+        // This thread takes the first share, and any share a thread couldn't be started for
+        for (int t = 1; t < numThreads; t++)
+                started[t] = (pthread_create(&threads[t], NULL, checkExists, &checks[t]) == 0);
 
-                if (trimmed_line[0] != '#' && trimmed_line[0] != '\0')
+        for (int t = 0; t < numThreads; t++)
+        {
+                if (!started[t])
+                        checkExists(&checks[t]);
+        }
+
+        for (int t = 1; t < numThreads; t++)
+        {
+                if (started[t])
+                        pthread_join(threads[t], NULL);
+        }
+}
+
+// #EXTINF:<seconds> <attributes>,<title>, returns the title or NULL
+static char *parseExtInf(const char *info, double *duration)
+{
+        char *end = NULL;
+        *duration = strtod(info, &end);
+
+        if (end == info || *duration < 0.0)
+                *duration = 0.0;
+
+        // Attribute values can have commas in quotes
+        bool quoted = false;
+
+        for (const char *c = end; *c != '\0'; c++)
+        {
+                if (*c == '"')
+                        quoted = !quoted;
+                else if (*c == ',' && !quoted)
                 {
-                        gchar *songPath;
+                        char *title = g_strstrip(g_strdup(c + 1));
 
-                        if (g_path_is_absolute(trimmed_line))
-                        {
-                                songPath = g_strdup(trimmed_line);
-                        }
-                        else
+                        if (title[0] != '\0')
+                                return title;
+
+                        g_free(title);
+                        return NULL;
+                }
+        }
+
+        return NULL;
+}
+
+void readM3UFile(const char *filename, PlayList *playlist, FileSystemEntry *library)
+{
+        FILE *file = fopen(filename, "r");
+
+        if (file == NULL)
+                return;
+
+        gchar *directory = g_path_get_dirname(filename);
+        M3UEntry *entries = NULL;
+        int count = 0;
+        int capacity = 0;
+        int numUnchecked = 0;
+        char *title = NULL;
+        double duration = 0.0;
+
+        char *line = NULL;
+        size_t lineSize = 0;
+        bool firstLine = true;
+
+        while (getline(&line, &lineSize, file) != -1)
+        {
+                char *trimmed = line;
+
+                // Byte order mark of an .m3u8 saved by some editors
+                if (firstLine && strncmp(trimmed, "\xEF\xBB\xBF", 3) == 0)
+                        trimmed += 3;
+
+                firstLine = false;
+                trimmed = g_strstrip(trimmed);
+
+                if (trimmed[0] == '\0')
+                        continue;
+
+                if (trimmed[0] == '#')
+                {
+                        if (strncmp(trimmed, "#EXTINF:", 8) == 0)
                         {
-                                songPath = g_build_filename(directory, trimmed_line, NULL);
+                                g_free(title);
+                                title = parseExtInf(trimmed + 8, &duration);
                         }
 
-                        if (songPath == NULL)
-                                continue;
+                        continue;
+                }
 
-                        if (existsFile(songPath) < 0)
-                                continue;
+                gchar *songPath = g_path_is_absolute(trimmed) ? g_strdup(trimmed) : g_build_filename(directory, trimmed, NULL);
+
+                if (songPath == NULL)
+                        continue;
+
+                bool exists = false;
+
+                // Songs in the library are known to exist, no need to look for them on disk
+                if (library != NULL)
+                {
+                        FileSystemEntry *entry = findCorrespondingEntry(library, songPath);
 
                         // Don't add songs that are already enqueued
-                        if (library != NULL)
+                        if (entry != NULL && entry->isEnqueued)
                         {
-                                FileSystemEntry *entry = findCorrespondingEntry(library, songPath);
+                                g_free(songPath);
+                                g_free(title);
+                                title = NULL;
+                                duration = 0.0;
+                                continue;
+                        }
 
-                                if (entry != NULL && entry->isEnqueued)
-                                {
-                                        g_free(songPath);
-                                        continue;
-                                }
+                        exists = (entry != NULL);
+                }
+
+                if (count == capacity)
+                {
+                        capacity = (capacity == 0) ? 256 : capacity * 2;
+                        M3UEntry *tmp = realloc(entries, capacity * sizeof(M3UEntry));
+
+                        if (tmp == NULL)
+                        {
+                                printf("Memory allocation error.\n");
+                                exit(0);
                         }
 
+                        entries = tmp;
+                }
+
+                entries[count].path = songPath;
+                entries[count].title = title;
+                entries[count].duration = duration;
+                entries[count].exists = exists;
+                count++;
+
+                if (!exists)
+                        numUnchecked++;
+
+                title = NULL;
+                duration = 0.0;
+        }
+
+        free(line);
+        fclose(file);
+        g_free(title);
+        g_free(directory);
+
+        if (numUnchecked > 0)
+        {
+                int *unchecked = malloc(numUnchecked * sizeof(int));
+
+                if (unchecked == NULL)
+                {
+                        printf("Memory allocation error.\n");
+                        exit(0);
+                }
+
+                for (int i = 0, j = 0; i < count; i++)
+                {
+                        if (!entries[i].exists)
+                                unchecked[j++] = i;
+                }
+
+                checkUncheckedEntries(entries, unchecked, numUnchecked);
+
+                free(unchecked);
+        }
+
+        freeIndex(playlist);
+
+        for (int i = 0; i < count; i++)
+        {
+                if (entries[i].exists)
+                {
                         Node *newNode = NULL;
-                        createNode(&newNode, songPath, nodeIdCounter++);
+                        createNode(&newNode, entries[i].path, nodeIdCounter++);
+
+                        // The playlist's own duration until the file is scanned
+                        if (newNode->song.duration <= 0.0)
+                                newNode->song.duration = entries[i].duration;
+
+                        if (entries[i].title != NULL)
+                                newNode->song.title = g_ref_string_new(entries[i].title);
 
                         if (playlist->head == NULL)
                         {
@@ -483,23 +1069,22 @@ void readM3UFile(const char *filename, PlayList *playlist, FileSystemEntry *libr
                         }
 
                         playlist->count++;
-
-                        g_free(songPath);
                 }
+
+                g_free(entries[i].path);
+                g_free(entries[i].title);
         }
 
-        g_free(directory);
-        g_strfreev(lines);
-        g_free(contents);
+        free(entries);
 }
 
-int makePlaylist(int argc, char *argv[], bool exactSearch, const char *path)
+int makePlaylist(int argc, char *argv[], bool exactSearch, const char *path, FileSystemEntry *library)
 {
         enum SearchType searchType = SearchAny;
         int searchTypeIndex = 1;
 
         const char *delimiter = ":";
-        PlayList partialPlaylist = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+        PlayList partialPlaylist = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, NULL};
 
         const char *allowedExtensions = MUSIC_FILE_EXTENSIONS;
 
@@ -582,7 +1167,7 @@ int makePlaylist(int argc, char *argv[], bool exactSearch, const char *path)
                         {
                                 if (strcmp(argv[1], "list") == 0)
                                 {
-                                        readM3UFile(buf, &playlist, NULL);
+                                        readM3UFile(buf, &playlist, library);
                                 }
                                 else
                                 {
@@ -661,6 +1246,10 @@ void writeM3UFile(const char *filename, const PlayList *playlist)
         Node *currentNode = playlist->head;
         while (currentNode != NULL)
         {
+                // Keep the titles the songs came with
+                if (currentNode->song.title != NULL)
+                        fprintf(file, "#EXTINF:%d,%s\n", (currentNode->song.duration > 0.0) ? (int)currentNode->song.duration : -1, currentNode->song.title);
+
                 fprintf(file, "%s\n", currentNode->song.filePath);
                 currentNode = currentNode->next;
         }
@@ -693,6 +1282,7 @@ void loadPlaylist(const char *directory, const char *playlistName, PlayList *pla
         playlist->count = 0;
         playlist->head = NULL;
         playlist->tail = NULL;
+        playlist->index = NULL;
         readM3UFile(playlistPath, playlist, NULL);
 }
 
@@ -787,51 +1377,30 @@ void exportCurrentPlaylist(const char *path)
         savePlaylist(m3uFilename, &playlist);
 }
 
-Node *deepCopyNode(Node *originalNode)
+Node *copyNode(const Node *originalNode)
 {
-        if (originalNode == NULL)
-        {
-                return NULL;
-        }
-
         Node *newNode = malloc(sizeof(Node));
 
         if (newNode == NULL)
         {
-                return NULL;
+                printf("Failed to allocate memory.");
+                exit(0);
         }
 
-        newNode->song.filePath = strdup(originalNode->song.filePath);
+        newNode->song.filePath = g_ref_string_acquire(originalNode->song.filePath);
+        newNode->song.title = (originalNode->song.title != NULL) ? g_ref_string_acquire(originalNode->song.title) : NULL;
         newNode->song.duration = originalNode->song.duration;
-        newNode->prev = NULL;
         newNode->id = originalNode->id;
-        newNode->next = deepCopyNode(originalNode->next);
-
-        if (newNode->next != NULL)
-        {
-                newNode->next->prev = newNode;
-        }
+        newNode->next = NULL;
+        newNode->prev = NULL;
+        newNode->chunk = NULL;
 
         return newNode;
 }
 
-Node *findTail(Node *head)
-{
-        if (head == NULL)
-                return NULL;
-
-        Node *current = head;
-        while (current->next != NULL)
-        {
-                current = current->next;
-        }
-
-        return current;
-}
-
 PlayList deepCopyPlayList(PlayList *originalList)
 {
-        PlayList newList = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+        PlayList newList = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, NULL};
 
         deepCopyPlayListOntoList(originalList, &newList);
         return newList;
@@ -844,9 +1413,78 @@ void deepCopyPlayListOntoList(PlayList *originalList, PlayList *newList)
                 return;
         }
 
-        newList->head = deepCopyNode(originalList->head);
-        newList->tail = findTail(newList->head);
-        newList->count = originalList->count;
+        freeIndex(newList);
+
+        newList->head = NULL;
+        newList->tail = NULL;
+        newList->count = 0;
+
+        for (Node *node = originalList->head; node != NULL; node = node->next)
+        {
+                Node *newNode = copyNode(node);
+
+                newNode->prev = newList->tail;
+
+                if (newList->tail != NULL)
+                        newList->tail->next = newNode;
+                else
+                        newList->head = newNode;
+
+                newList->tail = newNode;
+                newList->count++;
+        }
+}
+
+void orderPlaylistLike(PlayList *list, PlayList *order)
+{
+        if (list->count <= 1)
+                return;
+
+        Node **nodes = malloc(list->count * sizeof(Node *));
+        bool *placed = calloc(list->count, sizeof(bool));
+
+        if (nodes == NULL || placed == NULL)
+        {
+                printf("Memory allocation error.\n");
+                exit(0);
+        }
+
+        int count = 0;
+
+        for (Node *node = order->head; node != NULL && count < list->count; node = node->next)
+        {
+                Node *found = NULL;
+                int row = findNodeInList(list, node->id, &found);
+
+                if (found != NULL && !placed[row])
+                {
+                        placed[row] = true;
+                        nodes[count++] = found;
+                }
+        }
+
+        // Anything the order doesn't have stays at the end
+        int row = 0;
+
+        for (Node *node = list->head; node != NULL; node = node->next, row++)
+        {
+                if (!placed[row])
+                        nodes[count++] = node;
+        }
+
+        freeIndex(list);
+
+        list->head = nodes[0];
+        list->tail = nodes[count - 1];
+
+        for (int i = 0; i < count; i++)
+        {
+                nodes[i]->next = (i < count - 1) ? nodes[i + 1] : NULL;
+                nodes[i]->prev = (i > 0) ? nodes[i - 1] : NULL;
+        }
+
+        free(placed);
+        free(nodes);
 }
 
 Node *findPathInPlaylist(const char *path, PlayList *playlist)
@@ -883,60 +1521,31 @@ Node *findLastPathInPlaylist(const char *path, PlayList *playlist)
 
 int findNodeInList(PlayList *list, int id, Node **foundNode)
 {
-        Node *node = list->head;
-        int row = 0;
-
-        while (node != NULL)
-        {
-                if (id == node->id)
-                {
-                        *foundNode = node;
-                        return row;
-                }
+        *foundNode = NULL;
 
-                node = node->next;
-                row++;
-        }
+        if (list->head == NULL)
+                return -1;
 
-        *foundNode = NULL;
+        Node *node = g_hash_table_lookup(getIndex(list)->ids, GINT_TO_POINTER(id));
 
-        return -1;
-}
+        if (node == NULL)
+                return -1;
 
-void addSongToPlayList(PlayList *list, const char *filePath, int playlistMax)
-{
-        if (list->count >= playlistMax)
-                return;
+        *foundNode = node;
 
-        Node *newNode = NULL;
-        createNode(&newNode, filePath, list->count);
-        addToList(list, newNode);
+        return node->chunk->first + findInChunk(node->chunk, node);
 }
 
-void traverseFileSystemEntry(FileSystemEntry *entry, PlayList *list, int playlistMax)
+Node *findNodeAtRow(PlayList *list, int row)
 {
-        if (entry == NULL || list->count >= playlistMax)
-                return;
-
-        if (entry->isDirectory == 0)
-        {
-                addSongToPlayList(list, entry->fullPath, playlistMax);
-        }
-
-        if (entry->isDirectory == 1 && entry->children != NULL)
-        {
-                traverseFileSystemEntry(entry->children, list, playlistMax);
-        }
+        if (list->head == NULL || row < 0 || row >= list->count)
+                return NULL;
 
-        if (entry->next != NULL)
-        {
-                traverseFileSystemEntry(entry->next, list, playlistMax);
-        }
-}
+        PlayListIndex *index = getIndex(list);
+        PlayListChunk *chunk = index->chunks[findChunk(index, row)];
+        int offset = row - chunk->first;
 
-void createPlayListFromFileSystemEntry(FileSystemEntry *root, PlayList *list, int playlistMax)
-{
-        traverseFileSystemEntry(root, list, playlistMax);
+        return (offset < chunk->count) ? chunk->nodes[offset] : NULL;
 }
 
 int isMusicFile(const char *filename)
@@ -959,67 +1568,13 @@ int isMusicFile(const char *filename)
         return 0;
 }
 
-int containsMusicFiles(FileSystemEntry *entry)
-{
-        if (entry == NULL)
-                return 0;
-
-        FileSystemEntry *child = entry->children;
-
-        while (child != NULL)
-        {
-                if (!child->isDirectory && isMusicFile(child->name))
-                {
-                        return 1;
-                }
-                child = child->next;
-        }
-
-        return 0;
-}
-
-void addAlbumToPlayList(PlayList *list, FileSystemEntry *album, int playlistMax)
-{
-        FileSystemEntry *entry = album->children;
-
-        while (entry != NULL && list->count < playlistMax)
-        {
-                if (!entry->isDirectory && isMusicFile(entry->name))
-                {
-                        addSongToPlayList(list, entry->fullPath, playlistMax);
-                }
-                entry = entry->next;
-        }
-}
-
-void addAlbumsToPlayList(FileSystemEntry *entry, PlayList *list, int playlistMax)
-{
-        if (entry == NULL || list->count >= playlistMax)
-                return;
-
-        if (entry->isDirectory && containsMusicFiles(entry))
-        {
-                addAlbumToPlayList(list, entry, playlistMax);
-        }
-
-        if (entry->isDirectory && entry->children != NULL)
-        {
-                addAlbumsToPlayList(entry->children, list, playlistMax);
-        }
-
-        if (entry->next != NULL)
-        {
-                addAlbumsToPlayList(entry->next, list, playlistMax);
-        }
-}
-
 void shuffleEntries(FileSystemEntry **array, size_t n)
 {
         if (n > 1)
         {
                 for (size_t i = 0; i < n - 1; i++)
                 {
-                        size_t j = getRandomNumber(i, n - 1);
+                        size_t j = i + getRandomBelow(getShuffleRandomState(), n - i);
 
                         // Swap entries at i and j
                         FileSystemEntry *tmp = array[i];
@@ -1029,40 +1584,55 @@ void shuffleEntries(FileSystemEntry **array, size_t n)
         }
 }
 
-void collectAlbums(FileSystemEntry *entry, FileSystemEntry **albums, size_t *count)
+FileSystemEntry **getShuffledAlbumSongs(FileSystemEntry *root, int *count)
 {
-        if (entry == NULL)
-                return;
+        int numFiles = 0;
+        FileSystemEntry **files = getFileEntries(root, &numFiles);
 
-        if (entry->isDirectory && containsMusicFiles(entry))
-        {
-                albums[*count] = entry;
-                (*count)++;
-        }
+        *count = 0;
+
+        if (files == NULL)
+                return NULL;
+
+        FileSystemEntry **albums = malloc((numFiles + 1) * sizeof(FileSystemEntry *));
 
-        if (entry->isDirectory && entry->children != NULL)
+        if (albums == NULL)
         {
-                collectAlbums(entry->children, albums, count);
+                fprintf(stderr, "getShuffledAlbumSongs: malloc\n");
+                free(files);
+                return NULL;
         }
 
-        if (entry->next != NULL)
+        // Every directory with songs directly in it is an album
+        GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+        size_t numAlbums = 0;
+
+        for (int i = 0; i < numFiles; i++)
         {
-                collectAlbums(entry->next, albums, count);
-        }
-}
+                FileSystemEntry *album = files[i]->parent;
 
-void addShuffledAlbumsToPlayList(FileSystemEntry *root, PlayList *list, int playlistMax)
-{
-        size_t maxAlbums = 2000;
-        FileSystemEntry *albums[maxAlbums];
-        size_t albumCount = 0;
+                if (album != NULL && isMusicFile(files[i]->name) && !g_hash_table_contains(seen, album))
+                {
+                        g_hash_table_add(seen, album);
+                        albums[numAlbums++] = album;
+                }
+        }
 
-        collectAlbums(root, albums, &albumCount);
+        g_hash_table_destroy(seen);
 
-        shuffleEntries(albums, albumCount);
+        shuffleEntries(albums, numAlbums);
 
-        for (size_t i = 0; i < albumCount && list->count < playlistMax; i++)
+        // The albums hold no more songs than there are files, so they fit where the files were
+        for (size_t i = 0; i < numAlbums; i++)
         {
-                addAlbumToPlayList(list, albums[i], playlistMax);
+                for (FileSystemEntry *entry = albums[i]->children; entry != NULL; entry = entry->next)
+                {
+                        if (!entry->isDirectory && isMusicFile(entry->name))
+                                files[(*count)++] = entry;
+                }
         }
+
+        free(albums);
+
+        return files;
 }
@@ -9,14 +9,25 @@
 #include <stdbool.h>
 #include "directorytree.h"
 
-#define MAX_FILES 10000
+#ifndef PLAYLIST_CHUNK_SIZE
+#define PLAYLIST_CHUNK_SIZE 256
+#endif
+
+#ifndef M3U_CHECK_THREADS
+#define M3U_CHECK_THREADS 4
+#endif
 
 #ifndef PLAYLIST_STRUCT
 #define PLAYLIST_STRUCT
 
+struct PlayListChunk;
+
+typedef struct PlayListIndex PlayListIndex;
+
 typedef struct
 {
-        char *filePath;
+        char *filePath; // Reference counted, copies of a node share it
+        char *title;    // From #EXTINF, reference counted like the path, NULL if there was none
         double duration;
 } SongInfo;
 
@@ -26,6 +37,7 @@ typedef struct Node
         SongInfo song;
         struct Node *next;
         struct Node *prev;
+        struct PlayListChunk *chunk; // Where the list index keeps it
 } Node;
 
 typedef struct
@@ -34,6 +46,7 @@ typedef struct
         Node *tail;
         int count;
         pthread_mutex_t mutex;
+        PlayListIndex *index; // Ids and rows of the nodes, built on the first lookup
 } PlayList;
 
 extern Node *currentSong;
@@ -52,6 +65,9 @@ Node *getListPrev(Node *node);
 
 void createNode(Node **node, const char *directoryPath, int id);
 
+// Same song and id, the path isn't copied
+Node *copyNode(const Node *originalNode);
+
 void addToList(PlayList *list, Node *newNode);
 
 Node *deleteFromList(PlayList *list, Node *node);
@@ -60,9 +76,13 @@ void deletePlaylist(PlayList *playlist);
 
 void shufflePlaylist(PlayList *playlist);
 
+// Song keeps playing and is followed by the rest in random order
 void shufflePlaylistStartingFromSong(PlayList *playlist, Node *song);
 
-int makePlaylist(int argc, char *argv[], bool exactSearch, const char *path);
+// Shuffling moves whole albums and keeps the songs of each in order
+void setAlbumShuffle(bool enabled);
+
+int makePlaylist(int argc, char *argv[], bool exactSearch, const char *path, FileSystemEntry *library);
 
 void writeCurrentPlaylistToM3UFile(PlayList *playlist);
 
@@ -80,15 +100,21 @@ PlayList deepCopyPlayList(PlayList *originalList);
 
 void deepCopyPlayListOntoList(PlayList *originalList, PlayList *newList);
 
+// Relinks the nodes of list in the order their ids have in order, without copying any
+void orderPlaylistLike(PlayList *list, PlayList *order);
+
 Node *findPathInPlaylist(const char *path, PlayList *playlist);
 
 Node *findLastPathInPlaylist(const char *path, PlayList *playlist);
 
+// Returns the row of the node with the id, or -1
 int findNodeInList(PlayList *list, int id, Node **foundNode);
 
-void createPlayListFromFileSystemEntry(FileSystemEntry *root, PlayList *list, int playlistMax);
+// Node at the row counting from 0, NULL if there is none
+Node *findNodeAtRow(PlayList *list, int row);
 
-void addShuffledAlbumsToPlayList(FileSystemEntry *root, PlayList *list, int playlistMax);
+// The albums in random order, each with its songs in library order
+FileSystemEntry **getShuffledAlbumSongs(FileSystemEntry *root, int *count);
 
 void moveUpList(PlayList *list, Node *node);
 
@@ -100,4 +126,6 @@ void saveFavoritesPlaylist(const char *directory);
 
 int isMusicFile(const char *filename);
 
+// Appends the songs that exist, with the duration and title of their #EXTINF line if there is one.
+// With a library, songs found in it aren't looked for on disk and those already enqueued are skipped.
 void readM3UFile(const char *filename, PlayList *playlist, FileSystemEntry *library);
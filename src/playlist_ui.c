@@ -15,26 +15,15 @@ playlist_ui.c
 int startIter = 0;
 int previousChosenSong = 0;
 
-Node *determineStartNode(Node *head, int *foundAt, int listSize)
+// Row of the song that is playing, -1 if it isn't in the list
+int findCurrentSongRow(PlayList *list)
 {
-        Node *node = head;
         Node *foundNode = NULL;
-        int numSongs = 0;
-        *foundAt = -1;
 
-        while (node != NULL && numSongs <= listSize)
-        {
-                if (currentSong != NULL && currentSong->id == node->id)
-                {
-                        *foundAt = numSongs;
-                        foundNode = node;
-                        break;
-                }
-                node = node->next;
-                numSongs++;
-        }
+        if (currentSong == NULL)
+                return -1;
 
-        return foundNode ? foundNode : head;
+        return findNodeInList(list, currentSong->id, &foundNode);
 }
 
 void preparePlaylistString(Node *node, char *buffer, int bufferSize)
@@ -45,6 +34,13 @@ void preparePlaylistString(Node *node, char *buffer, int bufferSize)
                 return;
         }
 
+        // The title the playlist file gave it
+        if (node->song.title != NULL)
+        {
+                c_strcpy(buffer, node->song.title, bufferSize);
+                return;
+        }
+
         char filePath[MAXPATHLEN];
         c_strcpy(filePath, node->song.filePath, sizeof(filePath));
         char *lastSlash = strrchr(filePath, '/');
@@ -157,9 +153,7 @@ int displayPlaylist(PlayList *list, int maxListSize, int indent, int *chosenSong
 
         UISettings *ui = &(state->uiSettings);
 
-        int foundAt = -1;
-
-        Node *startNode = determineStartNode(list->head, &foundAt, list->count);
+        int foundAt = findCurrentSongRow(list);
 
         // Determine chosen song
         if (*chosenSong >= list->count)
@@ -195,19 +189,10 @@ int displayPlaylist(PlayList *list, int maxListSize, int indent, int *chosenSong
                         startIter = *chosenSong = 0;
         }
 
-        // Go up to find the starting node
-        for (int i = foundAt; i > startIter; i--)
-        {
-                if (i > 0 && startNode->prev != NULL)
-                        startNode = startNode->prev;
-        }
+        Node *startNode = findNodeAtRow(list, startIter);
 
-        // Go down to adjust the startNode
-        for (int i = (foundAt == -1) ? 0 : foundAt; i < startIter; i++)
-        {
-                if (startNode->next != NULL)
-                        startNode = startNode->next;
-        }
+        if (startNode == NULL)
+                startNode = (startIter < 0) ? list->head : list->tail;
 
         int printedRows = displayPlaylistItems(startNode, startIter, maxListSize, termWidth, indent, *chosenSong, chosenNodeId, ui);
 
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ringbuffer.h"
+
+/*
+
+ringbuffer.c
+
+ Lock-free single producer / single consumer ring buffer for PCM frames.
+
+ The decode thread is the only writer and the audio device callback the only
+ reader. Positions are free running frame counters, the buffer index is
+ position & mask. A small message queue travels alongside the frames so that
+ events like track switches take effect exactly when the frames before them
+ have been played.
+
+*/
+
+static size_t nextPowerOfTwo(size_t x)
+{
+        size_t n = 1;
+        while (n < x)
+                n <<= 1;
+        return n;
+}
+
+int initRingBuffer(RingBuffer *rb, size_t minFrames, size_t bytesPerFrame)
+{
+        if (rb == NULL || minFrames == 0 || bytesPerFrame == 0)
+                return -1;
+
+        size_t capacity = nextPowerOfTwo(minFrames);
+
+        if (rb->data == NULL || rb->capacity != capacity || rb->bytesPerFrame != bytesPerFrame)
+        {
+                unsigned char *data = realloc(rb->data, capacity * bytesPerFrame);
+
+                if (data == NULL)
+                {
+                        fprintf(stderr, "initRingBuffer: realloc\n");
+                        return -1;
+                }
+
+                rb->data = data;
+                rb->capacity = capacity;
+                rb->mask = capacity - 1;
+                rb->bytesPerFrame = bytesPerFrame;
+        }
+
+        resetRingBuffer(rb);
+
+        return 0;
+}
+
+void freeRingBuffer(RingBuffer *rb)
+{
+        if (rb == NULL)
+                return;
+
+        free(rb->data);
+        rb->data = NULL;
+        rb->capacity = 0;
+        rb->mask = 0;
+        rb->bytesPerFrame = 0;
+        resetRingBuffer(rb);
+}
+
+// Only call when neither the producer nor the consumer is running
+void resetRingBuffer(RingBuffer *rb)
+{
+        atomic_store(&rb->readPos, 0);
+        atomic_store(&rb->writePos, 0);
+        atomic_store(&rb->messageReadPos, 0);
+        atomic_store(&rb->messageWritePos, 0);
+}
+
+size_t ringBufferAvailableRead(RingBuffer *rb)
+{
+        size_t writePos = atomic_load_explicit(&rb->writePos, memory_order_acquire);
+        size_t readPos = atomic_load_explicit(&rb->readPos, memory_order_relaxed);
+
+        return writePos - readPos;
+}
+
+size_t ringBufferAvailableWrite(RingBuffer *rb)
+{
+        size_t readPos = atomic_load_explicit(&rb->readPos, memory_order_acquire);
+        size_t writePos = atomic_load_explicit(&rb->writePos, memory_order_relaxed);
+
+        return rb->capacity - (writePos - readPos);
+}
+
+size_t ringBufferWrite(RingBuffer *rb, const void *frames, size_t frameCount)
+{
+        if (rb->data == NULL)
+                return 0;
+
+        size_t space = ringBufferAvailableWrite(rb);
+
+        if (frameCount > space)
+                frameCount = space;
+
+        if (frameCount == 0)
+                return 0;
+
+        size_t writePos = atomic_load_explicit(&rb->writePos, memory_order_relaxed);
+        size_t start = writePos & rb->mask;
+        size_t firstPart = rb->capacity - start;
+
+        if (firstPart > frameCount)
+                firstPart = frameCount;
+
+        const unsigned char *src = (const unsigned char *)frames;
+
+        memcpy(rb->data + start * rb->bytesPerFrame, src, firstPart * rb->bytesPerFrame);
+
+        if (frameCount > firstPart)
+                memcpy(rb->data, src + firstPart * rb->bytesPerFrame, (frameCount - firstPart) * rb->bytesPerFrame);
+
+        atomic_store_explicit(&rb->writePos, writePos + frameCount, memory_order_release);
+
+        return frameCount;
+}
+
+size_t ringBufferRead(RingBuffer *rb, void *frames, size_t frameCount)
+{
+        if (rb->data == NULL)
+                return 0;
+
+        size_t available = ringBufferAvailableRead(rb);
+
+        if (frameCount > available)
+                frameCount = available;
+
+        if (frameCount == 0)
+                return 0;
+
+        size_t readPos = atomic_load_explicit(&rb->readPos, memory_order_relaxed);
+        size_t start = readPos & rb->mask;
+        size_t firstPart = rb->capacity - start;
+
+        if (firstPart > frameCount)
+                firstPart = frameCount;
+
+        unsigned char *dst = (unsigned char *)frames;
+
+        memcpy(dst, rb->data + start * rb->bytesPerFrame, firstPart * rb->bytesPerFrame);
+
+        if (frameCount > firstPart)
+                memcpy(dst + firstPart * rb->bytesPerFrame, rb->data, (frameCount - firstPart) * rb->bytesPerFrame);
+
+        atomic_store_explicit(&rb->readPos, readPos + frameCount, memory_order_release);
+
+        return frameCount;
+}
+
+size_t ringBufferWritePosition(RingBuffer *rb)
+{
+        return atomic_load_explicit(&rb->writePos, memory_order_acquire);
+}
+
+size_t ringBufferReadPosition(RingBuffer *rb)
+{
+        return atomic_load_explicit(&rb->readPos, memory_order_acquire);
+}
+
+// Consumer side: drop buffered frames up to position (never past the write position)
+void ringBufferSkipTo(RingBuffer *rb, size_t position)
+{
+        size_t readPos = atomic_load_explicit(&rb->readPos, memory_order_relaxed);
+        size_t writePos = atomic_load_explicit(&rb->writePos, memory_order_acquire);
+
+        if (position - readPos > writePos - readPos)
+                return;
+
+        atomic_store_explicit(&rb->readPos, position, memory_order_release);
+}
+
+size_t ringMessagesAvailableWrite(RingBuffer *rb)
+{
+        size_t writePos = atomic_load_explicit(&rb->messageWritePos, memory_order_relaxed);
+        size_t readPos = atomic_load_explicit(&rb->messageReadPos, memory_order_acquire);
+
+        return RING_MAX_MESSAGES - (writePos - readPos);
+}
+
+bool pushRingMessage(RingBuffer *rb, RingMessageType type, size_t position)
+{
+        size_t writePos = atomic_load_explicit(&rb->messageWritePos, memory_order_relaxed);
+        size_t readPos = atomic_load_explicit(&rb->messageReadPos, memory_order_acquire);
+
+        if (writePos - readPos >= RING_MAX_MESSAGES)
+                return false;
+
+        RingMessage *message = &rb->messages[writePos % RING_MAX_MESSAGES];
+        message->type = type;
+        message->position = position;
+
+        atomic_store_explicit(&rb->messageWritePos, writePos + 1, memory_order_release);
+
+        return true;
+}
+
+bool peekRingMessage(RingBuffer *rb, RingMessage *message)
+{
+        size_t readPos = atomic_load_explicit(&rb->messageReadPos, memory_order_relaxed);
+        size_t writePos = atomic_load_explicit(&rb->messageWritePos, memory_order_acquire);
+
+        if (readPos == writePos)
+                return false;
+
+        *message = rb->messages[readPos % RING_MAX_MESSAGES];
+
+        return true;
+}
+
+void popRingMessage(RingBuffer *rb)
+{
+        size_t readPos = atomic_load_explicit(&rb->messageReadPos, memory_order_relaxed);
+
+        atomic_store_explicit(&rb->messageReadPos, readPos + 1, memory_order_release);
+}
@@ -0,0 +1,66 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef RING_MAX_MESSAGES
+#define RING_MAX_MESSAGES 16
+#endif
+
+typedef enum
+{
+        RING_MSG_FLUSH, // Discard everything buffered before the message position (seek, skip)
+        RING_MSG_SWITCH // Playback has reached the end of the current track
+} RingMessageType;
+
+typedef struct
+{
+        RingMessageType type;
+        size_t position;
+} RingMessage;
+
+typedef struct
+{
+        unsigned char *data;
+        size_t capacity; // In frames, always a power of two
+        size_t mask;
+        size_t bytesPerFrame;
+        _Atomic size_t readPos;
+        _Atomic size_t writePos;
+        RingMessage messages[RING_MAX_MESSAGES];
+        _Atomic size_t messageReadPos;
+        _Atomic size_t messageWritePos;
+} RingBuffer;
+
+int initRingBuffer(RingBuffer *rb, size_t minFrames, size_t bytesPerFrame);
+
+void freeRingBuffer(RingBuffer *rb);
+
+void resetRingBuffer(RingBuffer *rb);
+
+size_t ringBufferAvailableRead(RingBuffer *rb);
+
+size_t ringBufferAvailableWrite(RingBuffer *rb);
+
+size_t ringBufferWrite(RingBuffer *rb, const void *frames, size_t frameCount);
+
+size_t ringBufferRead(RingBuffer *rb, void *frames, size_t frameCount);
+
+size_t ringBufferWritePosition(RingBuffer *rb);
+
+size_t ringBufferReadPosition(RingBuffer *rb);
+
+void ringBufferSkipTo(RingBuffer *rb, size_t position);
+
+// Room left in the message queue, only the writer may rely on it staying free
+size_t ringMessagesAvailableWrite(RingBuffer *rb);
+
+bool pushRingMessage(RingBuffer *rb, RingMessageType type, size_t position);
+
+bool peekRingMessage(RingBuffer *rb, RingMessage *message);
+
+void popRingMessage(RingBuffer *rb);
+
+#endif
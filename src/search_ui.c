@@ -1,9 +1,12 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <math.h>
 #include "soundcommon.h"
 #include "term.h"
 #include "common_ui.h"
 #include "common.h"
+#include "player_ui.h"
 #include "search_ui.h"
 
 /*
@@ -12,9 +15,16 @@ search_ui.c
 
  Search UI functions.
 
+ Searching happens on its own thread so typing never waits for it. Every
+ keystroke bumps a generation counter, and a search that sees it change
+ stops. Only the best matches are kept, in a heap with the worst on top, and
+ they are handed to the screen now and then while the search goes on.
+
 */
 
 #define MAX_SEARCH_LEN 32
+#define MAX_SEARCH_RESULTS 1000   // Far more than fit on screen, but there is scrolling
+#define SEARCH_PUBLISH_INTERVAL 4096 // Results between handing them to the screen
 
 int numSearchLetters = 0;
 int numSearchBytes = 0;
@@ -23,12 +33,32 @@ typedef struct SearchResult
 {
         FileSystemEntry *entry;
         int distance;
+        unsigned int order; // Place in the library, ties are shown in library order
 } SearchResult;
 
-// Global variables to store results
-SearchResult *results = NULL;
-size_t resultsCount = 0;
-size_t resultsCapacity = 0;
+// What is shown, guarded by resultsMutex
+static SearchResult results[MAX_SEARCH_RESULTS];
+static size_t resultsCount = 0;
+static bool resultsSorted = true;
+static pthread_mutex_t resultsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The latest search asked for, guarded by searchMutex
+static char requestedText[MAX_SEARCH_LEN * 4 + 1];
+static int requestedThreshold = 0;
+static bool searchRequested = false;
+static bool searchStopping = false;
+static bool searchThreadStarted = false;
+static pthread_t searchThread;
+static pthread_mutex_t searchMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t searchCond = PTHREAD_COND_INITIALIZER;
+
+static atomic_uint searchGeneration = 0;
+
+// Only touched by the search thread
+static SearchResult heap[MAX_SEARCH_RESULTS];
+static size_t heapCount = 0;
+static unsigned int heapOrder = 0;
+static unsigned int workingGeneration = 0;
 
 int minSearchLetters = 1;
 FileSystemEntry *currentSearchEntry = NULL;
@@ -42,65 +72,226 @@ FileSystemEntry *getCurrentSearchEntry(void)
 
 int getSearchResultsCount(void)
 {
-        return resultsCount;
+        pthread_mutex_lock(&resultsMutex);
+        int count = resultsCount;
+        pthread_mutex_unlock(&resultsMutex);
+
+        return count;
+}
+
+static bool isWorseResult(const SearchResult *a, const SearchResult *b)
+{
+        return a->distance != b->distance ? a->distance > b->distance : a->order > b->order;
 }
 
-// Function to add a result to the global array
-void addResult(FileSystemEntry *entry, int distance)
+static void siftUp(size_t i)
 {
-        if (resultsCount >= resultsCapacity)
+        while (i > 0)
         {
-                resultsCapacity = resultsCapacity == 0 ? 10 : resultsCapacity * 2;
-                results = realloc(results, resultsCapacity * sizeof(SearchResult));
+                size_t parent = (i - 1) / 2;
+
+                if (!isWorseResult(&heap[i], &heap[parent]))
+                        break;
+
+                SearchResult tmp = heap[i];
+                heap[i] = heap[parent];
+                heap[parent] = tmp;
+                i = parent;
         }
-        results[resultsCount].distance = distance;
-        results[resultsCount].entry = entry;
-        resultsCount++;
 }
 
-// Callback function to collect results
-void collectResult(FileSystemEntry *entry, int distance)
+static void siftDown(size_t i)
 {
-        addResult(entry, distance);
+        for (;;)
+        {
+                size_t worst = i;
+                size_t left = 2 * i + 1;
+                size_t right = left + 1;
+
+                if (left < heapCount && isWorseResult(&heap[left], &heap[worst]))
+                        worst = left;
+                if (right < heapCount && isWorseResult(&heap[right], &heap[worst]))
+                        worst = right;
+
+                if (worst == i)
+                        break;
+
+                SearchResult tmp = heap[i];
+                heap[i] = heap[worst];
+                heap[worst] = tmp;
+                i = worst;
+        }
 }
 
-// Free allocated memory from previous search
-void freeSearchResults(void)
+static bool isSearchCancelled(void)
 {
-        if (results != NULL)
+        return atomic_load(&searchGeneration) != workingGeneration;
+}
+
+static void publishResults(void)
+{
+        pthread_mutex_lock(&resultsMutex);
+
+        // A newer search or freeSearchResults came in meanwhile
+        if (!isSearchCancelled())
         {
-                free(results);
-                results = NULL;
+                memcpy(results, heap, heapCount * sizeof(SearchResult));
+                resultsCount = heapCount;
+                resultsSorted = false;
         }
 
-        if (currentSearchEntry != NULL)
-                currentSearchEntry = NULL;
+        pthread_mutex_unlock(&resultsMutex);
 
-        resultsCapacity = 0;
+        refresh = true;
+}
+
+// Called by the search for every match, in library order
+static void collectResult(FileSystemEntry *entry, int distance)
+{
+        SearchResult result = {entry, distance, heapOrder++};
+
+        if (heapCount < MAX_SEARCH_RESULTS)
+        {
+                heap[heapCount] = result;
+                siftUp(heapCount++);
+        }
+        else if (isWorseResult(&heap[0], &result))
+        {
+                heap[0] = result;
+                siftDown(0);
+        }
+
+        if (heapOrder % SEARCH_PUBLISH_INTERVAL == 0)
+                publishResults();
+}
+
+static void *searchThreadFunction(void *arg)
+{
+        (void)arg;
+
+        char text[MAX_SEARCH_LEN * 4 + 1];
+
+        for (;;)
+        {
+                pthread_mutex_lock(&searchMutex);
+
+                while (!searchRequested && !searchStopping)
+                        pthread_cond_wait(&searchCond, &searchMutex);
+
+                if (searchStopping)
+                {
+                        pthread_mutex_unlock(&searchMutex);
+                        break;
+                }
+
+                searchRequested = false;
+                c_strcpy(text, requestedText, sizeof(text));
+                int threshold = requestedThreshold;
+                workingGeneration = atomic_load(&searchGeneration);
+
+                pthread_mutex_unlock(&searchMutex);
+
+                heapCount = 0;
+                heapOrder = 0;
+
+                // The library can't be patched or replaced while it is searched
+                pthread_rwlock_rdlock(&libraryLock);
+
+                if (!isSearchCancelled())
+                {
+                        fuzzySearchLibrary(getLibrary(), text, threshold, collectResult, isSearchCancelled);
+
+                        publishResults();
+                }
+
+                pthread_rwlock_unlock(&libraryLock);
+        }
+
+        return NULL;
+}
+
+void stopSearchThread(void)
+{
+        pthread_mutex_lock(&searchMutex);
+
+        bool started = searchThreadStarted;
+        searchStopping = true;
+        searchThreadStarted = false;
+        atomic_fetch_add(&searchGeneration, 1);
+        pthread_cond_signal(&searchCond);
+
+        pthread_mutex_unlock(&searchMutex);
+
+        if (started)
+                pthread_join(searchThread, NULL);
+}
+
+// Free allocated memory from previous search
+void freeSearchResults(void)
+{
+        // Stops a search in progress from showing what it found
+        atomic_fetch_add(&searchGeneration, 1);
+
+        pthread_mutex_lock(&resultsMutex);
+
+        currentSearchEntry = NULL;
         resultsCount = 0;
+        resultsSorted = true;
+
+        pthread_mutex_unlock(&resultsMutex);
 }
 
-void fuzzySearch(FileSystemEntry *root, int threshold)
+void fuzzySearch(int threshold)
 {
-        freeSearchResults();
+        if (numSearchLetters <= minSearchLetters)
+        {
+                freeSearchResults();
+                refresh = true;
+                return;
+        }
+
+        pthread_mutex_lock(&searchMutex);
 
-        if (numSearchLetters > minSearchLetters)
+        if (!searchThreadStarted && !searchStopping)
         {
-                fuzzySearchRecursive(root, searchText, threshold, collectResult);
+                if (pthread_create(&searchThread, NULL, searchThreadFunction, NULL) != 0)
+                {
+                        perror("pthread_create");
+                        pthread_mutex_unlock(&searchMutex);
+                        return;
+                }
+
+                searchThreadStarted = true;
         }
-        refresh = true;
+
+        // The previous results stay on screen until the first new ones are in
+        c_strcpy(requestedText, searchText, sizeof(requestedText));
+        requestedThreshold = threshold;
+        searchRequested = true;
+        atomic_fetch_add(&searchGeneration, 1);
+
+        pthread_cond_signal(&searchCond);
+        pthread_mutex_unlock(&searchMutex);
 }
 
-int compareResults(const void *a, const void *b)
+static int compareResults(const void *a, const void *b)
 {
-        SearchResult *resultA = (SearchResult *)a;
-        SearchResult *resultB = (SearchResult *)b;
-        return resultA->distance - resultB->distance;
+        const SearchResult *resultA = (const SearchResult *)a;
+        const SearchResult *resultB = (const SearchResult *)b;
+
+        if (resultA->distance != resultB->distance)
+                return resultA->distance - resultB->distance;
+
+        return (resultA->order > resultB->order) - (resultA->order < resultB->order);
 }
 
-void sortResults(void)
+static void sortResults(void)
 {
-        qsort(results, resultsCount, sizeof(SearchResult), compareResults);
+        if (!resultsSorted)
+        {
+                qsort(results, resultsCount, sizeof(SearchResult), compareResults);
+                resultsSorted = true;
+        }
 }
 
 int displaySearchBox(int indent, UISettings *ui)
@@ -232,6 +423,8 @@ int displaySearchResults(int maxListSize, int indent, int *chosenRow, int startS
         char name[maxNameWidth + 1];
         int printedRows = 0;
 
+        pthread_mutex_lock(&resultsMutex);
+
         sortResults();
 
         if (*chosenRow >= (int)resultsCount - 1)
@@ -321,6 +514,8 @@ int displaySearchResults(int maxListSize, int indent, int *chosenRow, int startS
                 printedRows++;
         }
 
+        pthread_mutex_unlock(&resultsMutex);
+
         while (printedRows < maxListSize)
         {
                 printf("\n");
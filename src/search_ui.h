@@ -9,7 +9,10 @@ int removeFromSearchText(void);
 
 int getSearchResultsCount(void);
 
-void fuzzySearch(FileSystemEntry *root, int threshold);
+// Starts searching the library for the search text on the search thread
+void fuzzySearch(int threshold);
+
+void stopSearchThread(void);
 
 void freeSearchResults(void);
 
@@ -0,0 +1,652 @@
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "searchindex.h"
+
+/*
+
+searchindex.c
+
+ Library search. Names are casefolded and stripped of their extension once,
+ and kept as codepoints back to back. A trigram index narrows down which
+ names can contain the search term, and names are grouped by length so the
+ edit distance is only worked out for those that can be close enough.
+
+ Recent searches are kept on a stack. A name containing "abc" also contains
+ "ab", so typing one more letter only rechecks the names that matched before,
+ and a backspace gives back the results of the shorter term as they were.
+
+*/
+
+#define SEARCH_GRAM_BITS 16
+#define SEARCH_GRAM_BUCKETS (1u << SEARCH_GRAM_BITS)
+#define SEARCH_MAX_LENGTH 255 // Longer names share the last length group
+#define SEARCH_HISTORY_DEPTH 40
+#define SEARCH_CANCEL_CHECK_MASK 1023 // How often a long loop asks whether the search is still wanted
+
+typedef struct
+{
+        uint32_t entry;
+        uint32_t distance;
+} SearchMatch;
+
+typedef struct
+{
+        gunichar *term;
+        glong termLength;
+        uint32_t *contains; // Entries whose name contains the term, ascending
+        uint32_t numContains;
+        SearchMatch *matches; // Everything reported, ascending
+        uint32_t numMatches;
+} SearchStep;
+
+struct SearchIndex
+{
+        FileSystemEntry **entries; // In tree order
+        uint32_t count;
+        gunichar *codepoints;
+        uint32_t *nameStart; // count + 1 offsets into codepoints
+        uint32_t *gramStart; // SEARCH_GRAM_BUCKETS + 1 offsets into gramEntries
+        uint32_t *gramEntries; // Per trigram bucket the entries having it, ascending
+        uint32_t *byLength;    // Entries ordered by name length
+        uint32_t lengthStart[SEARCH_MAX_LENGTH + 2];
+        unsigned char *marks;  // One per entry, all zero between searches
+        SearchStep history[SEARCH_HISTORY_DEPTH]; // Each term starts with the one below it
+        int historyDepth;
+        int historyThreshold;
+};
+
+static uint32_t getGramBucket(const gunichar *p)
+{
+        uint32_t hash = p[0] * 0x9E3779B1u ^ p[1] * 0x85EBCA77u ^ p[2] * 0xC2B2AE3Du;
+
+        return (hash ^ (hash >> 15)) & (SEARCH_GRAM_BUCKETS - 1);
+}
+
+static int compareBuckets(const void *a, const void *b)
+{
+        uint32_t x = *(const uint32_t *)a;
+        uint32_t y = *(const uint32_t *)b;
+
+        return (x > y) - (x < y);
+}
+
+// Distinct trigram buckets of a name, returns how many were written to grams
+static uint32_t getNameGrams(const gunichar *name, uint32_t length, uint32_t *grams)
+{
+        if (length < 3)
+                return 0;
+
+        uint32_t count = 0;
+
+        for (uint32_t i = 0; i + 3 <= length; i++)
+                grams[count++] = getGramBucket(name + i);
+
+        qsort(grams, count, sizeof(uint32_t), compareBuckets);
+
+        uint32_t unique = 1;
+
+        for (uint32_t i = 1; i < count; i++)
+        {
+                if (grams[i] != grams[unique - 1])
+                        grams[unique++] = grams[i];
+        }
+
+        return unique;
+}
+
+static gunichar *getSearchName(const char *name, bool stripExtension, glong *length)
+{
+        char *folded = g_utf8_casefold(name, -1);
+        if (folded == NULL)
+                return NULL;
+
+        // Names are matched without the extension, like "song" for "song.flac"
+        char *dot = stripExtension ? strrchr(folded, '.') : NULL;
+        if (dot != NULL)
+                *dot = '\0';
+
+        gunichar *codepoints = g_utf8_to_ucs4_fast(folded, -1, length);
+        g_free(folded);
+
+        return codepoints;
+}
+
+static bool addSearchName(SearchIndex *index, FileSystemEntry *entry, size_t *capacity)
+{
+        glong length = 0;
+        gunichar *name = getSearchName(entry->name, true, &length);
+
+        if (name == NULL)
+                length = 0;
+
+        uint32_t start = index->nameStart[index->count];
+
+        if (start + (size_t)length > *capacity)
+        {
+                size_t newCapacity = *capacity * 2 > start + (size_t)length ? *capacity * 2 : start + (size_t)length;
+                gunichar *codepoints = realloc(index->codepoints, newCapacity * sizeof(gunichar));
+
+                if (codepoints == NULL)
+                {
+                        fprintf(stderr, "createSearchIndex: realloc\n");
+                        g_free(name);
+                        return false;
+                }
+
+                index->codepoints = codepoints;
+                *capacity = newCapacity;
+        }
+
+        if (length > 0)
+                memcpy(index->codepoints + start, name, length * sizeof(gunichar));
+
+        g_free(name);
+
+        index->entries[index->count] = entry;
+        index->count++;
+        index->nameStart[index->count] = start + length;
+
+        return true;
+}
+
+static uint32_t countEntries(FileSystemEntry *root)
+{
+        uint32_t count = 0;
+
+        for (FileSystemEntry *node = root; node != NULL;)
+        {
+                count++;
+
+                if (node->children != NULL)
+                {
+                        node = node->children;
+                        continue;
+                }
+
+                while (node != root && node->next == NULL)
+                        node = node->parent;
+
+                node = node != root ? node->next : NULL;
+        }
+
+        return count;
+}
+
+static bool buildGramIndex(SearchIndex *index)
+{
+        uint32_t maxLength = 0;
+
+        for (uint32_t i = 0; i < index->count; i++)
+        {
+                uint32_t length = index->nameStart[i + 1] - index->nameStart[i];
+                maxLength = length > maxLength ? length : maxLength;
+        }
+
+        uint32_t *grams = malloc((maxLength + 1) * sizeof(uint32_t));
+        index->gramStart = calloc(SEARCH_GRAM_BUCKETS + 1, sizeof(uint32_t));
+
+        if (grams == NULL || index->gramStart == NULL)
+        {
+                fprintf(stderr, "createSearchIndex: malloc\n");
+                free(grams);
+                return false;
+        }
+
+        // Counted first so every bucket gets its own slice of one array
+        for (uint32_t i = 0; i < index->count; i++)
+        {
+                uint32_t n = getNameGrams(index->codepoints + index->nameStart[i], index->nameStart[i + 1] - index->nameStart[i], grams);
+
+                for (uint32_t g = 0; g < n; g++)
+                        index->gramStart[grams[g] + 1]++;
+        }
+
+        for (uint32_t b = 0; b < SEARCH_GRAM_BUCKETS; b++)
+                index->gramStart[b + 1] += index->gramStart[b];
+
+        index->gramEntries = malloc((index->gramStart[SEARCH_GRAM_BUCKETS] + 1) * sizeof(uint32_t));
+        uint32_t *fill = malloc(SEARCH_GRAM_BUCKETS * sizeof(uint32_t));
+
+        if (index->gramEntries == NULL || fill == NULL)
+        {
+                fprintf(stderr, "createSearchIndex: malloc\n");
+                free(grams);
+                free(fill);
+                return false;
+        }
+
+        memcpy(fill, index->gramStart, SEARCH_GRAM_BUCKETS * sizeof(uint32_t));
+
+        for (uint32_t i = 0; i < index->count; i++)
+        {
+                uint32_t n = getNameGrams(index->codepoints + index->nameStart[i], index->nameStart[i + 1] - index->nameStart[i], grams);
+
+                for (uint32_t g = 0; g < n; g++)
+                        index->gramEntries[fill[grams[g]]++] = i;
+        }
+
+        free(fill);
+        free(grams);
+
+        return true;
+}
+
+static bool buildLengthIndex(SearchIndex *index)
+{
+        index->byLength = malloc((index->count + 1) * sizeof(uint32_t));
+        if (index->byLength == NULL)
+        {
+                fprintf(stderr, "createSearchIndex: malloc\n");
+                return false;
+        }
+
+        memset(index->lengthStart, 0, sizeof(index->lengthStart));
+
+        for (uint32_t i = 0; i < index->count; i++)
+        {
+                uint32_t length = index->nameStart[i + 1] - index->nameStart[i];
+                index->lengthStart[(length < SEARCH_MAX_LENGTH ? length : SEARCH_MAX_LENGTH) + 1]++;
+        }
+
+        for (int l = 0; l <= SEARCH_MAX_LENGTH; l++)
+                index->lengthStart[l + 1] += index->lengthStart[l];
+
+        uint32_t fill[SEARCH_MAX_LENGTH + 1];
+        memcpy(fill, index->lengthStart, sizeof(fill));
+
+        for (uint32_t i = 0; i < index->count; i++)
+        {
+                uint32_t length = index->nameStart[i + 1] - index->nameStart[i];
+                index->byLength[fill[length < SEARCH_MAX_LENGTH ? length : SEARCH_MAX_LENGTH]++] = i;
+        }
+
+        return true;
+}
+
+SearchIndex *createSearchIndex(FileSystemEntry *root)
+{
+        if (root == NULL)
+                return NULL;
+
+        SearchIndex *index = calloc(1, sizeof(SearchIndex));
+        if (index == NULL)
+        {
+                fprintf(stderr, "createSearchIndex: calloc\n");
+                return NULL;
+        }
+
+        uint32_t count = countEntries(root);
+        size_t capacity = (size_t)count * 16;
+
+        index->entries = malloc(count * sizeof(FileSystemEntry *));
+        index->nameStart = calloc((size_t)count + 1, sizeof(uint32_t));
+        index->codepoints = malloc(capacity * sizeof(gunichar));
+
+        if (index->entries == NULL || index->nameStart == NULL || index->codepoints == NULL)
+        {
+                fprintf(stderr, "createSearchIndex: malloc\n");
+                freeSearchIndex(index);
+                return NULL;
+        }
+
+        // Same order as the tree is shown in, so results come out that way too
+        for (FileSystemEntry *node = root; node != NULL && index->count < count;)
+        {
+                if (!addSearchName(index, node, &capacity))
+                {
+                        freeSearchIndex(index);
+                        return NULL;
+                }
+
+                if (node->children != NULL)
+                {
+                        node = node->children;
+                        continue;
+                }
+
+                while (node != root && node->next == NULL)
+                        node = node->parent;
+
+                node = node != root ? node->next : NULL;
+        }
+
+        index->marks = calloc((size_t)count + 1, 1);
+
+        if (index->marks == NULL || !buildGramIndex(index) || !buildLengthIndex(index))
+        {
+                freeSearchIndex(index);
+                return NULL;
+        }
+
+        return index;
+}
+
+static void freeSearchStep(SearchStep *step)
+{
+        g_free(step->term);
+        free(step->contains);
+        free(step->matches);
+        memset(step, 0, sizeof(SearchStep));
+}
+
+static void clearSearchHistory(SearchIndex *index)
+{
+        while (index->historyDepth > 0)
+                freeSearchStep(&index->history[--index->historyDepth]);
+}
+
+void freeSearchIndex(SearchIndex *index)
+{
+        if (index == NULL)
+                return;
+
+        clearSearchHistory(index);
+        free(index->marks);
+        free(index->entries);
+        free(index->codepoints);
+        free(index->nameStart);
+        free(index->gramStart);
+        free(index->gramEntries);
+        free(index->byLength);
+        free(index);
+}
+
+static bool containsTerm(const gunichar *name, uint32_t length, const gunichar *term, uint32_t termLength)
+{
+        if (termLength > length)
+                return false;
+
+        for (uint32_t i = 0; i + termLength <= length; i++)
+        {
+                if (name[i] == term[0] && memcmp(name + i, term, termLength * sizeof(gunichar)) == 0)
+                        return true;
+        }
+
+        return false;
+}
+
+/*
+ Levenshtein distance that gives up past maxDistance. Only the cells within
+ maxDistance of the diagonal can stay under it, so only those are filled in,
+ and it stops as soon as a whole row is over. row holds termLength + 1 ints.
+*/
+static int getBoundedEditDistance(const gunichar *name, int length, const gunichar *term, int termLength, int maxDistance, int *row)
+{
+        int over = maxDistance + 1;
+
+        if (abs(length - termLength) > maxDistance)
+                return over;
+
+        for (int j = 0; j <= termLength; j++)
+                row[j] = j <= maxDistance ? j : over;
+
+        for (int i = 1; i <= length; i++)
+        {
+                int from = i - maxDistance > 1 ? i - maxDistance : 1;
+                int to = i + maxDistance < termLength ? i + maxDistance : termLength;
+                int diagonal = row[from - 1];
+                int left = over;
+                int rowMin = over;
+
+                if (from == 1)
+                {
+                        row[0] = i;
+                        left = i;
+                        rowMin = i;
+                }
+
+                for (int j = from; j <= to; j++)
+                {
+                        int up = row[j];
+                        int value = name[i - 1] == term[j - 1] ? diagonal : diagonal + 1;
+
+                        value = MIN(value, MIN(up, left) + 1);
+                        value = MIN(value, over);
+
+                        diagonal = up;
+                        row[j] = value;
+                        left = value;
+                        rowMin = MIN(rowMin, value);
+                }
+
+                if (rowMin > maxDistance)
+                        return over;
+        }
+
+        return row[termLength];
+}
+
+static int compareMatches(const void *a, const void *b)
+{
+        uint32_t x = ((const SearchMatch *)a)->entry;
+        uint32_t y = ((const SearchMatch *)b)->entry;
+
+        return (x > y) - (x < y);
+}
+
+// Names containing the term, out of the previous step's if it has fewer than the term's rarest trigram
+static bool findContaining(SearchIndex *index, SearchStep *step, const SearchStep *previous, SearchCancelledCallback isCancelled)
+{
+        const uint32_t *candidates = NULL;
+        uint32_t numCandidates = index->count;
+
+        if (previous != NULL)
+        {
+                candidates = previous->contains;
+                numCandidates = previous->numContains;
+        }
+
+        for (glong i = 0; i + 3 <= step->termLength; i++)
+        {
+                uint32_t bucket = getGramBucket(step->term + i);
+                uint32_t size = index->gramStart[bucket + 1] - index->gramStart[bucket];
+
+                if (candidates == NULL || size < numCandidates)
+                {
+                        candidates = index->gramEntries + index->gramStart[bucket];
+                        numCandidates = size;
+                }
+        }
+
+        step->contains = malloc((numCandidates + 1) * sizeof(uint32_t));
+        if (step->contains == NULL)
+        {
+                fprintf(stderr, "searchIndex: malloc\n");
+                return false;
+        }
+
+        for (uint32_t c = 0; c < numCandidates; c++)
+        {
+                if ((c & SEARCH_CANCEL_CHECK_MASK) == 0 && isCancelled != NULL && isCancelled())
+                        return false;
+
+                uint32_t i = candidates != NULL ? candidates[c] : c;
+                uint32_t start = index->nameStart[i];
+
+                if (containsTerm(index->codepoints + start, index->nameStart[i + 1] - start, step->term, step->termLength))
+                        step->contains[step->numContains++] = i;
+        }
+
+        return true;
+}
+
+// A name more than threshold longer or shorter than the term can't be within threshold edits
+static bool findNearby(SearchIndex *index, SearchStep *step, int threshold, SearchCancelledCallback isCancelled)
+{
+        uint32_t capacity = 64;
+        uint32_t count = 0;
+        SearchMatch *nearby = malloc(capacity * sizeof(SearchMatch));
+        int *row = malloc((step->termLength + 1) * sizeof(int));
+
+        if (nearby == NULL || row == NULL)
+        {
+                fprintf(stderr, "searchIndex: malloc\n");
+                free(nearby);
+                free(row);
+                return false;
+        }
+
+        for (uint32_t c = 0; c < step->numContains; c++)
+                index->marks[step->contains[c]] = 1;
+
+        glong minLength = step->termLength > threshold ? step->termLength - threshold : 0;
+        glong maxLength = step->termLength + threshold;
+
+        minLength = minLength < SEARCH_MAX_LENGTH ? minLength : SEARCH_MAX_LENGTH;
+        maxLength = maxLength < SEARCH_MAX_LENGTH ? maxLength : SEARCH_MAX_LENGTH;
+
+        bool cancelled = false;
+
+        for (uint32_t k = index->lengthStart[minLength]; threshold > 0 && k < index->lengthStart[maxLength + 1]; k++)
+        {
+                if ((k & SEARCH_CANCEL_CHECK_MASK) == 0 && isCancelled != NULL && isCancelled())
+                {
+                        cancelled = true;
+                        break;
+                }
+
+                uint32_t i = index->byLength[k];
+
+                if (index->marks[i])
+                        continue;
+
+                uint32_t start = index->nameStart[i];
+                int distance = getBoundedEditDistance(index->codepoints + start, index->nameStart[i + 1] - start,
+                                                      step->term, step->termLength, threshold, row);
+
+                if (distance > threshold)
+                        continue;
+
+                if (count == capacity)
+                {
+                        capacity *= 2;
+                        SearchMatch *grown = realloc(nearby, capacity * sizeof(SearchMatch));
+                        if (grown == NULL)
+                                break;
+                        nearby = grown;
+                }
+
+                nearby[count].entry = i;
+                nearby[count].distance = distance;
+                count++;
+        }
+
+        for (uint32_t c = 0; c < step->numContains; c++)
+                index->marks[step->contains[c]] = 0;
+
+        free(row);
+
+        if (cancelled)
+        {
+                free(nearby);
+                return false;
+        }
+
+        // Both lists merged back into tree order
+        qsort(nearby, count, sizeof(SearchMatch), compareMatches);
+
+        step->matches = malloc(((size_t)step->numContains + count + 1) * sizeof(SearchMatch));
+        if (step->matches == NULL)
+        {
+                fprintf(stderr, "searchIndex: malloc\n");
+                free(nearby);
+                return false;
+        }
+
+        uint32_t a = 0, b = 0;
+
+        while (a < step->numContains || b < count)
+        {
+                if (b == count || (a < step->numContains && step->contains[a] < nearby[b].entry))
+                {
+                        step->matches[step->numMatches].entry = step->contains[a++];
+                        step->matches[step->numMatches].distance = 0;
+                }
+                else
+                {
+                        step->matches[step->numMatches] = nearby[b++];
+                }
+
+                step->numMatches++;
+        }
+
+        free(nearby);
+
+        return true;
+}
+
+static void pushSearchStep(SearchIndex *index, SearchStep *step)
+{
+        if (index->historyDepth == SEARCH_HISTORY_DEPTH)
+        {
+                freeSearchStep(&index->history[0]);
+                memmove(index->history, index->history + 1, (SEARCH_HISTORY_DEPTH - 1) * sizeof(SearchStep));
+                index->historyDepth--;
+        }
+
+        index->history[index->historyDepth++] = *step;
+}
+
+static bool startsWith(const SearchStep *step, const gunichar *term, glong termLength)
+{
+        return step->termLength <= termLength &&
+               memcmp(step->term, term, step->termLength * sizeof(gunichar)) == 0;
+}
+
+void searchIndex(SearchIndex *index, const char *searchTerm, int threshold, SearchResultCallback callback, SearchCancelledCallback isCancelled)
+{
+        if (index == NULL || searchTerm == NULL || callback == NULL || index->count == 0)
+                return;
+
+        SearchStep step;
+        memset(&step, 0, sizeof(step));
+
+        step.term = getSearchName(searchTerm, false, &step.termLength);
+
+        if (step.term == NULL || step.termLength == 0)
+        {
+                g_free(step.term);
+                return;
+        }
+
+        threshold = threshold < 0 ? 0 : (threshold > 254 ? 254 : threshold);
+
+        if (threshold != index->historyThreshold)
+        {
+                clearSearchHistory(index);
+                index->historyThreshold = threshold;
+        }
+
+        // Searches the new term doesn't start with are of no use anymore
+        while (index->historyDepth > 0 && !startsWith(&index->history[index->historyDepth - 1], step.term, step.termLength))
+                freeSearchStep(&index->history[--index->historyDepth]);
+
+        SearchStep *top = index->historyDepth > 0 ? &index->history[index->historyDepth - 1] : NULL;
+
+        if (top != NULL && top->termLength == step.termLength)
+        {
+                // Searched for this already, like after a backspace
+                g_free(step.term);
+        }
+        else if (findContaining(index, &step, top, isCancelled) && findNearby(index, &step, threshold, isCancelled))
+        {
+                pushSearchStep(index, &step);
+                top = &index->history[index->historyDepth - 1];
+        }
+        else
+        {
+                freeSearchStep(&step);
+                return;
+        }
+
+        for (uint32_t m = 0; m < top->numMatches; m++)
+        {
+                if ((m & SEARCH_CANCEL_CHECK_MASK) == 0 && isCancelled != NULL && isCancelled())
+                        break;
+
+                callback(index->entries[top->matches[m].entry], top->matches[m].distance);
+        }
+}
@@ -0,0 +1,22 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include "directorytree.h"
+
+typedef struct SearchIndex SearchIndex;
+
+typedef void (*SearchResultCallback)(FileSystemEntry *entry, int distance);
+
+// Asked now and then during a search, returning true stops it
+typedef bool (*SearchCancelledCallback)(void);
+
+// Casefolded names of every entry in the tree, the tree must not change while it's in use
+SearchIndex *createSearchIndex(FileSystemEntry *root);
+
+void freeSearchIndex(SearchIndex *index);
+
+// Entries whose name contains the term get distance 0, others within threshold edits their distance. In tree order.
+// Remembers recent terms so adding or removing a letter at the end is cheap.
+void searchIndex(SearchIndex *index, const char *searchTerm, int threshold, SearchResultCallback callback, SearchCancelledCallback isCancelled);
+
+#endif
@@ -53,6 +53,7 @@ AppSettings constructAppSettings(KeyValuePair *pairs, int count)
         c_strcpy(settings.hideGlimmeringText, "0", sizeof(settings.hideGlimmeringText));
         c_strcpy(settings.mouseEnabled, "1", sizeof(settings.mouseEnabled));
         c_strcpy(settings.replayGainCheckFirst, "0", sizeof(settings.replayGainCheckFirst));
+        c_strcpy(settings.replayGainLimiter, "1", sizeof(settings.replayGainLimiter));
         c_strcpy(settings.visualizerBarWidth, "2", sizeof(settings.visualizerBarWidth));
         c_strcpy(settings.visualizerBrailleMode, "0", sizeof(settings.visualizerBrailleMode));
         c_strcpy(settings.progressBarElapsedEvenChar, "━", sizeof(settings.progressBarElapsedEvenChar));
@@ -79,6 +80,10 @@ AppSettings constructAppSettings(KeyValuePair *pairs, int count)
 #endif
         c_strcpy(settings.hideHelp, "0", sizeof(settings.hideHelp));
         c_strcpy(settings.cacheLibrary, "-1", sizeof(settings.cacheLibrary));
+        c_strcpy(settings.watchLibrary, "0", sizeof(settings.watchLibrary));
+        c_strcpy(settings.indexMetadata, "0", sizeof(settings.indexMetadata));
+        c_strcpy(settings.shuffleAlbums, "0", sizeof(settings.shuffleAlbums));
+        c_strcpy(settings.shuffleSeed, "0", sizeof(settings.shuffleSeed));
         c_strcpy(settings.visualizerHeight, "6", sizeof(settings.visualizerHeight));
         c_strcpy(settings.visualizerColorType, "2", sizeof(settings.visualizerColorType));
         c_strcpy(settings.titleDelay, "9", sizeof(settings.titleDelay));
@@ -326,6 +331,26 @@ AppSettings constructAppSettings(KeyValuePair *pairs, int count)
                 {
                         snprintf(settings.replayGainCheckFirst, sizeof(settings.replayGainCheckFirst), "%s", pair->value);
                 }
+                else if (strcmp(lowercaseKey, "replaygainlimiter") == 0)
+                {
+                        snprintf(settings.replayGainLimiter, sizeof(settings.replayGainLimiter), "%s", pair->value);
+                }
+                else if (strcmp(lowercaseKey, "watchlibrary") == 0)
+                {
+                        snprintf(settings.watchLibrary, sizeof(settings.watchLibrary), "%s", pair->value);
+                }
+                else if (strcmp(lowercaseKey, "indexmetadata") == 0)
+                {
+                        snprintf(settings.indexMetadata, sizeof(settings.indexMetadata), "%s", pair->value);
+                }
+                else if (strcmp(lowercaseKey, "shufflealbums") == 0)
+                {
+                        snprintf(settings.shuffleAlbums, sizeof(settings.shuffleAlbums), "%s", pair->value);
+                }
+                else if (strcmp(lowercaseKey, "shuffleseed") == 0)
+                {
+                        snprintf(settings.shuffleSeed, sizeof(settings.shuffleSeed), "%s", pair->value);
+                }
                 else if (strcmp(lowercaseKey, "visualizerbarwidth") == 0)
                 {
                         snprintf(settings.visualizerBarWidth, sizeof(settings.visualizerBarWidth), "%s", pair->value);
@@ -860,6 +885,11 @@ void getConfig(AppSettings *settings, UISettings *ui)
         ui->hideHelp = (settings->hideHelp[0] == '1');
         ui->saveRepeatShuffleSettings = (settings->saveRepeatShuffleSettings[0] == '1');
         ui->trackTitleAsWindowTitle = (settings->trackTitleAsWindowTitle[0] == '1');
+        ui->replayGainLimiter = (settings->replayGainLimiter[0] == '1');
+        ui->watchLibrary = (settings->watchLibrary[0] == '1');
+        ui->indexMetadata = (settings->indexMetadata[0] == '1');
+        ui->shuffleAlbums = (settings->shuffleAlbums[0] == '1');
+        ui->shuffleSeed = strtoull(settings->shuffleSeed, NULL, 10);
 
         int tmp = getNumber(settings->color);
         if (tmp >= 0)
@@ -1009,12 +1039,26 @@ void setConfig(AppSettings *settings, UISettings *ui)
 
         snprintf(settings->cacheLibrary, sizeof(settings->cacheLibrary), "%d", ui->cacheLibrary);
 
+        if (settings->watchLibrary[0] == '\0')
+                ui->watchLibrary ? c_strcpy(settings->watchLibrary, "1", sizeof(settings->watchLibrary)) : c_strcpy(settings->watchLibrary, "0", sizeof(settings->watchLibrary));
+
+        if (settings->indexMetadata[0] == '\0')
+                ui->indexMetadata ? c_strcpy(settings->indexMetadata, "1", sizeof(settings->indexMetadata)) : c_strcpy(settings->indexMetadata, "0", sizeof(settings->indexMetadata));
+
+        if (settings->shuffleAlbums[0] == '\0')
+                ui->shuffleAlbums ? c_strcpy(settings->shuffleAlbums, "1", sizeof(settings->shuffleAlbums)) : c_strcpy(settings->shuffleAlbums, "0", sizeof(settings->shuffleAlbums));
+
+        if (settings->shuffleSeed[0] == '\0')
+                snprintf(settings->shuffleSeed, sizeof(settings->shuffleSeed), "%llu", (unsigned long long)ui->shuffleSeed);
+
         int currentVolume = getCurrentVolume();
         currentVolume = (currentVolume <= 0) ? 10 : currentVolume;
         snprintf(settings->lastVolume, sizeof(settings->lastVolume), "%d", currentVolume);
 
         if (settings->replayGainCheckFirst[0] == '\0')
                 snprintf(settings->replayGainCheckFirst, sizeof(settings->replayGainCheckFirst), "%d", ui->replayGainCheckFirst);
+        if (settings->replayGainLimiter[0] == '\0')
+                ui->replayGainLimiter ? c_strcpy(settings->replayGainLimiter, "1", sizeof(settings->replayGainLimiter)) : c_strcpy(settings->replayGainLimiter, "0", sizeof(settings->replayGainLimiter));
 
         if (settings->color[0] == '\0')
                 snprintf(settings->color, sizeof(settings->color), "%d", ui->mainColor);
@@ -1055,6 +1099,12 @@ void setConfig(AppSettings *settings, UISettings *ui)
         fprintf(file, "# Cache: Set to 1 to use cache of the music library directory tree for faster startup times.\n");
         fprintf(file, "cacheLibrary=%s\n\n", settings->cacheLibrary);
 
+        fprintf(file, "# Set to 1 to update the library while kew is running when music is added or removed (Linux only).\n");
+        fprintf(file, "watchLibrary=%s\n\n", settings->watchLibrary);
+
+        fprintf(file, "# Set to 1 to read the tags and durations of the whole library in the background and keep them in the cache.\n");
+        fprintf(file, "indexMetadata=%s\n\n", settings->indexMetadata);
+
         fprintf(file, "# Delay when drawing title in track view, set to 0 to have no delay.\n");
         fprintf(file, "titleDelay=%s\n\n", settings->titleDelay);
 
@@ -1067,12 +1117,21 @@ void setConfig(AppSettings *settings, UISettings *ui)
         fprintf(file, "# Replay gain check first, can be either 0=track, 1=album or 2=disabled.\n");
         fprintf(file, "replayGainCheckFirst=%s\n\n", settings->replayGainCheckFirst);
 
+        fprintf(file, "# Replay gain limiter, set to 1 to turn down peaks smoothly instead of clipping them when the gain is positive.\n");
+        fprintf(file, "replayGainLimiter=%s\n\n", settings->replayGainLimiter);
+
         fprintf(file, "# Save Repeat and Shuffle Settings.\n");
         fprintf(file, "saveRepeatShuffleSettings=%s\n\n", settings->saveRepeatShuffleSettings);
 
         fprintf(file, "repeatState=%s\n\n", settings->repeatState);
         fprintf(file, "shuffleEnabled=%s\n\n", settings->shuffleEnabled);
 
+        fprintf(file, "# Set to 1 to shuffle whole albums, the tracks of each album play in order.\n");
+        fprintf(file, "shuffleAlbums=%s\n\n", settings->shuffleAlbums);
+
+        fprintf(file, "# Shuffle seed, the same seed gives the same shuffles every time. 0=different every time.\n");
+        fprintf(file, "shuffleSeed=%s\n\n", settings->shuffleSeed);
+
         fprintf(file, "# Set the window title to the title of the currently playing track\n");
         fprintf(file, "trackTitleAsWindowTitle=%s\n\n", settings->trackTitleAsWindowTitle);
 
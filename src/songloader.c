@@ -3,14 +3,18 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 #include "tagLibWrapper.h"
 #include "cache.h"
+#include "covercache.h"
 #include "imgfunc.h"
 #include "file.h"
 #include "sound.h"
 #include "soundcommon.h"
 #include "utils.h"
 #include "songloader.h"
+#include "gain.h"
+#include "librarymetadata.h"
 #include "stb_image.h"
 /*
 
@@ -26,6 +30,9 @@ songloader.c
 
 static guint track_counter = 0;
 
+// The temp cover files are written on the main thread and deleted on the loader thread
+static pthread_mutex_t tmpCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
 void makeFilePath(char *dirPath, char *filePath, struct dirent *entry)
 {
         if (dirPath[strnlen(dirPath, MAXPATHLEN) - 1] == '/')
@@ -198,12 +205,7 @@ gchar *generateTrackId(void)
         return trackId;
 }
 
-void loadColor(SongData *songdata)
-{
-        getCoverColor(songdata->cover, songdata->coverWidth, songdata->coverHeight, &(songdata->red), &(songdata->green), &(songdata->blue));
-}
-
-void loadMetaData(SongData *songdata, AppState *state)
+void loadMetaData(SongData *songdata)
 {
         char path[MAXPATHLEN];
 
@@ -211,9 +213,25 @@ void loadMetaData(SongData *songdata, AppState *state)
         songdata->metadata->replaygainTrack = 0.0;
         songdata->metadata->replaygainAlbum = 0.0;
 
-        generateTempFilePath(songdata->coverArtPath, "cover", ".jpg");
+        TagSettings indexed;
+        double indexedDuration = 0.0;
+        int res;
 
-        int res = extractTags(songdata->filePath, songdata->metadata, &(songdata->duration), songdata->coverArtPath);
+        // The library index already has the tags and duration, the file is only opened for the cover
+        if (getIndexedMetadata(songdata->filePath, &indexed, &indexedDuration))
+        {
+                res = readTags(songdata->filePath, TAG_READ_COVER, songdata->metadata, NULL, &(songdata->coverData), &(songdata->coverDataSize));
+
+                if (res != -2)
+                {
+                        *songdata->metadata = indexed;
+                        songdata->duration = indexedDuration;
+                }
+        }
+        else
+        {
+                res = extractTags(songdata->filePath, songdata->metadata, &(songdata->duration), &(songdata->coverData), &(songdata->coverDataSize));
+        }
 
         if (res == -2)
         {
@@ -254,12 +272,89 @@ void loadMetaData(SongData *songdata, AppState *state)
                 else
                         c_strcpy(songdata->coverArtPath, "", sizeof(songdata->coverArtPath));
         }
+
+        // Embedded covers are decoded straight from the tag, a file is only written if something asks for a path.
+        // Either way the cover cache hands back a downscaled bitmap and its accent color once it has seen the image.
+        if (songdata->coverData != NULL)
+                songdata->cover = loadCoverFromMemory(songdata->coverData, songdata->coverDataSize, &(songdata->coverWidth), &(songdata->coverHeight),
+                                                      &(songdata->red), &(songdata->green), &(songdata->blue), &(songdata->coverId));
         else
+                songdata->cover = loadCoverFromFile(songdata->coverArtPath, &(songdata->coverWidth), &(songdata->coverHeight),
+                                                    &(songdata->red), &(songdata->green), &(songdata->blue), &(songdata->coverId));
+}
+
+const char *getCoverArtPath(SongData *songdata, AppState *state)
+{
+        if (songdata == NULL)
+                return "";
+
+        pthread_mutex_lock(&tmpCacheMutex);
+
+        if (songdata->coverArtPath[0] != '\0' || songdata->coverData == NULL)
         {
-                addToCache(state->tmpCache, songdata->coverArtPath);
+                pthread_mutex_unlock(&tmpCacheMutex);
+                return songdata->coverArtPath;
         }
 
-        songdata->cover = getBitmap(songdata->coverArtPath, &(songdata->coverWidth), &(songdata->coverHeight));
+        char path[MAXPATHLEN];
+
+        generateTempFilePath(path, "cover", ".jpg");
+
+        FILE *file = fopen(path, "wb");
+        if (file == NULL)
+        {
+                perror("getCoverArtPath: fopen");
+                pthread_mutex_unlock(&tmpCacheMutex);
+                return songdata->coverArtPath;
+        }
+
+        size_t written = fwrite(songdata->coverData, 1, songdata->coverDataSize, file);
+
+        if (fclose(file) != 0 || written != songdata->coverDataSize)
+        {
+                fprintf(stderr, "getCoverArtPath: could not write '%s'\n", path);
+                deleteFile(path);
+                pthread_mutex_unlock(&tmpCacheMutex);
+                return songdata->coverArtPath;
+        }
+
+        c_strcpy(songdata->coverArtPath, path, sizeof(songdata->coverArtPath));
+        addToCache(state->tmpCache, songdata->coverArtPath);
+
+        pthread_mutex_unlock(&tmpCacheMutex);
+
+        return songdata->coverArtPath;
+}
+
+// Worked out once per song so the audio path only has to multiply
+static float calcReplayGain(const TagSettings *metadata, int replayGainCheckFirst)
+{
+        if (metadata == NULL)
+                return 1.0f;
+
+        double first, second;
+
+        if (replayGainCheckFirst == 0) // Track first
+        {
+                first = metadata->replaygainTrack;
+                second = metadata->replaygainAlbum;
+        }
+        else if (replayGainCheckFirst == 1) // Album first
+        {
+                first = metadata->replaygainAlbum;
+                second = metadata->replaygainTrack;
+        }
+        else
+        {
+                return 1.0f;
+        }
+
+        if (first > -50.0)
+                return replayGainToLinear(first);
+        else if (second > -50.0)
+                return replayGainToLinear(second);
+
+        return 1.0f;
 }
 
 SongData *loadSongData(char *filePath, AppState *state)
@@ -275,11 +370,25 @@ SongData *loadSongData(char *filePath, AppState *state)
         songdata->blue = defaultColor;
         songdata->metadata = NULL;
         songdata->cover = NULL;
+        songdata->coverData = NULL;
+        songdata->coverDataSize = 0;
+        songdata->coverId = 0;
         songdata->duration = 0.0;
+        songdata->replayGain = 1.0f;
         songdata->avgBitRate = 0;
         c_strcpy(songdata->filePath, filePath, sizeof(songdata->filePath));
-        loadMetaData(songdata, state);
-        loadColor(songdata);
+        loadMetaData(songdata);
+
+        // Headers only estimate the length of some files, use it counted if it was before
+        double exactDuration = getExactDuration(filePath);
+
+        if (exactDuration > 0.0)
+        {
+                songdata->duration = exactDuration;
+                setKnownDuration(filePath, exactDuration);
+        }
+
+        songdata->replayGain = calcReplayGain(songdata->metadata, state->uiSettings.replayGainCheckFirst);
         return songdata;
 }
 
@@ -296,15 +405,21 @@ void unloadSongData(SongData **songdata, AppState *state)
                 data->cover = NULL;
         }
 
+        pthread_mutex_lock(&tmpCacheMutex);
+
         if (existsInCache(state->tmpCache, data->coverArtPath) && isInTempDir(data->coverArtPath))
         {
                 deleteFile(data->coverArtPath);
         }
 
+        pthread_mutex_unlock(&tmpCacheMutex);
+
+        free(data->coverData);
         free(data->metadata);
         free(data->trackId);
 
         data->cover = NULL;
+        data->coverData = NULL;
         data->metadata = NULL;
 
         data->trackId = NULL;
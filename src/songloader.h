@@ -47,10 +47,14 @@ typedef struct
         unsigned char blue;
         TagSettings *metadata;
         unsigned char *cover;
+        unsigned char *coverData; // Embedded picture bytes, NULL when the cover comes from an image file
+        size_t coverDataSize;
+        guint64 coverId;          // Same for every song sharing a cover image, 0 when there is none
         int avgBitRate;
         int coverWidth;
         int coverHeight;
         double duration;
+        float replayGain; // Linear, 1.0 when there is none or it is turned off
         bool hasErrors;
 } SongData;
 
@@ -59,3 +63,5 @@ typedef struct
 SongData *loadSongData(char *filePath, AppState *state);
 
 void unloadSongData(SongData **songdata, AppState *state);
+
+const char *getCoverArtPath(SongData *songdata, AppState *state);
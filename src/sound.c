@@ -36,7 +36,9 @@ ma_result initFirstDatasource(AudioData *pAudioData, UserData *pUserData)
 
         pAudioData->pUserData = pUserData;
         pAudioData->currentPCMFrame = 0;
+        pAudioData->totalFrames = 0;
         pAudioData->restart = false;
+        setDecodingSongChanged();
 
         if (hasBuiltinDecoder(filePath))
         {
@@ -47,7 +49,10 @@ ma_result initFirstDatasource(AudioData *pAudioData, UserData *pUserData)
                 pAudioData->format = first->outputFormat;
                 pAudioData->channels = first->outputChannels;
                 pAudioData->sampleRate = first->outputSampleRate;
-                ma_data_source_get_length_in_pcm_frames(first, &(pAudioData->totalFrames));
+
+                // The length of an mp3 is only known by scanning it, the decode pipeline takes care of that
+                if (!pathEndsWith(filePath, ".mp3"))
+                        ma_data_source_get_length_in_pcm_frames(first, &(pAudioData->totalFrames));
         }
         else if (pathEndsWith(filePath, "opus"))
         {
@@ -114,7 +119,32 @@ ma_result initFirstDatasource(AudioData *pAudioData, UserData *pUserData)
         return MA_SUCCESS;
 }
 
-int createDevice(UserData *userData, ma_device *device, ma_context *context, ma_data_source_vtable *vtable, ma_device_data_proc callback)
+int setupDecodePipeline(const DecoderOps *ops, ma_format format)
+{
+        if (initPcmRing(format, audioData.channels, audioData.sampleRate) < 0)
+        {
+                setErrorMessage("Failed to allocate audio buffer.");
+                return -1;
+        }
+
+        PcmPipeline *pipeline = getPcmPipeline();
+
+        initPipeline(pipeline, ops, &audioData, format);
+
+        // Without the limiter the gain is still applied, only clamped
+        if (initReplayGainStage(&audioData) < 0)
+                fprintf(stderr, "setupDecodePipeline: limiter disabled\n");
+
+        addPipelineStage(pipeline, replayGainStage, getReplayGainStageLatency(&audioData));
+
+        initAudioBuffer(audioData.sampleRate);
+
+        wakeDecodeThread();
+
+        return 0;
+}
+
+int createDevice(UserData *userData, ma_device *device, ma_context *context, ma_data_source_vtable *vtable, const DecoderOps *ops)
 {
         ma_result result;
 
@@ -125,11 +155,14 @@ int createDevice(UserData *userData, ma_device *device, ma_context *context, ma_
 
         audioData.base.vtable = vtable;
 
+        if (setupDecodePipeline(ops, audioData.format) < 0)
+                return -1;
+
         ma_device_config deviceConfig = ma_device_config_init(ma_device_type_playback);
         deviceConfig.playback.format = audioData.format;
         deviceConfig.playback.channels = audioData.channels;
         deviceConfig.sampleRate = audioData.sampleRate;
-        deviceConfig.dataCallback = callback;
+        deviceConfig.dataCallback = ring_on_audio_frames;
         deviceConfig.pUserData = &audioData;
 
         result = ma_device_init(context, &deviceConfig, device);
@@ -149,7 +182,7 @@ int createDevice(UserData *userData, ma_device *device, ma_context *context, ma_
 
 int builtin_createAudioDevice(UserData *userData, ma_device *device, ma_context *context, ma_data_source_vtable *vtable)
 {
-        return createDevice(userData, device, context, vtable, builtin_on_audio_frames);
+        return createDevice(userData, device, context, vtable, &builtinDecoderOps);
 }
 
 int vorbis_createAudioDevice(UserData *userData, ma_device *device, ma_context *context)
@@ -163,12 +196,16 @@ int vorbis_createAudioDevice(UserData *userData, ma_device *device, ma_context *
                 return -1;
         }
         ma_libvorbis *vorbis = getFirstVorbisDecoder();
+
+        if (setupDecodePipeline(&vorbisDecoderOps, vorbis->format) < 0)
+                return -1;
+
         ma_device_config deviceConfig = ma_device_config_init(ma_device_type_playback);
 
         deviceConfig.playback.format = vorbis->format;
         deviceConfig.playback.channels = audioData.channels;
         deviceConfig.sampleRate = audioData.sampleRate;
-        deviceConfig.dataCallback = vorbis_on_audio_frames;
+        deviceConfig.dataCallback = ring_on_audio_frames;
         deviceConfig.pUserData = vorbis;
 
         result = ma_device_init(context, &deviceConfig, device);
@@ -205,12 +242,16 @@ int m4a_createAudioDevice(UserData *userData, ma_device *device, ma_context *con
                 return -1;
         }
         m4a_decoder *decoder = getFirstM4aDecoder();
+
+        if (setupDecodePipeline(&m4aDecoderOps, decoder->format) < 0)
+                return -1;
+
         ma_device_config deviceConfig = ma_device_config_init(ma_device_type_playback);
 
         deviceConfig.playback.format = decoder->format;
         deviceConfig.playback.channels = audioData.channels;
         deviceConfig.sampleRate = audioData.sampleRate;
-        deviceConfig.dataCallback = m4a_on_audio_frames;
+        deviceConfig.dataCallback = ring_on_audio_frames;
         deviceConfig.pUserData = decoder;
 
         result = ma_device_init(context, &deviceConfig, device);
@@ -248,12 +289,15 @@ int opus_createAudioDevice(UserData *userData, ma_device *device, ma_context *co
         }
         ma_libopus *opus = getFirstOpusDecoder();
 
+        if (setupDecodePipeline(&opusDecoderOps, opus->format) < 0)
+                return -1;
+
         ma_device_config deviceConfig = ma_device_config_init(ma_device_type_playback);
 
         deviceConfig.playback.format = opus->format;
         deviceConfig.playback.channels = audioData.channels;
         deviceConfig.sampleRate = audioData.sampleRate;
-        deviceConfig.dataCallback = opus_on_audio_frames;
+        deviceConfig.dataCallback = ring_on_audio_frames;
         deviceConfig.pUserData = opus;
 
         result = ma_device_init(context, &deviceConfig, device);
@@ -288,12 +332,16 @@ int webm_createAudioDevice(UserData *userData, ma_device *device, ma_context *co
                 return -1;
         }
         ma_webm *webm = getFirstWebmDecoder();
+
+        if (setupDecodePipeline(&webmDecoderOps, audioData.format) < 0)
+                return -1;
+
         ma_device_config deviceConfig = ma_device_config_init(ma_device_type_playback);
 
         deviceConfig.playback.format = audioData.format;
         deviceConfig.playback.channels = audioData.channels;
         deviceConfig.sampleRate = audioData.sampleRate;
-        deviceConfig.dataCallback = webm_on_audio_frames;
+        deviceConfig.dataCallback = ring_on_audio_frames;
         deviceConfig.pUserData = webm;
 
         result = ma_device_init(context, &deviceConfig, device);
@@ -716,6 +764,8 @@ void cleanupAudioContext(void)
 
 int createAudioDevice()
 {
+        startDecodeThread();
+
         if (isContextInitialized)
         {
                 ma_context_uninit(&context);
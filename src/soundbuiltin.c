@@ -103,236 +103,25 @@ ma_data_source_vtable builtin_file_data_source_vtable = {
     0 // Flags
 };
 
-double dbToLinear(double db)
+static ma_data_source *getFirstBuiltinDataSource(void)
 {
-        return pow(10.0, db / 20.0);
+        return getFirstDecoder();
 }
 
-void builtin_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+static ma_data_source *getCurrentBuiltinDataSource(void)
 {
-        AudioData *audioData = (AudioData *)pDataSource;
-        ma_uint64 framesRead = 0;
-
-        // Convert ReplayGain dB values to linear gain factors
-        double gainDb = 0.0; // Default to 0 dB (no gain)
-        bool gainAvailable = false;
-
-        if ((!audioData->pUserData->songdataADeleted && audioData->pUserData->currentSongData == audioData->pUserData->songdataA) ||
-            (!audioData->pUserData->songdataBDeleted && audioData->pUserData->currentSongData == audioData->pUserData->songdataB))
-        {
-                if (audioData->pUserData->replayGainCheckFirst == 0)  // Track first
-                {
-                    if (audioData->pUserData->currentSongData->metadata->replaygainTrack > -50.0)
-                    {
-                        gainDb = audioData->pUserData->currentSongData->metadata->replaygainTrack;
-                        gainAvailable = true;
-                    }
-                    else if (audioData->pUserData->currentSongData->metadata->replaygainAlbum > -50.0)
-                    {
-                        gainDb = audioData->pUserData->currentSongData->metadata->replaygainAlbum;
-                        gainAvailable = true;
-                    }
-                }
-                else if (audioData->pUserData->replayGainCheckFirst == 1)  // Album first
-                {
-                    if (audioData->pUserData->currentSongData->metadata->replaygainAlbum > -50.0)
-                    {
-                        gainDb = audioData->pUserData->currentSongData->metadata->replaygainAlbum;
-                        gainAvailable = true;
-                    }
-                    else if (audioData->pUserData->currentSongData->metadata->replaygainTrack > -50.0)
-                    {
-                        gainDb = audioData->pUserData->currentSongData->metadata->replaygainTrack;
-                        gainAvailable = true;
-                    }
-                }
-        }
-
-        double totalGainFactor = 1.0;
-        if (gainAvailable)
-        {
-                totalGainFactor = dbToLinear(gainDb);
-        }
-
-        while (framesRead < frameCount)
-        {
-                ma_uint64 remainingFrames = frameCount - framesRead;
-
-                if (pthread_mutex_trylock(&dataSourceMutex) != 0)
-                {
-                        return;
-                }
-
-                if (isImplSwitchReached() || audioData == NULL)
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
-
-                if (audioData->switchFiles)
-                {
-                        executeSwitch(audioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        break;
-                }
-
-                ma_decoder *decoder = getCurrentBuiltinDecoder();
-
-                if ((getCurrentImplementationType() != BUILTIN && !isSkipToNext()))
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
-
-                if (audioData->totalFrames == 0)
-                        ma_data_source_get_length_in_pcm_frames(decoder, &(audioData->totalFrames));
-
-                if (isSeekRequested())
-                {
-                        ma_uint64 totalFrames = audioData->totalFrames;
-                        ma_uint64 seekPercent = getSeekPercentage();
-                        if (seekPercent >= 100.0)
-                                seekPercent = 100.0;
-                        ma_uint64 targetFrame = (ma_uint64)((totalFrames - 1) * seekPercent / 100.0);
-
-                        if (targetFrame >= totalFrames)
-                                targetFrame = totalFrames - 1;
-
-                        ma_result seekResult = ma_decoder_seek_to_pcm_frame(decoder, targetFrame);
-
-                        if (seekResult != MA_SUCCESS)
-                        {
-                                setSeekRequested(false);
-                                pthread_mutex_unlock(&dataSourceMutex);
-                                return;
-                        }
-
-                        setSeekRequested(false);
-                }
-
-                ma_uint64 framesToRead = 0;
-                ma_decoder *firstDecoder = getFirstDecoder();
-                ma_uint64 cursor = 0;
-                ma_result result;
-
-                if (firstDecoder == NULL)
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
-
-                if (isEOFReached())
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
-
-                result = callReadPCMFrames(
-                        firstDecoder,
-                        audioData->format,
-                        pFramesOut,
-                        framesRead,
-                        audioData->channels,
-                        remainingFrames,
-                        &framesToRead);
-
-                ma_data_source_get_cursor_in_pcm_frames(decoder, &cursor);
-
-                float *frames = (float *)pFramesOut + framesRead * audioData->channels;
-
-                // Apply replay gain
-                if (totalGainFactor != 1.0)
-                {
-                        switch (audioData->format)
-                        {
-                        case ma_format_f32:
-                                for (ma_uint64 i = 0; i < framesToRead; ++i)
-                                {
-                                        for (int ch = 0; ch < (int)audioData->channels; ++ch)
-                                        {
-                                                ma_uint64 frameIndex = i * audioData->channels + ch;
-                                                float originalSample = frames[frameIndex];
-                                                double sample = (double)originalSample;
-
-                                                sample *= totalGainFactor;
-                                                frames[frameIndex] = (float)sample;
-                                        }
-                                }
-                                break;
-
-                        case ma_format_s16:
-                                for (ma_uint64 i = 0; i < framesToRead; ++i)
-                                {
-                                        for (int ch = 0; ch < (int)audioData->channels; ++ch)
-                                        {
-                                                ma_uint64 frameIndex = i * audioData->channels + ch;
-                                                ma_int16 originalSample = frames[frameIndex];
-                                                double sample = (double)originalSample;
-
-                                                sample *= totalGainFactor;
-
-                                                if (sample > 32767.0)
-                                                        sample = 32767.0;
-                                                else if (sample < -32768.0)
-                                                        sample = -32768.0;
-
-                                                frames[frameIndex] = (ma_int16)sample;
-                                        }
-                                }
-                                break;
-
-                        case ma_format_s32:
-                                for (ma_uint64 i = 0; i < framesToRead; ++i)
-                                {
-                                        for (int ch = 0; ch < (int)audioData->channels; ++ch)
-                                        {
-                                                ma_uint64 frameIndex = i * audioData->channels + ch;
-                                                ma_int32 originalSample = frames[frameIndex];
-                                                double sample = (double)originalSample;
-
-                                                sample *= totalGainFactor;
-
-                                                // Clamp
-                                                if (sample > 2147483647.0)
-                                                        sample = 2147483647.0;
-                                                else if (sample < -2147483648.0)
-                                                        sample = -2147483648.0;
-
-                                                frames[frameIndex] = (ma_int32)sample;
-                                        }
-                                }
-                                break;
-
-                        default:
-                                break;
-                        }
-                }
-
-                if (((audioData->totalFrames != 0 && cursor != 0 && cursor >= audioData->totalFrames) || framesToRead == 0 || isSkipToNext() || result != MA_SUCCESS) && !isEOFReached())
-                {
-                        activateSwitch(audioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        continue;
-                }
-
-                framesRead += framesToRead;
-                setBufferSize(framesToRead);
-
-                pthread_mutex_unlock(&dataSourceMutex);
-        }
-
-        setAudioBuffer(pFramesOut, framesRead, audioData->sampleRate, audioData->channels, audioData->format);
-
-        if (pFramesRead != NULL)
-        {
-                *pFramesRead = framesRead;
-        }
+        return getCurrentBuiltinDecoder();
 }
 
-void builtin_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
+static ma_result seekBuiltin(ma_data_source *pDecoder, ma_uint64 frameIndex)
 {
-        AudioData *pDataSource = (AudioData *)pDevice->pUserData;
-        ma_uint64 framesRead = 0;
-        builtin_read_pcm_frames(&(pDataSource->base), pFramesOut, frameCount, &framesRead);
-        (void)pFramesIn;
+        return ma_decoder_seek_to_pcm_frame((ma_decoder *)pDecoder, frameIndex);
 }
+
+const DecoderOps builtinDecoderOps = {
+    BUILTIN,
+    getFirstBuiltinDataSource,
+    getCurrentBuiltinDataSource,
+    seekBuiltin,
+    NULL,
+    NULL};
@@ -1,5 +1,7 @@
 #include "soundcommon.h"
 #include "playerops.h"
+#include "ringbuffer.h"
+#include "gain.h"
 
 /*
 
@@ -11,6 +13,11 @@ soundcommon.c
 
 #define MAX_DECODERS 2
 
+#define RING_BUFFER_MILLISECONDS 100
+#define DECODE_CHUNK_FRAMES 2048
+#define DECODE_IDLE_MILLISECONDS 20 // Longest the decode thread sleeps when nobody wakes it
+#define KNOWN_DURATIONS 4
+
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
@@ -27,7 +34,6 @@ bool hasSilentlySwitched;
 
 int hopSize = 512;
 int fftSize = 2048;
-int prevFftSize = 0;
 int fftSizeMilliseconds = 45;
 
 float seekPercent = 0.0;
@@ -39,9 +45,10 @@ _Atomic bool readingFrames = false;
 pthread_mutex_t dataSourceMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t switchMutex = PTHREAD_MUTEX_INITIALIZER;
 ma_device device = {0};
-static float audioBuffer[MAX_BUFFER_SIZE];
-static int writeHead = 0;
-bool bufferReady = false;
+#define AUDIO_BUFFER_MASK (MAX_BUFFER_SIZE - 1)
+
+static float audioBuffer[MAX_BUFFER_SIZE]; // Circular, holds the downmixed samples for the visualizer
+static _Atomic size_t audioBufferSequence = 0; // Samples written so far, the write index is this & AUDIO_BUFFER_MASK
 AudioData audioData;
 int bufSize;
 ma_event switchAudioImpl;
@@ -69,6 +76,28 @@ m4a_decoder *m4aDecoders[MAX_DECODERS];
 m4a_decoder *firstM4aDecoder;
 #endif
 
+static RingBuffer pcmRing = {0};
+static size_t ringTargetFrames = 0;
+static unsigned char *decodeBuffer = NULL;
+static size_t decodeBufferBytes = 0;
+static unsigned char *carryBuffer = NULL; // First frames of the chained song, read together with the end of the one before
+static ma_uint64 carriedFrames = 0;
+static bool carryWaitsForSwitch = false; // The switch to the carried song is still to be activated
+static PcmPipeline pcmPipeline = {0};
+static pthread_t decodeThread;
+static _Atomic bool decodeThreadRunning = false;
+static _Atomic bool decodeWakePending = false;
+static pthread_mutex_t decodeWakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decodeWakeCond = PTHREAD_COND_INITIALIZER;
+static _Atomic bool switchExecuted = false;
+static _Atomic bool switchPending = false;
+static _Atomic bool flushBeforeWrite = false;
+static _Atomic bool flushOnSwitch = false;
+static SoftLimiter replayGainLimiter = {0};
+static char decodingPath[MAXPATHLEN];   // Song being decoded, decode thread only
+static double decodingDuration = 0.0;
+static _Atomic bool decodingSongChanged = true;
+
 int decoderIndex = -1;
 int m4aDecoderIndex = -1;
 int opusDecoderIndex = -1;
@@ -438,6 +467,85 @@ void getFileInfo(const char *filename, ma_uint32 *sampleRate, ma_uint32 *channel
         }
 }
 
+typedef struct
+{
+        char filePath[MAXPATHLEN];
+        double duration;
+} KnownDuration;
+
+// Counted lengths of the songs about to play, for formats whose headers can't be trusted
+static KnownDuration knownDurations[KNOWN_DURATIONS];
+static int knownDurationsNext = 0;
+static pthread_mutex_t knownDurationsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void setKnownDuration(const char *filePath, double duration)
+{
+        if (filePath == NULL || duration <= 0.0)
+                return;
+
+        pthread_mutex_lock(&knownDurationsMutex);
+
+        KnownDuration *known = &knownDurations[knownDurationsNext];
+
+        for (int i = 0; i < KNOWN_DURATIONS; i++)
+        {
+                if (strcmp(knownDurations[i].filePath, filePath) == 0)
+                {
+                        known = &knownDurations[i];
+                        break;
+                }
+        }
+
+        if (known == &knownDurations[knownDurationsNext])
+                knownDurationsNext = (knownDurationsNext + 1) % KNOWN_DURATIONS;
+
+        c_strcpy(known->filePath, filePath, sizeof(known->filePath));
+        known->duration = duration;
+
+        pthread_mutex_unlock(&knownDurationsMutex);
+}
+
+double getKnownDuration(const char *filePath)
+{
+        double duration = 0.0;
+
+        if (filePath == NULL || filePath[0] == '\0')
+                return duration;
+
+        pthread_mutex_lock(&knownDurationsMutex);
+
+        for (int i = 0; i < KNOWN_DURATIONS; i++)
+        {
+                if (strcmp(knownDurations[i].filePath, filePath) == 0)
+                {
+                        duration = knownDurations[i].duration;
+                        break;
+                }
+        }
+
+        pthread_mutex_unlock(&knownDurationsMutex);
+
+        return duration;
+}
+
+// Decodes the frame headers of the whole file, slow for long mp3s so keep it off the decode thread
+double calcExactDuration(const char *filePath)
+{
+        ma_decoder tmp;
+        ma_uint64 frames = 0;
+        double duration = 0.0;
+
+        if (ma_decoder_init_file(filePath, NULL, &tmp) != MA_SUCCESS)
+                return duration;
+
+        if (ma_decoder_get_length_in_pcm_frames(&tmp, &frames) == MA_SUCCESS && tmp.outputSampleRate > 0)
+                duration = (double)frames / tmp.outputSampleRate;
+
+        ma_decoder_uninit(&tmp);
+
+        return duration;
+}
+
 void getVorbisFileInfo(const char *filename, ma_format *format, ma_uint32 *channels, ma_uint32 *sampleRate, ma_channel *channelMap)
 {
         ma_libvorbis decoder;
@@ -722,147 +830,158 @@ ma_int32 unpack_s24(const ma_uint8 *p)
         return sample;
 }
 
-void setAudioBuffer(
-    void *buf,
-    int numFrames,
-    ma_uint32 sampleRate,
-    ma_uint32 channels,
-    ma_format format)
+// Works out the analysis window for a sample rate, only needed when the device is created
+void initAudioBuffer(ma_uint32 sampleRate)
 {
-        int bufIndex = 0;
-
-        // Dynamically determine FFT and hop size
         float hopFraction = 0.25f; // 25% hop (75% overlap)
 
         // Compute power-of-two window/hop sizes in samples
         int wantFFTSamples = (int)(fftSizeMilliseconds * sampleRate / 1000.0f);
-        fftSize = closestPowerOfTwo(wantFFTSamples);       // 2048 or 4096
-        int wantHopSamples = (int)(fftSize * hopFraction); // 25% of window length
-        hopSize = closestPowerOfTwo(wantHopSamples);       // 256, 512, 1024
+        int newFftSize = closestPowerOfTwo(wantFFTSamples);     // 2048 or 4096
+        int wantHopSamples = (int)(newFftSize * hopFraction);   // 25% of window length
+        int newHopSize = closestPowerOfTwo(wantHopSamples);     // 256, 512, 1024
 
-        if (fftSize > MAX_BUFFER_SIZE)
-                fftSize = MAX_BUFFER_SIZE;
+        if (newFftSize > MAX_BUFFER_SIZE / 2)
+                newFftSize = MAX_BUFFER_SIZE / 2;
 
         // Ensure hop is never >= window
-        if (hopSize >= fftSize)
-                hopSize = fftSize / 2; // fallback minimum overlap
+        if (newHopSize >= newFftSize)
+                newHopSize = newFftSize / 2; // fallback minimum overlap
 
-        while (bufIndex < numFrames)
-        {
-
-                if (writeHead >= fftSize)
-                        break;
+        hopSize = newHopSize;
+        fftSize = newFftSize;
+}
 
-                int framesLeft = numFrames - bufIndex;
-                int spaceLeft = fftSize - writeHead;
-                int framesToCopy = framesLeft < spaceLeft ? framesLeft : spaceLeft;
+// Runs on the audio thread: downmixes into the circular buffer, then publishes the new sequence
+void setAudioBuffer(
+    void *buf,
+    int numFrames,
+    ma_uint32 channels,
+    ma_format format)
+{
+        size_t head = atomic_load_explicit(&audioBufferSequence, memory_order_relaxed);
 
-                switch (format)
-                {
-                case ma_format_u8:
+        switch (format)
+        {
+        case ma_format_u8:
+        {
+                ma_uint8 *src = (ma_uint8 *)buf;
+                for (int i = 0; i < numFrames; ++i)
                 {
-                        ma_uint8 *src = (ma_uint8 *)buf + bufIndex * channels;
-                        for (int i = 0; i < framesToCopy; ++i)
+                        float sum = 0.0f;
+                        for (ma_uint32 ch = 0; ch < channels; ++ch)
                         {
-                                float sum = 0.0f;
-                                for (ma_uint32 ch = 0; ch < channels; ++ch)
-                                {
-                                        // Convert 0..255 to -1..1
-                                        sum += ((float)src[i * channels + ch] - 128.0f) / 128.0f;
-                                }
-                                audioBuffer[writeHead++] = sum / channels;
+                                // Convert 0..255 to -1..1
+                                sum += ((float)src[i * channels + ch] - 128.0f) / 128.0f;
                         }
-                        break;
+                        audioBuffer[head++ & AUDIO_BUFFER_MASK] = sum / channels;
                 }
-                case ma_format_s16:
+                break;
+        }
+        case ma_format_s16:
+        {
+                ma_int16 *src = (ma_int16 *)buf;
+                for (int i = 0; i < numFrames; ++i)
                 {
-                        ma_int16 *src = (ma_int16 *)buf + bufIndex * channels;
-                        for (int i = 0; i < framesToCopy; ++i)
+                        float sum = 0.0f;
+                        for (ma_uint32 ch = 0; ch < channels; ++ch)
                         {
-                                float sum = 0.0f;
-                                for (ma_uint32 ch = 0; ch < channels; ++ch)
-                                {
-                                        sum += (float)src[i * channels + ch] / 32768.0f;
-                                }
-                                audioBuffer[writeHead++] = sum / channels;
+                                sum += (float)src[i * channels + ch] / 32768.0f;
                         }
-                        break;
+                        audioBuffer[head++ & AUDIO_BUFFER_MASK] = sum / channels;
                 }
-                case ma_format_s24:
+                break;
+        }
+        case ma_format_s24:
+        {
+                ma_uint8 *src = (ma_uint8 *)buf;
+                for (int i = 0; i < numFrames; ++i)
                 {
-                        ma_uint8 *src = (ma_uint8 *)buf + bufIndex * channels * 3;
-                        for (int i = 0; i < framesToCopy; ++i)
+                        float sum = 0.0f;
+                        for (ma_uint32 ch = 0; ch < channels; ++ch)
                         {
-                                float sum = 0.0f;
-                                for (ma_uint32 ch = 0; ch < channels; ++ch)
-                                {
-                                        int idx = i * channels * 3 + ch * 3;
-                                        int32_t s = unpack_s24(&src[idx]);
-                                        sum += (float)s / 8388608.0f;
-                                }
-                                audioBuffer[writeHead++] = sum / channels;
+                                int idx = i * channels * 3 + ch * 3;
+                                int32_t s = unpack_s24(&src[idx]);
+                                sum += (float)s / 8388608.0f;
                         }
-                        break;
+                        audioBuffer[head++ & AUDIO_BUFFER_MASK] = sum / channels;
                 }
-                case ma_format_s32:
+                break;
+        }
+        case ma_format_s32:
+        {
+                int32_t *src = (int32_t *)buf;
+                for (int i = 0; i < numFrames; ++i)
                 {
-                        int32_t *src = (int32_t *)buf + bufIndex * channels;
-                        for (int i = 0; i < framesToCopy; ++i)
+                        float sum = 0.0f;
+                        for (ma_uint32 ch = 0; ch < channels; ++ch)
                         {
-                                float sum = 0.0f;
-                                for (ma_uint32 ch = 0; ch < channels; ++ch)
-                                {
-                                        sum += (float)src[i * channels + ch] / 2147483648.0f;
-                                }
-                                audioBuffer[writeHead++] = sum / channels;
+                                sum += (float)src[i * channels + ch] / 2147483648.0f;
                         }
-                        break;
+                        audioBuffer[head++ & AUDIO_BUFFER_MASK] = sum / channels;
                 }
-                case ma_format_f32:
+                break;
+        }
+        case ma_format_f32:
+        {
+                float *src = (float *)buf;
+                for (int i = 0; i < numFrames; ++i)
                 {
-                        float *src = (float *)buf + bufIndex * channels;
-                        for (int i = 0; i < framesToCopy; ++i)
+                        float sum = 0.0f;
+                        for (ma_uint32 ch = 0; ch < channels; ++ch)
                         {
-                                float sum = 0.0f;
-                                for (ma_uint32 ch = 0; ch < channels; ++ch)
-                                {
-                                        sum += src[i * channels + ch];
-                                }
-                                audioBuffer[writeHead++] = sum / channels;
+                                sum += src[i * channels + ch];
                         }
-                        break;
-                }
-                default:
-                        fprintf(stderr, "Unsupported format in setAudioBuffer!\n");
-                        return;
-                }
-                bufIndex += framesToCopy;
-
-                // Process full window(s), maintain overlap (hop)
-                while (writeHead >= fftSize)
-                {
-                        bufferReady = true; // let main loop know FFT is ready
-
-                        // Shift buffer for overlap (keep last fftSize-hopSize samples)
-                        memmove(
-                            audioBuffer,
-                            audioBuffer + hopSize,
-                            sizeof(float) * (fftSize - hopSize));
-                        writeHead -= hopSize;
+                        audioBuffer[head++ & AUDIO_BUFFER_MASK] = sum / channels;
                 }
+                break;
+        }
+        default:
+                return;
         }
+
+        atomic_store_explicit(&audioBufferSequence, head, memory_order_release);
 }
 
+// The sequence keeps counting so a reader never sees it go backwards
 void resetAudioBuffer(void)
 {
-        memset(audioBuffer, 0, sizeof(ma_int32) * MAX_BUFFER_SIZE);
-        writeHead = 0;
-        bufferReady = false;
+        memset(audioBuffer, 0, sizeof(audioBuffer));
 }
 
-void *getAudioBuffer(void)
+// Copies the latest size samples into window. Returns false until hopSize new samples
+// have arrived since the last window, or if the writer lapped the window while it was copied.
+bool getAudioWindow(float *window, int size)
 {
-        return audioBuffer;
+        static size_t lastSequence = 0;
+
+        if (window == NULL || size <= 0 || size > MAX_BUFFER_SIZE)
+                return false;
+
+        size_t sequence = atomic_load_explicit(&audioBufferSequence, memory_order_acquire);
+
+        if (sequence < (size_t)size || sequence - lastSequence < (size_t)hopSize)
+                return false;
+
+        size_t start = (sequence - size) & AUDIO_BUFFER_MASK;
+        size_t firstPart = MAX_BUFFER_SIZE - start;
+
+        if (firstPart > (size_t)size)
+                firstPart = size;
+
+        memcpy(window, audioBuffer + start, sizeof(float) * firstPart);
+
+        if ((size_t)size > firstPart)
+                memcpy(window + firstPart, audioBuffer, sizeof(float) * (size - firstPart));
+
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&audioBufferSequence, memory_order_relaxed) - (sequence - size) > MAX_BUFFER_SIZE)
+                return false;
+
+        lastSequence = sequence;
+
+        return true;
 }
 
 bool isRepeatEnabled(void)
@@ -903,6 +1022,9 @@ bool isSkipToNext(void)
 void setSkipToNext(bool value)
 {
         skipToNext = value;
+
+        if (value)
+                wakeDecodeThread();
 }
 
 double getSeekElapsed(void)
@@ -928,6 +1050,7 @@ void setEOFReached(void)
 void setEOFNotReached(void)
 {
         atomic_store(&EOFReached, false);
+        wakeDecodeThread();
 }
 
 bool isImplSwitchReached(void)
@@ -943,6 +1066,7 @@ void setImplSwitchReached(void)
 void setImplSwitchNotReached(void)
 {
         atomic_store(&switchReached, false);
+        wakeDecodeThread();
 }
 
 bool isPlaying(void)
@@ -975,12 +1099,16 @@ bool isSeekRequested(void)
 void setSeekRequested(bool value)
 {
         seekRequested = value;
+
+        if (value)
+                wakeDecodeThread();
 }
 
 void seekPercentage(float percent)
 {
         seekPercent = percent;
         seekRequested = true;
+        wakeDecodeThread();
 }
 
 void stopPlayback(void)
@@ -1033,8 +1161,10 @@ void clearCurrentTrack(void)
                 ma_device_stop(&device);
         }
 
+        pthread_mutex_lock(&dataSourceMutex);
         ma_data_source_set_next(currentDecoder, NULL);
         resetAllDecoders();
+        pthread_mutex_unlock(&dataSourceMutex);
 }
 
 void togglePausePlayback(void)
@@ -1080,10 +1210,21 @@ void setCurrentFileIndex(AudioData *pAudioData, int index)
         pthread_mutex_lock(&switchMutex);
         pAudioData->currentFileIndex = index;
         pthread_mutex_unlock(&switchMutex);
+
+        setDecodingSongChanged();
+        wakeDecodeThread();
+}
+
+void setDecodingSongChanged(void)
+{
+        atomic_store(&decodingSongChanged, true);
 }
 
 void activateSwitch(AudioData *pAudioData)
 {
+        if (isSkipToNext())
+                atomic_store(&flushOnSwitch, true);
+
         setSkipToNext(false);
 
         if (!isRepeatEnabled())
@@ -1110,597 +1251,757 @@ void executeSwitch(AudioData *pAudioData)
         switchDecoder(&vorbisDecoderIndex);
         switchDecoder(&webmDecoderIndex);
 
-        pAudioData->pUserData->currentSongData = (pAudioData->currentFileIndex == 0) ? pAudioData->pUserData->songdataA : pAudioData->pUserData->songdataB;
         pAudioData->totalFrames = 0;
         pAudioData->currentPCMFrame = 0;
+        setDecodingSongChanged();
+
+        // Don't let the tail of a skipped track leak out of the limiter delay
+        if (atomic_load(&flushOnSwitch))
+                resetReplayGainStage();
+
+        // The rest of the switch is done by the audio callback once the frames before it have been played
+        atomic_store(&switchExecuted, true);
+}
+
+static void applySwitch(AudioData *pAudioData)
+{
+        pAudioData->pUserData->currentSongData = (pAudioData->currentFileIndex == 0) ? pAudioData->pUserData->songdataA : pAudioData->pUserData->songdataB;
 
         setSeekElapsed(0.0);
 
         setEOFReached();
 }
 
-int getCurrentVolume(void)
+void discardBufferedFrames(void)
 {
-        return soundVolume;
+        resetReplayGainStage();
+        atomic_store(&flushBeforeWrite, true);
 }
 
-void setVolume(int volume)
+int initPcmRing(ma_format format, ma_uint32 channels, ma_uint32 sampleRate)
 {
-        if (volume > 100)
-        {
-                volume = 100;
-        }
-        else if (volume < 0)
+        ma_uint32 bytesPerFrame = ma_get_bytes_per_frame(format, channels);
+
+        if (bytesPerFrame == 0 || sampleRate == 0)
+                return -1;
+
+        ringTargetFrames = (size_t)sampleRate * RING_BUFFER_MILLISECONDS / 1000;
+
+        if (initRingBuffer(&pcmRing, ringTargetFrames + DECODE_CHUNK_FRAMES, bytesPerFrame) < 0)
+                return -1;
+
+        if (decodeBufferBytes < (size_t)DECODE_CHUNK_FRAMES * bytesPerFrame)
         {
-                volume = 0;
-        }
+                unsigned char *buffer = realloc(decodeBuffer, (size_t)DECODE_CHUNK_FRAMES * bytesPerFrame);
 
-        soundVolume = volume;
+                if (buffer == NULL)
+                {
+                        fprintf(stderr, "initPcmRing: realloc\n");
+                        return -1;
+                }
 
-        ma_device_set_master_volume(getDevice(), (float)volume / 100);
-}
+                decodeBuffer = buffer;
 
-int adjustVolumePercent(int volumeChange)
-{
-        soundVolume += volumeChange;
+                buffer = realloc(carryBuffer, (size_t)DECODE_CHUNK_FRAMES * bytesPerFrame);
 
-        setVolume(soundVolume);
+                if (buffer == NULL)
+                {
+                        fprintf(stderr, "initPcmRing: realloc\n");
+                        return -1;
+                }
+
+                carryBuffer = buffer;
+                decodeBufferBytes = (size_t)DECODE_CHUNK_FRAMES * bytesPerFrame;
+        }
+
+        carriedFrames = 0;
+        carryWaitsForSwitch = false;
+
+        atomic_store(&switchExecuted, false);
+        atomic_store(&switchPending, false);
+        atomic_store(&flushBeforeWrite, false);
+        atomic_store(&flushOnSwitch, false);
 
         return 0;
 }
 
-ma_uint64 lastCursor = 0;
-
-ma_result callReadPCMFrames(
-    ma_data_source *pDataSource,
-    ma_format format,
-    void *pFramesOut,
-    ma_uint64 framesRead,
-    ma_uint32 channels,
-    ma_uint64 remainingFrames,
-    ma_uint64 *pFramesToRead)
+// Decodes one chunk into the ring buffer. Returns false if there was nothing to do.
+static bool decodeIntoRing(void)
 {
-        ma_result result;
+        pthread_mutex_lock(&dataSourceMutex);
 
-        switch (format)
-        {
-        case ma_format_u8:
+        if (pcmPipeline.ops == NULL || pcmRing.data == NULL || isImplSwitchReached() ||
+            ma_device_get_state(&device) == ma_device_state_uninitialized)
         {
-                ma_uint8 *pOut = (ma_uint8 *)pFramesOut;
-                result = ma_data_source_read_pcm_frames(
-                    pDataSource,
-                    pOut + (framesRead * channels),
-                    remainingFrames,
-                    pFramesToRead);
+                pthread_mutex_unlock(&dataSourceMutex);
+                return false;
         }
-        break;
 
-        case ma_format_s16:
-        {
-                ma_int16 *pOut = (ma_int16 *)pFramesOut;
-                result = ma_data_source_read_pcm_frames(
-                    pDataSource,
-                    pOut + (framesRead * channels),
-                    remainingFrames,
-                    pFramesToRead);
-        }
-        break;
+        size_t buffered = ringBufferAvailableRead(&pcmRing);
+        size_t space = ringBufferAvailableWrite(&pcmRing);
 
-        case ma_format_s24:
+        // A chunk can need a flush, a flush on switch and a switch. Waiting for the callback to take
+        // the queued ones until they fit means those can always be pushed.
+        if (buffered >= ringTargetFrames || space == 0 || ringMessagesAvailableWrite(&pcmRing) < 3)
         {
-                ma_uint8 *pOut = (ma_uint8 *)pFramesOut;
-                result = ma_data_source_read_pcm_frames(
-                    pDataSource,
-                    pOut + (framesRead * channels * 3),
-                    remainingFrames,
-                    pFramesToRead);
+                pthread_mutex_unlock(&dataSourceMutex);
+                return false;
         }
-        break;
 
-        case ma_format_s32:
+        ma_uint64 framesToDecode = space < DECODE_CHUNK_FRAMES ? space : DECODE_CHUNK_FRAMES;
+        ma_uint64 framesDecoded = 0;
+
+        pipeline_read_pcm_frames(&pcmPipeline, decodeBuffer, framesToDecode, &framesDecoded);
+
+        // A seek happened before these frames were decoded, drop what is still queued
+        if (atomic_exchange(&flushBeforeWrite, false))
+                pushRingMessage(&pcmRing, RING_MSG_FLUSH, ringBufferWritePosition(&pcmRing));
+
+        ringBufferWrite(&pcmRing, decodeBuffer, (size_t)framesDecoded);
+
+        // The frames after the switch belong to the next track and keep being decoded while the
+        // callback plays up to it, the track is only switched for the listener when it gets there
+        if (atomic_exchange(&switchExecuted, false))
         {
-                ma_int32 *pOut = (ma_int32 *)pFramesOut;
-                result = ma_data_source_read_pcm_frames(
-                    pDataSource,
-                    pOut + (framesRead * channels),
-                    remainingFrames,
-                    pFramesToRead);
+                size_t position = ringBufferWritePosition(&pcmRing);
+
+                // Skipping shouldn't wait for the rest of the old track to play
+                if (atomic_exchange(&flushOnSwitch, false))
+                        pushRingMessage(&pcmRing, RING_MSG_FLUSH, position);
+
+                atomic_store(&switchPending, true);
+                pushRingMessage(&pcmRing, RING_MSG_SWITCH, position);
         }
-        break;
 
-        case ma_format_f32:
+        pthread_mutex_unlock(&dataSourceMutex);
+
+        return framesDecoded > 0;
+}
+
+void wakeDecodeThread(void)
+{
+        pthread_mutex_lock(&decodeWakeMutex);
+        atomic_store(&decodeWakePending, true);
+        pthread_cond_signal(&decodeWakeCond);
+        pthread_mutex_unlock(&decodeWakeMutex);
+}
+
+// The audio callback can't take the mutex, so a wakeup can slip in just before the wait and be lost.
+// The timeout catches that, and the request setters above never lose theirs.
+static void wakeDecodeThreadFromCallback(void)
+{
+        if (!atomic_exchange(&decodeWakePending, true))
+                pthread_cond_signal(&decodeWakeCond);
+}
+
+static void waitForDecodeWork(void)
+{
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)DECODE_IDLE_MILLISECONDS * 1000000L;
+
+        if (deadline.tv_nsec >= 1000000000L)
         {
-                float *pOut = (float *)pFramesOut;
-                result = ma_data_source_read_pcm_frames(
-                    pDataSource,
-                    pOut + (framesRead * channels),
-                    remainingFrames,
-                    pFramesToRead);
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
         }
-        break;
 
-        default:
+        pthread_mutex_lock(&decodeWakeMutex);
+
+        if (!atomic_load(&decodeWakePending) && atomic_load(&decodeThreadRunning))
+                pthread_cond_timedwait(&decodeWakeCond, &decodeWakeMutex, &deadline);
+
+        pthread_mutex_unlock(&decodeWakeMutex);
+}
+
+static void *decodeThreadFunction(void *arg)
+{
+        (void)arg;
+
+        while (atomic_load(&decodeThreadRunning))
         {
-                result = MA_INVALID_ARGS;
-        }
-        break;
+                // Cleared before looking, so a request made while decoding isn't slept through
+                atomic_store(&decodeWakePending, false);
+
+                if (!decodeIntoRing())
+                        waitForDecodeWork();
         }
 
-        return result;
+        return NULL;
 }
 
-#ifdef USE_FAAD
-void m4a_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+void startDecodeThread(void)
 {
-        m4a_decoder *m4a = (m4a_decoder *)pDataSource;
-        AudioData *pAudioData = (AudioData *)m4a->pReadSeekTellUserData;
-        ma_uint64 framesRead = 0;
+        if (atomic_load(&decodeThreadRunning))
+                return;
 
-        while (framesRead < frameCount)
+        atomic_store(&decodeThreadRunning, true);
+
+        if (pthread_create(&decodeThread, NULL, decodeThreadFunction, NULL) != 0)
         {
-                if (isImplSwitchReached())
-                        return;
+                perror("pthread_create");
+                atomic_store(&decodeThreadRunning, false);
+        }
+}
 
-                if (pthread_mutex_trylock(&dataSourceMutex) != 0)
-                {
-                        return;
-                }
+void stopDecodeThread(void)
+{
+        if (!atomic_load(&decodeThreadRunning))
+                return;
 
-                // Check if a file switch is required
-                if (pAudioData->switchFiles)
-                {
-                        executeSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        break; // Exit the loop after the file switch
-                }
+        atomic_store(&decodeThreadRunning, false);
+        wakeDecodeThread();
+        pthread_join(decodeThread, NULL);
 
-                if (getCurrentImplementationType() != M4A && !isSkipToNext())
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+        free(decodeBuffer);
+        free(carryBuffer);
+        decodeBuffer = NULL;
+        carryBuffer = NULL;
+        decodeBufferBytes = 0;
+        carriedFrames = 0;
+}
 
-                m4a_decoder *decoder = getCurrentM4aDecoder();
+// Only call once the playback device is gone
+void freePcmRing(void)
+{
+        freeRingBuffer(&pcmRing);
+        freeSoftLimiter(&replayGainLimiter);
+}
 
-                if (pAudioData->totalFrames == 0)
-                        ma_data_source_get_length_in_pcm_frames(decoder, &(pAudioData->totalFrames));
+// Runs on the audio thread: no locks and no decoder calls, only copying out of the ring buffer and waking the decoder
+void ring_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
+{
+        (void)pFramesIn;
 
-                // Check if seeking is requested
-                if (isSeekRequested())
-                {
-                        if (decoder->fileType != k_rawAAC)
-                        {
-                                ma_uint64 totalFrames = pAudioData->totalFrames;
-                                ma_uint64 seekPercent = getSeekPercentage();
+        unsigned char *out = (unsigned char *)pFramesOut;
+        size_t bytesPerFrame = pcmRing.bytesPerFrame;
+        size_t framesRead = 0;
 
-                                if (seekPercent >= 100.0)
-                                        seekPercent = 100.0;
+        while (framesRead < frameCount)
+        {
+                size_t framesWanted = frameCount - framesRead;
+                RingMessage message;
 
-                                ma_uint64 targetFrame = (ma_uint64)((totalFrames - 1) * seekPercent / 100.0);
+                if (peekRingMessage(&pcmRing, &message))
+                {
+                        size_t readPos = ringBufferReadPosition(&pcmRing);
 
-                                if (targetFrame >= totalFrames)
-                                        targetFrame = totalFrames - 1;
+                        if (message.type == RING_MSG_FLUSH)
+                        {
+                                ringBufferSkipTo(&pcmRing, message.position);
+                                popRingMessage(&pcmRing);
+                                continue;
+                        }
 
-                                // Set the read pointer for the decoder
-                                ma_result seekResult = m4a_decoder_seek_to_pcm_frame(decoder, targetFrame);
-                                if (seekResult != MA_SUCCESS)
-                                {
-                                        // Handle seek error
-                                        setSeekRequested(false);
-                                        pthread_mutex_unlock(&dataSourceMutex);
-                                        return;
-                                }
+                        // The next track follows in the same period
+                        if (message.position == readPos)
+                        {
+                                popRingMessage(&pcmRing);
+                                applySwitch(&audioData);
+                                atomic_store(&switchPending, false);
+                                continue;
                         }
 
-                        setSeekRequested(false); // Reset seek flag
+                        if (message.position - readPos < framesWanted)
+                                framesWanted = message.position - readPos;
                 }
 
-                // Read from the current decoder
-                ma_uint64 framesToRead = 0;
-                ma_result result;
-                ma_uint64 remainingFrames = frameCount - framesRead;
-                m4a_decoder *firstDecoder = getFirstM4aDecoder();
-                ma_uint64 cursor = 0;
+                size_t framesCopied = ringBufferRead(&pcmRing, out + framesRead * bytesPerFrame, framesWanted);
 
-                if (firstDecoder == NULL)
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+                if (framesCopied == 0)
+                        break;
 
-                result = callReadPCMFrames(
-                    firstDecoder,
-                    m4a->format,
-                    pFramesOut,
-                    framesRead,
-                    pAudioData->channels,
-                    remainingFrames,
-                    &framesToRead);
+                framesRead += framesCopied;
+        }
 
-                ma_data_source_get_cursor_in_pcm_frames(decoder, &cursor);
-
-                if (((cursor != 0 && cursor == lastCursor) || framesToRead == 0 || isSkipToNext() || result != MA_SUCCESS) && !isEOFReached())
-                {
-                        activateSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        continue;
-                }
+        // There is room in the ring again
+        if (framesRead > 0)
+        {
+                setAudioBuffer(out, (int)framesRead, pDevice->playback.channels, pDevice->playback.format);
+                wakeDecodeThreadFromCallback();
+        }
 
-                lastCursor = cursor;
+        if (framesRead < frameCount)
+                ma_silence_pcm_frames(out + framesRead * bytesPerFrame, frameCount - framesRead, pDevice->playback.format, pDevice->playback.channels);
+}
 
-                framesRead += framesToRead;
-                setBufferSize(framesToRead);
+int getCurrentVolume(void)
+{
+        return soundVolume;
+}
 
-                pthread_mutex_unlock(&dataSourceMutex);
+void setVolume(int volume)
+{
+        if (volume > 100)
+        {
+                volume = 100;
         }
-
-        setAudioBuffer(pFramesOut, framesRead, pAudioData->sampleRate, pAudioData->channels, pAudioData->format);
-
-        if (pFramesRead != NULL)
+        else if (volume < 0)
         {
-                *pFramesRead = framesRead;
+                volume = 0;
         }
+
+        soundVolume = volume;
+
+        ma_device_set_master_volume(getDevice(), (float)volume / 100);
 }
 
-void m4a_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
+int adjustVolumePercent(int volumeChange)
 {
-        AudioData *pDataSource = (AudioData *)pDevice->pUserData;
-        ma_uint64 framesRead = 0;
-        m4a_read_pcm_frames(&(pDataSource->base), pFramesOut, frameCount, &framesRead);
-        (void)pFramesIn;
+        soundVolume += volumeChange;
+
+        setVolume(soundVolume);
+
+        return 0;
 }
-#endif
 
-void opus_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+static ma_uint64 lastCursor = 0;
+
+static ma_data_source *getFirstOpusDataSource(void)
 {
-        ma_libopus *opus = (ma_libopus *)pDataSource;
-        AudioData *pAudioData = (AudioData *)opus->pReadSeekTellUserData;
+        return getFirstOpusDecoder();
+}
 
-        ma_uint64 framesRead = 0;
+static ma_data_source *getCurrentOpusDataSource(void)
+{
+        return getCurrentOpusDecoder();
+}
 
-        while (framesRead < frameCount)
-        {
-                if (isImplSwitchReached())
-                        return;
+static ma_result seekOpus(ma_data_source *pDecoder, ma_uint64 frameIndex)
+{
+        return ma_libopus_seek_to_pcm_frame((ma_libopus *)pDecoder, frameIndex);
+}
 
-                if (pthread_mutex_trylock(&dataSourceMutex) != 0)
-                {
-                        return;
-                }
+static ma_data_source *getFirstVorbisDataSource(void)
+{
+        return getFirstVorbisDecoder();
+}
 
-                // Check if a file switch is required
-                if (pAudioData->switchFiles)
-                {
-                        executeSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        break; // Exit the loop after the file switch
-                }
+static ma_data_source *getCurrentVorbisDataSource(void)
+{
+        return getCurrentVorbisDecoder();
+}
 
-                if (getCurrentImplementationType() != OPUS && !isSkipToNext())
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+static ma_result seekVorbis(ma_data_source *pDecoder, ma_uint64 frameIndex)
+{
+        return ma_libvorbis_seek_to_pcm_frame((ma_libvorbis *)pDecoder, frameIndex);
+}
 
-                ma_libopus *decoder = getCurrentOpusDecoder();
+static ma_data_source *getFirstWebmDataSource(void)
+{
+        return getFirstWebmDecoder();
+}
 
-                if (pAudioData->totalFrames == 0)
-                        ma_data_source_get_length_in_pcm_frames(decoder, &(pAudioData->totalFrames));
+static ma_data_source *getCurrentWebmDataSource(void)
+{
+        return getCurrentWebmDecoder();
+}
 
-                // Check if seeking is requested
-                if (isSeekRequested())
-                {
-                        ma_uint64 totalFrames = 0;
-                        ma_libopus_get_length_in_pcm_frames(decoder, &totalFrames);
-                        ma_uint64 seekPercent = getSeekPercentage();
-                        if (seekPercent >= 100.0)
-                                seekPercent = 100.0;
-                        ma_uint64 targetFrame = (ma_uint64)((totalFrames - 1) * seekPercent / 100.0);
-
-                        if (targetFrame >= totalFrames)
-                                targetFrame = totalFrames - 1;
-
-                        // Set the read pointer for the decoder
-                        ma_result seekResult = ma_libopus_seek_to_pcm_frame(decoder, targetFrame);
-                        if (seekResult != MA_SUCCESS)
-                        {
-                                // Handle seek error
-                                setSeekRequested(false);
-                                pthread_mutex_unlock(&dataSourceMutex);
-                                return;
-                        }
+static ma_result seekWebm(ma_data_source *pDecoder, ma_uint64 frameIndex)
+{
+        return ma_webm_seek_to_pcm_frame((ma_webm *)pDecoder, frameIndex);
+}
 
-                        setSeekRequested(false); // Reset seek flag
-                }
+const DecoderOps opusDecoderOps = {
+    OPUS,
+    getFirstOpusDataSource,
+    getCurrentOpusDataSource,
+    seekOpus,
+    NULL,
+    NULL};
 
-                // Read from the current decoder
-                ma_uint64 framesToRead = 0;
-                ma_result result;
-                ma_uint64 remainingFrames = frameCount - framesRead;
-                ma_libopus *firstDecoder = getFirstOpusDecoder();
-                ma_uint64 cursor = 0;
+const DecoderOps vorbisDecoderOps = {
+    VORBIS,
+    getFirstVorbisDataSource,
+    getCurrentVorbisDataSource,
+    seekVorbis,
+    NULL,
+    NULL};
 
-                if (firstDecoder == NULL)
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+const DecoderOps webmDecoderOps = {
+    WEBM,
+    getFirstWebmDataSource,
+    getCurrentWebmDataSource,
+    seekWebm,
+    NULL,
+    NULL};
 
-                if (isEOFReached())
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+#ifdef USE_FAAD
+static ma_data_source *getFirstM4aDataSource(void)
+{
+        return getFirstM4aDecoder();
+}
 
-                result = callReadPCMFrames(
-                    firstDecoder,
-                    opus->format,
-                    pFramesOut,
-                    framesRead,
-                    pAudioData->channels,
-                    remainingFrames,
-                    &framesToRead);
+static ma_data_source *getCurrentM4aDataSource(void)
+{
+        return getCurrentM4aDecoder();
+}
 
-                ma_data_source_get_cursor_in_pcm_frames(decoder, &cursor);
+static ma_result seekM4a(ma_data_source *pDecoder, ma_uint64 frameIndex)
+{
+        return m4a_decoder_seek_to_pcm_frame((m4a_decoder *)pDecoder, frameIndex);
+}
 
-                if (((cursor != 0 && cursor >= pAudioData->totalFrames) || framesToRead == 0 || isSkipToNext() || result != MA_SUCCESS) && !isEOFReached())
-                {
-                        activateSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        continue;
-                }
+static bool canSeekM4a(ma_data_source *pDecoder)
+{
+        return ((m4a_decoder *)pDecoder)->fileType != k_rawAAC;
+}
 
-                framesRead += framesToRead;
-                setBufferSize(framesToRead);
+// The m4a length isn't reliable, the track has ended when the cursor stops moving
+static bool isM4aAtEnd(AudioData *pAudioData, ma_uint64 cursor)
+{
+        (void)pAudioData;
 
-                pthread_mutex_unlock(&dataSourceMutex);
-        }
+        if (cursor != 0 && cursor == lastCursor)
+                return true;
 
-        setAudioBuffer(pFramesOut, framesRead, pAudioData->sampleRate, pAudioData->channels, pAudioData->format);
+        lastCursor = cursor;
 
-        if (pFramesRead != NULL)
-        {
-                *pFramesRead = framesRead;
-        }
+        return false;
+}
+
+const DecoderOps m4aDecoderOps = {
+    M4A,
+    getFirstM4aDataSource,
+    getCurrentM4aDataSource,
+    seekM4a,
+    canSeekM4a,
+    isM4aAtEnd};
+#endif
+
+int initReplayGainStage(AudioData *pAudioData)
+{
+        return initSoftLimiter(&replayGainLimiter, pAudioData->channels, pAudioData->sampleRate);
 }
 
-void opus_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
+// Decode thread only
+void resetReplayGainStage(void)
 {
-        AudioData *pDataSource = (AudioData *)pDevice->pUserData;
-        ma_uint64 framesRead = 0;
-        opus_read_pcm_frames(&(pDataSource->base), pFramesOut, frameCount, &framesRead);
-        (void)pFramesIn;
+        resetSoftLimiter(&replayGainLimiter);
 }
 
-void vorbis_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+// Frames are decoded ahead of playback, so this is the song being decoded, not necessarily currentSongData
+static float getDecodingReplayGain(AudioData *pAudioData)
 {
-        ma_libvorbis *vorbis = (ma_libvorbis *)pDataSource;
-        AudioData *pAudioData = (AudioData *)vorbis->pReadSeekTellUserData;
+        UserData *pUserData = pAudioData->pUserData;
 
-        ma_uint64 framesRead = 0;
+        if (pUserData == NULL)
+                return 1.0f;
 
-        while (framesRead < frameCount)
+        SongData *songData = (pAudioData->currentFileIndex == 0) ? pUserData->songdataA : pUserData->songdataB;
+        bool deleted = (pAudioData->currentFileIndex == 0) ? pUserData->songdataADeleted : pUserData->songdataBDeleted;
+
+        return (!deleted && songData != NULL) ? songData->replayGain : 1.0f;
+}
+
+static bool isReplayGainLimited(AudioData *pAudioData)
+{
+        return pAudioData->pUserData != NULL && pAudioData->pUserData->replayGainLimiter && replayGainLimiter.block != NULL;
+}
+
+ma_uint32 getReplayGainStageLatency(AudioData *pAudioData)
+{
+        return isReplayGainLimited(pAudioData) ? replayGainLimiter.lookAhead - 1 : 0;
+}
+
+ma_uint64 replayGainStage(AudioData *pAudioData, float replayGain, ma_format format, void *pFrames, ma_uint64 frameCount, ma_uint64 capacity, bool songEnded)
+{
+        if (!isReplayGainLimited(pAudioData))
         {
-                if (isImplSwitchReached())
-                        return;
+                applyGain(pFrames, format, frameCount * pAudioData->channels, replayGain);
+                return frameCount;
+        }
 
-                if (pthread_mutex_trylock(&dataSourceMutex) != 0)
-                {
-                        return;
-                }
+        // Only positive gain or frames still held back from one go through the limiter
+        ma_uint64 framesOut = applyGainWithLimiter(&replayGainLimiter, pFrames, format, frameCount, capacity, replayGain);
 
-                // Check if a file switch is required
-                if (pAudioData->switchFiles)
-                {
-                        executeSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        break;
-                }
+        // Whatever follows, the end of the song isn't kept waiting in the look-ahead
+        if (songEnded)
+        {
+                ma_uint32 bytesPerFrame = ma_get_bytes_per_frame(format, pAudioData->channels);
 
-                ma_libvorbis *decoder = getCurrentVorbisDecoder();
+                framesOut += drainSoftLimiter(&replayGainLimiter, (ma_uint8 *)pFrames + framesOut * bytesPerFrame, format, capacity - framesOut);
+        }
 
-                if (pAudioData->totalFrames == 0)
-                        ma_data_source_get_length_in_pcm_frames(decoder, &(pAudioData->totalFrames));
+        return framesOut;
+}
 
-                if ((getCurrentImplementationType() != VORBIS && !isSkipToNext()) || (decoder == NULL))
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+PcmPipeline *getPcmPipeline(void)
+{
+        return &pcmPipeline;
+}
 
-                // Check if seeking is requested
-                if (isSeekRequested())
-                {
-                        ma_uint64 totalFrames = 0;
-                        ma_libvorbis_get_length_in_pcm_frames(decoder, &totalFrames);
-                        ma_uint64 seekPercent = getSeekPercentage();
-                        if (seekPercent >= 100.0)
-                                seekPercent = 100.0;
-                        ma_uint64 targetFrame = (ma_uint64)((totalFrames - 1) * seekPercent / 100.0);
-
-                        if (targetFrame >= totalFrames)
-                                targetFrame = totalFrames - 1;
-
-                        // Set the read pointer for the decoder
-                        ma_result seekResult = ma_libvorbis_seek_to_pcm_frame(decoder, targetFrame);
-                        if (seekResult != MA_SUCCESS)
-                        {
-                                // Handle seek error
-                                setSeekRequested(false);
-                                pthread_mutex_unlock(&dataSourceMutex);
-                                return;
-                        }
+void initPipeline(PcmPipeline *pipeline, const DecoderOps *ops, AudioData *pAudioData, ma_format format)
+{
+        pipeline->ops = ops;
+        pipeline->pAudioData = pAudioData;
+        pipeline->format = format;
+        pipeline->numStages = 0;
+        pipeline->reservedFrames = 0;
+        lastCursor = 0;
+        carriedFrames = 0;
+        carryWaitsForSwitch = false;
+}
 
-                        setSeekRequested(false); // Reset seek flag
-                }
+int addPipelineStage(PcmPipeline *pipeline, pcm_stage_func stage, ma_uint32 latency)
+{
+        if (pipeline->numStages >= MAX_PIPELINE_STAGES)
+                return -1;
 
-                // Read from the current decoder
-                ma_uint64 framesToRead = 0;
-                ma_result result;
-                ma_uint64 framesRequested = frameCount - framesRead;
-                ma_libvorbis *firstDecoder = getFirstVorbisDecoder();
-                ma_uint64 cursor = 0;
+        pipeline->stages[pipeline->numStages++] = stage;
+        pipeline->reservedFrames += latency;
 
-                if (firstDecoder == NULL)
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+        return 0;
+}
 
-                if (isEOFReached())
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+// Path and header duration of the song being decoded, looked up once per song
+static const char *getDecodingSong(AudioData *pAudioData, double *duration)
+{
+        if (atomic_exchange(&decodingSongChanged, false) && pAudioData->pUserData != NULL)
+        {
+                pthread_mutex_lock(&switchMutex);
 
-                result = callReadPCMFrames(
-                    firstDecoder,
-                    vorbis->format,
-                    pFramesOut,
-                    framesRead,
-                    pAudioData->channels,
-                    framesRequested,
-                    &framesToRead);
+                SongData *songData = (pAudioData->currentFileIndex == 0) ? pAudioData->pUserData->songdataA : pAudioData->pUserData->songdataB;
 
-                ma_data_source_get_cursor_in_pcm_frames(decoder, &cursor);
+                decodingPath[0] = '\0';
+                decodingDuration = 0.0;
 
-                if (((cursor != 0 && cursor >= pAudioData->totalFrames) || isSkipToNext() || result != MA_SUCCESS) &&
-                    !isEOFReached())
+                if (songData != NULL)
                 {
-                        activateSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        continue;
+                        c_strcpy(decodingPath, songData->filePath, sizeof(decodingPath));
+                        decodingDuration = songData->duration;
                 }
 
-                framesRead += framesToRead;
-                setBufferSize(framesToRead);
-
-                pthread_mutex_unlock(&dataSourceMutex);
+                pthread_mutex_unlock(&switchMutex);
         }
 
-        setAudioBuffer(pFramesOut, framesRead, pAudioData->sampleRate, pAudioData->channels, pAudioData->format);
+        *duration = decodingDuration;
 
-        if (pFramesRead != NULL)
+        return decodingPath;
+}
+
+// Asking an mp3 decoder for its length scans the whole file, so that is left to the loader thread.
+// Until it has counted the song this returns 0, the end is found by running out of frames.
+static ma_uint64 getTotalFrames(const DecoderOps *ops, ma_data_source *decoder, AudioData *pAudioData, ma_uint64 *estimate)
+{
+        ma_uint64 totalFrames = 0;
+        double duration = 0.0;
+        const char *filePath = getDecodingSong(pAudioData, &duration);
+
+        *estimate = (ma_uint64)(duration * pAudioData->sampleRate);
+
+        if (ops->type != BUILTIN || !pathEndsWith(filePath, ".mp3"))
         {
-                *pFramesRead = framesRead;
+                ma_data_source_get_length_in_pcm_frames(decoder, &totalFrames);
+                return totalFrames;
         }
+
+        double known = getKnownDuration(filePath);
+
+        if (known > 0.0)
+                totalFrames = (ma_uint64)llround(known * pAudioData->sampleRate);
+
+        return totalFrames;
 }
 
-void vorbis_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
+// Reading from the first decoder runs on into the chained one once the current one is done.
+// Returns how many of the frames just read came from the chained decoder, or -1 if the chain is still on the current one.
+static ma_int64 countChainedFrames(ma_data_source *firstDecoder, ma_data_source *decoder, ma_uint64 framesRead)
 {
-        AudioData *pDataSource = (AudioData *)pDevice->pUserData;
-        ma_uint64 framesRead = 0;
-        vorbis_read_pcm_frames(&(pDataSource->base), pFramesOut, frameCount, &framesRead);
-        (void)pFramesIn;
+        ma_data_source *current = ma_data_source_get_current(firstDecoder);
+        ma_uint64 cursor = 0;
+
+        if (current == NULL || current == decoder || current != ma_data_source_get_next(decoder))
+                return -1;
+
+        if (ma_data_source_get_cursor_in_pcm_frames(current, &cursor) != MA_SUCCESS)
+                cursor = 0;
+
+        return (ma_int64)(cursor < framesRead ? cursor : framesRead);
 }
 
-void webm_read_pcm_frames(ma_data_source *pDataSource, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+// Keeps the chained song's first frames for the chunk after the switch, so each chunk is one song's
+static void carryChainedFrames(const ma_uint8 *pFrames, ma_uint64 frameCount, ma_uint32 bytesPerFrame)
 {
-        ma_webm *webm = (ma_webm *)pDataSource;
-        AudioData *pAudioData = (AudioData *)webm->pReadSeekTellUserData;
+        if (carryBuffer == NULL || frameCount > DECODE_CHUNK_FRAMES)
+                return;
 
+        memcpy(carryBuffer, pFrames, frameCount * bytesPerFrame);
+        carriedFrames = frameCount;
+}
+
+// Drives the decoders of any implementation: seeking, gapless switching to the chained decoder, then the stages
+void pipeline_read_pcm_frames(PcmPipeline *pipeline, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead)
+{
+        const DecoderOps *ops = pipeline->ops;
+        AudioData *pAudioData = pipeline->pAudioData;
+        ma_uint32 bytesPerFrame = ma_get_bytes_per_frame(pipeline->format, pAudioData->channels);
         ma_uint64 framesRead = 0;
+        bool songEnded = false;
 
-        while (framesRead < frameCount)
-        {
-                if (isImplSwitchReached())
-                        return;
+        // The stages may let out frames they held back, there has to be room for them
+        ma_uint64 framesToFill = frameCount > pipeline->reservedFrames ? frameCount - pipeline->reservedFrames : 0;
 
-                if (pthread_mutex_trylock(&dataSourceMutex) != 0)
+        // The chained song started while a switch was still pending, it can be switched to once playback got there
+        if (carryWaitsForSwitch)
+        {
+                if (atomic_load(&switchPending))
                 {
+                        if (pFramesRead != NULL)
+                                *pFramesRead = 0;
                         return;
                 }
 
+                // A skip goes somewhere else, the frames are dropped with the rest of the song
+                if (isSkipToNext())
+                        carriedFrames = 0;
+
+                carryWaitsForSwitch = false;
+                activateSwitch(pAudioData);
+        }
+
+        // A chunk is never mixed, so the stages see one song with its own replay gain
+        float replayGain = getDecodingReplayGain(pAudioData);
+
+        if (carriedFrames > 0 && !pAudioData->switchFiles)
+        {
+                ma_uint64 frames = carriedFrames < framesToFill ? carriedFrames : framesToFill;
+
+                memcpy(pFramesOut, carryBuffer, frames * bytesPerFrame);
+                memmove(carryBuffer, carryBuffer + frames * bytesPerFrame, (carriedFrames - frames) * bytesPerFrame);
+
+                carriedFrames -= frames;
+                framesRead = frames;
+        }
+
+        while (framesRead < framesToFill)
+        {
+                if (isImplSwitchReached())
+                        break;
+
                 // Check if a file switch is required
                 if (pAudioData->switchFiles)
                 {
                         executeSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
+                        songEnded = true;
                         break;
                 }
 
-                ma_webm *decoder = getCurrentWebmDecoder();
+                if (getCurrentImplementationType() != ops->type && !isSkipToNext())
+                        break;
 
-                if (pAudioData->totalFrames == 0)
-                        ma_data_source_get_length_in_pcm_frames(decoder, &(pAudioData->totalFrames));
+                ma_data_source *decoder = ops->getCurrentDecoder();
 
-                if ((getCurrentImplementationType() != WEBM && !isSkipToNext()) || (decoder == NULL))
-                {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+                if (decoder == NULL)
+                        break;
+
+                ma_uint64 estimatedFrames = pAudioData->totalFrames;
+
+                if (pAudioData->totalFrames == 0)
+                        pAudioData->totalFrames = getTotalFrames(ops, decoder, pAudioData, &estimatedFrames);
 
                 // Check if seeking is requested
                 if (isSeekRequested())
                 {
-                        ma_uint64 totalFrames = 0;
-                        ma_webm_get_length_in_pcm_frames(decoder, &totalFrames);
-                        ma_uint64 seekPercent = getSeekPercentage();
-                        if (seekPercent >= 100.0)
-                                seekPercent = 100.0;
-                        ma_uint64 targetFrame = (ma_uint64)((totalFrames - 1) * seekPercent / 100.0);
-
-                        if (targetFrame >= totalFrames)
-                                targetFrame = totalFrames - 1;
-
-                        // Set the read pointer for the decoder
-                        ma_result seekResult = ma_webm_seek_to_pcm_frame(decoder, targetFrame);
-                        if (seekResult != MA_SUCCESS)
+                        ma_uint64 totalFrames = (pAudioData->totalFrames != 0) ? pAudioData->totalFrames : estimatedFrames;
+
+                        if (totalFrames != 0 && (ops->canSeek == NULL || ops->canSeek(decoder)))
                         {
-                                // Handle seek error
-                                setSeekRequested(false);
-                                pthread_mutex_unlock(&dataSourceMutex);
-                                return;
+                                double seekPercent = getSeekPercentage();
+
+                                if (seekPercent >= 100.0)
+                                        seekPercent = 100.0;
+
+                                ma_uint64 targetFrame = (ma_uint64)((totalFrames - 1) * seekPercent / 100.0);
+
+                                if (targetFrame >= totalFrames)
+                                        targetFrame = totalFrames - 1;
+
+                                if (ops->seek(decoder, targetFrame) != MA_SUCCESS)
+                                {
+                                        setSeekRequested(false);
+                                        break;
+                                }
+
+                                discardBufferedFrames();
+
+                                // Whatever was read before the seek goes with the rest
+                                framesRead = 0;
+                                carriedFrames = 0;
                         }
 
-                        setSeekRequested(false); // Reset seek flag
+                        setSeekRequested(false);
                 }
 
-                // Read from the current decoder
+                ma_data_source *firstDecoder = ops->getFirstDecoder();
+
+                if (firstDecoder == NULL || isEOFReached())
+                        break;
+
+                // Read through the chain starting at the first decoder, so the next track follows without a gap
                 ma_uint64 framesToRead = 0;
-                ma_result result;
-                ma_uint64 framesRequested = frameCount - framesRead;
-                ma_webm *firstDecoder = getFirstWebmDecoder();
                 ma_uint64 cursor = 0;
+                ma_result result = ma_data_source_read_pcm_frames(
+                    firstDecoder,
+                    (ma_uint8 *)pFramesOut + framesRead * bytesPerFrame,
+                    framesToFill - framesRead,
+                    &framesToRead);
+
+                ma_data_source_get_cursor_in_pcm_frames(decoder, &cursor);
+
+                bool atEnd = (ops->isAtEnd != NULL)
+                                 ? ops->isAtEnd(pAudioData, cursor)
+                                 : (pAudioData->totalFrames != 0 && cursor != 0 && cursor >= pAudioData->totalFrames);
 
-                if (firstDecoder == NULL)
+                // The song ended somewhere in this read if the chain moved on, even when its length isn't known
+                ma_int64 chainedFrames = countChainedFrames(firstDecoder, decoder, framesToRead);
+                ma_uint64 songFrames = framesToRead;
+
+                if (chainedFrames >= 0)
                 {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
+                        atEnd = true;
+                        songFrames -= (ma_uint64)chainedFrames;
                 }
 
-                if (isEOFReached())
+                if ((atEnd || framesToRead == 0 || isSkipToNext() || result != MA_SUCCESS) && !isEOFReached())
                 {
-                        pthread_mutex_unlock(&dataSourceMutex);
-                        return;
-                }
+                        ma_uint8 *pChained = (ma_uint8 *)pFramesOut + (framesRead + songFrames) * bytesPerFrame;
 
-                result = callReadPCMFrames(
-                    firstDecoder,
-                    webm->format,
-                    pFramesOut,
-                    framesRead,
-                    pAudioData->channels,
-                    framesRequested,
-                    &framesToRead);
+                        // One switch at a time, the next waits until playback has reached the last
+                        if (atomic_load(&switchPending))
+                        {
+                                framesRead += songFrames;
 
-                ma_data_source_get_cursor_in_pcm_frames(decoder, &cursor);
+                                if (chainedFrames > 0 && !isSkipToNext())
+                                {
+                                        carryChainedFrames(pChained, (ma_uint64)chainedFrames, bytesPerFrame);
+                                        carryWaitsForSwitch = true;
+                                }
+
+                                break;
+                        }
+
+                        // The last frames of the song end the chunk, the chained song's first ones start the next. Only a skip drops them.
+                        if (!isSkipToNext())
+                        {
+                                framesRead += songFrames;
+                                setBufferSize(songFrames);
+
+                                if (chainedFrames > 0)
+                                        carryChainedFrames(pChained, (ma_uint64)chainedFrames, bytesPerFrame);
+                        }
 
-                if (((cursor != 0 && cursor >= pAudioData->totalFrames) || isSkipToNext() || result != MA_SUCCESS) &&
-                    !isEOFReached())
-                {
                         activateSwitch(pAudioData);
-                        pthread_mutex_unlock(&dataSourceMutex);
                         continue;
                 }
 
                 framesRead += framesToRead;
                 setBufferSize(framesToRead);
-
-                pthread_mutex_unlock(&dataSourceMutex);
         }
 
-        setAudioBuffer(pFramesOut, framesRead, pAudioData->sampleRate, pAudioData->channels, pAudioData->format);
+        for (int i = 0; i < pipeline->numStages; i++)
+                framesRead = pipeline->stages[i](pAudioData, replayGain, pipeline->format, pFramesOut, framesRead, frameCount, songEnded);
 
         if (pFramesRead != NULL)
         {
@@ -1816,17 +2117,3 @@ ma_webm *getCurrentWebmDecoder(void)
                 return webmDecoders[webmDecoderIndex];
 }
 
-void webm_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount)
-{
-        AudioData *pDataSource = (AudioData *)pDevice->pUserData;
-        ma_uint64 framesRead = 0;
-        webm_read_pcm_frames(&(pDataSource->base), pFramesOut, frameCount, &framesRead);
-
-        if (framesRead < frameCount)
-        {
-                ma_webm *webm = (ma_webm *)&(pDataSource->base);
-                float *output = (float *)pFramesOut;
-                memset(output + framesRead * webm->channels, 0, (frameCount - framesRead) * webm->channels * sizeof(float));
-        }
-        (void)pFramesIn;
-}
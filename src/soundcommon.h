@@ -64,10 +64,14 @@ typedef struct
         unsigned char blue;
         TagSettings *metadata;
         unsigned char *cover;
+        unsigned char *coverData; // Embedded picture bytes, NULL when the cover comes from an image file
+        size_t coverDataSize;
+        guint64 coverId;          // Same for every song sharing a cover image, 0 when there is none
         int avgBitRate;
         int coverWidth;
         int coverHeight;
         double duration;
+        float replayGain; // Linear, 1.0 when there is none or it is turned off
         bool hasErrors;
 } SongData;
 #endif
@@ -81,6 +85,7 @@ typedef struct
         bool songdataADeleted;
         bool songdataBDeleted;
         int replayGainCheckFirst;
+        bool replayGainLimiter;
         SongData *currentSongData;
         ma_uint32 currentPCMFrame;
 } UserData;
@@ -119,9 +124,47 @@ enum AudioImplementation
 struct m4a_decoder;
 typedef struct m4a_decoder m4a_decoder;
 
+#ifndef MAX_PIPELINE_STAGES
+#define MAX_PIPELINE_STAGES 4
+#endif
+
+// What the decode pipeline needs to know about one decoder implementation
+typedef struct
+{
+        enum AudioImplementation type;
+        ma_data_source *(*getFirstDecoder)(void);   // Head of the chain, reading starts here
+        ma_data_source *(*getCurrentDecoder)(void); // The decoder of the track that is playing
+        ma_result (*seek)(ma_data_source *pDecoder, ma_uint64 frameIndex);
+        bool (*canSeek)(ma_data_source *pDecoder);                // Optional, seeking always allowed if NULL
+        bool (*isAtEnd)(AudioData *pAudioData, ma_uint64 cursor); // Optional, compares against totalFrames if NULL
+} DecoderOps;
+
+// A chunk never spans two songs, replayGain is that of its song and songEnded is set on the chunk the song ends in.
+// A stage may hold frames back and let them out later, up to capacity. Returns how many frames it left in pFrames.
+typedef ma_uint64 (*pcm_stage_func)(AudioData *pAudioData, float replayGain, ma_format format, void *pFrames, ma_uint64 frameCount, ma_uint64 capacity, bool songEnded);
+
+typedef struct
+{
+        const DecoderOps *ops;
+        AudioData *pAudioData;
+        ma_format format;
+        pcm_stage_func stages[MAX_PIPELINE_STAGES];
+        int numStages;
+        ma_uint32 reservedFrames; // Room left in every chunk for the frames the stages hold back
+} PcmPipeline;
+
+extern const DecoderOps opusDecoderOps;
+
+extern const DecoderOps vorbisDecoderOps;
+
+extern const DecoderOps webmDecoderOps;
+
+#ifdef USE_FAAD
+extern const DecoderOps m4aDecoderOps;
+#endif
+
 extern int hopSize;
 extern int fftSize;
-extern int prevFftSize;
 
 typedef void (*uninit_func)(void *decoder);
 
@@ -129,8 +172,6 @@ extern AppState appState;
 
 extern AudioData audioData;
 
-extern bool bufferReady;
-
 extern double elapsedSeconds;
 
 extern bool hasSilentlySwitched;
@@ -201,18 +242,23 @@ ma_libvorbis *getFirstVorbisDecoder(void);
 
 void getFileInfo(const char *filename, ma_uint32 *sampleRate, ma_uint32 *channels, ma_format *format);
 
-void initAudioBuffer(void);
+double calcExactDuration(const char *filePath);
+
+// Lets the decode thread end the song at its counted length instead of scanning for it
+void setKnownDuration(const char *filePath, double duration);
+
+double getKnownDuration(const char *filePath);
 
-void *getAudioBuffer(void);
+void initAudioBuffer(ma_uint32 sampleRate);
 
-void setAudioBuffer(void *buf, int numSamples, ma_uint32 sampleRate, ma_uint32 channels, ma_format format);
+bool getAudioWindow(float *window, int size);
+
+void setAudioBuffer(void *buf, int numFrames, ma_uint32 channels, ma_format format);
 
 int32_t unpack_s24(const ma_uint8* p);
 
 void resetAudioBuffer(void);
 
-void freeAudioBuffer(void);
-
 bool isRepeatEnabled(void);
 
 void setRepeatEnabled(bool value);
@@ -275,6 +321,9 @@ bool hasBuiltinDecoder(char *filePath);
 
 void setCurrentFileIndex(AudioData *pAudioData, int index);
 
+// The decode thread looks up the path and duration of the song it decodes again
+void setDecodingSongChanged(void);
+
 void activateSwitch(AudioData *pPCMDataSource);
 
 void executeSwitch(AudioData *pPCMDataSource);
@@ -287,11 +336,38 @@ void setVolume(int volume);
 
 int adjustVolumePercent(int volumeChange);
 
-void m4a_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
+PcmPipeline *getPcmPipeline(void);
+
+void initPipeline(PcmPipeline *pipeline, const DecoderOps *ops, AudioData *pAudioData, ma_format format);
+
+// latency is the most frames the stage holds back at a time
+int addPipelineStage(PcmPipeline *pipeline, pcm_stage_func stage, ma_uint32 latency);
+
+void pipeline_read_pcm_frames(PcmPipeline *pipeline, void *pFramesOut, ma_uint64 frameCount, ma_uint64 *pFramesRead);
+
+int initReplayGainStage(AudioData *pAudioData);
+
+void resetReplayGainStage(void);
+
+ma_uint32 getReplayGainStageLatency(AudioData *pAudioData);
 
-void opus_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
+ma_uint64 replayGainStage(AudioData *pAudioData, float replayGain, ma_format format, void *pFrames, ma_uint64 frameCount, ma_uint64 capacity, bool songEnded);
 
-void vorbis_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
+
+int initPcmRing(ma_format format, ma_uint32 channels, ma_uint32 sampleRate);
+
+void discardBufferedFrames(void);
+
+void startDecodeThread(void);
+
+void stopDecodeThread(void);
+
+// Tells the decode thread there is something to do, instead of it finding out on its next poll
+void wakeDecodeThread(void);
+
+void freePcmRing(void);
+
+void ring_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
 
 void logTime(const char *message);
 
@@ -307,17 +383,6 @@ ma_webm *getCurrentWebmDecoder(void);
 
 ma_webm *getFirstWebmDecoder(void);
 
-void webm_on_audio_frames(ma_device *pDevice, void *pFramesOut, const void *pFramesIn, ma_uint32 frameCount);
-
-ma_result callReadPCMFrames(
-    ma_data_source *pDataSource,
-    ma_format format,
-    void *pFramesOut,
-    ma_uint64 framesRead,
-    ma_uint32 channels,
-    ma_uint64 remainingFrames,
-    ma_uint64 *pFramesToRead);
-
 bool doesOSallowVolumeControl();
 
 void shutdownAndroid(void);
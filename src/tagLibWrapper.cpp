@@ -4,10 +4,10 @@
 #include <cctype>
 #include <cstring>
 #include <cstdio>
+#include <cstdlib>
 #include <vector>
 #include <string>
 #include <cstring>
-#include <fstream>
 #include <iostream>
 #include <unordered_map>
 
@@ -24,6 +24,7 @@
 #include <taglib/wavfile.h>
 #include <taglib/xiphcomment.h>
 #include <taglib/tag.h>
+#include <taglib/tpropertymap.h>
 #include <taglib/apefooter.h>
 #include <taglib/apeitem.h>
 #include <taglib/apetag.h>
@@ -38,11 +39,6 @@ tagLibWrapper.cpp
 
 */
 
-#if defined(__linux__)
-#include <opus/opusfile.h>
-#else
-#include <opusfile.h>
-#endif
 #include "tagLibWrapper.h"
 
 // Base64 character map for decoding
@@ -58,12 +54,6 @@ static inline bool is_base64(unsigned char c)
         return (isalnum(c) || (c == '+') || (c == '/'));
 }
 
-#if defined(TAGLIB_MAJOR_VERSION) && TAGLIB_MAJOR_VERSION >= 2
-#define HAVE_COMPLEXPROPERTIES 1
-#else
-#define HAVE_COMPLEXPROPERTIES 0
-#endif
-
 std::vector<unsigned char> decodeBase64(const std::string &encoded_string)
 {
         const size_t MAX_DECODED_SIZE = 100 * 1024 * 1024;              // 100 MB
@@ -189,21 +179,6 @@ TagLib::StringList getOggFieldListCaseInsensitive(const TagLib::Ogg::XiphComment
 
 extern "C"
 {
-        // Function to read a 32-bit unsigned integer from buffer in big-endian format
-        unsigned int read_uint32_be(const unsigned char *buffer, size_t buffer_size, size_t offset)
-        {
-                if (buffer == nullptr || offset + 4 > buffer_size)
-                {
-                        // Handle error - throw exception, return error code, etc.
-                        throw std::runtime_error("Buffer overflow in read_uint32_be");
-                }
-
-                return (static_cast<unsigned int>(buffer[offset]) << 24) |
-                       (static_cast<unsigned int>(buffer[offset + 1]) << 16) |
-                       (static_cast<unsigned int>(buffer[offset + 2]) << 8) |
-                       static_cast<unsigned int>(buffer[offset + 3]);
-        }
-
         void parseFlacPictureBlock(const std::vector<unsigned char> &data,
                                    std::string &mimeType,
                                    std::vector<unsigned char> &imageData)
@@ -260,82 +235,18 @@ extern "C"
                 imageData.assign(&ptr[offset], &ptr[offset + dataLength]);
         }
 
-#if HAVE_COMPLEXPROPERTIES
-
-        bool extractCoverArtFromOgg(const std::string &audioFilePath, const std::string &outputFileName)
+        bool extractCoverArtFromXiph(TagLib::Ogg::XiphComment *xiphComment, std::vector<unsigned char> &coverData)
         {
-                TagLib::FileRef f(audioFilePath.c_str(), true);
-                if (!f.file() || !f.file()->isOpen())
-                {
-                        std::cerr << "Error: Could not open file: " << audioFilePath << std::endl;
-                        return false;
-                }
-
-                auto pictures = f.file()->complexProperties("PICTURE");
-                if (pictures.isEmpty())
-                {
-                        std::cerr << "No cover art found in the file (via complexProperties).\n";
-                        return false;
-                }
+                // Recent TagLib parses METADATA_BLOCK_PICTURE into the picture list itself
+                TagLib::List<TagLib::FLAC::Picture *> pictures = xiphComment->pictureList();
 
-                // Use the first picture found (usually the front cover)
-                for (const auto &pic : pictures)
+                if (!pictures.isEmpty() && pictures.front() != nullptr)
                 {
-                        auto it_data = pic.find("data");
-
-                        if (it_data == pic.end())
-                                continue; // Skip if no data
-
-                        // Write the image data to a file
-                        std::ofstream outFile(outputFileName, std::ios::binary);
-                        if (!outFile)
-                        {
-                                std::cerr << "Error: Could not write to output file.\n";
-                                return false;
-                        }
-                        TagLib::ByteVector bv = it_data->second.toByteVector();
-                        outFile.write(bv.data(), bv.size());
-                        outFile.close();
-
+                        TagLib::ByteVector pictureData = pictures.front()->data();
+                        coverData.assign(pictureData.data(), pictureData.data() + pictureData.size());
                         return true;
                 }
 
-                std::cerr << "No usable cover image found in complexProperties().\n";
-                return false;
-        }
-
-#else
-
-        bool extractCoverArtFromOgg(const std::string &audioFilePath, const std::string &outputFileName)
-        {
-                TagLib::File *file = nullptr;
-                TagLib::Tag *tag = nullptr;
-
-                // Try to open as Ogg Vorbis
-                file = new TagLib::Vorbis::File(audioFilePath.c_str());
-                if (!file->isValid())
-                {
-                        delete file;
-                        // Try to open as Opus
-                        file = new TagLib::Ogg::Opus::File(audioFilePath.c_str());
-                        if (!file->isValid())
-                        {
-                                delete file;
-                                std::cerr << "Error: File not found or not a valid Ogg Vorbis or Opus file." << std::endl;
-                                return false; // File not found or invalid
-                        }
-                }
-
-                tag = file->tag();
-
-                const TagLib::Ogg::XiphComment *xiphComment = dynamic_cast<TagLib::Ogg::XiphComment *>(tag);
-                if (!xiphComment)
-                {
-                        std::cerr << "Error: No XiphComment found in the file." << std::endl;
-                        delete file;
-                        return false; // No cover art found
-                }
-
                 // Check METADATA_BLOCK_PICTURE
                 TagLib::StringList pictureList = getOggFieldListCaseInsensitive(xiphComment,
                                                                                 "METADATA_BLOCK_PICTURE");
@@ -349,18 +260,8 @@ extern "C"
                         std::vector<unsigned char> imageData;
                         parseFlacPictureBlock(decodedData, mimeType, imageData);
 
-                        std::ofstream outFile(outputFileName, std::ios::binary);
-                        if (!outFile)
-                        {
-                                std::cerr << "Error: Could not write to output file." << std::endl;
-                                delete file;
-                                return false; // Could not write to output file
-                        }
-                        outFile.write(reinterpret_cast<const char *>(imageData.data()), imageData.size());
-
-                        outFile.close();
-                        delete file;
-                        return true; // Success
+                        coverData.swap(imageData);
+                        return !coverData.empty();
                 }
 
                 // Check COVERART and COVERARTMIME
@@ -371,28 +272,14 @@ extern "C"
                 if (!coverArtList.isEmpty() && !coverArtMimeList.isEmpty())
                 {
                         std::string base64Data = coverArtList.front().to8Bit(true);
-                        std::vector<unsigned char> imageData = decodeBase64(base64Data);
+                        coverData = decodeBase64(base64Data);
 
-                        std::ofstream outFile(outputFileName, std::ios::binary);
-                        if (!outFile)
-                        {
-                                std::cerr << "Error: Could not write to output file." << std::endl;
-                                delete file;
-                                return false; // Could not write to output file
-                        }
-                        outFile.write(reinterpret_cast<const char *>(imageData.data()), imageData.size());
-                        outFile.close();
-                        delete file;
-                        return true; // Success
+                        return !coverData.empty();
                 }
 
-                std::cerr << "No cover art found in the file." << std::endl;
-                delete file;
                 return false; // No cover art found
         }
 
-#endif
-
         bool looksLikeJpeg(const std::vector<unsigned char> &data)
         {
                 return data.size() > 4 &&
@@ -435,7 +322,7 @@ extern "C"
                 return false;
         }
 
-        bool extractCoverArtFromOggVideo(const std::string &audioFilePath, const std::string &outputFileName)
+        bool extractCoverArtFromOggVideo(const std::string &audioFilePath, std::vector<unsigned char> &coverData)
         {
                 FILE *oggFile = fopen(audioFilePath.c_str(), "rb");
                 if (!oggFile)
@@ -511,20 +398,13 @@ extern "C"
                 ogg_sync_clear(&oy);
                 fclose(oggFile);
 
-                // Write out a valid image stream
+                // Hand back the first valid image stream
                 for (auto &kv : streamPackets)
                 {
-                        const auto &data = kv.second;
+                        auto &data = kv.second;
                         if (looksLikeJpeg(data) || looksLikePng(data) || looksLikeWebp(data))
                         {
-                                std::ofstream outFile(outputFileName, std::ios::binary);
-                                if (!outFile)
-                                {
-                                        std::cerr << "Error: Could not write to output file." << std::endl;
-                                        return false;
-                                }
-                                outFile.write(reinterpret_cast<const char *>(data.data()), data.size());
-                                outFile.close();
+                                coverData.swap(data);
                                 return true;
                         }
                 }
@@ -532,320 +412,116 @@ extern "C"
                 return false;
         }
 
-        bool extractCoverArtFromMp3(const std::string &inputFile, const std::string &coverFilePath)
+        bool extractCoverArtFromId3v2(const TagLib::ID3v2::Tag *id3v2tag, std::vector<unsigned char> &coverData)
         {
-                TagLib::MPEG::File file(inputFile.c_str());
-                if (!file.isValid())
+                if (!id3v2tag)
                 {
-                        return false;
+                        return false; // No ID3v2 tag found
                 }
 
-                const TagLib::ID3v2::Tag *id3v2tag = file.ID3v2Tag();
-                if (id3v2tag)
-                {
-                        // Collect all attached picture frames
-                        TagLib::ID3v2::FrameList frames;
-                        frames.append(id3v2tag->frameListMap()["APIC"]);
-                        frames.append(id3v2tag->frameListMap()["PIC"]);
+                // Collect all attached picture frames
+                TagLib::ID3v2::FrameList frames;
+                frames.append(id3v2tag->frameListMap()["APIC"]);
+                frames.append(id3v2tag->frameListMap()["PIC"]);
 
-                        if (!frames.isEmpty())
-                        {
-                                for (auto it = frames.begin(); it != frames.end(); ++it)
-                                {
-                                        const TagLib::ID3v2::AttachedPictureFrame *picFrame = dynamic_cast<TagLib::ID3v2::AttachedPictureFrame *>(*it);
-                                        if (picFrame)
-                                        {
-                                                // Access picture data and MIME type
-                                                TagLib::ByteVector pictureData = picFrame->picture();
-                                                TagLib::String mimeType = picFrame->mimeType();
-
-                                                // Construct the output file path
-                                                std::string outputFilePath = coverFilePath;
-
-                                                // Write the image data to a file
-                                                FILE *outFile = fopen(outputFilePath.c_str(), "wb");
-                                                if (outFile)
-                                                {
-                                                        fwrite(pictureData.data(), 1, pictureData.size(), outFile);
-                                                        fclose(outFile);
-
-                                                        return true;
-                                                }
-                                                else
-                                                {
-                                                        return false; // Failed to open output file
-                                                }
-
-                                                // Break if only the first image is needed
-                                                break;
-                                        }
-                                }
-                        }
-                        else
+                for (auto it = frames.begin(); it != frames.end(); ++it)
+                {
+                        const TagLib::ID3v2::AttachedPictureFrame *picFrame = dynamic_cast<TagLib::ID3v2::AttachedPictureFrame *>(*it);
+                        if (picFrame)
                         {
-                                return false; // No picture frames found
+                                // Only the first image is needed
+                                TagLib::ByteVector pictureData = picFrame->picture();
+                                coverData.assign(pictureData.data(), pictureData.data() + pictureData.size());
+
+                                return true;
                         }
                 }
-                else
-                {
-                        return false; // No ID3v2 tag found
-                }
 
-                return true; // Success
+                return false; // No picture frames found
         }
 
-        bool extractCoverArtFromFlac(const std::string &inputFile, const std::string &coverFilePath)
+        bool extractCoverArtFromFlac(TagLib::FLAC::File *file, std::vector<unsigned char> &coverData)
         {
-                TagLib::FLAC::File file(inputFile.c_str());
-
-                if (file.pictureList().size() > 0)
+                if (file->pictureList().size() > 0)
                 {
-                        const TagLib::FLAC::Picture *picture = file.pictureList().front();
+                        const TagLib::FLAC::Picture *picture = file->pictureList().front();
                         if (picture)
                         {
-                                FILE *coverFile = fopen(coverFilePath.c_str(), "wb");
-                                if (coverFile)
-                                {
-                                        fwrite(picture->data().data(), 1, picture->data().size(), coverFile);
-                                        fclose(coverFile);
-                                        return true;
-                                }
-                                else
-                                {
-                                        return false;
-                                }
+                                TagLib::ByteVector pictureData = picture->data();
+                                coverData.assign(pictureData.data(), pictureData.data() + pictureData.size());
+                                return true;
                         }
                 }
 
                 return false;
         }
 
-        bool extractCoverArtFromWav(const std::string &inputFile, const std::string &coverFilePath)
+        bool extractCoverArtFromMp4(TagLib::MP4::File *file, std::vector<unsigned char> &coverData)
         {
-                TagLib::RIFF::WAV::File file(inputFile.c_str());
-                if (!file.isValid())
+                if (!file->tag())
                 {
                         return false;
                 }
 
-                const TagLib::ID3v2::Tag *id3v2tag = file.ID3v2Tag();
-                if (id3v2tag)
-                {
-                        // Collect all attached picture frames
-                        TagLib::ID3v2::FrameList frames;
-                        frames.append(id3v2tag->frameListMap()["APIC"]);
-                        frames.append(id3v2tag->frameListMap()["PIC"]);
+                const TagLib::MP4::Item coverItem = file->tag()->item("covr");
 
-                        if (!frames.isEmpty())
-                        {
-                                for (auto it = frames.begin(); it != frames.end(); ++it)
-                                {
-                                        const TagLib::ID3v2::AttachedPictureFrame *picFrame = dynamic_cast<TagLib::ID3v2::AttachedPictureFrame *>(*it);
-                                        if (picFrame)
-                                        {
-                                                // Access picture data and MIME type
-                                                TagLib::ByteVector pictureData = picFrame->picture();
-                                                TagLib::String mimeType = picFrame->mimeType();
-
-                                                // Construct the output file path
-                                                std::string outputFilePath = coverFilePath;
-
-                                                // Write the image data to a file
-                                                FILE *outFile = fopen(outputFilePath.c_str(), "wb");
-                                                if (outFile)
-                                                {
-                                                        fwrite(pictureData.data(), 1, pictureData.size(), outFile);
-                                                        fclose(outFile);
-
-                                                        return true;
-                                                }
-                                                else
-                                                {
-                                                        return false; // Failed to open output file
-                                                }
-
-                                                // Break if only the first image is needed
-                                                break;
-                                        }
-                                }
-                        }
-                        else
+                if (coverItem.isValid())
+                {
+                        TagLib::MP4::CoverArtList coverArtList = coverItem.toCoverArtList();
+                        if (!coverArtList.isEmpty())
                         {
-                                return false; // No picture frames found
+                                const TagLib::MP4::CoverArt &coverArt = coverArtList.front();
+                                TagLib::ByteVector pictureData = coverArt.data();
+                                coverData.assign(pictureData.data(), pictureData.data() + pictureData.size());
+                                return true; // Success
                         }
                 }
-                else
-                {
-                        return false; // No ID3v2 tag found
-                }
 
-                return true; // Success
+                return false; // No valid cover item or cover art found
         }
 
-        bool extractCoverArtFromOpus(const std::string &audioFilePath, const std::string &outputFileName)
+        // The cover from the file that is already open, only Ogg video streams need another read
+        bool extractCoverArt(TagLib::File *file, const char *input_file, std::vector<unsigned char> &coverData)
         {
-                int error;
-                OggOpusFile *of = op_open_file(audioFilePath.c_str(), &error);
-                if (error != OPUS_OK || of == nullptr)
+                if (TagLib::MPEG::File *mpegFile = dynamic_cast<TagLib::MPEG::File *>(file))
                 {
-                        std::cerr << "Error: Failed to open Opus file." << std::endl;
-                        return false;
+                        return extractCoverArtFromId3v2(mpegFile->ID3v2Tag(), coverData);
                 }
 
-                const OpusTags *tags = op_tags(of, -1);
-                if (!tags)
+                if (TagLib::FLAC::File *flacFile = dynamic_cast<TagLib::FLAC::File *>(file))
                 {
-                        std::cerr << "Error: No tags found in Opus file." << std::endl;
-                        op_free(of);
-                        return false;
+                        return extractCoverArtFromFlac(flacFile, coverData);
                 }
 
-                // Search through the metadata for an attached picture (if present)
-                for (int i = 0; i < tags->comments; ++i)
+                if (TagLib::MP4::File *mp4File = dynamic_cast<TagLib::MP4::File *>(file))
                 {
-                        // Check for METADATA_BLOCK_PICTURE
-                        const char *comment = tags->user_comments[i];
-                        if (strncasecmp(comment, "METADATA_BLOCK_PICTURE=", 23) == 0)
-                        {
-                                // Extract the value after "METADATA_BLOCK_PICTURE="
-                                std::string metadataBlockPicture(comment + 23);
-
-                                // Base64-decode this value to get the binary PICTURE block
-                                std::vector<unsigned char> pictureBlock = decodeBase64(metadataBlockPicture);
-
-                                if (pictureBlock.empty())
-                                {
-                                        std::cerr << "Failed to decode Base64 data." << std::endl;
-                                        op_free(of);
-                                        return false;
-                                }
-
-                                // Now parse the binary pictureBlock to extract the image data
-                                size_t offset = 0;
-
-                                if (pictureBlock.size() < 32)
-                                {
-                                        std::cerr << "Picture block too small." << std::endl;
-                                        op_free(of);
-                                        return false;
-                                }
-
-                                // Read PICTURE TYPE
-                                read_uint32_be(pictureBlock.data(), pictureBlock.size(), offset);
-                                offset += 4;
-
-                                // Read MIME TYPE LENGTH
-                                unsigned int mimeTypeLength = read_uint32_be(pictureBlock.data(), pictureBlock.size(), offset);
-                                offset += 4;
-
-                                // Read MIME TYPE
-                                if (offset + mimeTypeLength > pictureBlock.size())
-                                {
-                                        op_free(of);
-                                        return false;
-                                }
-                                offset += mimeTypeLength;
-
-                                // Read DESCRIPTION LENGTH
-                                unsigned int descriptionLength = read_uint32_be(pictureBlock.data(), pictureBlock.size(), offset);
-                                offset += 4;
-
-                                // Read DESCRIPTION
-                                if (offset + descriptionLength > pictureBlock.size())
-                                {
-                                        op_free(of);
-                                        return false;
-                                }
-                                offset += descriptionLength;
-                                // Optionally print or ignore description
-
-                                // Read WIDTH
-                                read_uint32_be(pictureBlock.data(), pictureBlock.size(), offset);
-                                offset += 4;
-
-                                // Read HEIGHT
-                                read_uint32_be(pictureBlock.data(), pictureBlock.size(), offset);
-                                offset += 4;
-                                ;
-
-                                // Read COLOR DEPTH
-                                read_uint32_be(pictureBlock.data(), pictureBlock.size(), offset);
-                                offset += 4;
-
-                                // Read NUMBER OF COLORS
-                                read_uint32_be(pictureBlock.data(), pictureBlock.size(), offset);
-                                offset += 4;
-
-                                // Read DATA LENGTH
-                                unsigned int dataLength = read_uint32_be(pictureBlock.data(), pictureBlock.size(), offset);
-                                offset += 4;
-
-                                if (offset + dataLength > pictureBlock.size())
-                                {
-                                        std::cerr << "Invalid image data length." << std::endl;
-                                        op_free(of);
-                                        return false;
-                                }
-
-                                // Extract image data
-                                std::vector<unsigned char> imageData(pictureBlock.begin() + offset, pictureBlock.begin() + offset + dataLength);
-
-                                // Save image data to file
-                                std::ofstream outFile(outputFileName, std::ios::binary);
-                                if (!outFile)
-                                {
-                                        std::cerr << "Error: Could not write to output file." << std::endl;
-                                        op_free(of);
-                                        return false;
-                                }
-                                outFile.write(reinterpret_cast<const char *>(imageData.data()), imageData.size());
-                                outFile.close();
-
-                                op_free(of);
-                                return true;
-                        }
+                        return extractCoverArtFromMp4(mp4File, coverData);
                 }
 
-                std::cerr << "No cover art found in the metadata." << std::endl;
-                op_free(of);
-                return false;
-        }
-
-        bool extractCoverArtFromMp4(const std::string &inputFile, const std::string &coverFilePath)
-        {
-                TagLib::MP4::File file(inputFile.c_str());
-
-                if (!file.isValid())
+                if (TagLib::RIFF::WAV::File *wavFile = dynamic_cast<TagLib::RIFF::WAV::File *>(file))
                 {
-                        return false;
+                        return extractCoverArtFromId3v2(wavFile->ID3v2Tag(), coverData);
                 }
 
-                const TagLib::MP4::Item coverItem = file.tag()->item("covr");
-
-                if (coverItem.isValid())
+                // Vorbis, Opus and the other Ogg formats
+                if (TagLib::Ogg::XiphComment *xiphComment = dynamic_cast<TagLib::Ogg::XiphComment *>(file->tag()))
                 {
-                        TagLib::MP4::CoverArtList coverArtList = coverItem.toCoverArtList();
-                        if (!coverArtList.isEmpty())
+                        if (extractCoverArtFromXiph(xiphComment, coverData))
                         {
-                                const TagLib::MP4::CoverArt &coverArt = coverArtList.front();
-                                FILE *coverFile = fopen(coverFilePath.c_str(), "wb");
-                                if (coverFile)
-                                {
-                                        fwrite(coverArt.data().data(), 1, coverArt.data().size(), coverFile);
-                                        fclose(coverFile);
-                                        return true; // Success
-                                }
-                                else
-                                {
-                                        fprintf(stderr, "Could not open output file '%s'\n", coverFilePath.c_str());
-                                        return false; // Failed to open the output file
-                                }
+                                return true;
+                        }
+
+                        std::string filename(input_file);
+                        std::string extension = filename.substr(filename.find_last_of('.') + 1);
+
+                        if (extension == "ogg")
+                        {
+                                return extractCoverArtFromOggVideo(input_file, coverData);
                         }
                 }
 
-                return false; // No valid cover item or cover art found
+                return false;
         }
-
         void trimcpp(std::string &str)
         {
                 // Remove leading spaces
@@ -914,15 +590,112 @@ extern "C"
                 return val;
         }
 
-        int extractTags(const char *input_file, TagSettings *tag_settings, double *duration, const char *coverFilePath)
+        void readReplayGainFromId3v2(TagLib::ID3v2::Tag *id3v2Tag, TagSettings *tag_settings)
         {
+                if (!id3v2Tag)
+                        return;
+
+                // Retrieve all TXXX frames
+                TagLib::ID3v2::FrameList frames = id3v2Tag->frameList("TXXX");
+                for (TagLib::ID3v2::FrameList::Iterator it = frames.begin();
+                     it != frames.end(); ++it)
+                {
+                        // Cast to the user-text (TXXX) frame class
+                        TagLib::ID3v2::TextIdentificationFrame *txxx =
+                            dynamic_cast<TagLib::ID3v2::TextIdentificationFrame *>(*it);
+                        if (!txxx)
+                                continue;
+
+                        TagLib::StringList fields = txxx->fieldList();
+                        if (fields.size() >= 2)
+                        {
+                                TagLib::String desc = fields[0];
+                                TagLib::String val = fields[1];
+
+                                if (desc.upper() == "REPLAYGAIN_TRACK_GAIN")
+                                {
+                                        tag_settings->replaygainTrack = parseDecibelValue(val);
+                                }
+                                else if (desc.upper() == "REPLAYGAIN_ALBUM_GAIN")
+                                {
+                                        tag_settings->replaygainAlbum = parseDecibelValue(val);
+                                }
+                        }
+                }
+        }
+
+        void readReplayGainFromApe(TagLib::APE::Tag *apeTag, TagSettings *tag_settings)
+        {
+                if (!apeTag)
+                        return;
+
+                TagLib::APE::ItemListMap items = apeTag->itemListMap();
+                for (auto it = items.begin(); it != items.end(); ++it)
+                {
+                        std::string key = it->first.upper().toCString();
+                        TagLib::String value = it->second.toString();
+
+                        if (key == "REPLAYGAIN_TRACK_GAIN")
+                        {
+                                tag_settings->replaygainTrack = parseDecibelValue(value);
+                        }
+                        else if (key == "REPLAYGAIN_ALBUM_GAIN")
+                        {
+                                tag_settings->replaygainAlbum = parseDecibelValue(value);
+                        }
+                }
+        }
+
+        void readReplayGainFromXiph(TagLib::Ogg::XiphComment *xiphComment, TagSettings *tag_settings)
+        {
+                if (!xiphComment)
+                        return;
+
+                const TagLib::Ogg::FieldListMap &fieldMap = xiphComment->fieldListMap();
+
+                auto trackGainIt = fieldMap.find("REPLAYGAIN_TRACK_GAIN");
+                if (trackGainIt != fieldMap.end())
+                {
+                        const TagLib::StringList &trackGainList = trackGainIt->second;
+                        if (!trackGainList.isEmpty())
+                        {
+                                tag_settings->replaygainTrack = parseDecibelValue(trackGainList.front());
+                        }
+                }
+
+                auto albumGainIt = fieldMap.find("REPLAYGAIN_ALBUM_GAIN");
+                if (albumGainIt != fieldMap.end())
+                {
+                        const TagLib::StringList &albumGainList = albumGainIt->second;
+                        if (!albumGainList.isEmpty())
+                        {
+                                tag_settings->replaygainAlbum = parseDecibelValue(albumGainList.front());
+                        }
+                }
+        }
+
+        int readTags(const char *input_file, int flags, TagSettings *tag_settings, double *duration, unsigned char **coverData, size_t *coverDataSize)
+        {
+                bool wantDuration = (flags & TAG_READ_DURATION) && duration != NULL;
+                bool wantCover = (flags & TAG_READ_COVER) && coverData != NULL && coverDataSize != NULL;
+
+                if (wantCover)
+                {
+                        *coverData = NULL;
+                        *coverDataSize = 0;
+                }
+
+                if (duration != NULL)
+                        *duration = 0.0;
+
                 memset(tag_settings, 0, sizeof(TagSettings)); // Initialize tag settings
 
                 tag_settings->replaygainTrack = 0.0;
                 tag_settings->replaygainAlbum = 0.0;
 
-                // Use TagLib's FileRef for generic file parsing.
-                TagLib::FileRef f(input_file);
+                // The file is opened once, tags, replay gain and cover all come from it.
+                // Audio properties are only parsed when the duration is asked for.
+                TagLib::FileRef f(input_file, wantDuration);
                 if (f.isNull() || !f.file())
                 {
                         fprintf(stderr, "FileRef is null or file could not be opened: '%s'\n", input_file);
@@ -961,6 +734,15 @@ extern "C"
                         c_strcpy(tag_settings->artist, tag->artist().toCString(true), sizeof(tag_settings->artist) - 1);
                         tag_settings->artist[sizeof(tag_settings->artist) - 1] = '\0';
 
+                        // Copy the album artist, which every tag format maps to the same property
+                        const TagLib::PropertyMap properties = tag->properties();
+                        auto albumArtistIt = properties.find("ALBUMARTIST");
+                        if (albumArtistIt != properties.end() && !albumArtistIt->second.isEmpty())
+                        {
+                                c_strcpy(tag_settings->album_artist, albumArtistIt->second.front().toCString(true), sizeof(tag_settings->album_artist) - 1);
+                                tag_settings->album_artist[sizeof(tag_settings->album_artist) - 1] = '\0';
+                        }
+
                         // Copy the album
                         c_strcpy(tag_settings->album, tag->album().toCString(true), sizeof(tag_settings->album) - 1);
                         tag_settings->album[sizeof(tag_settings->album) - 1] = '\0';
@@ -975,147 +757,72 @@ extern "C"
                 }
 
                 // Extract audio properties for duration.
-                if (f.audioProperties())
-                {
-                        *duration = f.audioProperties()->lengthInSeconds();
-                }
-                else
+                if (wantDuration)
                 {
-                        *duration = 0.0;
-                        fprintf(stderr, "No audio properties found for file '%s'\n", input_file);
-                        return -2;
-                }
-
-                // Extract replay gain information
-                if (std::string(input_file).find(".mp3") != std::string::npos)
-                {
-                        TagLib::MPEG::File mp3File(input_file);
-                        TagLib::ID3v2::Tag *id3v2Tag = mp3File.ID3v2Tag();
-
-                        if (id3v2Tag)
+                        if (f.audioProperties())
                         {
-                                // Retrieve all TXXX frames
-                                TagLib::ID3v2::FrameList frames = id3v2Tag->frameList("TXXX");
-                                for (TagLib::ID3v2::FrameList::Iterator it = frames.begin();
-                                     it != frames.end(); ++it)
-                                {
-                                        // Cast to the user-text (TXXX) frame class
-                                        TagLib::ID3v2::TextIdentificationFrame *txxx =
-                                            dynamic_cast<TagLib::ID3v2::TextIdentificationFrame *>(*it);
-                                        if (!txxx)
-                                                continue;
-
-                                        TagLib::StringList fields = txxx->fieldList();
-                                        if (fields.size() >= 2)
-                                        {
-                                                TagLib::String desc = fields[0];
-                                                TagLib::String val = fields[1];
-
-                                                if (desc.upper() == "REPLAYGAIN_TRACK_GAIN")
-                                                {
-                                                        tag_settings->replaygainTrack = parseDecibelValue(val);
-                                                }
-                                                else if (desc.upper() == "REPLAYGAIN_ALBUM_GAIN")
-                                                {
-                                                        tag_settings->replaygainAlbum = parseDecibelValue(val);
-                                                }
-                                        }
-                                }
+                                *duration = f.audioProperties()->lengthInMilliseconds() / 1000.0;
                         }
-
-                        TagLib::APE::Tag *apeTag = mp3File.APETag();
-
-                        if (apeTag)
+                        else
                         {
-                                TagLib::APE::ItemListMap items = apeTag->itemListMap();
-                                for (auto it = items.begin(); it != items.end(); ++it)
-                                {
-                                        std::string key = it->first.upper().toCString();
-                                        TagLib::String value = it->second.toString();
-
-                                        if (key == "REPLAYGAIN_TRACK_GAIN")
-                                        {
-                                                tag_settings->replaygainTrack = parseDecibelValue(value);
-                                        }
-                                        else if (key == "REPLAYGAIN_ALBUM_GAIN")
-                                        {
-                                                tag_settings->replaygainAlbum = parseDecibelValue(value);
-                                        }
-                                }
+                                fprintf(stderr, "No audio properties found for file '%s'\n", input_file);
+                                return -2;
                         }
                 }
-                else if (std::string(input_file).find(".flac") != std::string::npos)
-                {
-                        TagLib::FLAC::File flacFile(input_file);
-                        TagLib::Ogg::XiphComment *xiphComment = flacFile.xiphComment();
-
-                        if (xiphComment)
-                        {
-                                const TagLib::Ogg::FieldListMap &fieldMap = xiphComment->fieldListMap();
 
-                                auto trackGainIt = fieldMap.find("REPLAYGAIN_TRACK_GAIN");
-                                if (trackGainIt != fieldMap.end())
-                                {
-                                        const TagLib::StringList &trackGainList = trackGainIt->second;
-                                        if (!trackGainList.isEmpty())
-                                        {
-                                                tag_settings->replaygainTrack = parseDecibelValue(trackGainList.front());
-                                        }
-                                }
-
-                                auto albumGainIt = fieldMap.find("REPLAYGAIN_ALBUM_GAIN");
-                                if (albumGainIt != fieldMap.end())
-                                {
-                                        const TagLib::StringList &albumGainList = albumGainIt->second;
-                                        if (!albumGainList.isEmpty())
-                                        {
-                                                tag_settings->replaygainAlbum = parseDecibelValue(albumGainList.front());
-                                        }
-                                }
-                        }
-                }
-
-                std::string filename(input_file);
-                std::string extension = filename.substr(filename.find_last_of('.') + 1);
-                bool coverArtExtracted = false;
-
-                if (extension == "mp3")
-                {
-                        coverArtExtracted = extractCoverArtFromMp3(input_file, coverFilePath);
-                }
-                else if (extension == "flac")
+                // Extract replay gain information
+                if (TagLib::MPEG::File *mpegFile = dynamic_cast<TagLib::MPEG::File *>(f.file()))
                 {
-                        coverArtExtracted = extractCoverArtFromFlac(input_file, coverFilePath);
+                        readReplayGainFromId3v2(mpegFile->ID3v2Tag(), tag_settings);
+                        readReplayGainFromApe(mpegFile->APETag(), tag_settings);
                 }
-                else if (extension == "m4a" || extension == "aac")
+                else if (TagLib::FLAC::File *flacFile = dynamic_cast<TagLib::FLAC::File *>(f.file()))
                 {
-                        coverArtExtracted = extractCoverArtFromMp4(input_file, coverFilePath);
+                        readReplayGainFromXiph(flacFile->xiphComment(), tag_settings);
                 }
-                if (extension == "opus")
+
+                if (!wantCover)
                 {
-                        coverArtExtracted = extractCoverArtFromOpus(input_file, coverFilePath);
+                        return 0;
                 }
-                else if (extension == "ogg")
-                {
-                        coverArtExtracted = extractCoverArtFromOgg(input_file, coverFilePath);
 
-                        if (!coverArtExtracted)
-                        {
-                                coverArtExtracted = extractCoverArtFromOggVideo(input_file, coverFilePath);
-                        }
+                std::vector<unsigned char> cover;
+                bool coverArtExtracted = false;
+
+                try
+                {
+                        coverArtExtracted = extractCoverArt(f.file(), input_file, cover);
                 }
-                else if (extension == "wav")
+                catch (const std::exception &e)
                 {
-                        coverArtExtracted = extractCoverArtFromWav(input_file, coverFilePath);
+                        fprintf(stderr, "Could not read the cover of '%s': %s\n", input_file, e.what());
                 }
 
-                if (coverArtExtracted)
+                if (!coverArtExtracted || cover.empty())
                 {
-                        return 0;
+                        return -1;
                 }
-                else
+
+                // The caller owns the picture bytes and decodes them straight from memory
+                *coverData = static_cast<unsigned char *>(malloc(cover.size()));
+                if (*coverData == NULL)
                 {
+                        fprintf(stderr, "readTags: malloc\n");
                         return -1;
                 }
+                memcpy(*coverData, cover.data(), cover.size());
+                *coverDataSize = cover.size();
+
+                return 0;
+        }
+
+        int extractTags(const char *input_file, TagSettings *tag_settings, double *duration, unsigned char **coverData, size_t *coverDataSize)
+        {
+                int flags = TAG_READ_DURATION;
+
+                if (coverData != NULL)
+                        flags |= TAG_READ_COVER;
+
+                return readTags(input_file, flags, tag_settings, duration, coverData, coverDataSize);
         }
 }
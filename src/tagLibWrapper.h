@@ -23,7 +23,16 @@ extern "C"
                 double replaygainAlbum;
         } TagSettings;
 #endif
-        int extractTags(const char *input_file, TagSettings *tag_settings, double *duration, const char *coverFilePath);
+
+#define TAG_READ_DURATION 1 // Parse the audio properties for the duration
+#define TAG_READ_COVER 2    // Copy the embedded picture to coverData
+
+        // Opens the file once for the tags, replay gain and whatever the flags ask for.
+        // Returns -1 if it can't be opened or has no cover when one was asked for, -2 if it has no tags or duration.
+        int readTags(const char *input_file, int flags, TagSettings *tag_settings, double *duration, unsigned char **coverData, size_t *coverDataSize);
+
+        // readTags with the duration, and the cover unless coverData is NULL
+        int extractTags(const char *input_file, TagSettings *tag_settings, double *duration, unsigned char **coverData, size_t *coverDataSize);
 
 #ifdef __cplusplus
 }
@@ -4,6 +4,7 @@
 #include <math.h>
 #include <pwd.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/param.h>
@@ -22,34 +23,106 @@
 
 */
 
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
-#include <stdlib.h> // For arc4random
-#include <stdint.h> // For uint32_t
+static RandomState shuffleRandom; // Only shuffles draw from it, so a seed gives the same shuffles
+static bool shuffleSeeded = false;
+static RandomState otherRandom;
+static bool otherSeeded = false;
 
-uint32_t arc4random_uniform(uint32_t upper_bound);
+static inline uint64_t rotateLeft(uint64_t x, int k)
+{
+        return (x << k) | (x >> (64 - k));
+}
 
-int getRandomNumber(int min, int max)
+// splitmix64, spreads a seed over the whole state so that close seeds give unrelated sequences
+static uint64_t splitMix(uint64_t *x)
 {
-        return min + arc4random_uniform(max - min + 1);
+        uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
 }
 
-#else
-#include <stdlib.h>
-#include <time.h>
+void seedRandomState(RandomState *state, uint64_t seed)
+{
+        for (int i = 0; i < 4; i++)
+                state->s[i] = splitMix(&seed);
+}
 
-int getRandomNumber(int min, int max)
+// xoshiro256**
+uint64_t nextRandom(RandomState *state)
+{
+        uint64_t *s = state->s;
+        uint64_t result = rotateLeft(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotateLeft(s[3], 45);
+
+        return result;
+}
+
+// Lemire's multiply and reject, no modulo bias
+uint32_t getRandomBelow(RandomState *state, uint32_t bound)
 {
-        static int seeded = 0;
-        if (!seeded)
+        if (bound <= 1)
+                return 0;
+
+        uint64_t m = (nextRandom(state) >> 32) * bound;
+        uint32_t low = (uint32_t)m;
+
+        if (low < bound)
         {
-                srandom(time(NULL)); // Use srandom() to seed the random number generator
-                seeded = 1;
+                uint32_t threshold = -bound % bound;
+
+                while (low < threshold)
+                {
+                        m = (nextRandom(state) >> 32) * bound;
+                        low = (uint32_t)m;
+                }
         }
 
-        return min + (random() % (max - min + 1)); // Use random() instead of rand()
+        return (uint32_t)(m >> 32);
 }
 
-#endif
+static uint64_t getClockSeed(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        return ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ (uint64_t)getpid();
+}
+
+void seedShuffleRandom(uint64_t seed)
+{
+        seedRandomState(&shuffleRandom, (seed != 0) ? seed : getClockSeed());
+        shuffleSeeded = true;
+}
+
+RandomState *getShuffleRandomState(void)
+{
+        if (!shuffleSeeded)
+                seedShuffleRandom(0);
+
+        return &shuffleRandom;
+}
+
+int getRandomNumber(int min, int max)
+{
+        if (max <= min)
+                return min;
+
+        if (!otherSeeded)
+        {
+                seedRandomState(&otherRandom, getClockSeed() ^ 0x5bd1e995ULL);
+                otherSeeded = true;
+        }
+
+        return min + (int)getRandomBelow(&otherRandom, (uint32_t)(max - min) + 1);
+}
 
 void c_sleep(int milliseconds)
 {
@@ -410,6 +483,39 @@ char *getConfigPath(void)
         return configPath;
 }
 
+char *getCachePath(void)
+{
+        char *cachePath = malloc(MAXPATHLEN);
+        if (!cachePath)
+                return NULL;
+
+        const char *xdgCache = getenv("XDG_CACHE_HOME");
+
+        if (xdgCache)
+        {
+                snprintf(cachePath, MAXPATHLEN, "%s/kew", xdgCache);
+        }
+        else
+        {
+                const char *home = getHomePath();
+                if (home)
+                {
+#ifdef __APPLE__
+                        snprintf(cachePath, MAXPATHLEN, "%s/Library/Caches/kew", home);
+#else
+                        snprintf(cachePath, MAXPATHLEN, "%s/.cache/kew", home);
+#endif
+                }
+                else
+                {
+                        free(cachePath);
+                        return NULL;
+                }
+        }
+
+        return cachePath;
+}
+
 bool isValidFilename(const char *filename)
 {
         // Check for path traversal patterns
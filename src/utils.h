@@ -8,11 +8,31 @@
 #endif
 
 #include <regex.h>
+#include <stdint.h>
 
 #ifndef MAXPATHLEN
 #define MAXPATHLEN 4096
 #endif
 
+typedef struct
+{
+        uint64_t s[4];
+} RandomState;
+
+void seedRandomState(RandomState *state, uint64_t seed);
+
+uint64_t nextRandom(RandomState *state);
+
+// Uniform in [0, bound)
+uint32_t getRandomBelow(RandomState *state, uint32_t bound);
+
+// Seeds the generator shuffles draw from, 0 seeds it from the clock. The same seed gives the same shuffles.
+void seedShuffleRandom(uint64_t seed);
+
+// The shuffle generator, seeded from the clock if seedShuffleRandom wasn't called. Main thread only.
+RandomState *getShuffleRandomState(void);
+
+// Uniform in [min, max], from a generator of its own so it never disturbs the shuffles. Main thread only.
 int getRandomNumber(int min, int max);
 
 void c_sleep(int milliseconds);
@@ -43,6 +63,8 @@ const char *getHomePath(void);
 
 char *getConfigPath(void);
 
+char *getCachePath(void);
+
 void removeUnneededChars(char *str, int length);
 
 void shortenString(char *str, size_t maxLength);
@@ -24,12 +24,37 @@ visuals.c
 
 #define MAX_BARS 64
 
-int isFftInitialized = false;
+#define MAX_CACHED_PLANS 4
 
-float *fftInput = NULL;
-fftwf_complex *fftOutput = NULL;
+#define WISDOM_FILE "fftw_wisdom"
 
-int bufferIndex = 0;
+typedef struct
+{
+        int size;
+        float *input;
+        fftwf_complex *output;
+        float *window; // Blackman Harris coefficients
+        fftwf_plan plan;
+} FftPlan;
+
+typedef struct
+{
+        float sampleRate;
+        int fftSize;
+        int numBars;
+        int usedBars;                   // Bars below maxFreq, the rest stay empty
+        int binLo[MAX_BARS];
+        int binHi[MAX_BARS];
+        float correction[MAX_BARS];     // Pink-noise flattening in dB
+        bool aboveNyquist[MAX_BARS];
+} BandTable;
+
+static FftPlan planCache[MAX_CACHED_PLANS];
+static int numCachedPlans = 0;
+static FftPlan *currentPlan = NULL;
+static bool wisdomChanged = false;
+
+static BandTable bandTable = {0};
 
 ma_format format = ma_format_unknown;
 ma_uint32 sampleRate = 0;
@@ -57,9 +82,9 @@ void clearMagnitudes(int numBars, float *magnitudes)
         }
 }
 
-void applyBlackmanHarris(float *fftInput, int bufferSize)
+void computeBlackmanHarris(float *window, int bufferSize)
 {
-        if (!fftInput || bufferSize <= 1)
+        if (!window || bufferSize <= 1)
                 return;
 
         float alpha0 = 0.35875f;
@@ -70,10 +95,8 @@ void applyBlackmanHarris(float *fftInput, int bufferSize)
         for (int i = 0; i < bufferSize; i++)
         {
                 float fraction = (float)i / (float)(bufferSize - 1); // i / (N-1)
-                float window =
+                window[i] =
                     alpha0 - alpha1 * cosf(2.0f * M_PI * fraction) + alpha2 * cosf(4.0f * M_PI * fraction) - alpha3 * cosf(6.0f * M_PI * fraction);
-
-                fftInput[i] *= window;
         }
 }
 
@@ -109,34 +132,33 @@ void computeBandCenters(float minFreq, float sampleRate, int numBands, float *ce
         }
 }
 
-void fillEQBands(
-    const fftwf_complex *fftOutput,
-    int bufferSize,
-    float sampleRate,
-    float *bandDb,
-    int numBands,
-    const float *centerFreqs)
+// Works out which FFT bins belong to each bar, only needed when sample rate, fftSize or bar count change
+void buildBandTable(BandTable *table, float sampleRate, int bufferSize, int numBands)
 {
-        if (!fftOutput || !bandDb || !centerFreqs || bufferSize <= 0 || numBands <= 0 || sampleRate <= 0.0f)
-                return;
+        table->sampleRate = sampleRate;
+        table->fftSize = bufferSize;
+        table->numBars = numBands;
+        table->usedBars = 0;
 
-        // Check for valid bufferSize before proceeding
-        if (bufferSize <= 0)
+        if (sampleRate <= 0.0f || bufferSize <= 0 || numBands <= 0)
                 return;
 
-        int numBins = bufferSize / 2 + 1;
-        if (numBins <= 0)
-                return; // Guard against potential overflow during division
+        float centerFreqs[MAX_BARS];
+
+        float minFreq = 25.0f;
+        float audibleHalf = 10000.0f;
+        float maxFreq = fmin(audibleHalf, 0.5f * sampleRate);
+        float octaveFraction = 1.0f / 3.0f;
+        int usedBars = floor(log2(maxFreq / minFreq) / octaveFraction) + 1; // How many bars are actually in use, given we increase with 1/3 octave per bar
 
-        // Ensure binSpacing is valid (non-zero)
-        float binSpacing = (float)sampleRate / (float)bufferSize;
-        if (binSpacing <= 0)
-                return; // Avoid invalid bin spacing
+        table->usedBars = (usedBars > numBands) ? numBands : usedBars;
 
+        // Compute center frequencies for EQ bands
+        computeBandCenters(minFreq, maxFreq, numBands, centerFreqs);
+
+        int numBins = bufferSize / 2 + 1;
+        float binSpacing = sampleRate / (float)bufferSize;
         float width = powf(2.0f, 1.0f / 6.0f); // 1/3 octave: +/- 1/6 octave half-width
-        float normFactor = (float)bufferSize;
-        if (normFactor <= 0)
-                return; // Avoid division by zero in future calculations
 
         // Pink-noise flattening: +3 dB/octave
         float referenceFreq = fmaxf(centerFreqs[0], 1e-6f);
@@ -149,16 +171,11 @@ void fillEQBands(
         {
                 float center = centerFreqs[i];
 
-                if (center > nyquist)
-                {
-                        bandDb[i] = -INFINITY;
-                        continue;
-                }
+                table->aboveNyquist[i] = (center > nyquist);
 
                 float lo = center / width;
                 float hi = center * width;
 
-                // Prevent integer overflow while computing bin indices
                 int binLo = (int)ceilf(lo / binSpacing);
                 int binHi = (int)floorf(hi / binSpacing);
 
@@ -166,117 +183,80 @@ void fillEQBands(
                 binHi = (binHi >= numBins) ? numBins - 1 : binHi;
                 binHi = (binHi < binLo) ? binLo : binHi;
 
-                float sumSq = 0.0f;
-                int count = 0;
-                for (int k = binLo; k <= binHi; k++)
-                {
-                        if (k < 0 || k >= numBins)
-                                continue;
-
-                        // Normalize FFT output
-                        float real = fftOutput[k][0] / normFactor;
-                        float imag = fftOutput[k][1] / normFactor;
-                        float mag = sqrtf(real * real + imag * imag);
-                        sumSq += mag * mag;
-                        count++;
-                }
+                // Entirely above the last bin, leave the range empty
+                if (binLo >= numBins)
+                        binHi = binLo - 1;
 
-                // Ensure rms does not become zero, as log10(0) is undefined
-                float rms = (count > 0) ? sqrtf(sumSq / count) : 1e-9f; // Use a small value instead of 0
-                bandDb[i] = 20.0f * log10f(rms);
+                table->binLo[i] = binLo;
+                table->binHi[i] = binHi;
 
-                float freq = centerFreqs[i];
-                float octavesAboveRef = log2f(fminf(freq, maxFreqForCorrection) / referenceFreq);
-                float correction = fmaxf(octavesAboveRef, 0.0f) * correctionPerOctave;
-                bandDb[i] += correction;
+                float octavesAboveRef = log2f(fminf(center, maxFreqForCorrection) / referenceFreq);
+                table->correction[i] = fmaxf(octavesAboveRef, 0.0f) * correctionPerOctave;
         }
 }
 
-int normalizeAudioSamples(const void *audioBuffer, float *fftInput, int bufferSize, int bitDepth)
+void fillEQBands(
+    const fftwf_complex *fftOutput,
+    int bufferSize,
+    const BandTable *table,
+    float *bandDb)
 {
-        if (bitDepth == 8)
-        {
-                const uint8_t *buf = (const uint8_t *)audioBuffer;
-                for (int i = 0; i < bufferSize; ++i)
-                        fftInput[i] = ((float)buf[i] - 127.0f) / 128.0f;
-        }
-        else if (bitDepth == 16)
-        {
-                const int16_t *buf = (const int16_t *)audioBuffer;
-                for (int i = 0; i < bufferSize; ++i)
-                        fftInput[i] = (float)buf[i] / 32768.0f;
-        }
-        else if (bitDepth == 24)
+        if (!fftOutput || !bandDb || bufferSize <= 0)
+                return;
+
+        float normFactor = (float)bufferSize;
+        float normSq = normFactor * normFactor;
+
+        for (int i = 0; i < table->numBars; i++)
         {
-                const uint8_t *buf = (const uint8_t *)audioBuffer;
-                for (int i = 0; i < bufferSize; ++i)
+                if (table->aboveNyquist[i])
                 {
-                        int32_t sample = unpack_s24(buf + i * 3);
-                        fftInput[i] = (float)sample / 8388608.0f;
+                        bandDb[i] = -INFINITY;
+                        continue;
+                }
+
+                float sumSq = 0.0f;
+                int count = 0;
+                for (int k = table->binLo[i]; k <= table->binHi[i]; k++)
+                {
+                        // Normalized FFT output, squared magnitude
+                        float real = fftOutput[k][0];
+                        float imag = fftOutput[k][1];
+                        sumSq += (real * real + imag * imag) / normSq;
+                        count++;
                 }
-        }
-        else if (bitDepth == 32)
-        {
-                const float *buf = (const float *)audioBuffer;
-                for (int i = 0; i < bufferSize; ++i)
-                        fftInput[i] = buf[i];
-        }
-        else
-        {
-                // Unsupported bit depth
-                return -1;
-        }
 
-        return 0;
+                // Ensure rms does not become zero, as log10(0) is undefined
+                float rms = (count > 0) ? sqrtf(sumSq / count) : 1e-9f; // Use a small value instead of 0
+                bandDb[i] = 20.0f * log10f(rms) + table->correction[i];
+        }
 }
 
 void calcMagnitudes(
     int height,
-    int numBars,
-    void *audioBuffer,
-    int bitDepth,
-    float *fftInput,
-    fftwf_complex *fftOutput,
-    int fftSize,
+    FftPlan *fft,
+    const BandTable *table,
     float *magnitudes,
-    fftwf_plan plan, float *displayMagnitudes)
+    float *displayMagnitudes)
 {
-        // Only execute when we get the signal that we have enough samples (fftSize)
-        if (!bufferReady)
+        // Only execute when a new window (hopSize more samples) is available
+        if (!getAudioWindow(fft->input, fft->size))
                 return;
 
-        if (!audioBuffer)
-        {
-                fprintf(stderr, "Audio buffer is NULL.\n");
-                return;
-        }
-
-        bufferReady = false;
-
-        normalizeAudioSamples(audioBuffer, fftInput, fftSize, bitDepth);
-
         // Apply Blackman Harris window function
-        applyBlackmanHarris(fftInput, fftSize);
+        for (int i = 0; i < fft->size; i++)
+                fft->input[i] *= fft->window[i];
 
         // Compute fast fourier transform
-        fftwf_execute(plan);
+        fftwf_execute(fft->plan);
 
         // Clear previous magnitudes
         clearMagnitudes(MAX_BARS, magnitudes);
 
-        float centerFreqs[numBars];
-
-        float minFreq = 25.0f;
-        float audibleHalf = 10000.0f;
-        float maxFreq = fmin(audibleHalf, 0.5f * sampleRate);
-        float octaveFraction = 1.0f / 3.0f;
-        int usedBars = floor(log2(maxFreq / minFreq) / octaveFraction) + 1; // How many bars are actually in use, given we increase with 1/3 octave per bar
-
-        // Compute center frequencies for EQ bands
-        computeBandCenters(minFreq, maxFreq, numBars, centerFreqs);
-
         // Fill magnitudes for EQ bands from FFT output
-        fillEQBands(fftOutput, fftSize, sampleRate, magnitudes, numBars, centerFreqs);
+        fillEQBands(fft->output, fft->size, table, magnitudes);
+
+        int usedBars = table->usedBars;
 
         // Map magnitudes (in dB) to bar heights with gating and emphasis (pow/gated)
         for (int i = 0; i < usedBars; ++i)
@@ -362,39 +342,6 @@ char *getInbetweenChar(float prev, float next)
         return getInbetweendMotionChar(prev, next, firstDecimalDigit, secondDecimalDigit);
 }
 
-int getBitDepth(ma_format format)
-{
-
-        if (format == ma_format_unknown)
-                return -1;
-
-        int bitDepth = 32;
-
-        switch (format)
-        {
-        case ma_format_u8:
-                bitDepth = 8;
-                break;
-
-        case ma_format_s16:
-                bitDepth = 16;
-                break;
-
-        case ma_format_s24:
-                bitDepth = 24;
-                break;
-
-        case ma_format_f32:
-        case ma_format_s32:
-                bitDepth = 32;
-                break;
-        default:
-                break;
-        }
-
-        return bitDepth;
-}
-
 void printSpectrum(int row, int col, UISettings *ui, int height, int numBars, int visualizerWidth, float *magnitudes)
 {
         PixelData color;
@@ -502,18 +449,107 @@ void printSpectrum(int row, int col, UISettings *ui, int height, int numBars, in
         fflush(stdout);
 }
 
-void freeVisuals(void)
+static void freeFftPlan(FftPlan *fft)
+{
+        if (fft->plan != NULL)
+                fftwf_destroy_plan(fft->plan);
+
+        fftwf_free(fft->input);
+        fftwf_free(fft->output);
+        free(fft->window);
+
+        memset(fft, 0, sizeof(FftPlan));
+}
+
+// Plans are kept for every window size seen, so a sample rate change back and forth doesn't replan
+static FftPlan *getFftPlan(int size)
 {
-        if (fftInput != NULL)
+        if (size <= 1)
+                return NULL;
+
+        for (int i = 0; i < numCachedPlans; i++)
         {
-                free(fftInput);
-                fftInput = NULL;
+                if (planCache[i].size == size)
+                        return &planCache[i];
         }
-        if (fftOutput != NULL)
+
+        if (numCachedPlans == MAX_CACHED_PLANS)
+        {
+                // Drop the oldest
+                if (currentPlan == &planCache[0])
+                        currentPlan = NULL;
+                else if (currentPlan != NULL)
+                        currentPlan--;
+
+                freeFftPlan(&planCache[0]);
+                memmove(&planCache[0], &planCache[1], sizeof(FftPlan) * (MAX_CACHED_PLANS - 1));
+                memset(&planCache[MAX_CACHED_PLANS - 1], 0, sizeof(FftPlan));
+                numCachedPlans--;
+        }
+
+        FftPlan *fft = &planCache[numCachedPlans];
+
+        fft->size = size;
+        fft->input = (float *)fftwf_malloc(sizeof(float) * size);
+        fft->output = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * (size / 2 + 1));
+        fft->window = (float *)malloc(sizeof(float) * size);
+
+        if (fft->input == NULL || fft->output == NULL || fft->window == NULL)
+        {
+                freeFftPlan(fft);
+                return NULL;
+        }
+
+        // Measuring is slow the first time, the wisdom file makes it instant on later runs
+        fft->plan = fftwf_plan_dft_r2c_1d(size, fft->input, fft->output, FFTW_MEASURE);
+
+        if (fft->plan == NULL)
+        {
+                freeFftPlan(fft);
+                return NULL;
+        }
+
+        computeBlackmanHarris(fft->window, size);
+
+        wisdomChanged = true;
+        numCachedPlans++;
+
+        return fft;
+}
+
+void initVisuals(void)
+{
+        char *wisdomPath = getFilePath(WISDOM_FILE);
+
+        if (wisdomPath == NULL)
+                return;
+
+        // A missing or stale file just means plans get measured again
+        fftwf_import_wisdom_from_filename(wisdomPath);
+
+        free(wisdomPath);
+}
+
+void freeVisuals(void)
+{
+        if (wisdomChanged)
         {
-                fftwf_free(fftOutput);
-                fftOutput = NULL;
+                char *wisdomPath = getFilePath(WISDOM_FILE);
+
+                if (wisdomPath != NULL)
+                {
+                        fftwf_export_wisdom_to_filename(wisdomPath);
+                        free(wisdomPath);
+                }
+
+                wisdomChanged = false;
         }
+
+        for (int i = 0; i < numCachedPlans; i++)
+                freeFftPlan(&planCache[i]);
+
+        numCachedPlans = 0;
+        currentPlan = NULL;
 }
 
 void drawSpectrumVisualizer(int row, int col, AppState *state)
@@ -536,48 +572,29 @@ void drawSpectrumVisualizer(int row, int col, AppState *state)
         if (numBars > MAX_BARS)
                 numBars = MAX_BARS;
 
-        if (fftSize != prevFftSize)
-        {
-                freeVisuals();
-
-                memset(displayMagnitudes, 0, sizeof(displayMagnitudes));
-
-                fftInput = (float *)malloc(sizeof(float) * fftSize);
-                if (fftInput == NULL)
-                {
-                        for (int i = 0; i <= height; i++)
-                        {
-                                printf("\n");
-                        }
-                        return;
-                }
+        FftPlan *fft = getFftPlan(fftSize);
 
-                fftOutput = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * fftSize);
-                if (fftOutput == NULL)
+        if (fft == NULL)
+        {
+                for (int i = 0; i <= height; i++)
                 {
-                        fftwf_free(fftInput);
-                        fftInput = NULL;
-                        for (int i = 0; i <= height; i++)
-                        {
-                                printf("\n");
-                        }
-                        return;
+                        printf("\n");
                 }
-                prevFftSize = fftSize;
+                return;
         }
 
-        fftwf_plan plan = fftwf_plan_dft_r2c_1d(fftSize,
-                                                fftInput,
-                                                fftOutput,
-                                                FFTW_ESTIMATE);
+        if (fft != currentPlan)
+        {
+                memset(displayMagnitudes, 0, sizeof(displayMagnitudes));
+                currentPlan = fft;
+        }
 
         getCurrentFormatAndSampleRate(&format, &sampleRate);
 
-        int bitDepth = getBitDepth(format);
+        if (bandTable.sampleRate != (float)sampleRate || bandTable.fftSize != fft->size || bandTable.numBars != numBars)
+                buildBandTable(&bandTable, sampleRate, fft->size, numBars);
 
-        calcMagnitudes(height, numBars, getAudioBuffer(), bitDepth, fftInput, fftOutput, fftSize, magnitudes, plan, displayMagnitudes);
+        calcMagnitudes(height, fft, &bandTable, magnitudes, displayMagnitudes);
 
         printSpectrum(row, col, &(state->uiSettings), height, numBars, visualizerWidth, displayMagnitudes);
-
-        fftwf_destroy_plan(plan);
 }